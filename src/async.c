@@ -12,7 +12,10 @@
 
 
 #include "async.h"
+#include "crypto_pool.h"
+#include "eth_addr.h"
 #include "fastd.h"
+#include "handshake_pool.h"
 
 #include <sys/uio.h>
 
@@ -76,6 +79,28 @@ static void handle_verify_return(const fastd_async_verify_return_t *verify_retur
 
 #endif
 
+/** Handles a peer with deferred changes */
+static void handle_peer(const fastd_async_peer_t *peer_data) {
+	fastd_peer_t *peer = fastd_peer_find_by_id(peer_data->peer_id);
+	if (peer)
+		fastd_peer_handle_deferred(peer);
+}
+
+/** Handles a MAC address learned by a worker thread */
+static void handle_eth_addr(const fastd_async_eth_addr_t *eth_addr) {
+	fastd_peer_t *peer = NULL;
+
+	if (!eth_addr->local) {
+		peer = fastd_peer_find_by_id(eth_addr->peer_id);
+
+		/* The peer may have been reset since */
+		if (!peer || !fastd_peer_is_established(peer))
+			return;
+	}
+
+	fastd_peer_eth_addr_add(peer, eth_addr->addr);
+}
+
 
 /** Reads and handles a single notification from the async notification socket */
 void fastd_async_handle(void) {
@@ -113,13 +138,43 @@ void fastd_async_handle(void) {
 		break;
 #endif
 
+	case ASYNC_TYPE_CRYPTO:
+		fastd_crypto_pool_handle();
+		break;
+
+	case ASYNC_TYPE_HANDSHAKE:
+		fastd_handshake_pool_handle();
+		break;
+
+	case ASYNC_TYPE_PACKET: {
+		const fastd_async_packet_t *packet = (const fastd_async_packet_t *)buf;
+		fastd_receive_deferred(packet->sock, &packet->local_addr, &packet->remote_addr, packet->buffer);
+		break;
+	}
+
+	case ASYNC_TYPE_PEER:
+		handle_peer((const fastd_async_peer_t *)buf);
+		break;
+
+	case ASYNC_TYPE_ETH_ADDR:
+		handle_eth_addr((const fastd_async_eth_addr_t *)buf);
+		break;
+
 	default:
 		exit_bug("fastd_async_handle: unknown type");
 	}
+
+	fastd_crypto_pool_handle_missed();
+	fastd_handshake_pool_handle_missed();
 }
 
-/** Enqueues a new async notification */
-void fastd_async_enqueue(fastd_async_type_t type, const void *data, size_t len) {
+/**
+   Enqueues a new async notification, returning false if it couldn't be sent
+
+   This may be called by any thread. Notifications are dropped when the socket buffer is full, which
+   callers that may produce many notifications (like the worker threads) must be prepared for.
+*/
+bool fastd_async_try_enqueue(fastd_async_type_t type, const void *data, size_t len) {
 	fastd_async_hdr_t header;
 	/* use memset to zero the holes in the struct to make valgrind happy */
 	memset(&header, 0, sizeof(header));
@@ -135,6 +190,11 @@ void fastd_async_enqueue(fastd_async_type_t type, const void *data, size_t len)
 		.msg_iovlen = len ? 2 : 1,
 	};
 
-	if (sendmsg(ctx.async_wfd, &msg, 0) < 0)
+	return (sendmsg(ctx.async_wfd, &msg, 0) >= 0);
+}
+
+/** Enqueues a new async notification, warning if it couldn't be sent */
+void fastd_async_enqueue(fastd_async_type_t type, const void *data, size_t len) {
+	if (!fastd_async_try_enqueue(type, data, len))
 		pr_warn_errno("fastd_async_enqueue: sendmsg");
 }
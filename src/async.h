@@ -22,6 +22,11 @@ typedef enum fastd_async_type {
 	ASYNC_TYPE_NOP, /**< Does nothing (is used to ensure poll returns quickly after a signal has occurred) */
 	ASYNC_TYPE_RESOLVE_RETURN, /**< A DNS resolver response */
 	ASYNC_TYPE_VERIFY_RETURN,  /**< A on-verify return */
+	ASYNC_TYPE_CRYPTO,         /**< Packets have been encrypted or decrypted by the crypto threads */
+	ASYNC_TYPE_HANDSHAKE,      /**< Handshake computations have been finished by the handshake threads */
+	ASYNC_TYPE_PACKET,         /**< A packet received by a worker thread that must be handled by the main thread */
+	ASYNC_TYPE_PEER,           /**< Changes to a peer have been deferred to the main thread */
+	ASYNC_TYPE_ETH_ADDR,       /**< A MAC address has been learned by a worker thread */
 } fastd_async_type_t;
 
 
@@ -48,7 +53,28 @@ typedef struct fastd_async_verify_return {
 	uint8_t protocol_data[] __attribute__((aligned(8))); /**< Protocol-specific data */
 } fastd_async_verify_return_t;
 
+/** A packet handed to the main thread */
+typedef struct fastd_async_packet {
+	fastd_socket_t *sock;             /**< The main thread's socket the packet has been received on */
+	fastd_peer_address_t local_addr;  /**< The local address the packet was received on */
+	fastd_peer_address_t remote_addr; /**< The address the packet was received from */
+	fastd_buffer_t *buffer;           /**< The packet */
+} fastd_async_packet_t;
+
+/** A peer with deferred changes (see fastd_peer_defer()) */
+typedef struct fastd_async_peer {
+	uint64_t peer_id; /**< The ID of the peer */
+} fastd_async_peer_t;
+
+/** A MAC address learned by a worker thread */
+typedef struct fastd_async_eth_addr {
+	bool local;            /**< true if the address has been seen on the local interface */
+	uint64_t peer_id;      /**< The ID of the peer the address has been seen on (if it isn't local) */
+	fastd_eth_addr_t addr; /**< The MAC address */
+} fastd_async_eth_addr_t;
+
 
 void fastd_async_init(void);
 void fastd_async_handle(void);
+bool fastd_async_try_enqueue(fastd_async_type_t type, const void *data, size_t len);
 void fastd_async_enqueue(fastd_async_type_t type, const void *data, size_t len);
@@ -8,37 +8,265 @@
    \file
 
    Buffer management
+
+   Buffers are allocated from a small number of size classes, the largest of which fits
+   ctx.max_buffer. Each class allocates its buffers in slabs, which are never returned to the
+   system before fastd terminates, and keeps the free buffers in a depot. Each thread caches up
+   to BUFFER_CACHE_SIZE free buffers per class, so the depot lock is only taken once for a batch of
+   allocations or frees.
 */
 
 
-#define FASTD_BUFFER_COUNT 3
+#include "fastd.h"
 
+#include <sys/mman.h>
 
-#include "fastd.h"
 
+/** A slab of buffers */
+typedef struct buffer_slab {
+	void *mem;      /**< The memory of the slab */
+	size_t size;    /**< The size of the slab */
+	bool hugepages; /**< Specifies if the slab was mapped with huge pages */
+} buffer_slab_t;
+
+/** A size class of buffers */
+typedef struct buffer_class {
+	size_t size;                 /**< The size of the buffer space of the buffers of this class */
+	fastd_buffer_t *free;        /**< The free buffers in the depot */
+	size_t n_free;               /**< The number of buffers in the depot */
+	size_t total;                /**< The number of buffers allocated for this class */
+	VECTOR(buffer_slab_t) slabs; /**< The slabs allocated for this class */
+	fastd_buffer_stats_t stats;  /**< The statistics of this class */
+} buffer_class_t;
+
+/** The free buffers of a size class cached by a thread */
+typedef struct buffer_cache {
+	fastd_buffer_t *free; /**< The cached buffers */
+	size_t count;         /**< The number of cached buffers */
+} buffer_cache_t;
+
+
+/** The size classes, ordered by increasing size */
+static buffer_class_t classes[BUFFER_CLASSES];
+
+/** The number of size classes in use */
+static size_t n_classes = 0;
+
+/** Protects the depots of all size classes */
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The free buffers cached by the current thread */
+static THREAD_LOCAL buffer_cache_t caches[BUFFER_CLASSES];
+
+
+/** Acquires the depot lock */
+static inline void depot_acquire(void) {
+	if ((errno = pthread_mutex_lock(&depot_lock)) != 0)
+		exit_errno("pthread_mutex_lock");
+}
+
+/** Releases the depot lock */
+static inline void depot_release(void) {
+	if ((errno = pthread_mutex_unlock(&depot_lock)) != 0)
+		exit_errno("pthread_mutex_unlock");
+}
+
+
+/** Returns the memory used by a single buffer of a class, including the descriptor */
+static inline size_t buffer_stride(const buffer_class_t *cls) {
+	return sizeof(fastd_buffer_t) + cls->size;
+}
+
+#ifdef MAP_HUGETLB
+
+/** Maps a slab backed by huge pages, returning NULL on failure */
+static void *map_hugepages(size_t size) {
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (mem != MAP_FAILED)
+		return mem;
+
+	pr_debug_errno("unable to allocate buffers from huge pages: mmap");
+	return NULL;
+}
+
+#else
+
+/** Huge pages are not supported on this system */
+static void *map_hugepages(UNUSED size_t size) {
+	return NULL;
+}
+
+#endif
+
+/**
+   Allocates a new slab of buffers for a class and adds them to its depot
+
+   Must be called with the depot lock held. When huge pages are enabled, but can't be allocated,
+   the slab is allocated from normal memory and the failure is counted.
+*/
+static void grow_class(buffer_class_t *cls) {
+	size_t stride = buffer_stride(cls);
+	buffer_slab_t slab = {};
+
+	if (conf.buffer_hugepages) {
+		slab.size = alignto(stride, BUFFER_HUGEPAGE_SIZE);
+		slab.mem = map_hugepages(slab.size);
+		slab.hugepages = slab.mem;
+
+		if (!slab.mem)
+			cls->stats.alloc_failures++;
+	}
+
+	if (!slab.mem) {
+		slab.size = BUFFER_SLAB_BUFFERS * stride;
+		slab.mem = fastd_alloc_aligned(slab.size, sizeof(fastd_block128_t));
+	}
+
+	size_t i, n = slab.size / stride;
+	for (i = 0; i < n; i++) {
+		fastd_buffer_t *buffer = (fastd_buffer_t *)((uint8_t *)slab.mem + i * stride);
+		buffer->size = cls->size;
+		buffer->cls = cls - classes;
+		buffer->len = SIZE_MAX;
+		buffer->data = cls->free;
+		cls->free = buffer;
+	}
+
+	cls->n_free += n;
+	cls->total += n;
+	cls->stats.total = cls->total;
+
+	VECTOR_ADD(cls->slabs, slab);
+}
+
+/** Moves up to half a cache worth of buffers from the depot of a class into the current thread's cache */
+static void cache_refill(buffer_class_t *cls, buffer_cache_t *cache) {
+	depot_acquire();
+
+	if (cls->n_free < BUFFER_CACHE_SIZE / 2)
+		grow_class(cls);
+
+	size_t i;
+	for (i = 0; i < BUFFER_CACHE_SIZE / 2 && cls->free; i++) {
+		fastd_buffer_t *buffer = cls->free;
+		cls->free = buffer->data;
+		cls->n_free--;
+
+		buffer->data = cache->free;
+		cache->free = buffer;
+		cache->count++;
+	}
+
+	size_t used = cls->total - cls->n_free;
+	if (used > cls->stats.high_water)
+		cls->stats.high_water = used;
+
+	depot_release();
+}
+
+/** Returns \e count buffers from the current thread's cache of a class to its depot */
+static void cache_drain(buffer_class_t *cls, buffer_cache_t *cache, size_t count) {
+	depot_acquire();
+
+	size_t i;
+	for (i = 0; i < count && cache->free; i++) {
+		fastd_buffer_t *buffer = cache->free;
+		cache->free = buffer->data;
+		cache->count--;
+
+		buffer->data = cls->free;
+		cls->free = buffer;
+		cls->n_free++;
+	}
 
-/** The pool of statically allocated buffers */
-static fastd_buffer_t *buffers = NULL;
+	depot_release();
+}
 
+/**
+   Returns all buffers cached by the current thread to the depots
 
-/** Initializes the buffer pool */
+   Must be called by each thread using buffers before it terminates.
+*/
+void fastd_buffer_cache_flush(void) {
+	size_t i;
+	for (i = 0; i < n_classes; i++)
+		cache_drain(&classes[i], &caches[i], SIZE_MAX);
+}
+
+
+/**
+   Initializes the buffer pool
+
+   The largest size class fits ctx.max_buffer; each smaller class has half the size of the next
+   larger one, down to BUFFER_MIN_CLASS_SIZE. No buffers are allocated until they are needed.
+*/
 void fastd_init_buffers(void) {
+	size_t sizes[BUFFER_CLASSES];
+	size_t size = alignto(ctx.max_buffer, sizeof(fastd_block128_t));
+
+	n_classes = 0;
+
+	do {
+		sizes[n_classes++] = size;
+		size = alignto(size / 2, sizeof(fastd_block128_t));
+	} while (n_classes < BUFFER_CLASSES && size >= BUFFER_MIN_CLASS_SIZE);
+
 	size_t i;
-	for (i = 0; i < FASTD_BUFFER_COUNT; i++) {
-		fastd_buffer_t *buffer =
-			fastd_alloc_aligned(sizeof(*buffer) + ctx.max_buffer, sizeof(fastd_block128_t));
-		fastd_buffer_free(buffer);
+	for (i = 0; i < n_classes; i++) {
+		buffer_class_t *cls = &classes[i];
+
+		*cls = (buffer_class_t){};
+		cls->size = sizes[n_classes - i - 1];
+		cls->stats.size = cls->size;
 	}
+
+	pr_debug(
+		"initialized buffer pool with %Z size classes of up to %Z bytes", n_classes,
+		classes[n_classes - 1].size);
 }
 
 /** Frees the buffer pool */
 void fastd_cleanup_buffers(void) {
+	fastd_buffer_cache_flush();
+
+	size_t i, j;
+	for (i = 0; i < n_classes; i++) {
+		buffer_class_t *cls = &classes[i];
+
+		if (cls->n_free != cls->total)
+			exit_bug("buffers leaked");
+
+		for (j = 0; j < VECTOR_LEN(cls->slabs); j++) {
+			buffer_slab_t *slab = &VECTOR_INDEX(cls->slabs, j);
+
+			if (slab->hugepages)
+				munmap(slab->mem, slab->size);
+			else
+				free(slab->mem);
+		}
+
+		VECTOR_FREE(cls->slabs);
+	}
+
+	n_classes = 0;
+}
+
+
+/**
+   Returns the statistics of the buffer pool
+
+   The statistics of up to \e max size classes are stored in \e stats; the number of size classes is returned.
+*/
+size_t fastd_buffer_get_stats(fastd_buffer_stats_t *stats, size_t max) {
+	depot_acquire();
+
 	size_t i;
-	for (i = 0; i < FASTD_BUFFER_COUNT; i++)
-		free(fastd_buffer_alloc(0, 0));
+	for (i = 0; i < n_classes && i < max; i++)
+		stats[i] = classes[i].stats;
+
+	depot_release();
 
-	if (buffers)
-		exit_bug("too many buffers to free");
+	return n_classes;
 }
 
 
@@ -52,17 +280,26 @@ void fastd_cleanup_buffers(void) {
 */
 fastd_buffer_t *fastd_buffer_alloc(size_t len, size_t headroom) {
 	size_t base_len = alignto(headroom + len, sizeof(fastd_block128_t));
-	if (base_len > ctx.max_buffer)
+
+	size_t i;
+	for (i = 0; i < n_classes; i++) {
+		if (base_len <= classes[i].size)
+			break;
+	}
+
+	if (i == n_classes)
 		exit_fatal("BUG: oversized buffer alloc (%Z > %Z)", base_len, ctx.max_buffer);
 
-	fastd_buffer_t *buffer = buffers;
-	if (!buffer)
-		exit_bug("out of buffers");
+	buffer_cache_t *cache = &caches[i];
+	if (!cache->free)
+		cache_refill(&classes[i], cache);
 
+	fastd_buffer_t *buffer = cache->free;
 	if (buffer->len != SIZE_MAX)
 		exit_bug("dirty freed buffer");
 
-	buffers = buffer->data;
+	cache->free = buffer->data;
+	cache->count--;
 
 	buffer->data = buffer->base + headroom;
 	buffer->len = len;
@@ -72,7 +309,13 @@ fastd_buffer_t *fastd_buffer_alloc(size_t len, size_t headroom) {
 
 /** Returns a buffer to the buffer pool */
 void fastd_buffer_free(fastd_buffer_t *buffer) {
+	buffer_cache_t *cache = &caches[buffer->cls];
+
 	buffer->len = SIZE_MAX;
-	buffer->data = buffers;
-	buffers = buffer;
+	buffer->data = cache->free;
+	cache->free = buffer;
+	cache->count++;
+
+	if (cache->count > BUFFER_CACHE_SIZE)
+		cache_drain(&classes[buffer->cls], cache, BUFFER_CACHE_SIZE / 2);
 }
@@ -19,8 +19,10 @@
 
 /** A buffer descriptor */
 struct fastd_buffer {
-	void *data; /**< The beginning of the actual data in the buffer */
-	size_t len; /**< The data length */
+	void *data;   /**< The beginning of the actual data in the buffer */
+	size_t len;   /**< The data length */
+	size_t size;  /**< The size of the buffer space */
+	unsigned cls; /**< The size class of the buffer pool the buffer belongs to */
 
 	uint8_t base[] __attribute__((aligned(16))); /**< Buffer space */
 };
@@ -32,8 +34,19 @@ struct fastd_buffer_view {
 };
 
 
+/** Statistics of a size class of the buffer pool */
+typedef struct fastd_buffer_stats {
+	size_t size;             /**< The size of the buffers of the class */
+	size_t total;            /**< The number of buffers allocated for the class */
+	size_t high_water;       /**< The highest number of buffers that were in use or cached by threads at once */
+	uint64_t alloc_failures; /**< The number of slabs that couldn't be allocated from huge pages */
+} fastd_buffer_stats_t;
+
+
 void fastd_init_buffers(void);
 void fastd_cleanup_buffers(void);
+void fastd_buffer_cache_flush(void);
+size_t fastd_buffer_get_stats(fastd_buffer_stats_t *stats, size_t max);
 
 
 fastd_buffer_t *fastd_buffer_alloc(size_t len, size_t headroom);
@@ -79,6 +92,21 @@ static inline void fastd_buffer_zero_pad(fastd_buffer_t *buffer) {
 	memset(end, 0, end_align - end);
 }
 
+/**
+   Prepares a buffer to be encrypted for multiple peers without copying it
+
+   Realigns the buffer like fastd_buffer_align() and zeroes the head space and trailing padding
+   the encryption methods read from. Consumes the passed buffer.
+*/
+static inline fastd_buffer_t *fastd_buffer_prepare_shared(fastd_buffer_t *buffer, size_t headroom) {
+	buffer = fastd_buffer_align(buffer, headroom);
+
+	memset((uint8_t *)buffer->data - headroom, 0, headroom);
+	fastd_buffer_zero_pad(buffer);
+
+	return buffer;
+}
+
 /** Pushes the data head (decreases the head space) */
 static inline void fastd_buffer_push(fastd_buffer_t *buffer, size_t len) {
 	if (len > fastd_buffer_headroom(buffer))
@@ -32,6 +32,26 @@
 #endif
 
 
+#if defined(USE_UDP_SEGMENT) || defined(USE_UDP_GRO)
+#include <netinet/udp.h>
+
+#ifndef SOL_UDP
+/** Compatiblity define for systems not defining SOL_UDP */
+#define SOL_UDP 17
+#endif
+#endif
+
+#if defined(USE_UDP_SEGMENT) && !defined(UDP_SEGMENT)
+/** Compatiblity define for systems supporting, but not defining UDP_SEGMENT */
+#define UDP_SEGMENT 103
+#endif
+
+#if defined(USE_UDP_GRO) && !defined(UDP_GRO)
+/** Compatiblity define for systems supporting, but not defining UDP_GRO */
+#define UDP_GRO 104
+#endif
+
+
 #ifndef SOCK_NONBLOCK
 /** Defined if SOCK_NONBLOCK doesn't have an effect */
 #define NO_HAVE_SOCK_NONBLOCK
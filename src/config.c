@@ -22,6 +22,7 @@
 #include "handshake.h"
 #include "lex.h"
 #include "method.h"
+#include "offload.h"
 #include "peer.h"
 #include "peer_group.h"
 
@@ -52,6 +53,21 @@ static void default_config(void) {
 	conf.mode = MODE_TAP;
 	conf.iface_persist = true;
 
+#ifdef USE_RECVMMSG
+	conf.receive_batch = DEFAULT_RECEIVE_BATCH;
+#else
+	conf.receive_batch = 1;
+#endif
+
+#ifdef USE_SENDMMSG
+	conf.send_batch = DEFAULT_SEND_BATCH;
+#else
+	conf.send_batch = 1;
+#endif
+
+	conf.iface_drain_budget = DEFAULT_IFACE_DRAIN_BUDGET;
+	conf.socket_drain_budget = DEFAULT_SOCKET_DRAIN_BUDGET;
+
 	conf.drop_caps = DROP_CAPS_ON;
 
 	conf.protocol = &fastd_protocol_ec25519_fhmqvc;
@@ -551,6 +567,29 @@ static void config_check_base(void) {
 		if (!fastd_config_single_iface())
 			exit_error("In Android integration mode exactly one peer must be configured");
 	}
+
+	if (conf.worker_threads) {
+#ifdef USE_IO_URING
+		/* Worker threads may open and close sockets, but the io_uring instance is owned by the main thread */
+		exit_error("config error: worker threads are not supported with io_uring");
+#endif
+
+		if (conf.mode != MODE_TAP)
+			exit_error("config error: worker threads are only supported in TAP mode");
+
+		if (!conf.n_bind_addrs)
+			exit_error("config error: worker threads require at least one bind address");
+
+		/* The kernel prefers connected sockets, so these would take the peers' packets away from the workers */
+		if (conf.socket_connect)
+			exit_error("config error: socket connect can't be used with worker threads");
+
+		const fastd_bind_address_t *addr;
+		for (addr = conf.bind_addrs; addr; addr = addr->next) {
+			if (addr->flags & FASTD_BIND_DYNAMIC)
+				exit_error("config error: worker threads can't be used with dynamic bind addresses");
+		}
+	}
 }
 
 /** Performs more checks on the configuration */
@@ -662,6 +701,22 @@ static void configure_peers(bool dirs_only) {
 	size_t headroom = max_size_t(conf.encrypt_headroom, conf.decrypt_headroom + conf.overhead);
 	ctx.max_buffer = alignto(
 		max_size_t(headroom + fastd_max_payload(ctx.max_mtu), MAX_HANDSHAKE_SIZE), sizeof(fastd_block128_t));
+
+#ifdef USE_IFACE_OFFLOAD
+	/* Frames read from interfaces with offloads enabled may be much larger than the MTU */
+	if (conf.iface_offload)
+		ctx.max_buffer = max_size_t(
+			ctx.max_buffer,
+			alignto(conf.encrypt_headroom + 16 + FASTD_OFFLOAD_MAX_FRAME, sizeof(fastd_block128_t)));
+#endif
+
+#ifdef USE_IO_URING
+	/* io_uring writes the source address and ancillary data of received datagrams in front of the data */
+	ctx.max_buffer = max_size_t(
+		ctx.max_buffer,
+		alignto(conf.decrypt_headroom + FASTD_POLL_RECV_HEADROOM + fastd_receive_buffer_size(),
+			sizeof(fastd_block128_t)));
+#endif
 }
 
 /** Initialized the peers not configured through peer directories */
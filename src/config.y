@@ -50,15 +50,20 @@
 %token TOK_AS
 %token TOK_ASYNC
 %token TOK_AUTO
+%token TOK_BATCH
 %token TOK_BIND
+%token TOK_BUDGET
+%token TOK_BUFFER
 %token TOK_CAPABILITIES
 %token TOK_CIPHER
 %token TOK_CONNECT
+%token TOK_CRYPTO
 %token TOK_DEBUG
 %token TOK_DEBUG2
 %token TOK_DEFAULT
 %token TOK_DISESTABLISH
 %token TOK_DOWN
+%token TOK_DRAIN
 %token TOK_DROP
 %token TOK_EARLY
 %token TOK_ERROR
@@ -69,8 +74,10 @@
 %token TOK_FORWARD
 %token TOK_FROM
 %token TOK_GROUP
+%token TOK_HANDSHAKE
 %token TOK_HANDSHAKES
 %token TOK_HIDE
+%token TOK_HUGEPAGES
 %token TOK_INCLUDE
 %token TOK_INFO
 %token TOK_INTERFACE
@@ -88,6 +95,7 @@
 %token TOK_MTU
 %token TOK_MULTITAP
 %token TOK_NO
+%token TOK_OFFLOAD
 %token TOK_ON
 %token TOK_PACKET
 %token TOK_PEER
@@ -98,23 +106,30 @@
 %token TOK_POST_DOWN
 %token TOK_PRE_UP
 %token TOK_PROTOCOL
+%token TOK_RATE
+%token TOK_RECEIVE
 %token TOK_REMOTE
 %token TOK_SECRET
 %token TOK_SECURE
+%token TOK_SEGMENTATION
+%token TOK_SEND
 %token TOK_SOCKET
 %token TOK_STATUS
 %token TOK_STDERR
 %token TOK_SYNC
 %token TOK_SYSLOG
 %token TOK_TAP
+%token TOK_THREADS
 %token TOK_TO
 %token TOK_TUN
+%token TOK_UDP
 %token TOK_UP
 %token TOK_USE
 %token TOK_USER
 %token TOK_VERBOSE
 %token TOK_VERIFY
 %token TOK_WARN
+%token TOK_WORKER
 %token TOK_YES
 
 
@@ -124,6 +139,7 @@
 	#include "peer_group.h"
 
 	#include <limits.h>
+	#include <sys/mman.h>
 
 	static void fastd_config_handle_bind_address(
 		fastd_peer_address_t address, int64_t maybe_port, const char *bindtodevice, unsigned bind_default);
@@ -173,8 +189,22 @@ statement:	peer_group_statement
 	|	TOK_LOG log ';'
 	|	TOK_HIDE hide ';'
 	|	TOK_INTERFACE interface ';'
+	|	TOK_INTERFACE TOK_OFFLOAD iface_offload ';'
+	|	TOK_INTERFACE TOK_DRAIN TOK_BUDGET iface_drain_budget ';'
+	|	TOK_SOCKET TOK_DRAIN TOK_BUDGET socket_drain_budget ';'
+	|	TOK_SOCKET TOK_CONNECT socket_connect ';'
 	|	TOK_BIND bind ';'
+	|	TOK_BUFFER TOK_HUGEPAGES buffer_hugepages ';'
 	|	TOK_PACKET TOK_MARK packet_mark ';'
+	|	TOK_RECEIVE TOK_BATCH receive_batch ';'
+	|	TOK_SEND TOK_BATCH send_batch ';'
+	|	TOK_UDP TOK_SEGMENTATION TOK_OFFLOAD udp_segmentation ';'
+	|	TOK_UDP TOK_RECEIVE TOK_OFFLOAD udp_receive_offload ';'
+	|	TOK_WORKER TOK_THREADS worker_threads ';'
+	|	TOK_CRYPTO TOK_THREADS crypto_threads ';'
+	|	TOK_HANDSHAKE TOK_THREADS handshake_threads ';'
+	|	TOK_HANDSHAKE TOK_RATE TOK_LIMIT handshake_rate_limit ';'
+	|	TOK_HANDSHAKE TOK_KEY TOK_BUDGET handshake_key_budget ';'
 	|	TOK_MTU mtu ';'
 	|	TOK_PMTU pmtu ';'
 	|	TOK_MODE mode ';'
@@ -366,6 +396,167 @@ packet_mark:	TOK_UINT {
 #endif
 		}
 
+receive_batch:	TOK_UINT {
+#ifdef USE_RECVMMSG
+			if ($1 < 1 || $1 > MAX_RECEIVE_BATCH) {
+				fastd_config_error(&@$, state, "invalid receive batch size");
+				YYERROR;
+			}
+
+			conf.receive_batch = $1;
+#else
+			fastd_config_error(&@$, state, "batched receives are not supported on this system");
+			YYERROR;
+#endif
+		}
+
+send_batch:	TOK_UINT {
+#ifdef USE_SENDMMSG
+			if ($1 < 1 || $1 > MAX_SEND_BATCH) {
+				fastd_config_error(&@$, state, "invalid send batch size");
+				YYERROR;
+			}
+
+			conf.send_batch = $1;
+#else
+			fastd_config_error(&@$, state, "batched sends are not supported on this system");
+			YYERROR;
+#endif
+		}
+
+iface_drain_budget:
+		TOK_UINT {
+			if ($1 < 1 || $1 > MAX_DRAIN_BUDGET) {
+				fastd_config_error(&@$, state, "invalid interface drain budget");
+				YYERROR;
+			}
+
+			conf.iface_drain_budget = $1;
+		}
+
+socket_drain_budget:
+		TOK_UINT {
+			if ($1 < 1 || $1 > MAX_DRAIN_BUDGET) {
+				fastd_config_error(&@$, state, "invalid socket drain budget");
+				YYERROR;
+			}
+
+			conf.socket_drain_budget = $1;
+		}
+
+socket_connect:
+		boolean {
+#ifdef SO_REUSEPORT
+			conf.socket_connect = $1;
+#else
+			if ($1) {
+				fastd_config_error(&@$, state, "connected peer sockets are not supported on this system");
+				YYERROR;
+			}
+#endif
+		}
+
+worker_threads:	TOK_UINT {
+#ifdef USE_WORKER_THREADS
+			if ($1 > MAX_WORKER_THREADS) {
+				fastd_config_error(&@$, state, "invalid number of worker threads");
+				YYERROR;
+			}
+
+			conf.worker_threads = $1;
+#else
+			fastd_config_error(&@$, state, "worker threads are not supported on this system");
+			YYERROR;
+#endif
+		}
+
+crypto_threads:	TOK_UINT {
+			if ($1 > MAX_CRYPTO_THREADS) {
+				fastd_config_error(&@$, state, "invalid number of crypto threads");
+				YYERROR;
+			}
+
+			conf.crypto_threads = $1;
+		}
+
+handshake_threads:
+		TOK_UINT {
+			if ($1 > MAX_HANDSHAKE_THREADS) {
+				fastd_config_error(&@$, state, "invalid number of handshake threads");
+				YYERROR;
+			}
+
+			conf.handshake_threads = $1;
+		}
+
+handshake_rate_limit:
+		TOK_UINT {
+			if ($1 > INT_MAX) {
+				fastd_config_error(&@$, state, "invalid handshake rate limit");
+				YYERROR;
+			}
+
+			conf.handshake_rate_limit = $1;
+		}
+
+handshake_key_budget:
+		TOK_UINT {
+			if ($1 > SIZE_MAX / 1024) {
+				fastd_config_error(&@$, state, "invalid handshake key budget");
+				YYERROR;
+			}
+
+			conf.handshake_key_budget = $1 * 1024;
+		}
+
+udp_segmentation:
+		boolean {
+#ifdef USE_UDP_SEGMENT
+			conf.udp_segmentation = $1;
+#else
+			if ($1) {
+				fastd_config_error(&@$, state, "UDP segmentation offload is not supported on this system");
+				YYERROR;
+			}
+#endif
+		}
+
+buffer_hugepages:
+		boolean {
+#ifdef MAP_HUGETLB
+			conf.buffer_hugepages = $1;
+#else
+			if ($1) {
+				fastd_config_error(&@$, state, "huge pages are not supported on this system");
+				YYERROR;
+			}
+#endif
+		}
+
+iface_offload:
+		boolean {
+#ifdef USE_IFACE_OFFLOAD
+			conf.iface_offload = $1;
+#else
+			if ($1) {
+				fastd_config_error(&@$, state, "TUN/TAP interface offloads are not supported on this system");
+				YYERROR;
+			}
+#endif
+		}
+
+udp_receive_offload:
+		boolean {
+#if defined(USE_UDP_GRO) && defined(USE_RECVMMSG)
+			conf.udp_receive_offload = $1;
+#else
+			if ($1) {
+				fastd_config_error(&@$, state, "UDP receive offload is not supported on this system");
+				YYERROR;
+			}
+#endif
+		}
+
 mtu:		TOK_UINT {
 			if ($1 < 576 || $1 > 65535) {
 				fastd_config_error(&@$, state, "invalid MTU");
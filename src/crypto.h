@@ -32,7 +32,7 @@ struct fastd_cipher {
 
 	/** Initializes a cipher context with the given key and cipher-specific flags */
 	fastd_cipher_state_t *(*init)(const uint8_t *key, int flags);
-	/** Encrypts or decrypts data */
+	/** Encrypts or decrypts data; \e out may be equal to \e in for in-place operation */
 	bool (*crypt)(
 		const fastd_cipher_state_t *state, fastd_block128_t *out, const fastd_block128_t *in, size_t len,
 		const uint8_t *iv);
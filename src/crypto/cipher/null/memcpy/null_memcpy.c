@@ -27,7 +27,9 @@ static fastd_cipher_state_t *null_init(UNUSED const uint8_t *key, UNUSED int fla
 static bool null_memcpy(
 	UNUSED const fastd_cipher_state_t *state, fastd_block128_t *out, const fastd_block128_t *in, size_t len,
 	UNUSED const uint8_t *iv) {
-	memcpy(out, in, len);
+	if (out != in)
+		memcpy(out, in, len);
+
 	return true;
 }
 
@@ -0,0 +1,487 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Encryption and decryption of payload packets by a pool of crypto threads
+
+   Each peer has a ring of jobs in the order they were submitted. A peer with pending jobs is
+   handled by a single crypto thread at a time, as the method session states are not thread-safe,
+   so the jobs of a peer are processed in order, while the jobs of different peers are processed
+   in parallel. Finished jobs are handed back to the main thread in the same order through an
+   async notification.
+
+   The main thread must not free or replace a session while jobs using it may be running;
+   fastd_crypto_queue_settle() waits for all jobs of a peer to finish.
+*/
+
+
+#include "crypto_pool.h"
+#include "async.h"
+#include "fastd.h"
+#include "method.h"
+
+
+/** The number of jobs of a single peer that can be queued (must be a power of 2) */
+#define CRYPTO_QUEUE_SIZE 64
+
+/** The maximum number of jobs of a peer a crypto thread handles before it continues with the next peer */
+#define CRYPTO_BATCH 16
+
+
+/** The queue of jobs of a single peer */
+struct fastd_crypto_queue {
+	fastd_peer_t *peer;               /**< The peer the jobs belong to */
+	fastd_crypto_complete_t complete; /**< The function to call for each finished job */
+
+	fastd_crypto_job_t jobs[CRYPTO_QUEUE_SIZE]; /**< The ring of jobs */
+	size_t head;                                /**< The index of the first job that hasn't been handed back */
+	size_t done;                                /**< The index of the first job that hasn't been processed */
+	size_t tail;                                /**< The index after the last submitted job */
+
+	fastd_crypto_queue_t *next_run;  /**< The next queue in the run list */
+	fastd_crypto_queue_t *next_done; /**< The next queue in the done list */
+
+	bool runnable;   /**< Set if the queue is in the run list */
+	bool running;    /**< Set while a crypto thread is processing jobs of the queue */
+	bool finished;   /**< Set if the queue is in the done list */
+	bool delivering; /**< Set while the main thread hands back finished jobs of the queue */
+	bool dead;       /**< Set if the queue has been freed while finished jobs were being handed back */
+};
+
+/** A singly-linked list of queues with a tail pointer */
+typedef struct crypto_queue_list {
+	fastd_crypto_queue_t *head; /**< The first queue of the list */
+	fastd_crypto_queue_t **tail; /**< The location of the next pointer of the last queue */
+} crypto_queue_list_t;
+
+
+/** The lock protecting all queues and the state of the pool */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signalled when a queue has been added to the run list or the pool is stopped */
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+/** Signalled when a crypto thread has finished processing jobs of a queue */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+/** The crypto threads */
+static pthread_t *threads = NULL;
+
+/** The queues with jobs waiting to be processed */
+static crypto_queue_list_t run_list = { NULL, &run_list.head };
+
+/** The queues with finished jobs waiting to be handed back */
+static crypto_queue_list_t done_list = { NULL, &done_list.head };
+
+/** The number of jobs in all queues */
+static size_t jobs = 0;
+
+/** Set if the main thread has been notified about finished jobs it hasn't handled yet */
+static bool notified = false;
+
+/**
+   Set before a notification is sent, and cleared when the main thread handles the finished jobs
+
+   The async notification socket is shared with the worker threads, so sending may fail when its
+   buffer is full. The main thread will still read the notifications that filled the buffer, and
+   checks this flag when it does.
+*/
+static bool missed = false;
+
+/** Set when the crypto threads should terminate */
+static bool stopping = false;
+
+
+/** Acquires the lock */
+static inline void lock_acquire(void) {
+	if ((errno = pthread_mutex_lock(&lock)) != 0)
+		exit_errno("pthread_mutex_lock");
+}
+
+/** Releases the lock */
+static inline void lock_release(void) {
+	if ((errno = pthread_mutex_unlock(&lock)) != 0)
+		exit_errno("pthread_mutex_unlock");
+}
+
+/** Waits for a condition variable */
+static inline void cond_wait(pthread_cond_t *cond) {
+	if ((errno = pthread_cond_wait(cond, &lock)) != 0)
+		exit_errno("pthread_cond_wait");
+}
+
+/** Returns the job with the given index */
+static inline fastd_crypto_job_t *queue_job(fastd_crypto_queue_t *queue, size_t i) {
+	return &queue->jobs[i % CRYPTO_QUEUE_SIZE];
+}
+
+
+/** Appends a queue to a list */
+static void list_push(crypto_queue_list_t *list, fastd_crypto_queue_t *queue, fastd_crypto_queue_t **next) {
+	*next = NULL;
+	*list->tail = queue;
+	list->tail = next;
+}
+
+/** Removes a queue from a list */
+static void list_remove(crypto_queue_list_t *list, fastd_crypto_queue_t *queue, size_t next_offset) {
+	fastd_crypto_queue_t **cur;
+	for (cur = &list->head; *cur; cur = (fastd_crypto_queue_t **)((uint8_t *)*cur + next_offset)) {
+		if (*cur != queue)
+			continue;
+
+		fastd_crypto_queue_t **next = (fastd_crypto_queue_t **)((uint8_t *)queue + next_offset);
+		*cur = *next;
+		if (list->tail == next)
+			list->tail = cur;
+
+		return;
+	}
+}
+
+/** Adds a queue to the run list */
+static inline void run_list_push(fastd_crypto_queue_t *queue) {
+	queue->runnable = true;
+	list_push(&run_list, queue, &queue->next_run);
+}
+
+/** Takes the first queue from the run list */
+static inline fastd_crypto_queue_t *run_list_pop(void) {
+	fastd_crypto_queue_t *queue = run_list.head;
+	if (!queue)
+		return NULL;
+
+	run_list.head = queue->next_run;
+	if (!run_list.head)
+		run_list.tail = &run_list.head;
+
+	queue->runnable = false;
+	return queue;
+}
+
+/** Adds a queue to the done list */
+static inline void done_list_push(fastd_crypto_queue_t *queue) {
+	queue->finished = true;
+	list_push(&done_list, queue, &queue->next_done);
+}
+
+/** Takes the first queue from the done list */
+static inline fastd_crypto_queue_t *done_list_pop(void) {
+	fastd_crypto_queue_t *queue = done_list.head;
+	if (!queue)
+		return NULL;
+
+	done_list.head = queue->next_done;
+	if (!done_list.head)
+		done_list.tail = &done_list.head;
+
+	queue->finished = false;
+	return queue;
+}
+
+/** Removes a queue from the run and done lists */
+static void unlink_queue(fastd_crypto_queue_t *queue) {
+	if (queue->runnable) {
+		list_remove(&run_list, queue, offsetof(fastd_crypto_queue_t, next_run));
+		queue->runnable = false;
+	}
+
+	if (queue->finished) {
+		list_remove(&done_list, queue, offsetof(fastd_crypto_queue_t, next_done));
+		queue->finished = false;
+	}
+}
+
+
+/**
+   Encrypts or decrypts the packet of a job
+
+   This is called by the crypto threads, and by the main thread when no crypto threads are configured.
+   The buffer of the job is always consumed.
+*/
+void fastd_crypto_job_run(fastd_crypto_job_t *job) {
+	fastd_buffer_t *in = job->buffer;
+
+	if (job->encrypt) {
+		job->buffer = fastd_method_encrypt(job->providers[0], job->sessions[0], in);
+		return;
+	}
+
+	job->buffer = NULL;
+
+	size_t i;
+	for (i = 0; i < array_size(job->sessions); i++) {
+		if (!job->sessions[i])
+			continue;
+
+		job->buffer = fastd_method_decrypt(job->providers[i], job->sessions[i], in, job->now, &job->reordered);
+		if (job->buffer) {
+			job->session = i;
+			return;
+		}
+	}
+
+	fastd_buffer_free(in);
+}
+
+/** The main loop of a crypto thread */
+static void *crypto_thread(UNUSED void *arg) {
+	lock_acquire();
+
+	while (true) {
+		fastd_crypto_queue_t *queue;
+
+		while (!stopping && !(queue = run_list_pop()))
+			cond_wait(&work_cond);
+
+		if (stopping)
+			break;
+
+		queue->running = true;
+
+		size_t n;
+		for (n = 0; n < CRYPTO_BATCH && queue->done < queue->tail; n++) {
+			fastd_crypto_job_t *job = queue_job(queue, queue->done);
+
+			lock_release();
+			fastd_crypto_job_run(job);
+			lock_acquire();
+
+			queue->done++;
+		}
+
+		queue->running = false;
+
+		if (queue->done < queue->tail)
+			run_list_push(queue);
+
+		if (!queue->finished && !queue->delivering)
+			done_list_push(queue);
+
+		if (!notified) {
+			__atomic_store_n(&missed, true, __ATOMIC_SEQ_CST);
+			notified = fastd_async_try_enqueue(ASYNC_TYPE_CRYPTO, NULL, 0);
+		}
+
+		if ((errno = pthread_cond_broadcast(&done_cond)) != 0)
+			exit_errno("pthread_cond_broadcast");
+	}
+
+	lock_release();
+
+	fastd_buffer_cache_flush();
+
+	return NULL;
+}
+
+
+/** Starts the crypto threads */
+void fastd_crypto_pool_start(void) {
+	if (!conf.crypto_threads)
+		return;
+
+	threads = fastd_new_array(conf.crypto_threads, pthread_t);
+
+	size_t i;
+	for (i = 0; i < conf.crypto_threads; i++) {
+		if ((errno = pthread_create(&threads[i], NULL, crypto_thread, NULL)) != 0)
+			exit_errno("unable to create crypto thread");
+	}
+}
+
+/**
+   Stops the crypto threads and waits for them to terminate
+
+   All queues must have been freed before.
+*/
+void fastd_crypto_pool_stop(void) {
+	if (!threads)
+		return;
+
+	lock_acquire();
+	stopping = true;
+	if ((errno = pthread_cond_broadcast(&work_cond)) != 0)
+		exit_errno("pthread_cond_broadcast");
+	lock_release();
+
+	size_t i;
+	for (i = 0; i < conf.crypto_threads; i++) {
+		if ((errno = pthread_join(threads[i], NULL)) != 0)
+			exit_errno("pthread_join");
+	}
+
+	free(threads);
+	threads = NULL;
+}
+
+/**
+   Hands back the finished jobs to the main thread
+
+   This is called when the async notification sent by a crypto thread is received. The jobs of each
+   peer are handed back in the order they were submitted in.
+*/
+void fastd_crypto_pool_handle(void) {
+	lock_acquire();
+
+	notified = false;
+	__atomic_store_n(&missed, false, __ATOMIC_RELAXED);
+
+	fastd_crypto_queue_t *queue;
+	while ((queue = done_list_pop())) {
+		queue->delivering = true;
+
+		while (queue->head < queue->done && !queue->dead) {
+			fastd_crypto_job_t job = *queue_job(queue, queue->head);
+			queue->head++;
+			jobs--;
+
+			lock_release();
+			queue->complete(queue->peer, &job);
+			lock_acquire();
+		}
+
+		queue->delivering = false;
+
+		if (queue->dead)
+			free(queue);
+	}
+
+	lock_release();
+}
+
+/**
+   Hands back finished jobs whose notification may not have been sent
+
+   This is called by the main thread for each async notification it handles.
+*/
+void fastd_crypto_pool_handle_missed(void) {
+	if (__atomic_load_n(&missed, __ATOMIC_SEQ_CST))
+		fastd_crypto_pool_handle();
+}
+
+
+/**
+   Creates the job queue of a peer
+
+   Returns NULL if no crypto threads are configured, in which case the jobs are processed by the
+   main thread directly.
+*/
+fastd_crypto_queue_t *fastd_crypto_queue_new(fastd_peer_t *peer, fastd_crypto_complete_t complete) {
+	if (!conf.crypto_threads)
+		return NULL;
+
+	fastd_crypto_queue_t *queue = fastd_new0(fastd_crypto_queue_t);
+	queue->peer = peer;
+	queue->complete = complete;
+
+	return queue;
+}
+
+/**
+   Removes all jobs from a queue, waiting for a crypto thread still processing them; the lock must be held
+
+   A crypto thread adds the queue to the run and done lists again when it has finished its batch, so
+   the queue is only unlinked afterwards.
+*/
+static void discard_jobs(fastd_crypto_queue_t *queue) {
+	while (queue->running)
+		cond_wait(&done_cond);
+
+	unlink_queue(queue);
+
+	for (; queue->head < queue->tail; queue->head++) {
+		fastd_crypto_job_t *job = queue_job(queue, queue->head);
+		if (job->buffer)
+			fastd_buffer_free(job->buffer);
+
+		jobs--;
+	}
+
+	queue->done = queue->tail;
+}
+
+/** Frees the job queue of a peer, dropping all jobs that haven't been handed back yet */
+void fastd_crypto_queue_free(fastd_crypto_queue_t *queue) {
+	if (!queue)
+		return;
+
+	lock_acquire();
+
+	discard_jobs(queue);
+
+	/* The queue is freed by fastd_crypto_pool_handle() if it is currently handing back a job of the queue */
+	if (queue->delivering)
+		queue->dead = true;
+	else
+		free(queue);
+
+	lock_release();
+}
+
+/** Drops all jobs of a queue that haven't been handed back yet, for example when a peer is reset */
+void fastd_crypto_queue_discard(fastd_crypto_queue_t *queue) {
+	if (!queue)
+		return;
+
+	lock_acquire();
+	discard_jobs(queue);
+	lock_release();
+}
+
+/**
+   Adds a job to the queue of a peer
+
+   Returns false if too many jobs are queued already; in this case, the job is not
+   submitted and the caller keeps ownership of the buffer.
+*/
+bool fastd_crypto_queue_submit(fastd_crypto_queue_t *queue, const fastd_crypto_job_t *job) {
+	lock_acquire();
+
+	if (queue->tail - queue->head >= CRYPTO_QUEUE_SIZE || jobs >= CRYPTO_MAX_JOBS) {
+		lock_release();
+		return false;
+	}
+
+	*queue_job(queue, queue->tail) = *job;
+	queue->tail++;
+	jobs++;
+
+	if (!queue->runnable && !queue->running) {
+		run_list_push(queue);
+
+		if ((errno = pthread_cond_signal(&work_cond)) != 0)
+			exit_errno("pthread_cond_signal");
+	}
+
+	lock_release();
+
+	return true;
+}
+
+/**
+   Waits until all submitted jobs of a peer have been processed
+
+   This must be called before the sessions of a peer are freed or replaced. The jobs that haven't been
+   handed back yet are marked as detached, as the sessions they were processed with may not exist anymore
+   when they are handed back.
+*/
+void fastd_crypto_queue_settle(fastd_crypto_queue_t *queue) {
+	if (!queue)
+		return;
+
+	lock_acquire();
+
+	while (queue->done < queue->tail || queue->running)
+		cond_wait(&done_cond);
+
+	size_t i;
+	for (i = queue->head; i < queue->done; i++)
+		queue_job(queue, i)->detached = true;
+
+	lock_release();
+}
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Encryption and decryption of payload packets by a pool of crypto threads
+*/
+
+
+#pragma once
+
+#include "types.h"
+
+
+/** A packet to encrypt or decrypt */
+typedef struct fastd_crypto_job {
+	bool encrypt; /**< true for encryption, false for decryption */
+
+	/**
+	   The sessions to use
+
+	   For encryption, only the first session is used. For decryption, the sessions are tried
+	   in order until the packet can be decrypted; unused entries are NULL.
+	*/
+	fastd_method_session_state_t *sessions[2];
+	const fastd_method_provider_t *providers[2]; /**< The providers of the sessions */
+
+	fastd_buffer_t *buffer; /**< The packet; replaced with the result (or NULL on failure) when the job is done */
+	size_t stat_size;       /**< The size to add to the statistics */
+	fastd_timeout_t now;    /**< The time the job was submitted at (used as the current time by crypto threads) */
+
+	size_t session;  /**< The index of the session a packet was decrypted with */
+	bool reordered;  /**< Set if a decrypted packet was received out of order */
+	bool detached;   /**< Set if the sessions of the peer have been changed after the job was done */
+} fastd_crypto_job_t;
+
+/** A function handling a finished job in the main thread */
+typedef void (*fastd_crypto_complete_t)(fastd_peer_t *peer, fastd_crypto_job_t *job);
+
+/** The queue of jobs of a single peer */
+typedef struct fastd_crypto_queue fastd_crypto_queue_t;
+
+
+void fastd_crypto_job_run(fastd_crypto_job_t *job);
+
+void fastd_crypto_pool_start(void);
+void fastd_crypto_pool_stop(void);
+void fastd_crypto_pool_handle(void);
+void fastd_crypto_pool_handle_missed(void);
+
+fastd_crypto_queue_t *fastd_crypto_queue_new(fastd_peer_t *peer, fastd_crypto_complete_t complete);
+void fastd_crypto_queue_free(fastd_crypto_queue_t *queue);
+bool fastd_crypto_queue_submit(fastd_crypto_queue_t *queue, const fastd_crypto_job_t *job);
+void fastd_crypto_queue_settle(fastd_crypto_queue_t *queue);
+void fastd_crypto_queue_discard(fastd_crypto_queue_t *queue);
@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   The table of MAC addresses learned in TAP mode
+
+   The entries are found through a hashtable with open addressing and linear probing, keyed with
+   SipHash-1-3 like the peer address hashtable. Each slot contains the MAC address, so lookups don't
+   need to access the entries themselves until a match is found.
+
+   When an address is seen again, its timeout is only updated if it would move by more than
+   ETH_ADDR_REFRESH_TIME, so the entries of busy addresses aren't written to for every frame.
+
+   Expired entries are found using an aging wheel with one slot per maintenance interval. Each entry
+   is put into the slot of its timeout when it is created. As refreshing an entry doesn't move it
+   in the wheel, entries that haven't timed out yet when their slot is handled are moved to the
+   slot of their new timeout instead of being removed.
+
+   Each peer additionally keeps a list of the entries associated with it, so the addresses of a
+   peer can be listed and removed without walking the whole table.
+
+   Worker threads only refresh the timeouts of existing entries; new addresses and addresses that
+   have moved to a different peer are handed to the main thread.
+*/
+
+
+#include "eth_addr.h"
+#include "async.h"
+#include "hash.h"
+#include "peer.h"
+
+
+/** The initial number of slots of the hashtable */
+#define ETH_ADDR_HT_INITIAL_SIZE 64
+
+
+/** Returns the key of a MAC address */
+static inline uint64_t address_key(fastd_eth_addr_t addr) {
+	uint64_t key = 0;
+	memcpy(&key, addr.data, sizeof(addr.data));
+	return key;
+}
+
+/** Returns the hash value of a key */
+static inline uint64_t key_hash(uint64_t key) {
+	return fastd_siphash13(ctx.eth_addr_ht_key, &key, 1);
+}
+
+/** Returns the slot of the aging wheel for a timeout */
+static inline fastd_peer_eth_addr_t **wheel_slot(fastd_timeout_t timeout) {
+	return &ctx.eth_addr_wheel[(timeout / MAINTENANCE_INTERVAL) % ETH_ADDR_WHEEL_SLOTS];
+}
+
+/** Adds an entry to the slot of the aging wheel for its timeout */
+static void wheel_add(fastd_peer_eth_addr_t *entry) {
+	fastd_peer_eth_addr_t **slot = wheel_slot(entry->timeout);
+
+	entry->wheel_next = *slot;
+	entry->wheel_pprev = slot;
+
+	if (*slot)
+		(*slot)->wheel_pprev = &entry->wheel_next;
+
+	*slot = entry;
+}
+
+/** Removes an entry from the aging wheel */
+static void wheel_remove(fastd_peer_eth_addr_t *entry) {
+	*entry->wheel_pprev = entry->wheel_next;
+
+	if (entry->wheel_next)
+		entry->wheel_next->wheel_pprev = entry->wheel_pprev;
+}
+
+
+/** Adds an entry to the list of MAC addresses of its peer */
+static void peer_list_add(fastd_peer_eth_addr_t *entry) {
+	if (!entry->peer) {
+		entry->peer_pprev = NULL;
+		return;
+	}
+
+	fastd_peer_eth_addr_t **head = &entry->peer->eth_addrs;
+
+	entry->peer_next = *head;
+	entry->peer_pprev = head;
+
+	if (*head)
+		(*head)->peer_pprev = &entry->peer_next;
+
+	*head = entry;
+}
+
+/** Removes an entry from the list of MAC addresses of its peer */
+static void peer_list_remove(fastd_peer_eth_addr_t *entry) {
+	if (!entry->peer_pprev)
+		return;
+
+	*entry->peer_pprev = entry->peer_next;
+
+	if (entry->peer_next)
+		entry->peer_next->peer_pprev = entry->peer_pprev;
+}
+
+
+/** Finds the slot containing a key, returning NULL if it isn't found */
+static fastd_eth_addr_slot_t *table_find(uint64_t key) {
+	size_t mask = ctx.eth_addr_ht_size - 1;
+	size_t i;
+
+	for (i = key_hash(key) & mask; ctx.eth_addr_ht[i].entry; i = (i + 1) & mask) {
+		if (ctx.eth_addr_ht[i].key == key)
+			return &ctx.eth_addr_ht[i];
+	}
+
+	return NULL;
+}
+
+/** Adds an entry to the first empty slot for its hash value in a table */
+static void table_insert(fastd_eth_addr_slot_t *slots, size_t size, uint64_t key, fastd_peer_eth_addr_t *entry) {
+	size_t mask = size - 1;
+	size_t i;
+
+	for (i = key_hash(key) & mask; slots[i].entry; i = (i + 1) & mask) {}
+
+	slots[i] = (fastd_eth_addr_slot_t){ .key = key, .entry = entry };
+}
+
+/** Removes the entry at a slot, moving back the following entries of the same probe sequence */
+static void table_delete(size_t i) {
+	size_t mask = ctx.eth_addr_ht_size - 1;
+	size_t j = i;
+
+	ctx.eth_addr_ht_used--;
+
+	while (true) {
+		ctx.eth_addr_ht[i] = (fastd_eth_addr_slot_t){};
+
+		size_t home;
+		do {
+			j = (j + 1) & mask;
+			if (!ctx.eth_addr_ht[j].entry)
+				return;
+
+			home = key_hash(ctx.eth_addr_ht[j].key) & mask;
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+		ctx.eth_addr_ht[i] = ctx.eth_addr_ht[j];
+		i = j;
+	}
+}
+
+/** Doubles the size of the hashtable */
+static void grow_hashtable(void) {
+	size_t size = 2 * ctx.eth_addr_ht_size;
+	fastd_eth_addr_slot_t *slots = fastd_new0_array(size, fastd_eth_addr_slot_t);
+
+	size_t i;
+	for (i = 0; i < ctx.eth_addr_ht_size; i++) {
+		if (ctx.eth_addr_ht[i].entry)
+			table_insert(slots, size, ctx.eth_addr_ht[i].key, ctx.eth_addr_ht[i].entry);
+	}
+
+	free(ctx.eth_addr_ht);
+	ctx.eth_addr_ht = slots;
+	ctx.eth_addr_ht_size = size;
+
+	pr_debug("resized MAC address hashtable to %u entries", (unsigned)size);
+}
+
+/** Removes the entry at a slot of the hashtable and frees it (it must have been unlinked from all lists before) */
+static void delete_slot(size_t i) {
+	fastd_peer_eth_addr_t *entry = ctx.eth_addr_ht[i].entry;
+
+	table_delete(i);
+	free(entry);
+}
+
+
+/** Initializes the MAC address table */
+void fastd_peer_eth_addr_init(void) {
+	fastd_random_bytes(ctx.eth_addr_ht_key, sizeof(ctx.eth_addr_ht_key), false);
+
+	ctx.eth_addr_ht_size = ETH_ADDR_HT_INITIAL_SIZE;
+	ctx.eth_addr_ht_used = 0;
+	ctx.eth_addr_ht = fastd_new0_array(ctx.eth_addr_ht_size, fastd_eth_addr_slot_t);
+
+	memset(ctx.eth_addr_wheel, 0, sizeof(ctx.eth_addr_wheel));
+	ctx.eth_addr_wheel_pos = fastd_now() / MAINTENANCE_INTERVAL;
+}
+
+/** Frees the MAC address table */
+void fastd_peer_eth_addr_free(void) {
+	size_t i;
+	for (i = 0; i < ctx.eth_addr_ht_size; i++)
+		free(ctx.eth_addr_ht[i].entry);
+
+	free(ctx.eth_addr_ht);
+	ctx.eth_addr_ht = NULL;
+}
+
+/** Associates a MAC address with a peer (or NULL for local addresses), or updates the timeout of an existing entry */
+void fastd_peer_eth_addr_add(fastd_peer_t *peer, fastd_eth_addr_t addr) {
+	if (peer && !fastd_peer_is_established(peer))
+		exit_bug("tried to learn ethernet address on non-established peer");
+
+	uint64_t key = address_key(addr);
+	fastd_timeout_t timeout = fastd_now() + ETH_ADDR_STALE_TIME;
+
+	fastd_eth_addr_slot_t *slot = table_find(key);
+	if (slot && slot->entry->peer == peer) {
+		fastd_peer_eth_addr_t *entry = slot->entry;
+
+		/* Worker threads may refresh the same entry concurrently */
+		if (timeout - __atomic_load_n(&entry->timeout, __ATOMIC_RELAXED) > ETH_ADDR_REFRESH_TIME)
+			__atomic_store_n(&entry->timeout, timeout, __ATOMIC_RELAXED);
+
+		return; /* We're done here. */
+	}
+
+	if (fastd_worker_is_shared()) {
+		fastd_async_eth_addr_t eth_addr = {
+			.local = !peer,
+			.peer_id = peer ? peer->id : 0,
+			.addr = addr,
+		};
+
+		/* If the notification is dropped, the address will be handed over again with the next frame */
+		fastd_async_try_enqueue(ASYNC_TYPE_ETH_ADDR, &eth_addr, sizeof(eth_addr));
+		return;
+	}
+
+	if (slot) {
+		fastd_peer_eth_addr_t *entry = slot->entry;
+
+		peer_list_remove(entry);
+		entry->peer = peer;
+		peer_list_add(entry);
+
+		if (timeout - entry->timeout > ETH_ADDR_REFRESH_TIME)
+			entry->timeout = timeout;
+
+		return;
+	}
+
+	/* Keep the load factor below 3/4 */
+	if (4 * (ctx.eth_addr_ht_used + 1) > 3 * ctx.eth_addr_ht_size)
+		grow_hashtable();
+
+	fastd_peer_eth_addr_t *entry = fastd_new(fastd_peer_eth_addr_t);
+	*entry = (fastd_peer_eth_addr_t){
+		.addr = addr,
+		.peer = peer,
+		.timeout = timeout,
+	};
+
+	table_insert(ctx.eth_addr_ht, ctx.eth_addr_ht_size, key, entry);
+	ctx.eth_addr_ht_used++;
+	wheel_add(entry);
+	peer_list_add(entry);
+
+	if (peer)
+		pr_debug("learned new MAC address %E on peer %P", &addr, peer);
+	else
+		pr_debug("learned new local MAC address %E", &addr);
+}
+
+/** Finds the peer that is associated with a given MAC address */
+bool fastd_peer_find_by_eth_addr(const fastd_eth_addr_t addr, fastd_peer_t **peer) {
+	const fastd_eth_addr_slot_t *slot = table_find(address_key(addr));
+	if (!slot)
+		return false;
+
+	*peer = slot->entry->peer;
+	return true;
+}
+
+/** Removes all MAC addresses associated with a peer */
+void fastd_peer_eth_addr_forget(fastd_peer_t *peer) {
+	while (peer->eth_addrs) {
+		fastd_peer_eth_addr_t *entry = peer->eth_addrs;
+
+		peer_list_remove(entry);
+		wheel_remove(entry);
+		delete_slot(table_find(address_key(entry->addr)) - ctx.eth_addr_ht);
+	}
+}
+
+/** Removes all time-outed MAC addresses, handling the slots of the aging wheel for all past maintenance intervals */
+void fastd_peer_eth_addr_cleanup(void) {
+	int64_t pos = fastd_now() / MAINTENANCE_INTERVAL;
+
+	/* Every slot needs to be handled at most once */
+	if (pos - ctx.eth_addr_wheel_pos > ETH_ADDR_WHEEL_SLOTS)
+		ctx.eth_addr_wheel_pos = pos - ETH_ADDR_WHEEL_SLOTS;
+
+	for (; ctx.eth_addr_wheel_pos < pos; ctx.eth_addr_wheel_pos++) {
+		fastd_peer_eth_addr_t **slot = &ctx.eth_addr_wheel[ctx.eth_addr_wheel_pos % ETH_ADDR_WHEEL_SLOTS];
+
+		/* Detach the list, so entries moved back into the same slot aren't handled again */
+		fastd_peer_eth_addr_t *entry = *slot, *next;
+		*slot = NULL;
+
+		for (; entry; entry = next) {
+			next = entry->wheel_next;
+
+			if (!fastd_timed_out(entry->timeout)) {
+				wheel_add(entry);
+				continue;
+			}
+
+			pr_debug(
+				"MAC address %E not seen for more than %u seconds, removing", &entry->addr,
+				ETH_ADDR_STALE_TIME / 1000);
+
+			peer_list_remove(entry);
+			delete_slot(table_find(address_key(entry->addr)) - ctx.eth_addr_ht);
+		}
+	}
+}
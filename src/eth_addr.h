@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   The table of MAC addresses learned in TAP mode
+*/
+
+
+#pragma once
+
+
+#include "fastd.h"
+
+
+/** An entry for a MAC address seen at another peer */
+struct fastd_peer_eth_addr {
+	fastd_eth_addr_t addr;   /**< The MAC address */
+	fastd_peer_t *peer;      /**< The corresponding peer (NULL for local addresses) */
+	fastd_timeout_t timeout; /**< Timeout after which the address entry will be purged */
+
+	fastd_peer_eth_addr_t *wheel_next;   /**< The next entry in the same slot of the aging wheel */
+	fastd_peer_eth_addr_t **wheel_pprev; /**< The pointer to this entry in the same slot of the aging wheel */
+
+	fastd_peer_eth_addr_t *peer_next;   /**< The next entry in the peer's list of MAC addresses */
+	fastd_peer_eth_addr_t **peer_pprev; /**< The pointer to this entry in the peer's list (NULL if none) */
+};
+
+/** A slot of the MAC address hashtable */
+struct fastd_eth_addr_slot {
+	uint64_t key;                 /**< The MAC address in the lower 48 bits (in memory order) */
+	fastd_peer_eth_addr_t *entry; /**< The entry (NULL for empty slots) */
+};
+
+
+void fastd_peer_eth_addr_init(void);
+void fastd_peer_eth_addr_free(void);
+
+void fastd_peer_eth_addr_add(fastd_peer_t *peer, fastd_eth_addr_t addr);
+bool fastd_peer_find_by_eth_addr(const fastd_eth_addr_t addr, fastd_peer_t **peer);
+void fastd_peer_eth_addr_forget(fastd_peer_t *peer);
+void fastd_peer_eth_addr_cleanup(void);
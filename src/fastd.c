@@ -19,11 +19,17 @@
 #include "async.h"
 #include "config.h"
 #include "crypto.h"
+#include "crypto_pool.h"
+#include "eth_addr.h"
+#include "handshake_limit.h"
+#include "handshake_pool.h"
+#include "offload.h"
 #include "peer.h"
 #include "peer_group.h"
 #include "peer_hashtable.h"
 #include "polling.h"
 #include "version.h"
+#include "worker.h"
 
 #include <grp.h>
 #include <signal.h>
@@ -75,7 +81,7 @@ static void on_signal(int signo) {
 		return;
 	}
 
-#ifndef USE_EPOLL
+#if !defined(USE_EPOLL) && !defined(USE_IO_URING)
 	/* Avoids a race condition between pthread_sigmask() and poll() (FreeBSD doesn't have ppoll() ...) */
 	fastd_async_enqueue(ASYNC_TYPE_NOP, NULL, 0);
 #endif
@@ -464,9 +470,12 @@ static inline void init(int argc, char *argv[]) {
 	init_config(&status_fd);
 
 	fastd_update_time();
-	fastd_task_schedule(&ctx.next_maintenance, TASK_TYPE_MAINTENANCE, ctx.now + MAINTENANCE_INTERVAL);
+	fastd_task_schedule(&ctx.next_maintenance, TASK_TYPE_MAINTENANCE, fastd_now() + MAINTENANCE_INTERVAL);
 
 	fastd_receive_unknown_init();
+	fastd_handshake_limit_init();
+	fastd_receive_init();
+	fastd_send_init();
 
 #ifdef WITH_DYNAMIC_PEERS
 	fastd_sem_init(&ctx.verify_limit, VERIFY_LIMIT);
@@ -480,7 +489,7 @@ static inline void init(int argc, char *argv[]) {
 	pr_info("fastd " FASTD_VERSION " starting");
 
 	fastd_update_time();
-	ctx.started = ctx.now;
+	ctx.started = fastd_now();
 
 	fastd_cap_acquire();
 
@@ -501,11 +510,14 @@ static inline void init(int argc, char *argv[]) {
 			exit(1); /* An error message has already been printed by fastd_iface_open() */
 	}
 
+	fastd_workers_init();
+
 	/* change groups before trying to write the PID file as they can be relevant for file access */
 	set_groups();
 	write_pid();
 
 	fastd_peer_hashtable_init();
+	fastd_peer_eth_addr_init();
 
 	notify_systemd();
 
@@ -532,6 +544,10 @@ static inline void init(int argc, char *argv[]) {
 		set_user();
 
 	fastd_config_load_peer_dirs(true);
+
+	fastd_crypto_pool_start();
+	fastd_handshake_pool_start();
+	fastd_workers_start();
 }
 
 
@@ -586,6 +602,10 @@ static inline void handle_signals(void) {
 /** A single iteration of fastd's main loop */
 static inline void run(void) {
 	fastd_task_handle();
+
+	/* Write all coalesced and send all queued packets before waiting for new events */
+	fastd_offload_flush();
+	fastd_send_flush();
 	fastd_poll_handle();
 
 	handle_signals();
@@ -607,8 +627,15 @@ static void delete_peers(void) {
 static inline void cleanup(void) {
 	pr_info("terminating fastd");
 
+	fastd_workers_stop();
 	delete_peers();
+	fastd_crypto_pool_stop();
+	fastd_handshake_pool_stop();
 
+	fastd_offload_flush();
+	fastd_send_flush();
+	fastd_workers_free();
+	fastd_poll_free_buffers();
 	fastd_cleanup_buffers();
 
 	if (ctx.iface) {
@@ -622,17 +649,20 @@ static inline void cleanup(void) {
 
 	on_post_down();
 
+	fastd_peer_eth_addr_free();
 	fastd_peer_hashtable_free();
 
 	pthread_attr_destroy(&ctx.detached_thread);
 
 	VECTOR_FREE(ctx.async_pids);
 	VECTOR_FREE(ctx.peers);
-	VECTOR_FREE(ctx.eth_addrs);
 
 	free(ctx.protocol_state);
 
+	fastd_send_free();
+	fastd_receive_free();
 	fastd_receive_unknown_free();
+	fastd_handshake_limit_free();
 
 	close_log();
 	fastd_config_release();
@@ -19,8 +19,10 @@
 
 #include "buffer.h"
 #include "log.h"
+#include "peer_index.h"
 #include "polling.h"
 #include "sem.h"
+#include "sha256.h"
 #include "shell.h"
 #include "task.h"
 #include "util.h"
@@ -63,6 +65,9 @@ struct fastd_protocol {
 	/** Performs one-time initialization tasks for the protocol */
 	fastd_protocol_config_t *(*init)(void);
 
+	/** Performs periodic maintenance tasks for the protocol */
+	void (*maintenance)(void);
+
 	/** Sends a handshake to the given peer */
 	void (*handshake_init)(
 		fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
@@ -87,6 +92,17 @@ struct fastd_protocol {
 	/** Sends a payload data packet to the given peer */
 	void (*send)(fastd_peer_t *peer, fastd_buffer_t *buffer);
 
+	/**
+	   Sends a payload data packet to the given peer without consuming the buffer
+
+	   Used to send the same packet to multiple peers; the buffer must have been prepared with
+	   fastd_buffer_prepare_shared().
+	*/
+	void (*send_shared)(fastd_peer_t *peer, const fastd_buffer_t *buffer);
+
+	/** Handles the changes to the session state the worker threads have deferred to the main thread */
+	void (*handle_deferred)(fastd_peer_t *peer);
+
 
 	/** Initializes the protocol state for a peer */
 	void (*init_peer_state)(fastd_peer_t *peer);
@@ -154,6 +170,11 @@ struct fastd_socket {
 					     a random port) */
 	fastd_peer_t *peer; /**< If the socket belongs to a single peer (as it was create dynamically when sending a
 			       handshake), contains that peer */
+	fastd_send_queue_t *queue; /**< Packets waiting to be sent on the socket (NULL if sends are not queued) */
+	bool udp_segment;          /**< Set if UDP segmentation offload is used to send packets on the socket */
+	bool udp_gro;              /**< Set if coalesced datagrams are received on the socket (UDP GRO) */
+	fastd_socket_t *parent;    /**< For sockets of worker threads: the main thread's socket with the same bind address */
+	bool connected;            /**< Set for the connected socket of an established peer */
 };
 
 /** A TUN/TAP interface */
@@ -163,6 +184,7 @@ struct fastd_iface {
 	fastd_peer_t *peer; /**< The peer associated with the interface (if any) */
 	uint16_t mtu;       /**< The MTU of the interface */
 	bool cleanup;       /**< Determines if the interface should be deleted after use; not used on all platforms */
+	bool vnet_hdr;      /**< Determines if packets on the interface are prefixed with a virtio-net header */
 };
 
 
@@ -220,6 +242,21 @@ struct fastd_config {
 #endif
 	bool forward; /**< Specifies if packet forwarding is enable */
 
+	size_t receive_batch;       /**< The maximum number of datagrams to receive from a socket at once */
+	size_t send_batch;          /**< The maximum number of packets to queue before they are sent */
+	size_t iface_drain_budget;  /**< The maximum number of packets to read from the interface when it is readable */
+	size_t socket_drain_budget; /**< The maximum number of messages to read from a socket when it is readable */
+	bool socket_connect;      /**< Specifies if established peers should get a connected socket of their own */
+	bool udp_segmentation;    /**< Specifies if UDP segmentation offload should be used to send packets */
+	bool udp_receive_offload; /**< Specifies if UDP GRO should be enabled on the bound sockets */
+	bool iface_offload;       /**< Specifies if TUN/TAP interfaces should be opened with offloads enabled */
+	bool buffer_hugepages;    /**< Specifies if packet buffers should be allocated from huge pages */
+	size_t worker_threads;    /**< The number of worker threads handling packets in addition to the main thread */
+	size_t crypto_threads;    /**< The number of threads encrypting and decrypting payload packets */
+	size_t handshake_threads; /**< The number of threads performing the key agreements of handshakes */
+	size_t handshake_rate_limit; /**< The number of handshakes per second above which cookies are required (or 0) */
+	size_t handshake_key_budget; /**< The memory available for precomputed tables of peer keys (in bytes) */
+
 	fastd_drop_caps_t drop_caps; /**< Specifies if and when to drop capabilities */
 
 #ifdef USE_USER
@@ -284,7 +321,7 @@ struct fastd_context {
 
 	int64_t started; /**< The timestamp when fastd was started */
 
-	int64_t now; /**< The current monotonous timestamp in milliseconds after an arbitrary point in time */
+	fastd_timeout_t now; /**< The current monotonous timestamp in milliseconds (read with fastd_now()) */
 
 	fastd_iface_t *iface; /**< The default tunnel interface */
 
@@ -295,9 +332,9 @@ struct fastd_context {
 	fastd_sem_t verify_limit; /**< Keeps track of the number of verifier threads */
 #endif
 
-#ifdef USE_EPOLL
+#if defined(USE_EPOLL)
 	int epoll_fd; /**< The file descriptor for the epoll facility */
-#else
+#elif !defined(USE_IO_URING)
 	VECTOR(fastd_poll_fd_t *) fds; /**< Vector of file descriptors to poll on, indexed by the FD itself */
 	VECTOR(struct pollfd) pollfds; /**< The vector of pollfds for all file descriptors */
 #endif
@@ -310,12 +347,20 @@ struct fastd_context {
 	uint16_t max_mtu;  /**< The maximum MTU of all peer-specific interfaces */
 	size_t max_buffer; /**< Maximum buffer size needed for any combination of peer MTU, method, or handshake */
 
-	uint32_t peer_addr_ht_seed;           /**< The hash seed used for peer_addr_ht */
-	size_t peer_addr_ht_size;             /**< The number of hash buckets in the peer address hashtable */
-	size_t peer_addr_ht_used;             /**< The current number of entries in the peer address hashtable */
-	VECTOR(fastd_peer_t *) *peer_addr_ht; /**< An array of hash buckets for the peer hash table */
+	uint64_t peer_addr_ht_key[2];              /**< The SipHash key used for peer_addr_ht */
+	fastd_peer_hashtable_entry_t *peer_addr_ht; /**< The slots of the peer address hashtable */
+	size_t peer_addr_ht_size;                  /**< The number of slots in peer_addr_ht (a power of two) */
+	size_t peer_addr_ht_used;                  /**< The number of used slots in peer_addr_ht */
+
+	/** While the peer address hashtable is being resized, the slots of the previous table */
+	fastd_peer_hashtable_entry_t *peer_addr_ht_old;
+	size_t peer_addr_ht_old_size; /**< The number of slots in peer_addr_ht_old */
+	size_t peer_addr_ht_old_used; /**< The number of entries that remain to be moved from peer_addr_ht_old */
+	size_t peer_addr_ht_moved;    /**< The number of slots of peer_addr_ht_old that have been moved */
 
-	fastd_pqueue_t *task_queue;    /**< Priority queue of scheduled tasks */
+	fastd_peer_index_t peer_owners; /**< Index of the peers by their statically configured remote addresses */
+
+	fastd_task_wheel_t task_wheel; /**< Timer wheel of scheduled tasks */
 	fastd_task_t next_maintenance; /**< Schedules the next maintenance call */
 
 	VECTOR(pid_t) async_pids; /**< PIDs of asynchronously executed commands which still have to be reaped */
@@ -339,13 +384,40 @@ struct fastd_context {
 
 	fastd_stats_t stats; /**< Traffic statistics */
 
-	VECTOR(fastd_peer_eth_addr_t)
-	eth_addrs; /**< Sorted vector of all known ethernet addresses with associated peers and timeouts */
+#ifdef WITH_STATUS_SOCKET
+	uint64_t receive_wakeups;   /**< The number of times a socket was handled because it was readable */
+	uint64_t receive_datagrams; /**< The number of datagrams received on all sockets */
+#endif
+
+	uint64_t eth_addr_ht_key[2];        /**< The SipHash key used for eth_addr_ht */
+	fastd_eth_addr_slot_t *eth_addr_ht; /**< The slots of the hashtable of all known ethernet addresses */
+	size_t eth_addr_ht_size;            /**< The number of slots in eth_addr_ht (a power of two) */
+	size_t eth_addr_ht_used;            /**< The number of used slots in eth_addr_ht */
+
+	/** The aging wheel of the ethernet addresses, sorting the entries by their timeout */
+	fastd_peer_eth_addr_t *eth_addr_wheel[ETH_ADDR_WHEEL_SLOTS];
+	int64_t eth_addr_wheel_pos; /**< The number of the next maintenance interval handled by the aging wheel */
 
 	uint32_t unknown_handshake_seed; /**< Hash seed for the unknown handshake hashtables */
 	fastd_handshake_timeout_t
 		*unknown_handshakes[UNKNOWN_TABLES]; /**< Hash tables unknown addresses handshakes have been sent to */
 
+	int64_t handshake_rate_start; /**< The start of the current interval of the handshake rate measurement */
+	size_t handshake_rate_count;  /**< The number of handshakes received in the current interval */
+	size_t handshake_rate_prev;   /**< The number of handshakes received in the previous interval */
+	bool handshake_under_load;    /**< Set while the handshake rate is above the limit */
+
+	/** The current and the previous secret used to create handshake cookies */
+	uint32_t handshake_cookie_secrets[2][FASTD_HMACSHA256_KEY_WORDS];
+	fastd_timeout_t handshake_cookie_rotate; /**< The time the current cookie secret will be replaced */
+
+	uint32_t handshake_bucket_seed;              /**< Hash seed for the handshake token buckets */
+	fastd_handshake_bucket_t *handshake_buckets; /**< The token buckets limiting the handshake rate per source */
+	/** The token buckets limiting the rate of handshakes without cookie support per source */
+	fastd_handshake_bucket_t *handshake_fallback_buckets;
+	int64_t handshake_fallback_tokens;       /**< The tokens shared by all handshakes without cookie support */
+	fastd_timeout_t handshake_fallback_last; /**< The time handshake_fallback_tokens has been updated */
+
 	fastd_protocol_state_t *protocol_state; /**< Protocol-specific state */
 };
 
@@ -367,16 +439,36 @@ void fastd_send(
 	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
 	fastd_peer_t *peer, fastd_buffer_t *buffer, size_t stat_size);
 void fastd_send_data(fastd_buffer_t *buffer, fastd_peer_t *source, fastd_peer_t *dest);
+void fastd_send_init(void);
+void fastd_send_free(void);
+fastd_send_queue_t *fastd_send_queue_new(fastd_socket_t *sock);
+void fastd_send_queue_free(fastd_send_queue_t *queue);
+void fastd_send_flush(void);
+void fastd_send_forget_peer(const fastd_peer_t *peer);
+#ifdef USE_IO_URING
+void fastd_send_complete(void *request, int res);
+#endif
 
 void fastd_receive_unknown_init(void);
 void fastd_receive_unknown_free(void);
-void fastd_receive(fastd_socket_t *sock);
+void fastd_receive_init(void);
+void fastd_receive_free(void);
+size_t fastd_receive_buffer_size(void);
+size_t fastd_receive(fastd_socket_t *sock, size_t max);
+#ifdef USE_IO_URING
+void fastd_receive_datagram(
+	fastd_socket_t *sock, struct msghdr *message, fastd_peer_address_t *recvaddr, fastd_buffer_t *buffer);
+#endif
+void fastd_receive_deferred(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_buffer_t *buffer);
 void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reordered);
 
 void fastd_close_all_fds(void);
 
 void fastd_socket_bind_all(void);
 fastd_socket_t *fastd_socket_open(fastd_peer_t *peer, int af);
+fastd_socket_t *fastd_socket_connect(fastd_peer_t *peer);
 void fastd_socket_close(fastd_socket_t *sock);
 void fastd_socket_error(fastd_socket_t *sock);
 
@@ -384,6 +476,7 @@ void fastd_resolve_peer(fastd_peer_t *peer, fastd_remote_t *remote);
 
 fastd_iface_t *fastd_iface_open(fastd_peer_t *peer);
 void fastd_iface_handle(fastd_iface_t *iface);
+size_t fastd_iface_handle_queue(fastd_iface_t *iface, int fd, size_t max);
 void fastd_iface_write(fastd_iface_t *iface, fastd_buffer_t *buffer);
 void fastd_iface_close(fastd_iface_t *iface);
 
@@ -542,6 +635,15 @@ static inline void fastd_string_stack_free(fastd_string_stack_t *str) {
 	}
 }
 
+/**
+   Returns the current time
+
+   The time is updated by all threads handling packets, so it is read atomically.
+*/
+static inline fastd_timeout_t fastd_now(void) {
+	return __atomic_load_n(&ctx.now, __ATOMIC_RELAXED);
+}
+
 /**
    Checks if a timeout has occured
 
@@ -549,10 +651,11 @@ static inline void fastd_string_stack_free(fastd_string_stack_t *str) {
 
    @return true if the given timeout is before or equal to the current time
 
-   \note The current time is updated only once per main loop iteration, after waiting for input.
+   \note The current time is updated only once per main loop iteration (and by the worker threads whenever they
+   have waited for packets), after waiting for input.
 */
 static inline bool fastd_timed_out(fastd_timeout_t timeout) {
-	return timeout <= ctx.now;
+	return timeout <= fastd_now();
 }
 
 /** Returns the minimum of two fastd_timeout_t values */
@@ -566,9 +669,17 @@ static inline void fastd_timeout_advance(fastd_timeout_t *a, fastd_timeout_t v)
 		*a = v;
 }
 
-/** Updates the current time */
+/**
+   Updates the current time
+
+   With worker threads, multiple threads may update the time at once; it is ensured that it never moves
+   backwards.
+*/
 static inline void fastd_update_time(void) {
-	ctx.now = fastd_get_time();
+	fastd_timeout_t now = fastd_get_time(), prev = fastd_now();
+
+	while (prev < now &&
+	       !__atomic_compare_exchange_n(&ctx.now, &prev, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
 }
 
 /** Checks if a on-verify command is set */
@@ -12,6 +12,7 @@
 
 
 #include "handshake.h"
+#include "handshake_limit.h"
 #include "method.h"
 #include "peer.h"
 #include "peer_group.h"
@@ -36,6 +37,8 @@ static const char *const RECORD_TYPES[RECORD_MAX] = {
 	"version name",
 	"method list",
 	"TLV message authentication code",
+	"cookie",
+	"cookie nonce",
 };
 
 
@@ -169,6 +172,8 @@ static fastd_buffer_t *new_handshake(
 			      RECORD_LEN(protocol_len) +    /* protocol name */
 			      RECORD_LEN(method_len) +      /* method name */
 			      RECORD_LEN(method_list_len) + /* supported method name list */
+			      ((type & 1) ? RECORD_LEN(HANDSHAKE_COOKIE_NONCE_BYTES) : 0) + /* cookie nonce */
+			      ((type & 1) ? RECORD_LEN(HANDSHAKE_COOKIE_BYTES) : 0) +       /* cookie */
 			      tail_space;
 
 	/* TODO: Make this a soft error */
@@ -375,6 +380,11 @@ static inline bool check_records(
 			return false;
 		}
 
+		if (as_uint8(&handshake->records[RECORD_REPLY_CODE]) == REPLY_COOKIE) {
+			fastd_handshake_limit_handle_cookie(sock, local_addr, remote_addr, peer, handshake);
+			return false;
+		}
+
 		if (as_uint8(&handshake->records[RECORD_REPLY_CODE]) != REPLY_SUCCESS) {
 			print_error_reply(peer, remote_addr, handshake);
 			return false;
@@ -475,6 +485,9 @@ void fastd_handshake_handle(
 	if (!check_records(sock, local_addr, remote_addr, peer, &handshake))
 		goto end_free;
 
+	if (!fastd_handshake_limit_check(sock, local_addr, remote_addr, peer, &handshake))
+		goto end_free;
+
 	if (handshake.type > 1) {
 		if (handshake.records[RECORD_VERSION_NAME].data)
 			handshake.peer_version = peer_version = fastd_strndup(
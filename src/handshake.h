@@ -47,6 +47,8 @@ typedef enum fastd_handshake_record_type {
 	RECORD_VERSION_NAME,            /**< The fastd version */
 	RECORD_METHOD_LIST,             /**< Zero-separated list of supported methods */
 	RECORD_TLV_MAC,                 /**< Message authentication code of the TLV records */
+	RECORD_COOKIE,                  /**< A cookie bound to the initiator's address */
+	RECORD_COOKIE_NONCE,            /**< A nonce binding cookie replies to the handshake they answer */
 	RECORD_MAX,                     /**< (Number of defined record types) */
 } fastd_handshake_record_type_t;
 
@@ -55,6 +57,7 @@ typedef enum fastd_reply_code {
 	REPLY_SUCCESS = 0,        /**< The handshake was sucessfull */
 	REPLY_MANDATORY_MISSING,  /**< A required TLV field is missing */
 	REPLY_UNACCEPTABLE_VALUE, /**< A TLV field has an invalid value */
+	REPLY_COOKIE,             /**< The handshake must be repeated with the provided cookie */
 	REPLY_MAX,                /**< (Number of defined reply codes */
 } fastd_reply_code_t;
 
@@ -125,7 +128,7 @@ static inline uint16_t fastd_handshake_tlv_len(const fastd_buffer_t *buffer) {
 static inline uint8_t *fastd_handshake_extend(fastd_buffer_t *buffer, fastd_handshake_record_type_t type, size_t len) {
 	uint8_t *dst = buffer->data + buffer->len;
 
-	if ((uint8_t *)buffer->data + buffer->len + RECORD_LEN(len) > buffer->base + ctx.max_buffer)
+	if ((uint8_t *)buffer->data + buffer->len + RECORD_LEN(len) > buffer->base + buffer->size)
 		exit_bug("not enough buffer allocated for handshake");
 
 	buffer->len += RECORD_LEN(len);
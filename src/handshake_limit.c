@@ -0,0 +1,425 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Rate limiting of received handshakes using cookies and per-source token buckets
+
+   Handling a handshake requires expensive key agreements, so fastd can be overloaded by a flood of
+   handshakes. When more handshakes than configured with \e handshake \e rate \e limit are received
+   per second, initial handshakes and handshake finishes are only handled if they contain a cookie
+   bound to their source address. Handshakes without a valid cookie are answered with a cookie
+   reply; fastd peers include the cookie in all handshakes they send to the same address afterwards.
+
+   As a valid cookie proves that the sender can receive packets sent to the source address, the
+   rate of handshakes handled for each source address can then be limited with a token bucket, without
+   spoofed packets using up the tokens of legitimate peers. The token buckets are kept in a
+   fixed-size hashtable like the ones of backoff_unknown(), so the memory used doesn't depend on the
+   number of sources.
+
+   Handshakes that can't carry a cookie (those of older fastd versions, which don't send a cookie
+   nonce, and handshakes sent to unknown peers) would never be handled under load. As their source
+   addresses may be spoofed, they are limited by a single token bucket shared by all sources first,
+   so a flood can't cause more key agreements than this bucket allows; the handshakes passing it are
+   then limited by a separate table of per-source token buckets with a much lower rate, so a single
+   source can't use up the shared tokens. Spoofed handshakes can't use up the tokens of peers
+   supporting cookies.
+
+   Cookies are MACs of the source address using a secret that is replaced every
+   HANDSHAKE_COOKIE_SECRET_LIFETIME; cookies created with the previous secret are accepted as well.
+
+   Like the cookie replies of WireGuard, cookie replies are bound to the handshake they answer, so
+   they can't be forged by hosts that haven't seen this handshake: each handshake that may be
+   answered with a cookie carries a random nonce, which the cookie reply echoes. The reply is
+   authenticated with a MAC keyed with a hash of the public key of the peer under load (taken from
+   the recipient key record of the handshake), and a cookie reply is only accepted when it comes from
+   the address the last handshake has been sent to and echoes its nonce.
+*/
+
+
+#include "handshake_limit.h"
+#include "crypto.h"
+#include "handshake.h"
+#include "peer.h"
+#include "peer_hashtable.h"
+
+
+/** The interval the handshake rate is measured in */
+#define RATE_INTERVAL 1000
+
+
+/** The representation of an address a cookie is computed from */
+typedef union cookie_input {
+	struct {
+		uint16_t family;   /**< The address family */
+		uint16_t port;     /**< The port in network byte order */
+		uint32_t scope_id; /**< The scope ID of link-local IPv6 addresses (0 for all other addresses) */
+		uint8_t addr[16];  /**< The IPv4 or IPv6 address */
+	};
+	uint32_t words[6]; /**< The input as a sequence of words */
+} cookie_input_t;
+
+
+/** Computes the cookie of an address */
+static void make_cookie(
+	uint8_t cookie[HANDSHAKE_COOKIE_BYTES], const uint32_t secret[FASTD_HMACSHA256_KEY_WORDS],
+	const fastd_peer_address_t *addr) {
+	cookie_input_t input = {};
+	input.family = addr->sa.sa_family;
+
+	switch (addr->sa.sa_family) {
+	case AF_INET:
+		input.port = addr->in.sin_port;
+		memcpy(input.addr, &addr->in.sin_addr, sizeof(addr->in.sin_addr));
+		break;
+
+	case AF_INET6:
+		input.port = addr->in6.sin6_port;
+		memcpy(input.addr, &addr->in6.sin6_addr, sizeof(addr->in6.sin6_addr));
+		if (IN6_IS_ADDR_LINKLOCAL(&addr->in6.sin6_addr))
+			input.scope_id = addr->in6.sin6_scope_id;
+		break;
+
+	default:
+		exit_bug("make_cookie: unknown address family");
+	}
+
+	fastd_sha256_t mac;
+	fastd_hmacsha256(&mac, secret, input.words, sizeof(input));
+	memcpy(cookie, mac.b, HANDSHAKE_COOKIE_BYTES);
+}
+
+/** Derives the key cookie replies are authenticated with from the public key of the peer sending them */
+static void derive_reply_key(uint32_t out[FASTD_HMACSHA256_KEY_WORDS], const uint8_t *public_key) {
+	static const union {
+		char c[FASTD_SHA256_BLOCK_BYTES];
+		uint32_t w[FASTD_SHA256_BLOCK_WORDS];
+	} label = { .c = "fastd handshake cookie reply" };
+
+	uint32_t key[FASTD_SHA256_BLOCK_WORDS];
+	memcpy(key, public_key, FASTD_SHA256_BLOCK_BYTES);
+
+	fastd_sha256_t hash;
+	fastd_sha256_blocks(&hash, label.w, key, NULL);
+	memcpy(out, hash.w, FASTD_HMACSHA256_KEY_BYTES);
+}
+
+/** Checks if a handshake carries the records needed to send an authenticated cookie reply */
+static bool has_cookie_nonce(const fastd_handshake_t *handshake) {
+	return handshake->records[RECORD_COOKIE_NONCE].length == HANDSHAKE_COOKIE_NONCE_BYTES &&
+	       handshake->records[RECORD_RECIPIENT_KEY].length == FASTD_SHA256_BLOCK_BYTES;
+}
+
+/** Replaces the cookie secret when it has expired */
+static void rotate_cookie_secret(void) {
+	if (!fastd_timed_out(ctx.handshake_cookie_rotate))
+		return;
+
+	memcpy(ctx.handshake_cookie_secrets[1], ctx.handshake_cookie_secrets[0],
+	       sizeof(ctx.handshake_cookie_secrets[0]));
+	fastd_random_bytes(ctx.handshake_cookie_secrets[0], sizeof(ctx.handshake_cookie_secrets[0]), false);
+
+	ctx.handshake_cookie_rotate = fastd_now() + HANDSHAKE_COOKIE_SECRET_LIFETIME;
+}
+
+/** Checks if a handshake contains a valid cookie for its source address */
+static bool check_cookie(const fastd_peer_address_t *addr, const fastd_handshake_t *handshake) {
+	const fastd_handshake_record_t *record = &handshake->records[RECORD_COOKIE];
+	if (record->length != HANDSHAKE_COOKIE_BYTES)
+		return false;
+
+	size_t i;
+	for (i = 0; i < array_size(ctx.handshake_cookie_secrets); i++) {
+		uint8_t cookie[HANDSHAKE_COOKIE_BYTES];
+		make_cookie(cookie, ctx.handshake_cookie_secrets[i], addr);
+
+		if (secure_memequal(cookie, record->data, HANDSHAKE_COOKIE_BYTES))
+			return true;
+	}
+
+	return false;
+}
+
+/** Sends a cookie reply for a handshake */
+static void send_cookie(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_handshake_t *handshake) {
+	const fastd_handshake_record_t *nonce = &handshake->records[RECORD_COOKIE_NONCE];
+
+	uint8_t cookie[HANDSHAKE_COOKIE_BYTES];
+	make_cookie(cookie, ctx.handshake_cookie_secrets[0], remote_addr);
+
+	fastd_buffer_t *buffer = fastd_buffer_alloc(
+		sizeof(fastd_handshake_packet_t) + 2 * RECORD_LEN(1) /* handshake type, reply code */ +
+			RECORD_LEN(HANDSHAKE_COOKIE_NONCE_BYTES) + RECORD_LEN(HANDSHAKE_COOKIE_BYTES) +
+			RECORD_LEN(FASTD_SHA256_HASH_BYTES),
+		0);
+
+	fastd_handshake_packet_t *reply = buffer->data;
+	reply->packet_type = PACKET_HANDSHAKE;
+	reply->rsv = 0;
+	reply->tlv_len = 0;
+	buffer->len = sizeof(*reply);
+
+	fastd_handshake_add_uint8(buffer, RECORD_HANDSHAKE_TYPE, handshake->type + 1);
+	fastd_handshake_add_uint8(buffer, RECORD_REPLY_CODE, REPLY_COOKIE);
+	fastd_handshake_add(buffer, RECORD_COOKIE_NONCE, HANDSHAKE_COOKIE_NONCE_BYTES, nonce->data);
+	fastd_handshake_add(buffer, RECORD_COOKIE, HANDSHAKE_COOKIE_BYTES, cookie);
+
+	uint32_t key[FASTD_HMACSHA256_KEY_WORDS];
+	derive_reply_key(key, handshake->records[RECORD_RECIPIENT_KEY].data);
+
+	fastd_sha256_t hmacbuf;
+	uint8_t *mac = fastd_handshake_add_zero(buffer, RECORD_TLV_MAC, FASTD_SHA256_HASH_BYTES);
+	fastd_hmacsha256(&hmacbuf, key, fastd_handshake_tlv_data(buffer), fastd_handshake_tlv_len(buffer));
+	memcpy(mac, hmacbuf.b, FASTD_SHA256_HASH_BYTES);
+
+	fastd_send(sock, local_addr, remote_addr, peer, buffer, 0);
+}
+
+/** Checks if a received cookie reply answers the last handshake sent to the peer and is authentic */
+static bool verify_cookie_reply(
+	const fastd_peer_t *peer, const fastd_peer_address_t *remote_addr, const fastd_handshake_t *handshake) {
+	const fastd_handshake_record_t *nonce = &handshake->records[RECORD_COOKIE_NONCE];
+	const fastd_handshake_record_t *mac = &handshake->records[RECORD_TLV_MAC];
+
+	if (nonce->length != HANDSHAKE_COOKIE_NONCE_BYTES || mac->length != FASTD_SHA256_HASH_BYTES)
+		return false;
+
+	if (!fastd_peer_address_equal(&peer->handshake_cookie_nonce_address, remote_addr) ||
+	    !secure_memequal(peer->handshake_cookie_nonce, nonce->data, HANDSHAKE_COOKIE_NONCE_BYTES))
+		return false;
+
+	/* The MAC is computed over the TLV records with a zeroed MAC record (and needs 32bit-aligned input) */
+	uint32_t tlv_data[block_count(handshake->tlv_len, sizeof(uint32_t))];
+	memcpy(tlv_data, handshake->tlv_data, handshake->tlv_len);
+	memset((uint8_t *)tlv_data + (mac->data - (const uint8_t *)handshake->tlv_data), 0, FASTD_SHA256_HASH_BYTES);
+
+	return fastd_hmacsha256_verify(mac->data, peer->handshake_cookie_reply_key, tlv_data, handshake->tlv_len);
+}
+
+
+/** Accounts for a received handshake and checks if the handshake rate is above the limit */
+static bool update_load(void) {
+	int64_t elapsed = fastd_now() - ctx.handshake_rate_start;
+
+	if (elapsed >= RATE_INTERVAL) {
+		ctx.handshake_rate_prev = (elapsed < 2 * RATE_INTERVAL) ? ctx.handshake_rate_count : 0;
+		ctx.handshake_rate_count = 0;
+		ctx.handshake_rate_start = fastd_now();
+	}
+
+	ctx.handshake_rate_count++;
+
+	bool under_load = ctx.handshake_rate_count > conf.handshake_rate_limit ||
+			  ctx.handshake_rate_prev > conf.handshake_rate_limit;
+
+	if (under_load != ctx.handshake_under_load) {
+		if (under_load)
+			pr_warn("received more than %u handshakes per second, requiring cookies",
+				(unsigned)conf.handshake_rate_limit);
+		else
+			pr_info("handshake rate is below the limit again, not requiring cookies anymore");
+
+		ctx.handshake_under_load = under_load;
+	}
+
+	return under_load;
+}
+
+/** Returns the token bucket entry for an address in a table of token buckets */
+static fastd_handshake_bucket_t *bucket_entry(fastd_handshake_bucket_t *buckets, const fastd_peer_address_t *addr) {
+	uint32_t hash = ctx.handshake_bucket_seed;
+	fastd_peer_address_hash(&hash, addr);
+	fastd_hash_final(&hash);
+
+	return &buckets[hash % HANDSHAKE_BUCKETS];
+}
+
+/** Adds the tokens for the time since the last update to a token bucket, up to \e burst tokens */
+static inline void refill_tokens(int64_t *tokens, fastd_timeout_t *last, int64_t interval, int64_t burst) {
+	*tokens += fastd_now() - *last;
+	if (*tokens > burst * interval)
+		*tokens = burst * interval;
+
+	*last = fastd_now();
+}
+
+/** Takes a token from a token bucket, returning false if none is available */
+static inline bool consume_token(int64_t *tokens, int64_t interval) {
+	if (*tokens < interval)
+		return false;
+
+	*tokens -= interval;
+	return true;
+}
+
+/**
+   Takes a token from the bucket of an address, returning false if none is available
+
+   A token is added to the bucket every \e interval milliseconds, up to \e burst tokens. An address
+   taking over an entry only gets a single token, so sending from changing addresses doesn't gain
+   a burst of handshakes.
+*/
+static bool take_token(
+	fastd_handshake_bucket_t *buckets, const fastd_peer_address_t *addr, int64_t interval, int64_t burst) {
+	fastd_handshake_bucket_t *bucket = bucket_entry(buckets, addr);
+
+	if (fastd_peer_address_equal(&bucket->address, addr)) {
+		refill_tokens(&bucket->tokens, &bucket->last, interval, burst);
+	} else {
+		/* The entry is unused or belongs to another address, take it over */
+		bucket->address = *addr;
+		bucket->tokens = interval;
+		bucket->last = fastd_now();
+	}
+
+	return consume_token(&bucket->tokens, interval);
+}
+
+
+/** Initializes the handshake rate limiting state */
+void fastd_handshake_limit_init(void) {
+	if (!conf.handshake_rate_limit)
+		return;
+
+	ctx.handshake_rate_start = fastd_now();
+
+	fastd_random_bytes(ctx.handshake_cookie_secrets, sizeof(ctx.handshake_cookie_secrets), false);
+	ctx.handshake_cookie_rotate = fastd_now() + HANDSHAKE_COOKIE_SECRET_LIFETIME;
+
+	ctx.handshake_buckets = fastd_new0_array(HANDSHAKE_BUCKETS, fastd_handshake_bucket_t);
+	ctx.handshake_fallback_buckets = fastd_new0_array(HANDSHAKE_BUCKETS, fastd_handshake_bucket_t);
+	ctx.handshake_fallback_tokens = HANDSHAKE_FALLBACK_BURST * HANDSHAKE_FALLBACK_INTERVAL;
+	ctx.handshake_fallback_last = fastd_now();
+	fastd_random_bytes(&ctx.handshake_bucket_seed, sizeof(ctx.handshake_bucket_seed), false);
+}
+
+/** Frees the handshake rate limiting state */
+void fastd_handshake_limit_free(void) {
+	free(ctx.handshake_buckets);
+	ctx.handshake_buckets = NULL;
+
+	free(ctx.handshake_fallback_buckets);
+	ctx.handshake_fallback_buckets = NULL;
+}
+
+/**
+   Checks if a received handshake should be handled
+
+   Initial handshakes and handshake finishes without a valid cookie are answered with a cookie
+   reply while the handshake rate is above the limit. Handshakes that can't carry a cookie are
+   handled at a reduced total rate, and a reduced rate per source address, instead.
+*/
+bool fastd_handshake_limit_check(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_handshake_t *handshake) {
+	if (!conf.handshake_rate_limit)
+		return true;
+
+	/* Only the sender of these types will retry with a cookie */
+	if (handshake->type != 1 && handshake->type != 3)
+		return true;
+
+	if (!update_load())
+		return true;
+
+	rotate_cookie_secret();
+
+	if (!has_cookie_nonce(handshake)) {
+		refill_tokens(
+			&ctx.handshake_fallback_tokens, &ctx.handshake_fallback_last, HANDSHAKE_FALLBACK_INTERVAL,
+			HANDSHAKE_FALLBACK_BURST);
+
+		if (!consume_token(&ctx.handshake_fallback_tokens, HANDSHAKE_FALLBACK_INTERVAL)) {
+			pr_debug2("received too many handshakes without cookie support, ignoring %I", remote_addr);
+			return false;
+		}
+
+		if (!take_token(
+			    ctx.handshake_fallback_buckets, remote_addr, HANDSHAKE_FALLBACK_BUCKET_INTERVAL,
+			    HANDSHAKE_FALLBACK_BUCKET_BURST)) {
+			pr_debug2("received too many handshakes without cookie support from %I, ignoring", remote_addr);
+			return false;
+		}
+
+		return true;
+	}
+
+	if (!check_cookie(remote_addr, handshake)) {
+		pr_debug2("sending cookie to %I", remote_addr);
+		send_cookie(sock, local_addr, remote_addr, peer, handshake);
+		return false;
+	}
+
+	if (!take_token(ctx.handshake_buckets, remote_addr, HANDSHAKE_BUCKET_INTERVAL, HANDSHAKE_BUCKET_BURST)) {
+		pr_debug2("received too many handshakes from %I, ignoring", remote_addr);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+   Handles a cookie reply received for one of our handshakes
+
+   Cookie replies that don't answer the last handshake sent to the peer or can't be authenticated are
+   ignored. Otherwise, the cookie is stored with the peer and included in further handshakes sent to
+   the same address. When no cookie was known for the address before, the handshake is retried
+   immediately.
+*/
+void fastd_handshake_limit_handle_cookie(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_handshake_t *handshake) {
+	const fastd_handshake_record_t *record = &handshake->records[RECORD_COOKIE];
+
+	if (!peer || record->length != HANDSHAKE_COOKIE_BYTES) {
+		pr_debug("received unexpected cookie reply from %I", remote_addr);
+		return;
+	}
+
+	if (!verify_cookie_reply(peer, remote_addr, handshake)) {
+		pr_debug("received invalid cookie reply from %P[%I]", peer, remote_addr);
+		return;
+	}
+
+	bool retry = fastd_timed_out(peer->handshake_cookie_timeout) ||
+		     !fastd_peer_address_equal(&peer->handshake_cookie_address, remote_addr);
+
+	memcpy(peer->handshake_cookie, record->data, HANDSHAKE_COOKIE_BYTES);
+	peer->handshake_cookie_address = *remote_addr;
+	peer->handshake_cookie_timeout = fastd_now() + HANDSHAKE_COOKIE_VALID;
+
+	if (!retry)
+		return;
+
+	pr_verbose("%P[%I] is under load, retrying handshake with cookie", peer, remote_addr);
+	conf.protocol->handshake_init(sock, local_addr, remote_addr, peer);
+}
+
+/**
+   Adds a cookie nonce and the cookie received from a peer (if there is a valid one for the given address) to a
+   handshake
+
+   The nonce is remembered with the peer, so only cookie replies to this handshake are accepted.
+   \e public_key is the public key of the peer (FASTD_SHA256_BLOCK_BYTES bytes), which must also be
+   sent in the recipient key record of the handshake.
+*/
+void fastd_handshake_add_cookie(
+	fastd_buffer_t *buffer, fastd_peer_t *peer, const fastd_peer_address_t *remote_addr, const void *public_key) {
+	fastd_random_bytes(peer->handshake_cookie_nonce, HANDSHAKE_COOKIE_NONCE_BYTES, false);
+	peer->handshake_cookie_nonce_address = *remote_addr;
+	derive_reply_key(peer->handshake_cookie_reply_key, public_key);
+
+	fastd_handshake_add(buffer, RECORD_COOKIE_NONCE, HANDSHAKE_COOKIE_NONCE_BYTES, peer->handshake_cookie_nonce);
+
+	if (fastd_timed_out(peer->handshake_cookie_timeout) ||
+	    !fastd_peer_address_equal(&peer->handshake_cookie_address, remote_addr))
+		return;
+
+	fastd_handshake_add(buffer, RECORD_COOKIE, HANDSHAKE_COOKIE_BYTES, peer->handshake_cookie);
+}
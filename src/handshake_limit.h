@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Rate limiting of received handshakes using cookies and per-source token buckets
+*/
+
+
+#pragma once
+
+#include "fastd.h"
+
+
+/** A token bucket limiting the rate of handshakes handled for a source address */
+struct fastd_handshake_bucket {
+	fastd_peer_address_t address; /**< The source address */
+	fastd_timeout_t last;         /**< The time the tokens of the bucket have been updated */
+	int64_t tokens;               /**< The available tokens, measured in milliseconds of refill time */
+};
+
+
+void fastd_handshake_limit_init(void);
+void fastd_handshake_limit_free(void);
+
+bool fastd_handshake_limit_check(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_handshake_t *handshake);
+void fastd_handshake_limit_handle_cookie(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const fastd_handshake_t *handshake);
+
+void fastd_handshake_add_cookie(
+	fastd_buffer_t *buffer, fastd_peer_t *peer, const fastd_peer_address_t *remote_addr, const void *public_key);
@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Expensive handshake computations performed by a pool of handshake threads
+
+   The key agreements of the handshake protocol are by far the most expensive operations fastd
+   performs when a peer connects. When handshake threads are configured, the protocol hands them
+   to the pool as jobs, so the main thread can continue forwarding packets while many peers are
+   connecting at the same time.
+
+   Finished jobs are collected in a list and handed back to the main thread through an async
+   notification. Each job is completed and destroyed in the main thread; the pool doesn't know
+   anything about the jobs' data, so the protocol must check if the result is still relevant
+   when a job is completed.
+*/
+
+
+#include "handshake_pool.h"
+#include "async.h"
+#include "fastd.h"
+
+
+/** A singly-linked list of jobs with a tail pointer */
+typedef struct handshake_job_list {
+	fastd_handshake_job_t *head;  /**< The first job of the list */
+	fastd_handshake_job_t **tail; /**< The location of the next pointer of the last job */
+} handshake_job_list_t;
+
+
+/** The lock protecting the job lists and the state of the pool */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signalled when a job has been submitted or the pool is stopped */
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+/** The handshake threads */
+static pthread_t *threads = NULL;
+
+/** The jobs waiting to be run */
+static handshake_job_list_t run_list = { NULL, &run_list.head };
+
+/** The finished jobs waiting to be completed */
+static handshake_job_list_t done_list = { NULL, &done_list.head };
+
+/** The number of jobs that have been submitted, but not completed yet */
+static size_t jobs = 0;
+
+/** Set if the main thread has been notified about finished jobs it hasn't handled yet */
+static bool notified = false;
+
+/**
+   Set before a notification is sent, and cleared when the main thread completes the finished jobs
+
+   Sending fails when the buffer of the async notification socket is full; the main thread checks
+   this flag when it reads the notifications that filled the buffer (see crypto_pool.c).
+*/
+static bool missed = false;
+
+/** Set when the handshake threads should terminate */
+static bool stopping = false;
+
+
+/** Acquires the lock */
+static inline void lock_acquire(void) {
+	if ((errno = pthread_mutex_lock(&lock)) != 0)
+		exit_errno("pthread_mutex_lock");
+}
+
+/** Releases the lock */
+static inline void lock_release(void) {
+	if ((errno = pthread_mutex_unlock(&lock)) != 0)
+		exit_errno("pthread_mutex_unlock");
+}
+
+
+/** Appends a job to a list */
+static inline void list_push(handshake_job_list_t *list, fastd_handshake_job_t *job) {
+	job->next = NULL;
+	*list->tail = job;
+	list->tail = &job->next;
+}
+
+/** Takes the first job from a list */
+static inline fastd_handshake_job_t *list_pop(handshake_job_list_t *list) {
+	fastd_handshake_job_t *job = list->head;
+	if (!job)
+		return NULL;
+
+	list->head = job->next;
+	if (!list->head)
+		list->tail = &list->head;
+
+	return job;
+}
+
+/** Takes all jobs from a list */
+static inline fastd_handshake_job_t *list_take(handshake_job_list_t *list) {
+	fastd_handshake_job_t *job = list->head;
+
+	list->head = NULL;
+	list->tail = &list->head;
+
+	return job;
+}
+
+/** Destroys all jobs of a list */
+static void destroy_jobs(fastd_handshake_job_t *job) {
+	while (job) {
+		fastd_handshake_job_t *next = job->next;
+		job->destroy(job);
+		job = next;
+	}
+}
+
+
+/** The main loop of a handshake thread */
+static void *handshake_thread(UNUSED void *arg) {
+	lock_acquire();
+
+	while (true) {
+		fastd_handshake_job_t *job;
+
+		while (!stopping && !(job = list_pop(&run_list))) {
+			if ((errno = pthread_cond_wait(&work_cond, &lock)) != 0)
+				exit_errno("pthread_cond_wait");
+		}
+
+		if (stopping)
+			break;
+
+		lock_release();
+		job->run(job);
+		lock_acquire();
+
+		list_push(&done_list, job);
+
+		if (!notified) {
+			__atomic_store_n(&missed, true, __ATOMIC_SEQ_CST);
+			notified = fastd_async_try_enqueue(ASYNC_TYPE_HANDSHAKE, NULL, 0);
+		}
+	}
+
+	lock_release();
+
+	return NULL;
+}
+
+
+/** Starts the handshake threads */
+void fastd_handshake_pool_start(void) {
+	if (!conf.handshake_threads)
+		return;
+
+	threads = fastd_new_array(conf.handshake_threads, pthread_t);
+
+	size_t i;
+	for (i = 0; i < conf.handshake_threads; i++) {
+		if ((errno = pthread_create(&threads[i], NULL, handshake_thread, NULL)) != 0)
+			exit_errno("unable to create handshake thread");
+	}
+}
+
+/** Stops the handshake threads, waiting for them to terminate, and destroys all jobs that haven't been completed */
+void fastd_handshake_pool_stop(void) {
+	if (!threads)
+		return;
+
+	lock_acquire();
+	stopping = true;
+	if ((errno = pthread_cond_broadcast(&work_cond)) != 0)
+		exit_errno("pthread_cond_broadcast");
+	lock_release();
+
+	size_t i;
+	for (i = 0; i < conf.handshake_threads; i++) {
+		if ((errno = pthread_join(threads[i], NULL)) != 0)
+			exit_errno("pthread_join");
+	}
+
+	free(threads);
+	threads = NULL;
+
+	destroy_jobs(list_take(&run_list));
+	destroy_jobs(list_take(&done_list));
+	jobs = 0;
+}
+
+/**
+   Completes the finished jobs
+
+   This is called when the async notification sent by a handshake thread is received.
+*/
+void fastd_handshake_pool_handle(void) {
+	lock_acquire();
+
+	notified = false;
+	__atomic_store_n(&missed, false, __ATOMIC_RELAXED);
+	fastd_handshake_job_t *job = list_take(&done_list);
+
+	lock_release();
+
+	size_t n = 0;
+
+	while (job) {
+		fastd_handshake_job_t *next = job->next;
+
+		job->complete(job);
+		job->destroy(job);
+
+		job = next;
+		n++;
+	}
+
+	lock_acquire();
+	jobs -= n;
+	lock_release();
+}
+
+/**
+   Completes finished jobs whose notification may not have been sent
+
+   This is called by the main thread for each async notification it handles.
+*/
+void fastd_handshake_pool_handle_missed(void) {
+	if (__atomic_load_n(&missed, __ATOMIC_SEQ_CST))
+		fastd_handshake_pool_handle();
+}
+
+/**
+   Submits a job to the handshake threads
+
+   When no handshake threads are configured, the job is run and completed immediately. The job is always
+   consumed; false is returned (and the job is destroyed without being completed) if too many jobs are
+   pending already.
+*/
+bool fastd_handshake_pool_submit(fastd_handshake_job_t *job) {
+	if (!threads) {
+		job->run(job);
+		job->complete(job);
+		job->destroy(job);
+		return true;
+	}
+
+	lock_acquire();
+
+	if (jobs >= HANDSHAKE_MAX_JOBS) {
+		lock_release();
+		job->destroy(job);
+		return false;
+	}
+
+	jobs++;
+	list_push(&run_list, job);
+
+	if ((errno = pthread_cond_signal(&work_cond)) != 0)
+		exit_errno("pthread_cond_signal");
+
+	lock_release();
+
+	return true;
+}
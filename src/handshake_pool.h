@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Expensive handshake computations performed by a pool of handshake threads
+*/
+
+
+#pragma once
+
+#include "types.h"
+
+
+/** A handshake job */
+typedef struct fastd_handshake_job fastd_handshake_job_t;
+
+/** A computation of a handshake job; the protocol-specific job data is usually embedded after the generic part */
+struct fastd_handshake_job {
+	fastd_handshake_job_t *next; /**< The next job in the list the job is currently in */
+
+	void (*run)(fastd_handshake_job_t *job);      /**< Performs the computation (in a handshake thread) */
+	void (*complete)(fastd_handshake_job_t *job); /**< Handles the result (in the main thread) */
+	void (*destroy)(fastd_handshake_job_t *job);  /**< Frees the job */
+};
+
+
+void fastd_handshake_pool_start(void);
+void fastd_handshake_pool_stop(void);
+void fastd_handshake_pool_handle(void);
+void fastd_handshake_pool_handle_missed(void);
+
+bool fastd_handshake_pool_submit(fastd_handshake_job_t *job);
@@ -7,9 +7,10 @@
 /**
    \file
 
-   An implementation of the Jenkins hash function
+   Implementations of the Jenkins hash function and of SipHash-1-3
 
    \sa https://en.wikipedia.org/wiki/Jenkins_hash_function
+   \sa https://www.aumasson.jp/siphash/siphash.pdf
 */
 
 
@@ -36,3 +37,61 @@ static inline void fastd_hash_final(uint32_t *hash) {
 	*hash ^= (*hash >> 11);
 	*hash += (*hash << 15);
 }
+
+
+/** Rotates a 64bit value left by \e b bits */
+static inline uint64_t fastd_hash_rotl64(uint64_t x, unsigned b) {
+	return (x << b) | (x >> (64 - b));
+}
+
+/** Performs a single SipRound on the SipHash state */
+static inline void fastd_siphash_round(uint64_t v[4]) {
+	v[0] += v[1];
+	v[1] = fastd_hash_rotl64(v[1], 13);
+	v[1] ^= v[0];
+	v[0] = fastd_hash_rotl64(v[0], 32);
+	v[2] += v[3];
+	v[3] = fastd_hash_rotl64(v[3], 16);
+	v[3] ^= v[2];
+	v[0] += v[3];
+	v[3] = fastd_hash_rotl64(v[3], 21);
+	v[3] ^= v[0];
+	v[2] += v[1];
+	v[1] = fastd_hash_rotl64(v[1], 17);
+	v[1] ^= v[2];
+	v[2] = fastd_hash_rotl64(v[2], 32);
+}
+
+/**
+   Computes the SipHash-1-3 value of \e n 64bit words with a 128bit key
+
+   The words are used in host byte order, so the result only matches the reference implementation on
+   little-endian systems, which doesn't matter for hashtables.
+*/
+static inline uint64_t fastd_siphash13(const uint64_t key[2], const uint64_t *data, size_t n) {
+	uint64_t v[4] = {
+		key[0] ^ UINT64_C(0x736f6d6570736575),
+		key[1] ^ UINT64_C(0x646f72616e646f6d),
+		key[0] ^ UINT64_C(0x6c7967656e657261),
+		key[1] ^ UINT64_C(0x7465646279746573),
+	};
+
+	size_t i;
+	for (i = 0; i < n; i++) {
+		v[3] ^= data[i];
+		fastd_siphash_round(v);
+		v[0] ^= data[i];
+	}
+
+	uint64_t b = (uint64_t)(8 * n) << 56;
+	v[3] ^= b;
+	fastd_siphash_round(v);
+	v[0] ^= b;
+
+	v[2] ^= 0xff;
+	fastd_siphash_round(v);
+	fastd_siphash_round(v);
+	fastd_siphash_round(v);
+
+	return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
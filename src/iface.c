@@ -16,16 +16,29 @@
 
 #include "config.h"
 #include "fastd.h"
+#include "offload.h"
 #include "peer.h"
 #include "polling.h"
+#include "worker.h"
 
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 
 #ifdef __linux__
 
 #include <linux/if_tun.h>
 
+#ifndef TUN_F_USO4
+/** Compatiblity define for systems supporting, but not defining TUN_F_USO4 */
+#define TUN_F_USO4 0x20
+#endif
+
+#ifndef TUN_F_USO6
+/** Compatiblity define for systems supporting, but not defining TUN_F_USO6 */
+#define TUN_F_USO6 0x40
+#endif
+
 #else
 
 #ifndef __APPLE__
@@ -75,36 +88,77 @@ static void cleanup_iface(fastd_iface_t *iface);
 
 #ifdef __linux__
 
-/** Opens the TUN/TAP device helper shared by Android and Linux targets */
-static bool open_iface_linux(fastd_iface_t *iface, const char *ifname, uint16_t mtu, const char *dev_name) {
-	struct ifreq ifr = {};
+#ifdef USE_IFACE_OFFLOAD
 
-	iface->fd = FASTD_POLL_FD(POLL_TYPE_IFACE, open(dev_name, O_RDWR | O_NONBLOCK));
-	if (iface->fd.fd < 0)
-		exit_errno("could not open TUN/TAP device file");
+/** Enables checksum and segmentation offloads on a TUN/TAP device opened with IFF_VNET_HDR */
+static void enable_offload(fastd_iface_t *iface) {
+	unsigned long offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
 
-	if (ifname)
-		strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	/* UDP segmentation offload is only supported since Linux 6.2, retry without it */
+	if (ioctl(iface->fd.fd, TUNSETOFFLOAD, offload | TUN_F_USO4 | TUN_F_USO6) == 0)
+		return;
+
+	if (ioctl(iface->fd.fd, TUNSETOFFLOAD, offload) < 0)
+		pr_warn_errno("unable to enable TUN/TAP offloads: TUNSETOFFLOAD ioctl failed");
+}
+
+#endif
+
+/** Returns the TUNSETIFF flags for the configured interface type and options */
+static short get_iface_flags(void) {
+	short flags;
 
 	switch (get_iface_type()) {
 	case IFACE_TYPE_TAP:
-		ifr.ifr_flags = IFF_TAP;
+		flags = IFF_TAP;
 		break;
 
 	case IFACE_TYPE_TUN:
-		ifr.ifr_flags = IFF_TUN;
+		flags = IFF_TUN;
 		break;
 
 	default:
 		exit_bug("invalid mode");
 	}
 
-	ifr.ifr_flags |= IFF_NO_PI;
+	flags |= IFF_NO_PI;
+#ifdef USE_IFACE_OFFLOAD
+	if (conf.iface_offload)
+		flags |= IFF_VNET_HDR;
+#endif
+#ifdef USE_WORKER_THREADS
+	if (conf.worker_threads)
+		flags |= IFF_MULTI_QUEUE;
+#endif
+
+	return flags;
+}
+
+/** Opens the TUN/TAP device helper shared by Android and Linux targets */
+static bool open_iface_linux(fastd_iface_t *iface, const char *ifname, uint16_t mtu, const char *dev_name) {
+	struct ifreq ifr = {};
+
+	iface->fd = FASTD_POLL_FD(POLL_TYPE_IFACE, open(dev_name, O_RDWR | O_NONBLOCK));
+	if (iface->fd.fd < 0)
+		exit_errno("could not open TUN/TAP device file");
+
+	if (ifname)
+		strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+	ifr.ifr_flags = get_iface_flags();
+
 	if (ioctl(iface->fd.fd, TUNSETIFF, &ifr) < 0) {
 		pr_error_errno("unable to open TUN/TAP interface: TUNSETIFF ioctl failed");
 		return false;
 	}
 
+#ifdef USE_IFACE_OFFLOAD
+	if (conf.iface_offload) {
+		iface->vnet_hdr = true;
+		enable_offload(iface);
+	}
+#endif
+
 	iface->name = fastd_strndup(ifr.ifr_name, IFNAMSIZ - 1);
 
 	if (ioctl(ctx.ioctl_sock, SIOCGIFMTU, &ifr) < 0)
@@ -124,6 +178,32 @@ static bool open_iface_linux(fastd_iface_t *iface, const char *ifname, uint16_t
 /** Removes TUN/TAP interfaces on platforms which need this */
 static void cleanup_iface(UNUSED fastd_iface_t *iface) {}
 
+#ifdef USE_WORKER_THREADS
+
+/**
+   Opens an additional queue of a multi-queue TUN/TAP interface
+
+   Returns the file descriptor of the new queue. Packets sent by the kernel are distributed over
+   all queues of the interface by flow.
+*/
+int fastd_iface_open_queue(const fastd_iface_t *iface) {
+	struct ifreq ifr = {};
+
+	int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+	if (fd < 0)
+		exit_errno("could not open TUN/TAP device file");
+
+	strncpy(ifr.ifr_name, iface->name, IFNAMSIZ - 1);
+	ifr.ifr_flags = get_iface_flags();
+
+	if (ioctl(fd, TUNSETIFF, &ifr) < 0)
+		exit_errno("unable to open TUN/TAP interface queue: TUNSETIFF ioctl failed");
+
+	return fd;
+}
+
+#endif
+
 #endif
 
 #if defined(__ANDROID__)
@@ -136,6 +216,7 @@ static bool open_iface(fastd_iface_t *iface, const char *ifname, uint16_t mtu) {
 
 		pr_debug("using android TUN fd");
 		iface->fd = FASTD_POLL_FD(POLL_TYPE_IFACE, fastd_android_receive_tunfd());
+		fastd_setnonblock(iface->fd.fd);
 		fastd_android_send_pid();
 
 		return true;
@@ -396,19 +477,68 @@ static void cleanup_iface(UNUSED fastd_iface_t *iface) {}
 #endif
 
 
-/** Reads a packet from the TUN/TAP device */
-void fastd_iface_handle(fastd_iface_t *iface) {
+#ifdef USE_IFACE_OFFLOAD
+
+/** Reads a frame from a queue of a TUN/TAP device with offloads enabled, returning false if there was none to read */
+static bool handle_offload(fastd_iface_t *iface, int fd, size_t max_len) {
+	/* Keep the data aligned after the virtio-net header has been removed */
+	fastd_buffer_t *buffer =
+		fastd_buffer_alloc(FASTD_OFFLOAD_MAX_FRAME, conf.encrypt_headroom + 16 - FASTD_OFFLOAD_HDR_SIZE);
+
+	ssize_t len = read(fd, buffer->data, FASTD_OFFLOAD_MAX_FRAME);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			fastd_buffer_free(buffer);
+			return false;
+		}
+
+		exit_errno("read");
+	}
+
+	buffer->len = len;
+
+	fastd_offload_handle(buffer, max_len, iface->peer);
+	return true;
+}
+
+/** Writes a packet with a virtio-net header to a TUN/TAP device with offloads enabled */
+void fastd_iface_write_gso(fastd_iface_t *iface, const struct virtio_net_hdr *hdr, const fastd_buffer_t *buffer) {
+	struct iovec iov[2] = {
+		{ .iov_base = (void *)hdr, .iov_len = sizeof(*hdr) },
+		{ .iov_base = buffer->data, .iov_len = buffer->len },
+	};
+
+	if (writev(iface->fd.fd, iov, 2) < 0)
+		pr_debug2_errno("writev");
+}
+
+#endif
+
+
+/** Reads a packet from a queue of the TUN/TAP device, returning false if there was none to read */
+static bool handle_frame(fastd_iface_t *iface, int fd) {
 	size_t max_len = fastd_max_payload(iface->mtu);
 
+#ifdef USE_IFACE_OFFLOAD
+	if (iface->vnet_hdr)
+		return handle_offload(iface, fd, max_len);
+#endif
+
 	fastd_buffer_t *buffer;
 	if (multiaf_tun && get_iface_type() == IFACE_TYPE_TUN)
 		buffer = fastd_buffer_alloc(max_len + 4, conf.encrypt_headroom + 12);
 	else
 		buffer = fastd_buffer_alloc(max_len, conf.encrypt_headroom);
 
-	ssize_t len = read(iface->fd.fd, buffer->data, max_len);
-	if (len < 0)
+	ssize_t len = read(fd, buffer->data, max_len);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			fastd_buffer_free(buffer);
+			return false;
+		}
+
 		exit_errno("read");
+	}
 
 	buffer->len = len;
 
@@ -416,6 +546,29 @@ void fastd_iface_handle(fastd_iface_t *iface) {
 		fastd_buffer_pull(buffer, 4);
 
 	fastd_send_data(buffer, NULL, iface->peer);
+	return true;
+}
+
+/**
+   Reads up to \e max packets from a queue of the TUN/TAP device
+
+   \e fd is the file descriptor of the interface itself or one of the additional queues of a
+   multi-queue interface. Returns the number of packets that have been read; if it is less than
+   requested, the queue has been drained.
+*/
+size_t fastd_iface_handle_queue(fastd_iface_t *iface, int fd, size_t max) {
+	size_t i;
+	for (i = 0; i < max; i++) {
+		if (!handle_frame(iface, fd))
+			break;
+	}
+
+	return i;
+}
+
+/** Reads a packet from the TUN/TAP device */
+void fastd_iface_handle(fastd_iface_t *iface) {
+	handle_frame(iface, iface->fd.fd);
 }
 
 /** Writes a packet to the TUN/TAP device */
@@ -425,6 +578,14 @@ void fastd_iface_write(fastd_iface_t *iface, fastd_buffer_t *buffer) {
 		return;
 	}
 
+#ifdef USE_IFACE_OFFLOAD
+	if (iface->vnet_hdr) {
+		struct virtio_net_hdr hdr = {};
+		fastd_iface_write_gso(iface, &hdr, buffer);
+		return;
+	}
+#endif
+
 	if (multiaf_tun && get_iface_type() == IFACE_TYPE_TUN) {
 		uint8_t version = *((uint8_t *)buffer->data) >> 4;
 		uint32_t af;
@@ -531,6 +692,8 @@ fastd_iface_t *fastd_iface_open(fastd_peer_t *peer) {
 
 /** Closes the TUN/TAP device */
 void fastd_iface_close(fastd_iface_t *iface) {
+	fastd_offload_flush_iface(iface);
+
 	if (fastd_poll_fd_close(&iface->fd))
 		cleanup_iface(iface);
 	else
@@ -47,15 +47,20 @@ static const keyword_t keywords[] = {
 	{ "as", TOK_AS },
 	{ "async", TOK_ASYNC },
 	{ "auto", TOK_AUTO },
+	{ "batch", TOK_BATCH },
 	{ "bind", TOK_BIND },
+	{ "budget", TOK_BUDGET },
+	{ "buffer", TOK_BUFFER },
 	{ "capabilities", TOK_CAPABILITIES },
 	{ "cipher", TOK_CIPHER },
 	{ "connect", TOK_CONNECT },
+	{ "crypto", TOK_CRYPTO },
 	{ "debug", TOK_DEBUG },
 	{ "debug2", TOK_DEBUG2 },
 	{ "default", TOK_DEFAULT },
 	{ "disestablish", TOK_DISESTABLISH },
 	{ "down", TOK_DOWN },
+	{ "drain", TOK_DRAIN },
 	{ "drop", TOK_DROP },
 	{ "early", TOK_EARLY },
 	{ "error", TOK_ERROR },
@@ -66,8 +71,10 @@ static const keyword_t keywords[] = {
 	{ "forward", TOK_FORWARD },
 	{ "from", TOK_FROM },
 	{ "group", TOK_GROUP },
+	{ "handshake", TOK_HANDSHAKE },
 	{ "handshakes", TOK_HANDSHAKES },
 	{ "hide", TOK_HIDE },
+	{ "hugepages", TOK_HUGEPAGES },
 	{ "include", TOK_INCLUDE },
 	{ "info", TOK_INFO },
 	{ "interface", TOK_INTERFACE },
@@ -85,6 +92,7 @@ static const keyword_t keywords[] = {
 	{ "mtu", TOK_MTU },
 	{ "multitap", TOK_MULTITAP },
 	{ "no", TOK_NO },
+	{ "offload", TOK_OFFLOAD },
 	{ "on", TOK_ON },
 	{ "packet", TOK_PACKET },
 	{ "peer", TOK_PEER },
@@ -95,23 +103,30 @@ static const keyword_t keywords[] = {
 	{ "post-down", TOK_POST_DOWN },
 	{ "pre-up", TOK_PRE_UP },
 	{ "protocol", TOK_PROTOCOL },
+	{ "rate", TOK_RATE },
+	{ "receive", TOK_RECEIVE },
 	{ "remote", TOK_REMOTE },
 	{ "secret", TOK_SECRET },
 	{ "secure", TOK_SECURE },
+	{ "segmentation", TOK_SEGMENTATION },
+	{ "send", TOK_SEND },
 	{ "socket", TOK_SOCKET },
 	{ "status", TOK_STATUS },
 	{ "stderr", TOK_STDERR },
 	{ "sync", TOK_SYNC },
 	{ "syslog", TOK_SYSLOG },
 	{ "tap", TOK_TAP },
+	{ "threads", TOK_THREADS },
 	{ "to", TOK_TO },
 	{ "tun", TOK_TUN },
+	{ "udp", TOK_UDP },
 	{ "up", TOK_UP },
 	{ "use", TOK_USE },
 	{ "user", TOK_USER },
 	{ "verbose", TOK_VERBOSE },
 	{ "verify", TOK_VERIFY },
 	{ "warn", TOK_WARN },
+	{ "worker", TOK_WORKER },
 	{ "yes", TOK_YES },
 };
 
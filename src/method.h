@@ -54,8 +54,39 @@ struct fastd_method_provider {
 
 	/** Encrypts a packet for a given session, adding method-specific headers */
 	fastd_buffer_t *(*encrypt)(fastd_method_session_state_t *session, fastd_buffer_t *in);
-	/** Decrypts a packet for a given session, stripping method-specific headers */
-	fastd_buffer_t *(*decrypt)(fastd_method_session_state_t *session, fastd_buffer_t *in, bool *reordered);
+	/**
+	   Decrypts a packet for a given session, stripping method-specific headers
+
+	   Decryption may run outside of the main thread, so the current time is passed as \a now instead of
+	   being read from the global context.
+	*/
+	fastd_buffer_t *(*decrypt)(
+		fastd_method_session_state_t *session, fastd_buffer_t *in, fastd_timeout_t now, bool *reordered);
+
+	/**
+	   Encrypts a packet in place, using the buffer's headroom for the method-specific headers (optional)
+
+	   Only called for buffers with at least \a encrypt_headroom bytes of headroom and data aligned to
+	   16 bytes. On failure, the buffer contents are undefined.
+	*/
+	bool (*encrypt_inplace)(fastd_method_session_state_t *session, fastd_buffer_t *buffer);
+	/**
+	   Decrypts a packet in place (optional)
+
+	   Only called for buffers with at least \a decrypt_headroom bytes of headroom. The packet is
+	   authenticated before it is decrypted, so the buffer is left unmodified on failure and can be
+	   passed to another session.
+	*/
+	bool (*decrypt_inplace)(
+		fastd_method_session_state_t *session, fastd_buffer_t *buffer, fastd_timeout_t now, bool *reordered);
+
+	/**
+	   Encrypts a packet without consuming or modifying it (optional)
+
+	   Allows encrypting a single packet for multiple peers. The \a encrypt_headroom bytes in front of the
+	   data and the padding after it must be zero.
+	*/
+	fastd_buffer_t *(*encrypt_shared)(fastd_method_session_state_t *session, const fastd_buffer_t *in);
 };
 
 
@@ -73,3 +104,56 @@ static inline const fastd_method_info_t *fastd_method_get_by_name(const char *na
 
 	return NULL;
 }
+
+
+/**
+   Encrypts a packet for a given session, in place if supported by the provider
+
+   The input buffer is consumed; NULL is returned on failure.
+*/
+static inline fastd_buffer_t *fastd_method_encrypt(
+	const fastd_method_provider_t *provider, fastd_method_session_state_t *session, fastd_buffer_t *in) {
+	if (provider->encrypt_inplace && fastd_buffer_headroom(in) >= provider->encrypt_headroom &&
+	    (uintptr_t)in->data % sizeof(fastd_block128_t) == 0) {
+		if (provider->encrypt_inplace(session, in))
+			return in;
+
+		fastd_buffer_free(in);
+		return NULL;
+	}
+
+	fastd_buffer_t *out = provider->encrypt(session, in);
+	if (!out)
+		fastd_buffer_free(in);
+
+	return out;
+}
+
+/**
+   Encrypts a packet for a given session without consuming or modifying it
+
+   The buffer must have been prepared with fastd_buffer_prepare_shared(). Providers that can't encrypt
+   a shared buffer get a copy of it. Returns NULL on failure.
+*/
+static inline fastd_buffer_t *fastd_method_encrypt_shared(
+	const fastd_method_provider_t *provider, fastd_method_session_state_t *session, const fastd_buffer_t *in) {
+	if (provider->encrypt_shared)
+		return provider->encrypt_shared(session, in);
+
+	return fastd_method_encrypt(provider, session, fastd_buffer_dup(in, conf.encrypt_headroom));
+}
+
+/**
+   Decrypts a packet for a given session, in place if supported by the provider
+
+   On success, the input buffer is consumed. On failure, NULL is returned and the input buffer
+   is left unmodified.
+*/
+static inline fastd_buffer_t *fastd_method_decrypt(
+	const fastd_method_provider_t *provider, fastd_method_session_state_t *session, fastd_buffer_t *in,
+	fastd_timeout_t now, bool *reordered) {
+	if (provider->decrypt_inplace && fastd_buffer_headroom(in) >= provider->decrypt_headroom)
+		return provider->decrypt_inplace(session, in, now, reordered) ? in : NULL;
+
+	return provider->decrypt(session, in, now, reordered);
+}
@@ -142,7 +142,8 @@ fail:
 }
 
 /** Decrypts a packet */
-static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fastd_buffer_t *in, bool *reordered) {
+static fastd_buffer_t *
+method_decrypt(fastd_method_session_state_t *session, fastd_buffer_t *in, fastd_timeout_t now, bool *reordered) {
 	if (in->len < COMMON_HEADBYTES)
 		return NULL;
 
@@ -154,7 +155,7 @@ static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fas
 	uint8_t in_nonce[COMMON_NONCEBYTES];
 	uint8_t flags;
 	int64_t age;
-	if (!fastd_method_handle_common_header(&session->common, &in_view, in_nonce, &flags, &age))
+	if (!fastd_method_handle_common_header(&session->common, &in_view, in_nonce, &flags, now, &age))
 		return NULL;
 
 	if (flags)
@@ -174,7 +175,7 @@ static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fas
 		    session->cipher_state, outblocks, inblocks, n_blocks * sizeof(fastd_block128_t), nonce))
 		goto fail;
 
-	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age);
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age, now);
 	if (reorder_check.set)
 		*reordered = reorder_check.state;
 	else
@@ -19,9 +19,10 @@ void fastd_method_common_init(fastd_method_common_t *session, fastd_peer_t *peer
 	memset(session, 0, sizeof(*session));
 
 	session->peer = peer;
+	session->initiator = initiator;
 
-	session->valid_till = ctx.now + KEY_VALID;
-	session->refresh_after = ctx.now + KEY_REFRESH - fastd_rand(0, KEY_REFRESH_SPLAY);
+	session->valid_till = fastd_now() + KEY_VALID;
+	session->refresh_after = fastd_now() + KEY_REFRESH - fastd_rand(0, KEY_REFRESH_SPLAY);
 
 	if (initiator) {
 		session->send_nonce[COMMON_NONCEBYTES - 1] = 3;
@@ -33,7 +34,8 @@ void fastd_method_common_init(fastd_method_common_t *session, fastd_peer_t *peer
 
 /** Checks if a received nonce is valid */
 bool fastd_method_is_nonce_valid(
-	const fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t *age) {
+	const fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], fastd_timeout_t now,
+	int64_t *age) {
 	if ((nonce[0] & 1) != (session->receive_nonce[0] & 1))
 		return false;
 
@@ -48,7 +50,7 @@ bool fastd_method_is_nonce_valid(
 	*age >>= 1;
 
 	if (*age >= 0) {
-		if (fastd_timed_out(session->reorder_timeout))
+		if (session->reorder_timeout <= now)
 			return false;
 
 		if (*age > 64)
@@ -65,8 +67,8 @@ bool fastd_method_is_nonce_valid(
    false if the packet is okay and not reordered and true
    if it is reordered.
 */
-fastd_tristate_t
-fastd_method_reorder_check(fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t age) {
+fastd_tristate_t fastd_method_reorder_check(
+	fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t age, fastd_timeout_t now) {
 	if (age < 0) {
 		size_t shift = -age;
 
@@ -79,7 +81,7 @@ fastd_method_reorder_check(fastd_method_common_t *session, const uint8_t nonce[C
 			session->receive_reorder_seen |= ((uint64_t)1 << (shift - 1));
 
 		memcpy(session->receive_nonce, nonce, COMMON_NONCEBYTES);
-		session->reorder_timeout = ctx.now + REORDER_TIME;
+		session->reorder_timeout = now + REORDER_TIME;
 		return FASTD_TRISTATE_FALSE;
 	} else if (age == 0 || session->receive_reorder_seen & ((uint64_t)1 << (age - 1))) {
 		pr_debug("dropping duplicate packet from %P (age %u)", session->peer, (unsigned)age);
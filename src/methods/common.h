@@ -33,7 +33,11 @@ typedef struct fastd_method_common {
 	fastd_timeout_t valid_till;    /**< How long the session is valid */
 	fastd_timeout_t refresh_after; /**< When to try refreshing the session */
 
+	bool initiator; /**< Set if this side has initiated the session */
+
 	uint8_t send_nonce[COMMON_NONCEBYTES];    /**< The next nonce to use */
+	uint16_t send_nonce_high;                 /**< The two most significant bytes of \a send_nonce (accessed
+						     atomically, as encryption may run in a crypto thread) */
 	uint8_t receive_nonce[COMMON_NONCEBYTES]; /**< The hightest nonce received to far for this session */
 
 	fastd_timeout_t reorder_timeout; /**< How long to packets with a lower sequence number (nonce) than the newest
@@ -45,9 +49,20 @@ typedef struct fastd_method_common {
 
 void fastd_method_common_init(fastd_method_common_t *session, fastd_peer_t *peer, bool initiator);
 bool fastd_method_is_nonce_valid(
-	const fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t *age);
-fastd_tristate_t
-fastd_method_reorder_check(fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t age);
+	const fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], fastd_timeout_t now,
+	int64_t *age);
+fastd_tristate_t fastd_method_reorder_check(
+	fastd_method_common_t *session, const uint8_t nonce[COMMON_NONCEBYTES], int64_t age, fastd_timeout_t now);
+
+
+/**
+   Returns the two most significant bytes of the send nonce
+
+   This may be called while another thread is encrypting a packet with the session.
+*/
+static inline uint16_t fastd_method_send_nonce_high(const fastd_method_common_t *session) {
+	return __atomic_load_n(&session->send_nonce_high, __ATOMIC_RELAXED);
+}
 
 
 /**
@@ -57,7 +72,7 @@ fastd_method_reorder_check(fastd_method_common_t *session, const uint8_t nonce[C
    should be impossible)
 */
 static inline bool fastd_method_session_common_is_valid(const fastd_method_common_t *session) {
-	if (session->send_nonce[0] == 0xff && session->send_nonce[1] == 0xff)
+	if (fastd_method_send_nonce_high(session) == 0xffff)
 		return false;
 
 	return (!fastd_timed_out(session->valid_till));
@@ -69,7 +84,7 @@ static inline bool fastd_method_session_common_is_valid(const fastd_method_commo
    The initiator of a session uses the odd nonces, the responder the even ones.
 */
 static inline bool fastd_method_session_common_is_initiator(const fastd_method_common_t *session) {
-	return (session->send_nonce[COMMON_NONCEBYTES - 1] & 1);
+	return session->initiator;
 }
 
 /**
@@ -78,7 +93,7 @@ static inline bool fastd_method_session_common_is_initiator(const fastd_method_c
    A session wants to be refreshed when session->refresh_after has timeouted, or if lots of nonces have been used up
 */
 static inline bool fastd_method_session_common_want_refresh(const fastd_method_common_t *session) {
-	if (session->send_nonce[0] == 0xff)
+	if ((fastd_method_send_nonce_high(session) >> 8) == 0xff)
 		return true;
 
 	if (fastd_method_session_common_is_initiator(session) && fastd_timed_out(session->refresh_after))
@@ -89,7 +104,7 @@ static inline bool fastd_method_session_common_want_refresh(const fastd_method_c
 
 /** The common \a session_superseded implementation */
 static inline void fastd_method_session_common_superseded(fastd_method_common_t *session) {
-	fastd_timeout_t valid_max = ctx.now + KEY_VALID_OLD;
+	fastd_timeout_t valid_max = fastd_now() + KEY_VALID_OLD;
 
 	if (valid_max < session->valid_till)
 		session->valid_till = valid_max;
@@ -110,6 +125,11 @@ static inline void fastd_method_increment_nonce(fastd_method_common_t *session)
 			if (++session->send_nonce[i])
 				break;
 		}
+
+		if (i <= 1)
+			__atomic_store_n(
+				&session->send_nonce_high, (session->send_nonce[0] << 8) | session->send_nonce[1],
+				__ATOMIC_RELAXED);
 	}
 }
 
@@ -133,9 +153,9 @@ fastd_method_take_common_header(fastd_buffer_view_t *buffer, uint8_t nonce[COMMO
 /** Handles the common header of a packet */
 static inline bool fastd_method_handle_common_header(
 	const fastd_method_common_t *session, fastd_buffer_view_t *buffer, uint8_t nonce[COMMON_NONCEBYTES],
-	uint8_t *flags, int64_t *age) {
+	uint8_t *flags, fastd_timeout_t now, int64_t *age) {
 	fastd_method_take_common_header(buffer, nonce, flags);
-	return fastd_method_is_nonce_valid(session, nonce, age);
+	return fastd_method_is_nonce_valid(session, nonce, now, age);
 }
 
 
@@ -179,8 +179,8 @@ static void method_session_free(fastd_method_session_state_t *session) {
 	}
 }
 
-/** Encrypts and authenticates a packet */
-static fastd_buffer_t *method_encrypt(fastd_method_session_state_t *session, fastd_buffer_t *in) {
+/** Encrypts and authenticates a packet without modifying it */
+static fastd_buffer_t *method_encrypt_shared(fastd_method_session_state_t *session, const fastd_buffer_t *in) {
 	fastd_buffer_t *out = fastd_buffer_alloc(sizeof(fastd_block128_t) + in->len, COMMON_HEADROOM);
 
 	int n_blocks = block_count(in->len, sizeof(fastd_block128_t));
@@ -210,8 +210,6 @@ static fastd_buffer_t *method_encrypt(fastd_method_session_state_t *session, fas
 
 	block_xor_a(&outblocks[0], &tag);
 
-	fastd_buffer_free(in);
-
 	fastd_method_put_common_header(out, session->common.send_nonce, 0);
 	fastd_method_increment_nonce(&session->common);
 
@@ -222,8 +220,18 @@ fail:
 	return NULL;
 }
 
+/** Encrypts and authenticates a packet */
+static fastd_buffer_t *method_encrypt(fastd_method_session_state_t *session, fastd_buffer_t *in) {
+	fastd_buffer_t *out = method_encrypt_shared(session, in);
+	if (out)
+		fastd_buffer_free(in);
+
+	return out;
+}
+
 /** Verifies and decrypts a packet */
-static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fastd_buffer_t *in, bool *reordered) {
+static fastd_buffer_t *
+method_decrypt(fastd_method_session_state_t *session, fastd_buffer_t *in, fastd_timeout_t now, bool *reordered) {
 	if (in->len < COMMON_HEADBYTES + sizeof(fastd_block128_t))
 		return NULL;
 
@@ -235,7 +243,7 @@ static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fas
 	uint8_t in_nonce[COMMON_NONCEBYTES];
 	uint8_t flags;
 	int64_t age;
-	if (!fastd_method_handle_common_header(&session->common, &in_view, in_nonce, &flags, &age))
+	if (!fastd_method_handle_common_header(&session->common, &in_view, in_nonce, &flags, now, &age))
 		return NULL;
 
 	if (flags)
@@ -273,7 +281,7 @@ static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fas
 
 	fastd_buffer_pull(out, sizeof(fastd_block128_t));
 
-	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age);
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age, now);
 	if (reorder_check.set)
 		*reordered = reorder_check.state;
 	else
@@ -289,10 +297,103 @@ fail:
 }
 
 
+/** Encrypts and authenticates a packet in place */
+static bool method_encrypt_inplace(fastd_method_session_state_t *session, fastd_buffer_t *buffer) {
+	int n_blocks = block_count(buffer->len, sizeof(fastd_block128_t));
+
+	fastd_block128_t tag;
+
+	uint8_t gmac_nonce[session->method->gmac_cipher_info->iv_length] __attribute__((aligned(8)));
+	fastd_method_expand_nonce(gmac_nonce, session->common.send_nonce, sizeof(gmac_nonce));
+
+	uint8_t nonce[session->method->cipher_info->iv_length ?: 1] __attribute__((aligned(8)));
+	fastd_method_expand_nonce(nonce, session->common.send_nonce, session->method->cipher_info->iv_length);
+
+	if (!session->cipher->crypt(
+		    session->cipher_state, buffer->data, buffer->data, n_blocks * sizeof(fastd_block128_t), nonce))
+		return false;
+
+	fastd_buffer_push(buffer, sizeof(fastd_block128_t));
+	fastd_block128_t *blocks = buffer->data;
+
+	if (!session->gmac_cipher->crypt(
+		    session->gmac_cipher_state, blocks, &ZERO_BLOCK, sizeof(fastd_block128_t), gmac_nonce))
+		return false;
+
+	fastd_buffer_zero_pad(buffer);
+
+	if (!session->ghash->digest(session->ghash_state, &tag, blocks + 1, buffer->len - sizeof(fastd_block128_t)))
+		return false;
+
+	block_xor_a(&blocks[0], &tag);
+
+	fastd_method_put_common_header(buffer, session->common.send_nonce, 0);
+	fastd_method_increment_nonce(&session->common);
+
+	return true;
+}
+
+/** Verifies and decrypts a packet in place */
+static bool method_decrypt_inplace(
+	fastd_method_session_state_t *session, fastd_buffer_t *buffer, fastd_timeout_t now, bool *reordered) {
+	if (buffer->len < COMMON_HEADBYTES + sizeof(fastd_block128_t))
+		return false;
+
+	if (!method_session_is_valid(session))
+		return false;
+
+	fastd_buffer_view_t view = fastd_buffer_get_view(buffer);
+
+	uint8_t in_nonce[COMMON_NONCEBYTES];
+	uint8_t flags;
+	int64_t age;
+	if (!fastd_method_handle_common_header(&session->common, &view, in_nonce, &flags, now, &age))
+		return false;
+
+	if (flags)
+		return false;
+
+	uint8_t nonce[session->method->cipher_info->iv_length ?: 1] __attribute__((aligned(8)));
+	fastd_method_expand_nonce(nonce, in_nonce, session->method->cipher_info->iv_length);
+
+	uint8_t gmac_nonce[session->method->gmac_cipher_info->iv_length] __attribute__((aligned(8)));
+	fastd_method_expand_nonce(gmac_nonce, in_nonce, sizeof(gmac_nonce));
+
+	int n_blocks = block_count(view.len, sizeof(fastd_block128_t));
+
+	fastd_block128_t *blocks = (fastd_block128_t *)((uint8_t *)buffer->data + COMMON_HEADBYTES);
+	fastd_block128_t tag, expected;
+
+	if (!session->gmac_cipher->crypt(
+		    session->gmac_cipher_state, &expected, blocks, sizeof(fastd_block128_t), gmac_nonce))
+		return false;
+
+	if (!session->ghash->digest(session->ghash_state, &tag, blocks + 1, view.len - sizeof(fastd_block128_t)))
+		return false;
+
+	if (!block_equal(&tag, &expected))
+		return false;
+
+	if (!session->cipher->crypt(
+		    session->cipher_state, blocks + 1, blocks + 1, (n_blocks - 1) * sizeof(fastd_block128_t), nonce))
+		return false;
+
+	fastd_buffer_pull(buffer, COMMON_HEADBYTES + sizeof(fastd_block128_t));
+
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age, now);
+	if (reorder_check.set)
+		*reordered = reorder_check.state;
+	else
+		buffer->len = 0;
+
+	return true;
+}
+
+
 /** The composed-gmac method provider */
 const fastd_method_provider_t fastd_method_composed_gmac = {
 	.overhead = COMMON_HEADBYTES + sizeof(fastd_block128_t),
-	.encrypt_headroom = 0,
+	.encrypt_headroom = 2 * sizeof(fastd_block128_t), /* tag and aligned common header for in-place encryption */
 	.decrypt_headroom = 0,
 
 	.create_by_name = method_create_by_name,
@@ -309,4 +410,7 @@ const fastd_method_provider_t fastd_method_composed_gmac = {
 
 	.encrypt = method_encrypt,
 	.decrypt = method_decrypt,
+	.encrypt_inplace = method_encrypt_inplace,
+	.decrypt_inplace = method_decrypt_inplace,
+	.encrypt_shared = method_encrypt_shared,
 };
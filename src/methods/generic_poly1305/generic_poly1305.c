@@ -127,18 +127,21 @@ static void method_session_free(fastd_method_session_state_t *session) {
 }
 
 
-/** Encrypts and authenticates a packet */
-static fastd_buffer_t *method_encrypt(fastd_method_session_state_t *session, fastd_buffer_t *in) {
-	fastd_buffer_push_zero(in, KEYBYTES);
+/**
+   Encrypts and authenticates a packet without modifying it
 
-	fastd_buffer_t *out = fastd_buffer_alloc(in->len, COMMON_HEADROOM);
+   The KEYBYTES bytes in front of the data of \e in must be zero.
+*/
+static fastd_buffer_t *method_encrypt_shared(fastd_method_session_state_t *session, const fastd_buffer_t *in) {
+	size_t len = in->len + KEYBYTES;
+	fastd_buffer_t *out = fastd_buffer_alloc(len, COMMON_HEADROOM);
 
 	uint8_t nonce[session->method->cipher_info->iv_length] __attribute__((aligned(8)));
 	fastd_method_expand_nonce(nonce, session->common.send_nonce, sizeof(nonce));
 
-	int n_blocks = block_count(in->len, sizeof(fastd_block128_t));
+	int n_blocks = block_count(len, sizeof(fastd_block128_t));
 
-	const fastd_block128_t *inblocks = in->data;
+	const fastd_block128_t *inblocks = (const fastd_block128_t *)((const uint8_t *)in->data - KEYBYTES);
 	fastd_block128_t *outblocks = out->data;
 	uint8_t tag[TAGBYTES] __attribute__((aligned(8)));
 
@@ -153,8 +156,6 @@ static fastd_buffer_t *method_encrypt(fastd_method_session_state_t *session, fas
 
 	fastd_buffer_push_from(out, tag, TAGBYTES);
 
-	fastd_buffer_free(in);
-
 	fastd_method_put_common_header(out, session->common.send_nonce, 0);
 	fastd_method_increment_nonce(&session->common);
 
@@ -165,8 +166,21 @@ fail:
 	return NULL;
 }
 
+/** Encrypts and authenticates a packet */
+static fastd_buffer_t *method_encrypt(fastd_method_session_state_t *session, fastd_buffer_t *in) {
+	fastd_buffer_push_zero(in, KEYBYTES);
+	fastd_buffer_pull(in, KEYBYTES);
+
+	fastd_buffer_t *out = method_encrypt_shared(session, in);
+	if (out)
+		fastd_buffer_free(in);
+
+	return out;
+}
+
 /** Verifies and decrypts a packet */
-static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fastd_buffer_t *in, bool *reordered) {
+static fastd_buffer_t *
+method_decrypt(fastd_method_session_state_t *session, fastd_buffer_t *in, fastd_timeout_t now, bool *reordered) {
 	if (in->len < COMMON_HEADBYTES + TAGBYTES)
 		return NULL;
 
@@ -179,7 +193,7 @@ static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fas
 	int64_t age;
 
 	fastd_buffer_view_t in_view = fastd_buffer_get_view(in);
-	if (!fastd_method_handle_common_header(&session->common, &in_view, in_nonce, &flags, &age))
+	if (!fastd_method_handle_common_header(&session->common, &in_view, in_nonce, &flags, now, &age))
 		return NULL;
 
 	if (flags)
@@ -214,7 +228,7 @@ static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fas
 
 	fastd_buffer_pull(out, KEYBYTES);
 
-	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age);
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age, now);
 	if (reorder_check.set)
 		*reordered = reorder_check.state;
 	else
@@ -233,6 +247,92 @@ fail:
 }
 
 
+/** Encrypts and authenticates a packet in place */
+static bool method_encrypt_inplace(fastd_method_session_state_t *session, fastd_buffer_t *buffer) {
+	fastd_buffer_push_zero(buffer, KEYBYTES);
+
+	uint8_t nonce[session->method->cipher_info->iv_length] __attribute__((aligned(8)));
+	fastd_method_expand_nonce(nonce, session->common.send_nonce, sizeof(nonce));
+
+	int n_blocks = block_count(buffer->len, sizeof(fastd_block128_t));
+
+	fastd_block128_t *blocks = buffer->data;
+	uint8_t tag[TAGBYTES] __attribute__((aligned(8)));
+
+	if (!session->cipher->crypt(session->cipher_state, blocks, blocks, n_blocks * sizeof(fastd_block128_t), nonce))
+		return false;
+
+	const unsigned char *key = blocks->b;
+	fastd_buffer_pull(buffer, KEYBYTES);
+
+	crypto_onetimeauth_poly1305(tag, buffer->data, buffer->len, key);
+
+	fastd_buffer_push_from(buffer, tag, TAGBYTES);
+
+	fastd_method_put_common_header(buffer, session->common.send_nonce, 0);
+	fastd_method_increment_nonce(&session->common);
+
+	return true;
+}
+
+/**
+   Verifies and decrypts a packet in place
+
+   The Poly1305 key is generated separately to verify the packet before the buffer is modified. As the
+   key stream starts KEYBYTES in front of the data, the decryption clobbers the header, the tag and a
+   few bytes of the headroom.
+*/
+static bool method_decrypt_inplace(
+	fastd_method_session_state_t *session, fastd_buffer_t *buffer, fastd_timeout_t now, bool *reordered) {
+	if (buffer->len < COMMON_HEADBYTES + TAGBYTES)
+		return false;
+
+	if (!method_session_is_valid(session))
+		return false;
+
+	uint8_t in_nonce[COMMON_NONCEBYTES];
+	uint8_t flags;
+	int64_t age;
+
+	fastd_buffer_view_t view = fastd_buffer_get_view(buffer);
+	if (!fastd_method_handle_common_header(&session->common, &view, in_nonce, &flags, now, &age))
+		return false;
+
+	if (flags)
+		return false;
+
+	uint8_t nonce[session->method->cipher_info->iv_length] __attribute__((aligned(8)));
+	fastd_method_expand_nonce(nonce, in_nonce, sizeof(nonce));
+
+	fastd_block128_t key[KEYBYTES / sizeof(fastd_block128_t)] = {};
+	if (!session->cipher->crypt(session->cipher_state, key, key, KEYBYTES, nonce))
+		return false;
+
+	const uint8_t *tag = view.data;
+	if (crypto_onetimeauth_poly1305_verify(tag, tag + TAGBYTES, view.len - TAGBYTES, key->b) != 0)
+		return false;
+
+	fastd_buffer_pull(buffer, COMMON_HEADBYTES + TAGBYTES);
+	fastd_buffer_push(buffer, KEYBYTES);
+
+	int n_blocks = block_count(buffer->len, sizeof(fastd_block128_t));
+	fastd_block128_t *blocks = buffer->data;
+
+	if (!session->cipher->crypt(session->cipher_state, blocks, blocks, n_blocks * sizeof(fastd_block128_t), nonce))
+		return false;
+
+	fastd_buffer_pull(buffer, KEYBYTES);
+
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age, now);
+	if (reorder_check.set)
+		*reordered = reorder_check.state;
+	else
+		buffer->len = 0;
+
+	return true;
+}
+
+
 /** The generic-poly1305 method provider */
 const fastd_method_provider_t fastd_method_generic_poly1305 = {
 	.overhead = COMMON_HEADBYTES + TAGBYTES,
@@ -253,4 +353,7 @@ const fastd_method_provider_t fastd_method_generic_poly1305 = {
 
 	.encrypt = method_encrypt,
 	.decrypt = method_decrypt,
+	.encrypt_inplace = method_encrypt_inplace,
+	.decrypt_inplace = method_decrypt_inplace,
+	.encrypt_shared = method_encrypt_shared,
 };
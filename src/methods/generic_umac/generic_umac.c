@@ -126,18 +126,21 @@ static void method_session_free(fastd_method_session_state_t *session) {
 	}
 }
 
-/** Encrypts and authenticates a packet */
-static fastd_buffer_t *method_encrypt(fastd_method_session_state_t *session, fastd_buffer_t *in) {
-	fastd_buffer_push_zero(in, sizeof(fastd_block128_t));
+/**
+   Encrypts and authenticates a packet without modifying it
 
-	fastd_buffer_t *out = fastd_buffer_alloc(in->len, COMMON_HEADROOM);
+   The block in front of the data of \e in must be zero.
+*/
+static fastd_buffer_t *method_encrypt_shared(fastd_method_session_state_t *session, const fastd_buffer_t *in) {
+	size_t len = in->len + sizeof(fastd_block128_t);
+	fastd_buffer_t *out = fastd_buffer_alloc(len, COMMON_HEADROOM);
 
 	uint8_t nonce[session->method->cipher_info->iv_length] __attribute__((aligned(8)));
 	fastd_method_expand_nonce(nonce, session->common.send_nonce, sizeof(nonce));
 
-	int n_blocks = block_count(in->len, sizeof(fastd_block128_t));
+	int n_blocks = block_count(len, sizeof(fastd_block128_t));
 
-	const fastd_block128_t *inblocks = in->data;
+	const fastd_block128_t *inblocks = (const fastd_block128_t *)in->data - 1;
 	fastd_block128_t *outblocks = out->data;
 	fastd_block128_t tag;
 
@@ -152,8 +155,6 @@ static fastd_buffer_t *method_encrypt(fastd_method_session_state_t *session, fas
 
 	block_xor_a(&outblocks[0], &tag);
 
-	fastd_buffer_free(in);
-
 	fastd_method_put_common_header(out, session->common.send_nonce, 0);
 	fastd_method_increment_nonce(&session->common);
 
@@ -164,8 +165,21 @@ fail:
 	return NULL;
 }
 
+/** Encrypts and authenticates a packet */
+static fastd_buffer_t *method_encrypt(fastd_method_session_state_t *session, fastd_buffer_t *in) {
+	fastd_buffer_push_zero(in, sizeof(fastd_block128_t));
+	fastd_buffer_pull(in, sizeof(fastd_block128_t));
+
+	fastd_buffer_t *out = method_encrypt_shared(session, in);
+	if (out)
+		fastd_buffer_free(in);
+
+	return out;
+}
+
 /** Verifies and decrypts a packet */
-static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fastd_buffer_t *in, bool *reordered) {
+static fastd_buffer_t *
+method_decrypt(fastd_method_session_state_t *session, fastd_buffer_t *in, fastd_timeout_t now, bool *reordered) {
 	if (in->len < COMMON_HEADBYTES + sizeof(fastd_block128_t))
 		return NULL;
 
@@ -177,7 +191,7 @@ static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fas
 	uint8_t in_nonce[COMMON_NONCEBYTES];
 	uint8_t flags;
 	int64_t age;
-	if (!fastd_method_handle_common_header(&session->common, &in_view, in_nonce, &flags, &age))
+	if (!fastd_method_handle_common_header(&session->common, &in_view, in_nonce, &flags, now, &age))
 		return NULL;
 
 	if (flags)
@@ -209,7 +223,7 @@ static fastd_buffer_t *method_decrypt(fastd_method_session_state_t *session, fas
 
 	fastd_buffer_pull(out, sizeof(fastd_block128_t));
 
-	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age);
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age, now);
 	if (reorder_check.set)
 		*reordered = reorder_check.state;
 	else
@@ -223,10 +237,95 @@ fail:
 }
 
 
+/** Encrypts and authenticates a packet in place */
+static bool method_encrypt_inplace(fastd_method_session_state_t *session, fastd_buffer_t *buffer) {
+	fastd_buffer_push_zero(buffer, sizeof(fastd_block128_t));
+
+	uint8_t nonce[session->method->cipher_info->iv_length] __attribute__((aligned(8)));
+	fastd_method_expand_nonce(nonce, session->common.send_nonce, sizeof(nonce));
+
+	int n_blocks = block_count(buffer->len, sizeof(fastd_block128_t));
+
+	fastd_block128_t *blocks = buffer->data;
+	fastd_block128_t tag;
+
+	if (!session->cipher->crypt(session->cipher_state, blocks, blocks, n_blocks * sizeof(fastd_block128_t), nonce))
+		return false;
+
+	fastd_buffer_zero_pad(buffer);
+
+	if (!session->uhash->digest(session->uhash_state, &tag, blocks + 1, buffer->len - sizeof(fastd_block128_t)))
+		return false;
+
+	block_xor_a(&blocks[0], &tag);
+
+	fastd_method_put_common_header(buffer, session->common.send_nonce, 0);
+	fastd_method_increment_nonce(&session->common);
+
+	return true;
+}
+
+/**
+   Verifies and decrypts a packet in place
+
+   The first block of the key stream is generated separately to verify the packet before the buffer
+   is modified.
+*/
+static bool method_decrypt_inplace(
+	fastd_method_session_state_t *session, fastd_buffer_t *buffer, fastd_timeout_t now, bool *reordered) {
+	if (buffer->len < COMMON_HEADBYTES + sizeof(fastd_block128_t))
+		return false;
+
+	if (!method_session_is_valid(session))
+		return false;
+
+	fastd_buffer_view_t view = fastd_buffer_get_view(buffer);
+
+	uint8_t in_nonce[COMMON_NONCEBYTES];
+	uint8_t flags;
+	int64_t age;
+	if (!fastd_method_handle_common_header(&session->common, &view, in_nonce, &flags, now, &age))
+		return false;
+
+	if (flags)
+		return false;
+
+	uint8_t nonce[session->method->cipher_info->iv_length] __attribute__((aligned(8)));
+	fastd_method_expand_nonce(nonce, in_nonce, sizeof(nonce));
+
+	int n_blocks = block_count(view.len, sizeof(fastd_block128_t));
+
+	fastd_block128_t *blocks = (fastd_block128_t *)((uint8_t *)buffer->data + COMMON_HEADBYTES);
+	fastd_block128_t tag, expected;
+
+	if (!session->cipher->crypt(session->cipher_state, &expected, blocks, sizeof(fastd_block128_t), nonce))
+		return false;
+
+	if (!session->uhash->digest(session->uhash_state, &tag, blocks + 1, view.len - sizeof(fastd_block128_t)))
+		return false;
+
+	if (!block_equal(&tag, &expected))
+		return false;
+
+	if (!session->cipher->crypt(session->cipher_state, blocks, blocks, n_blocks * sizeof(fastd_block128_t), nonce))
+		return false;
+
+	fastd_buffer_pull(buffer, COMMON_HEADBYTES + sizeof(fastd_block128_t));
+
+	fastd_tristate_t reorder_check = fastd_method_reorder_check(&session->common, in_nonce, age, now);
+	if (reorder_check.set)
+		*reordered = reorder_check.state;
+	else
+		buffer->len = 0;
+
+	return true;
+}
+
+
 /** The generic-umac method provider */
 const fastd_method_provider_t fastd_method_generic_umac = {
 	.overhead = COMMON_HEADBYTES + sizeof(fastd_block128_t),
-	.encrypt_headroom = sizeof(fastd_block128_t),
+	.encrypt_headroom = 2 * sizeof(fastd_block128_t), /* tag and aligned common header for in-place encryption */
 	.decrypt_headroom = 0,
 
 	.create_by_name = method_create_by_name,
@@ -243,4 +342,7 @@ const fastd_method_provider_t fastd_method_generic_umac = {
 
 	.encrypt = method_encrypt,
 	.decrypt = method_decrypt,
+	.encrypt_inplace = method_encrypt_inplace,
+	.decrypt_inplace = method_decrypt_inplace,
+	.encrypt_shared = method_encrypt_shared,
 };
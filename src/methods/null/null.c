@@ -83,8 +83,9 @@ static fastd_buffer_t *method_encrypt(UNUSED fastd_method_session_state_t *sessi
 }
 
 /** Just returns the input buffer as the output */
-static fastd_buffer_t *
-method_decrypt(UNUSED fastd_method_session_state_t *session, fastd_buffer_t *in, UNUSED bool *reordered) {
+static fastd_buffer_t *method_decrypt(
+	UNUSED fastd_method_session_state_t *session, fastd_buffer_t *in, UNUSED fastd_timeout_t now,
+	UNUSED bool *reordered) {
 	fastd_buffer_pull(in, 1);
 
 	return in;
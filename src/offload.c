@@ -0,0 +1,636 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   TUN/TAP interface offloads
+
+   When offloads are enabled on a TUN/TAP interface, the kernel may pass packets with incomplete checksums
+   and TCP/UDP packets of up to 64 KiB (GSO frames) to fastd. These are completed and split into packets
+   fitting the interface MTU here, right before they are handed to the encryption.
+
+   In the other direction, consecutive segments of the same TCP flow are coalesced into GSO frames again
+   after decryption (GRO), so they can be written to the interface at once. Pending flows are written
+   at the end of each main loop iteration.
+*/
+
+
+#include "offload.h"
+#include "fastd.h"
+
+
+#ifdef USE_IFACE_OFFLOAD
+
+#include <linux/if_ether.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+
+#ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+/** Compatiblity define for systems supporting, but not defining VIRTIO_NET_HDR_GSO_UDP_L4 */
+#define VIRTIO_NET_HDR_GSO_UDP_L4 5
+#endif
+
+
+/** The TCP FIN flag */
+#define TCP_FLAG_FIN 0x01
+
+/** The TCP PSH flag */
+#define TCP_FLAG_PSH 0x08
+
+/** The TCP ACK flag */
+#define TCP_FLAG_ACK 0x10
+
+/** The TCP CWR flag */
+#define TCP_FLAG_CWR 0x80
+
+
+/** The maximum length of the headers of a coalesced TCP segment (Ethernet with two VLAN tags, IPv4 and TCP with options) */
+#define GRO_MAX_HDR (14 + 2 * 4 + 60 + 60)
+
+
+/** The header layout of a GSO frame */
+typedef struct offload_frame {
+	size_t l3;      /**< The offset of the IP header */
+	size_t l4;      /**< The offset of the TCP/UDP header */
+	size_t hdr_len; /**< The length of all headers up to the payload */
+	uint8_t proto;  /**< The IP protocol of the frame */
+	bool ipv6;      /**< true if the frame is an IPv6 packet */
+} offload_frame_t;
+
+/** A flow of TCP segments which are coalesced before being written to an interface */
+typedef struct gro_flow {
+	fastd_iface_t *iface;     /**< The interface the flow is written to (NULL if the flow is unused) */
+	fastd_buffer_t *buffer;   /**< The coalesced packet */
+	offload_frame_t frame;    /**< The header layout of the coalesced packet */
+	size_t mss;               /**< The payload length of the coalesced segments */
+	size_t segments;          /**< The number of coalesced segments */
+	uint32_t next_seq;        /**< The TCP sequence number expected for the next segment of the flow */
+	uint8_t key[GRO_MAX_HDR]; /**< The headers of the first segment with all fields masked which may differ between segments */
+} gro_flow_t;
+
+
+/** The flows currently being coalesced */
+static THREAD_LOCAL gro_flow_t gro_flows[GRO_FLOWS];
+
+/** The index of the flow to write next when a new flow needs to be started and all flows are in use */
+static THREAD_LOCAL size_t gro_next = 0;
+
+
+/** Reads a 16-bit big-endian value from a possibly unaligned location */
+static inline uint16_t get_u16(const uint8_t *p) {
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohs(v);
+}
+
+/** Writes a 16-bit big-endian value to a possibly unaligned location */
+static inline void put_u16(uint8_t *p, uint16_t v) {
+	v = htons(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+/** Reads a 32-bit big-endian value from a possibly unaligned location */
+static inline uint32_t get_u32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+/** Writes a 32-bit big-endian value to a possibly unaligned location */
+static inline void put_u32(uint8_t *p, uint32_t v) {
+	v = htonl(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+
+/** Adds the 16-bit words of a memory area to an Internet checksum */
+static uint64_t csum_add(uint64_t sum, const uint8_t *data, size_t len) {
+	size_t i;
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (data[i] << 8) | data[i + 1];
+
+	if (len & 1)
+		sum += data[len - 1] << 8;
+
+	return sum;
+}
+
+/** Folds an Internet checksum accumulator to 16 bits */
+static uint16_t csum_fold(uint64_t sum) {
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+/**
+   Stores a folded Internet checksum
+
+   0 is replaced by the equivalent 0xffff, as a UDP checksum of 0 means that no checksum is present.
+*/
+static void csum_store(uint8_t *p, uint64_t sum) {
+	uint16_t csum = ~csum_fold(sum);
+	put_u16(p, csum ? csum : 0xffff);
+}
+
+/** Returns the checksum accumulator of the TCP/UDP pseudo header of a packet */
+static uint64_t pseudo_header_sum(const uint8_t *data, const offload_frame_t *frame, size_t l4_len) {
+	uint64_t sum = frame->proto + l4_len;
+
+	if (frame->ipv6)
+		return csum_add(sum, data + frame->l3 + offsetof(struct ip6_hdr, ip6_src), 2 * sizeof(struct in6_addr));
+	else
+		return csum_add(sum, data + frame->l3 + offsetof(struct ip, ip_src), 2 * sizeof(struct in_addr));
+}
+
+
+/** Completes the checksum of a packet the kernel has left to the offloading device */
+static bool complete_csum(fastd_buffer_t *buffer, const struct virtio_net_hdr *hdr) {
+	uint8_t *data = buffer->data;
+
+	if ((size_t)hdr->csum_start + hdr->csum_offset + 2 > buffer->len)
+		return false;
+
+	/* The checksum field already contains the sum of the pseudo header */
+	uint64_t sum = csum_add(0, data + hdr->csum_start, buffer->len - hdr->csum_start);
+	csum_store(data + hdr->csum_start + hdr->csum_offset, sum);
+
+	return true;
+}
+
+/** Determines the offset of the IP header, skipping the Ethernet header and VLAN tags in TAP mode */
+static bool get_l3_offset(const fastd_buffer_t *buffer, size_t *l3) {
+	const uint8_t *data = buffer->data;
+
+	if (conf.mode == MODE_TUN) {
+		*l3 = 0;
+		return true;
+	}
+
+	size_t offset = 2 * ETH_ALEN;
+	size_t i;
+	for (i = 0; i <= 2; i++) {
+		if (buffer->len < offset + 2)
+			return false;
+
+		uint16_t proto = get_u16(data + offset);
+		if (proto != ETH_P_8021Q && proto != ETH_P_8021AD) {
+			*l3 = offset + 2;
+			return true;
+		}
+
+		offset += 4;
+	}
+
+	return false;
+}
+
+/** Determines and validates the header layout of a GSO frame */
+static bool parse_frame(const fastd_buffer_t *buffer, const struct virtio_net_hdr *hdr, offload_frame_t *frame) {
+	const uint8_t *data = buffer->data;
+
+	if (!(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		return false;
+
+	if (!get_l3_offset(buffer, &frame->l3) || frame->l3 >= buffer->len)
+		return false;
+
+	uint8_t version = data[frame->l3] >> 4;
+	size_t l3_len;
+
+	switch (hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+		if (version != 4)
+			return false;
+
+		frame->proto = IPPROTO_TCP;
+		break;
+
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		if (version != 6)
+			return false;
+
+		frame->proto = IPPROTO_TCP;
+		break;
+
+	case VIRTIO_NET_HDR_GSO_UDP_L4:
+		if (version != 4 && version != 6)
+			return false;
+
+		frame->proto = IPPROTO_UDP;
+		break;
+
+	default:
+		return false;
+	}
+
+	frame->ipv6 = (version == 6);
+	if (frame->ipv6)
+		l3_len = sizeof(struct ip6_hdr);
+	else
+		l3_len = (data[frame->l3] & 0x0f) * 4;
+
+	frame->l4 = hdr->csum_start;
+	if (l3_len < sizeof(struct ip) || frame->l4 < frame->l3 + l3_len)
+		return false;
+
+	if (frame->proto == IPPROTO_TCP) {
+		if (buffer->len < frame->l4 + sizeof(struct tcphdr))
+			return false;
+
+		size_t tcp_len = (data[frame->l4 + 12] >> 4) * 4;
+		if (tcp_len < sizeof(struct tcphdr))
+			return false;
+
+		frame->hdr_len = frame->l4 + tcp_len;
+	} else {
+		frame->hdr_len = frame->l4 + sizeof(struct udphdr);
+	}
+
+	return (frame->hdr_len < buffer->len);
+}
+
+/** Updates the IP header of a segment */
+static void update_ip_header(uint8_t *data, const offload_frame_t *frame, size_t len, uint16_t index) {
+	uint8_t *ip = data + frame->l3;
+
+	if (frame->ipv6) {
+		put_u16(ip + offsetof(struct ip6_hdr, ip6_plen), len - frame->l3 - sizeof(struct ip6_hdr));
+		return;
+	}
+
+	uint8_t *id = ip + offsetof(struct ip, ip_id);
+	uint8_t *sum = ip + offsetof(struct ip, ip_sum);
+
+	put_u16(ip + offsetof(struct ip, ip_len), len - frame->l3);
+	put_u16(id, get_u16(id) + index);
+	put_u16(sum, 0);
+	csum_store(sum, csum_add(0, ip, (ip[0] & 0x0f) * 4));
+}
+
+/** Updates the TCP/UDP header of a segment and computes its checksum */
+static void update_l4_header(uint8_t *data, const offload_frame_t *frame, size_t len, size_t offset, bool last) {
+	uint8_t *l4 = data + frame->l4;
+	uint8_t *sum;
+	size_t l4_len = len - frame->l4;
+
+	if (frame->proto == IPPROTO_TCP) {
+		uint8_t *seq = l4 + offsetof(struct tcphdr, th_seq);
+		uint8_t *flags = l4 + offsetof(struct tcphdr, th_flags);
+
+		put_u32(seq, get_u32(seq) + offset);
+
+		if (offset)
+			*flags &= ~TCP_FLAG_CWR;
+		if (!last)
+			*flags &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+
+		sum = l4 + offsetof(struct tcphdr, th_sum);
+	} else {
+		put_u16(l4 + offsetof(struct udphdr, uh_ulen), l4_len);
+		sum = l4 + offsetof(struct udphdr, uh_sum);
+	}
+
+	put_u16(sum, 0);
+	csum_store(sum, csum_add(pseudo_header_sum(data, frame, l4_len), l4, l4_len));
+}
+
+/** Splits a GSO frame into segments and sends them */
+static bool send_segments(
+	const fastd_buffer_t *buffer, const struct virtio_net_hdr *hdr, size_t max_len, fastd_peer_t *dest) {
+	offload_frame_t frame;
+	if (!parse_frame(buffer, hdr, &frame))
+		return false;
+
+	size_t mss = hdr->gso_size;
+	if (!mss || frame.hdr_len + mss > max_len)
+		return false;
+
+	const uint8_t *data = buffer->data;
+	size_t payload_len = buffer->len - frame.hdr_len;
+	size_t offset;
+	uint16_t index = 0;
+
+	for (offset = 0; offset < payload_len; offset += mss) {
+		size_t seg_len = min_size_t(mss, payload_len - offset);
+		size_t len = frame.hdr_len + seg_len;
+
+		fastd_buffer_t *segment = fastd_buffer_alloc(len, conf.encrypt_headroom);
+		uint8_t *seg_data = segment->data;
+
+		memcpy(seg_data, data, frame.hdr_len);
+		memcpy(seg_data + frame.hdr_len, data + frame.hdr_len + offset, seg_len);
+
+		update_ip_header(seg_data, &frame, len, index++);
+		update_l4_header(seg_data, &frame, len, offset, offset + seg_len == payload_len);
+
+		fastd_send_data(segment, NULL, dest);
+	}
+
+	return true;
+}
+
+
+/**
+   Handles a frame read from an interface with offloads enabled
+
+   The buffer must start with the virtio-net header. Packets which don't need to be segmented are sent
+   as they are; GSO frames are split into packets of at most \e max_len bytes. The buffer is consumed in any case.
+*/
+void fastd_offload_handle(fastd_buffer_t *buffer, size_t max_len, fastd_peer_t *dest) {
+	struct virtio_net_hdr hdr;
+
+	if (buffer->len < sizeof(hdr)) {
+		pr_debug("fastd_offload_handle: truncated frame");
+		fastd_buffer_free(buffer);
+		return;
+	}
+
+	fastd_buffer_pull_to(buffer, &hdr, sizeof(hdr));
+
+	if (hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+		if (buffer->len > max_len) {
+			pr_debug("fastd_offload_handle: oversized packet");
+			fastd_buffer_free(buffer);
+			return;
+		}
+
+		if ((hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && !complete_csum(buffer, &hdr)) {
+			pr_debug("fastd_offload_handle: invalid checksum offset");
+			fastd_buffer_free(buffer);
+			return;
+		}
+
+		fastd_send_data(buffer, NULL, dest);
+		return;
+	}
+
+	if (!send_segments(buffer, &hdr, max_len, dest))
+		pr_debug("fastd_offload_handle: unsupported GSO frame (type %u)", (unsigned)hdr.gso_type);
+
+	fastd_buffer_free(buffer);
+}
+
+
+/**
+   Determines the header layout of a received packet and checks if it is a TCP segment that can be coalesced
+
+   Only segments with payload and without flags other than ACK and PSH are coalesced. Fragments and IPv6 extension
+   headers are not supported. Segments with invalid checksums are never coalesced, as the kernel doesn't verify
+   the checksums of GSO frames.
+*/
+static bool parse_segment(const fastd_buffer_t *buffer, offload_frame_t *frame) {
+	const uint8_t *data = buffer->data;
+	size_t len = buffer->len;
+
+	if (!get_l3_offset(buffer, &frame->l3) || len < frame->l3 + sizeof(struct ip))
+		return false;
+
+	const uint8_t *ip = data + frame->l3;
+	size_t l3_len;
+
+	switch (ip[0] >> 4) {
+	case 4:
+		l3_len = (ip[0] & 0x0f) * 4;
+		if (l3_len < sizeof(struct ip) || len < frame->l3 + l3_len)
+			return false;
+
+		if (get_u16(ip + offsetof(struct ip, ip_len)) != len - frame->l3)
+			return false;
+		if (get_u16(ip + offsetof(struct ip, ip_off)) & (IP_MF | IP_OFFMASK))
+			return false;
+		if (ip[offsetof(struct ip, ip_p)] != IPPROTO_TCP)
+			return false;
+		if (csum_fold(csum_add(0, ip, l3_len)) != 0xffff)
+			return false;
+
+		frame->ipv6 = false;
+		break;
+
+	case 6:
+		l3_len = sizeof(struct ip6_hdr);
+		if (len < frame->l3 + l3_len)
+			return false;
+
+		if (get_u16(ip + offsetof(struct ip6_hdr, ip6_plen)) != len - frame->l3 - l3_len)
+			return false;
+		if (ip[offsetof(struct ip6_hdr, ip6_nxt)] != IPPROTO_TCP)
+			return false;
+
+		frame->ipv6 = true;
+		break;
+
+	default:
+		return false;
+	}
+
+	frame->proto = IPPROTO_TCP;
+	frame->l4 = frame->l3 + l3_len;
+	if (len < frame->l4 + sizeof(struct tcphdr))
+		return false;
+
+	const uint8_t *tcp = data + frame->l4;
+	size_t tcp_len = (tcp[12] >> 4) * 4;
+
+	frame->hdr_len = frame->l4 + tcp_len;
+	if (tcp_len < sizeof(struct tcphdr) || frame->hdr_len >= len || frame->hdr_len > GRO_MAX_HDR)
+		return false;
+
+	if ((tcp[offsetof(struct tcphdr, th_flags)] & ~TCP_FLAG_PSH) != TCP_FLAG_ACK)
+		return false;
+
+	size_t l4_len = len - frame->l4;
+	return (csum_fold(csum_add(pseudo_header_sum(data, frame, l4_len), tcp, l4_len)) == 0xffff);
+}
+
+/** Copies the headers of a segment, masking all fields which may differ between segments of the same flow */
+static void get_flow_key(uint8_t *key, const uint8_t *data, const offload_frame_t *frame) {
+	memcpy(key, data, frame->hdr_len);
+
+	uint8_t *ip = key + frame->l3;
+	uint8_t *tcp = key + frame->l4;
+
+	if (frame->ipv6) {
+		memset(ip + offsetof(struct ip6_hdr, ip6_plen), 0, 2);
+	} else {
+		memset(ip + offsetof(struct ip, ip_len), 0, 2);
+		memset(ip + offsetof(struct ip, ip_id), 0, 2);
+		memset(ip + offsetof(struct ip, ip_sum), 0, 2);
+	}
+
+	memset(tcp + offsetof(struct tcphdr, th_seq), 0, 4);
+	memset(tcp + offsetof(struct tcphdr, th_win), 0, 2);
+	memset(tcp + offsetof(struct tcphdr, th_sum), 0, 2);
+	tcp[offsetof(struct tcphdr, th_flags)] &= ~TCP_FLAG_PSH;
+}
+
+/** Writes a coalesced flow to its interface and frees it */
+static void flush_flow(gro_flow_t *flow) {
+	fastd_buffer_t *buffer = flow->buffer;
+	const offload_frame_t *frame = &flow->frame;
+
+	if (flow->segments > 1) {
+		uint8_t *data = buffer->data;
+		size_t l4_len = buffer->len - frame->l4;
+
+		update_ip_header(data, frame, buffer->len, 0);
+
+		/* The kernel expects the sum of the pseudo header in the checksum field, like a device would */
+		put_u16(data + frame->l4 + offsetof(struct tcphdr, th_sum),
+			csum_fold(pseudo_header_sum(data, frame, l4_len)));
+
+		struct virtio_net_hdr hdr = {
+			.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+			.gso_type = frame->ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4,
+			.hdr_len = frame->hdr_len,
+			.gso_size = flow->mss,
+			.csum_start = frame->l4,
+			.csum_offset = offsetof(struct tcphdr, th_sum),
+		};
+
+		fastd_iface_write_gso(flow->iface, &hdr, buffer);
+	} else {
+		fastd_iface_write(flow->iface, buffer);
+	}
+
+	fastd_buffer_free(buffer);
+
+	flow->iface = NULL;
+	flow->buffer = NULL;
+}
+
+/** Returns the flow a segment belongs to (if any) */
+static gro_flow_t *find_flow(const fastd_iface_t *iface, const offload_frame_t *frame, const uint8_t *key) {
+	size_t i;
+	for (i = 0; i < GRO_FLOWS; i++) {
+		gro_flow_t *flow = &gro_flows[i];
+
+		if (flow->iface != iface)
+			continue;
+
+		if (flow->frame.l4 != frame->l4 || flow->frame.hdr_len != frame->hdr_len)
+			continue;
+
+		if (memcmp(flow->key, key, frame->hdr_len) == 0)
+			return flow;
+	}
+
+	return NULL;
+}
+
+/** Returns an unused flow, writing the oldest one if necessary */
+static gro_flow_t *get_unused_flow(void) {
+	size_t i;
+	for (i = 0; i < GRO_FLOWS; i++) {
+		if (!gro_flows[i].iface)
+			return &gro_flows[i];
+	}
+
+	gro_flow_t *flow = &gro_flows[gro_next];
+	gro_next = (gro_next + 1) % GRO_FLOWS;
+
+	flush_flow(flow);
+	return flow;
+}
+
+
+/**
+   Passes a received packet to the coalescing stage of an interface with offloads enabled
+
+   The buffer isn't consumed, as the packet data is copied when it is coalesced.
+
+   \return true if the packet is handled by the coalescing stage; false if it needs to be written to the
+   interface by the caller
+*/
+bool fastd_offload_receive(fastd_iface_t *iface, const fastd_buffer_t *buffer) {
+	if (!iface->vnet_hdr)
+		return false;
+
+	offload_frame_t frame;
+	uint8_t key[GRO_MAX_HDR];
+
+	if (!parse_segment(buffer, &frame)) {
+		/* Make sure packets are not reordered within a flow */
+		fastd_offload_flush_iface(iface);
+		return false;
+	}
+
+	get_flow_key(key, buffer->data, &frame);
+
+	const uint8_t *data = buffer->data;
+	const uint8_t *tcp = data + frame.l4;
+	size_t payload_len = buffer->len - frame.hdr_len;
+	uint32_t seq = get_u32(tcp + offsetof(struct tcphdr, th_seq));
+	bool push = tcp[offsetof(struct tcphdr, th_flags)] & TCP_FLAG_PSH;
+
+	gro_flow_t *flow = find_flow(iface, &frame, key);
+	if (flow) {
+		fastd_buffer_t *coalesced = flow->buffer;
+
+		if (seq == flow->next_seq && payload_len <= flow->mss &&
+		    coalesced->len + payload_len - frame.l3 <= IP_MAXPACKET) {
+			memcpy((uint8_t *)coalesced->data + coalesced->len, data + frame.hdr_len, payload_len);
+			coalesced->len += payload_len;
+
+			flow->segments++;
+			flow->next_seq += payload_len;
+
+			if (push)
+				((uint8_t *)coalesced->data)[frame.l4 + offsetof(struct tcphdr, th_flags)] |= TCP_FLAG_PSH;
+
+			/* A shorter segment or PSH ends the burst */
+			if (push || payload_len < flow->mss)
+				flush_flow(flow);
+
+			return true;
+		}
+
+		flush_flow(flow);
+	}
+
+	if (push)
+		return false;
+
+	if (!flow)
+		flow = get_unused_flow();
+
+	flow->iface = iface;
+	flow->buffer = fastd_buffer_alloc(frame.l3 + IP_MAXPACKET, 0);
+	flow->buffer->len = buffer->len;
+	memcpy(flow->buffer->data, data, buffer->len);
+
+	flow->frame = frame;
+	flow->mss = payload_len;
+	flow->segments = 1;
+	flow->next_seq = seq + payload_len;
+	memcpy(flow->key, key, frame.hdr_len);
+
+	return true;
+}
+
+/** Writes all coalesced flows of an interface */
+void fastd_offload_flush_iface(fastd_iface_t *iface) {
+	size_t i;
+	for (i = 0; i < GRO_FLOWS; i++) {
+		if (gro_flows[i].iface == iface)
+			flush_flow(&gro_flows[i]);
+	}
+}
+
+/** Writes all coalesced flows */
+void fastd_offload_flush(void) {
+	size_t i;
+	for (i = 0; i < GRO_FLOWS; i++) {
+		if (gro_flows[i].iface)
+			flush_flow(&gro_flows[i]);
+	}
+}
+
+#endif
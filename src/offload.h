@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   TUN/TAP interface offloads
+*/
+
+
+#pragma once
+
+#include "types.h"
+
+
+#ifdef USE_IFACE_OFFLOAD
+
+#include <linux/virtio_net.h>
+
+
+/** The size of the virtio-net header prefixed to packets on interfaces with offloads enabled */
+#define FASTD_OFFLOAD_HDR_SIZE sizeof(struct virtio_net_hdr)
+
+/**
+   The maximum size of a frame read from an interface with offloads enabled, including the virtio-net header
+
+   This allows for an IP packet of maximum size, preceded by an Ethernet header with up to two VLAN tags.
+*/
+#define FASTD_OFFLOAD_MAX_FRAME (FASTD_OFFLOAD_HDR_SIZE + 14 + 2 * 4 + 65535)
+
+
+void fastd_offload_handle(fastd_buffer_t *buffer, size_t max_len, fastd_peer_t *dest);
+bool fastd_offload_receive(fastd_iface_t *iface, const fastd_buffer_t *buffer);
+void fastd_offload_flush_iface(fastd_iface_t *iface);
+void fastd_offload_flush(void);
+
+void fastd_iface_write_gso(fastd_iface_t *iface, const struct virtio_net_hdr *hdr, const fastd_buffer_t *buffer);
+
+#else /* USE_IFACE_OFFLOAD */
+
+static inline bool fastd_offload_receive(UNUSED fastd_iface_t *iface, UNUSED const fastd_buffer_t *buffer) {
+	return false;
+}
+
+static inline void fastd_offload_flush_iface(UNUSED fastd_iface_t *iface) {}
+static inline void fastd_offload_flush(void) {}
+
+#endif
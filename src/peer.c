@@ -11,6 +11,8 @@
 */
 
 #include "peer.h"
+#include "async.h"
+#include "eth_addr.h"
 #include "peer_group.h"
 #include "peer_hashtable.h"
 #include "polling.h"
@@ -156,8 +158,35 @@ fastd_peer_t *fastd_peer_find_by_id(uint64_t id) {
 		return NULL;
 }
 
-/** Closes and frees a peer's dynamic socket */
+/** Closes and frees a peer's connected socket */
+void fastd_peer_close_connected_socket(fastd_peer_t *peer) {
+	if (!peer->connected_sock)
+		return;
+
+	pr_debug("closing connected socket of peer %P", peer);
+
+	fastd_socket_close(peer->connected_sock);
+	free(peer->connected_sock);
+	peer->connected_sock = NULL;
+}
+
+/** Opens a connected socket for an established peer that uses a bound socket, if enabled */
+static void open_connected_socket(fastd_peer_t *peer) {
+	if (!conf.socket_connect || peer->connected_sock)
+		return;
+
+	if (fastd_peer_is_socket_dynamic(peer) || peer->address.sa.sa_family == AF_UNSPEC)
+		return;
+
+	peer->connected_sock = fastd_socket_connect(peer);
+	if (peer->connected_sock)
+		pr_debug("opened connected socket for peer %P", peer);
+}
+
+/** Closes and frees a peer's dynamic socket (and its connected socket) */
 static inline void free_socket(fastd_peer_t *peer) {
+	fastd_peer_close_connected_socket(peer);
+
 	if (!peer->sock)
 		return;
 
@@ -217,10 +246,24 @@ void fastd_peer_reset_socket(fastd_peer_t *peer) {
 	}
 }
 
+/**
+   Rounds the timeout of a peer maintenance task up to a multiple of PEER_TASK_GRANULARITY
+
+   The tasks of all peers with timeouts in the same interval are thus handled in a single sweep,
+   and the keepalives sent by them are flushed together. Timeouts that have been reached already
+   are kept, so the task is handled immediately.
+*/
+static inline fastd_timeout_t coalesce_task_timeout(fastd_timeout_t timeout) {
+	if (timeout == FASTD_TIMEOUT_INV || fastd_timed_out(timeout))
+		return timeout;
+
+	return (timeout + PEER_TASK_GRANULARITY - 1) / PEER_TASK_GRANULARITY * PEER_TASK_GRANULARITY;
+}
+
 /** Schedules the peer maintenance task (or removes the scheduled task if there's nothing to do) */
 static void schedule_peer_task(fastd_peer_t *peer) {
-	fastd_timeout_t timeout = fastd_timeout_min(
-		peer->reset_timeout, fastd_timeout_min(peer->keepalive_timeout, peer->next_handshake));
+	fastd_timeout_t timeout = coalesce_task_timeout(fastd_timeout_min(
+		peer->reset_timeout, fastd_timeout_min(peer->keepalive_timeout, peer->next_handshake)));
 
 	if (timeout == FASTD_TIMEOUT_INV) {
 		pr_debug2("Removing scheduled task for %P", peer);
@@ -236,7 +279,7 @@ static void schedule_peer_task(fastd_peer_t *peer) {
 
 /** Sets the timeout for the next handshake without actually rescheduling */
 static void set_next_handshake(fastd_peer_t *peer, int delay) {
-	peer->next_handshake = ctx.now + delay;
+	peer->next_handshake = fastd_now() + delay;
 }
 
 /** Sets the timeout for the next handshake to the default delay and jitter without actually rescheduling */
@@ -255,21 +298,42 @@ void fastd_peer_schedule_handshake(fastd_peer_t *peer, int delay) {
 	schedule_peer_task(peer);
 }
 
-/** Checks if the peer group \e group1 lies in \e group2 */
-static inline bool is_group_in(const fastd_peer_group_t *group1, const fastd_peer_group_t *group2) {
-	while (group1) {
-		if (group1 == group2)
-			return true;
+/**
+   Hands changes to a peer to the main thread
 
-		group1 = group1->parent;
-	}
+   This is used by threads handling packets in parallel to other threads (see fastd_worker_is_shared()),
+   which must not change the state of the peer themselves. Only a single notification is queued until
+   the main thread has handled the deferred changes. If the notification can't be queued, the changes
+   are dropped, so they can be deferred again by the next packet that needs them.
+*/
+void fastd_peer_defer(fastd_peer_t *peer, fastd_peer_deferred_t deferred) {
+	if (__atomic_fetch_or(&peer->deferred, deferred, __ATOMIC_RELAXED))
+		return;
 
-	return false;
+	fastd_async_peer_t peer_data = { .peer_id = peer->id };
+	if (!fastd_async_try_enqueue(ASYNC_TYPE_PEER, &peer_data, sizeof(peer_data)))
+		__atomic_store_n(&peer->deferred, 0, __ATOMIC_RELAXED);
+}
+
+/** Handles the changes deferred with fastd_peer_defer() in the main thread */
+void fastd_peer_handle_deferred(fastd_peer_t *peer) {
+	uint8_t deferred = __atomic_exchange_n(&peer->deferred, 0, __ATOMIC_RELAXED);
+
+	if (!fastd_peer_is_established(peer))
+		return;
+
+	if ((deferred & PEER_DEFERRED_HANDSHAKE) && !fastd_peer_handshake_scheduled(peer))
+		fastd_peer_schedule_handshake_default(peer);
+
+	if (deferred & PEER_DEFERRED_PROTOCOL)
+		conf.protocol->handle_deferred(peer);
 }
 
-/** Checks if a peer lies in a peer group */
-static bool is_peer_in_group(const fastd_peer_t *peer, const fastd_peer_group_t *group) {
-	return is_group_in(peer->group, group);
+/** Adds \e delta to the established peer counts of a peer's group and all groups above it */
+static void count_established(const fastd_peer_t *peer, ssize_t delta) {
+	fastd_peer_group_t *group;
+	for (group = peer->group; group; group = group->parent)
+		group->n_established += delta;
 }
 
 /**
@@ -281,6 +345,7 @@ static bool is_peer_in_group(const fastd_peer_t *peer, const fastd_peer_group_t
 */
 static void reset_peer(fastd_peer_t *peer) {
 	if (fastd_peer_is_established(peer)) {
+		count_established(peer, -1);
 		on_disestablish(peer);
 		pr_info("connection with %P disestablished.", peer);
 	}
@@ -289,16 +354,7 @@ static void reset_peer(fastd_peer_t *peer) {
 
 	conf.protocol->reset_peer_state(peer);
 
-	size_t i, deleted = 0;
-	for (i = 0; i < VECTOR_LEN(ctx.eth_addrs); i++) {
-		if (VECTOR_INDEX(ctx.eth_addrs, i).peer == peer) {
-			deleted++;
-		} else if (deleted) {
-			VECTOR_INDEX(ctx.eth_addrs, i - deleted) = VECTOR_INDEX(ctx.eth_addrs, i);
-		}
-	}
-
-	VECTOR_RESIZE(ctx.eth_addrs, VECTOR_LEN(ctx.eth_addrs) - deleted);
+	fastd_peer_eth_addr_forget(peer);
 
 	fastd_task_unschedule(&peer->task);
 
@@ -360,7 +416,7 @@ static void setup_peer(fastd_peer_t *peer) {
 		for (i = 0; i < VECTOR_LEN(peer->remotes); i++) {
 			fastd_remote_t *remote = &VECTOR_INDEX(peer->remotes, i);
 
-			remote->last_resolve_timeout = ctx.now;
+			remote->last_resolve_timeout = fastd_now();
 
 			if (!remote->hostname) {
 				remote->n_addresses = 1;
@@ -371,17 +427,17 @@ static void setup_peer(fastd_peer_t *peer) {
 		peer->next_remote = 0;
 	}
 
-	peer->last_handshake_timeout = ctx.now;
+	peer->last_handshake_timeout = fastd_now();
 	peer->last_handshake_address.sa.sa_family = AF_UNSPEC;
 
-	peer->last_handshake_response_timeout = ctx.now;
+	peer->last_handshake_response_timeout = fastd_now();
 	peer->last_handshake_response_address.sa.sa_family = AF_UNSPEC;
 
-	peer->establish_handshake_timeout = ctx.now;
+	peer->establish_handshake_timeout = fastd_now();
 
 #ifdef WITH_DYNAMIC_PEERS
-	peer->verify_timeout = ctx.now;
-	peer->verify_valid_timeout = ctx.now;
+	peer->verify_timeout = fastd_now();
+	peer->verify_valid_timeout = fastd_now();
 #endif
 
 	peer->next_handshake = FASTD_TIMEOUT_INV;
@@ -389,7 +445,7 @@ static void setup_peer(fastd_peer_t *peer) {
 	peer->keepalive_timeout = FASTD_TIMEOUT_INV;
 
 	if (fastd_peer_is_dynamic(peer))
-		peer->reset_timeout = ctx.now;
+		peer->reset_timeout = fastd_now();
 
 	if (!fastd_peer_is_enabled(peer))
 		/* Keep the peer in STATE_INACTIVE */
@@ -432,6 +488,8 @@ static void setup_peer(fastd_peer_t *peer) {
    use fastd_peer_delete() instead.
 */
 void fastd_peer_free(fastd_peer_t *peer) {
+	fastd_send_forget_peer(peer);
+
 	free(peer->key);
 
 	size_t i;
@@ -458,6 +516,7 @@ static void delete_peer(fastd_peer_t *peer) {
 
 	size_t i = peer_index(peer);
 	VECTOR_DELETE(ctx.peers, i);
+	fastd_peer_hashtable_remove_owner(peer);
 
 	conf.protocol->free_peer_state(peer);
 
@@ -466,6 +525,11 @@ static void delete_peer(fastd_peer_t *peer) {
 		fastd_iface_close(peer->iface);
 	}
 
+#ifdef USE_WORKER_THREADS
+	if ((errno = pthread_mutex_destroy(&peer->lock)) != 0)
+		exit_errno("pthread_mutex_destroy");
+#endif
+
 	fastd_peer_free(peer);
 }
 
@@ -590,33 +654,27 @@ bool fastd_peer_claim_address(
 		if (fastd_peer_is_established(new_peer))
 			fastd_peer_reset(new_peer);
 	} else {
-		size_t i;
-		for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
-			fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
-
-			if (peer == new_peer)
-				continue;
-
-			if (!fastd_peer_is_enabled(peer))
-				continue;
+		if (fastd_peer_hashtable_lookup_owner(remote_addr, new_peer)) {
+			reset_peer_address(new_peer);
+			return false;
+		}
 
-			if (fastd_peer_owns_address(peer, remote_addr)) {
+		fastd_peer_t *peer = fastd_peer_hashtable_lookup(remote_addr);
+		if (peer && peer != new_peer && fastd_peer_is_enabled(peer)) {
+			if (!force && fastd_peer_is_established(peer)) {
 				reset_peer_address(new_peer);
 				return false;
 			}
 
-			if (fastd_peer_address_equal(&peer->address, remote_addr)) {
-				if (!force && fastd_peer_is_established(peer)) {
-					reset_peer_address(new_peer);
-					return false;
-				}
-
-				reset_peer_address(peer);
-				break;
-			}
+			reset_peer_address(peer);
 		}
 	}
 
+	/* The connected socket is only valid for the addresses and the bound socket it was opened for */
+	if (!fastd_peer_address_equal(&new_peer->address, remote_addr) ||
+	    (local_addr && !fastd_peer_address_equal(&new_peer->local_address, local_addr)))
+		fastd_peer_close_connected_socket(new_peer);
+
 	fastd_peer_hashtable_remove(new_peer);
 	new_peer->address = *remote_addr;
 	fastd_peer_hashtable_insert(new_peer);
@@ -629,6 +687,9 @@ bool fastd_peer_claim_address(
 	if (local_addr)
 		new_peer->local_address = *local_addr;
 
+	if (fastd_peer_is_established(new_peer))
+		open_connected_socket(new_peer);
+
 	return true;
 }
 
@@ -648,19 +709,6 @@ void fastd_peer_delete(fastd_peer_t *peer) {
 	delete_peer(peer);
 }
 
-/** Counts how many peers in the given peer group have established a connection */
-static inline size_t count_established_group_peers(const fastd_peer_group_t *group) {
-	size_t i, ret = 0;
-	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
-		fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
-
-		if (fastd_peer_is_established(peer) && is_peer_in_group(peer, group))
-			ret++;
-	}
-
-	return ret;
-}
-
 /** Checks if a peer may currently establish a connection */
 bool fastd_peer_may_connect(fastd_peer_t *peer) {
 	if (fastd_peer_is_established(peer))
@@ -672,7 +720,7 @@ bool fastd_peer_may_connect(fastd_peer_t *peer) {
 		if (group->max_connections < 0)
 			continue;
 
-		if (count_established_group_peers(group) >= (size_t)group->max_connections)
+		if (group->n_established >= (size_t)group->max_connections)
 			return false;
 	}
 
@@ -759,7 +807,13 @@ bool fastd_peer_add(fastd_peer_t *peer) {
 
 	peer->id = ctx.next_peer_id++;
 
+#ifdef USE_WORKER_THREADS
+	if ((errno = pthread_mutex_init(&peer->lock, NULL)) != 0)
+		exit_errno("pthread_mutex_init");
+#endif
+
 	VECTOR_ADD(ctx.peers, peer);
+	fastd_peer_hashtable_add_owner(peer);
 
 	conf.protocol->init_peer_state(peer);
 
@@ -805,7 +859,7 @@ static void send_handshake(fastd_peer_t *peer, fastd_remote_t *next_remote) {
 		return;
 	}
 
-	peer->last_handshake_timeout = ctx.now + MIN_HANDSHAKE_INTERVAL;
+	peer->last_handshake_timeout = fastd_now() + MIN_HANDSHAKE_INTERVAL;
 	peer->last_handshake_address = peer->address;
 	conf.protocol->handshake_init(peer->sock, &peer->local_address, &peer->address, peer);
 }
@@ -824,11 +878,13 @@ bool fastd_peer_set_established(fastd_peer_t *peer) {
 	}
 
 	peer->state = STATE_ESTABLISHED;
-	peer->established = ctx.now;
+	peer->established = fastd_now();
+	count_established(peer, 1);
 	fastd_peer_seen(peer);
 	fastd_peer_clear_keepalive(peer);
 
 	schedule_peer_task(peer);
+	open_connected_socket(peer);
 
 	on_establish(peer);
 	pr_info("connection with %P established.", peer);
@@ -836,59 +892,6 @@ bool fastd_peer_set_established(fastd_peer_t *peer) {
 	return true;
 }
 
-/** Compares two MAC addresses */
-static inline int eth_addr_cmp(const fastd_eth_addr_t *addr1, const fastd_eth_addr_t *addr2) {
-	return memcmp(addr1->data, addr2->data, sizeof(fastd_eth_addr_t));
-}
-
-/** Compares two fastd_peer_eth_addr_t entries by their MAC addresses */
-static int peer_eth_addr_cmp(const fastd_peer_eth_addr_t *addr1, const fastd_peer_eth_addr_t *addr2) {
-	return eth_addr_cmp(&addr1->addr, &addr2->addr);
-}
-
-/** Adds a MAC address to the sorted list of addresses associated with a peer (or updates the timeout of an existing
- * entry) */
-void fastd_peer_eth_addr_add(fastd_peer_t *peer, fastd_eth_addr_t addr) {
-	size_t min = 0, max = VECTOR_LEN(ctx.eth_addrs);
-
-	if (peer && !fastd_peer_is_established(peer))
-		exit_bug("tried to learn ethernet address on non-established peer");
-
-	while (max > min) {
-		size_t cur = min + (max - min) / 2;
-		int cmp = eth_addr_cmp(&addr, &VECTOR_INDEX(ctx.eth_addrs, cur).addr);
-
-		if (cmp == 0) {
-			VECTOR_INDEX(ctx.eth_addrs, cur).peer = peer;
-			VECTOR_INDEX(ctx.eth_addrs, cur).timeout = ctx.now + ETH_ADDR_STALE_TIME;
-			return; /* We're done here. */
-		} else if (cmp < 0) {
-			max = cur;
-		} else {
-			min = cur + 1;
-		}
-	}
-
-	VECTOR_INSERT(ctx.eth_addrs, ((fastd_peer_eth_addr_t){ addr, peer, ctx.now + ETH_ADDR_STALE_TIME }), min);
-
-	if (peer)
-		pr_debug("learned new MAC address %E on peer %P", &addr, peer);
-	else
-		pr_debug("learned new local MAC address %E", &addr);
-}
-
-/** Finds the peer that is associated with a given MAC address */
-bool fastd_peer_find_by_eth_addr(const fastd_eth_addr_t addr, fastd_peer_t **peer) {
-	const fastd_peer_eth_addr_t key = { .addr = addr };
-	fastd_peer_eth_addr_t *peer_eth_addr = VECTOR_BSEARCH(&key, ctx.eth_addrs, peer_eth_addr_cmp);
-
-	if (!peer_eth_addr)
-		return false;
-
-	*peer = peer_eth_addr->peer;
-	return true;
-}
-
 /** Sends a handshake to one peer, if a scheduled handshake is due */
 static void handle_task_handshake(fastd_peer_t *peer) {
 	set_next_handshake_default(peer);
@@ -959,24 +962,6 @@ void fastd_peer_handle_task(fastd_task_t *task) {
 	schedule_peer_task(peer);
 }
 
-/** Removes all time-outed MAC addresses from \e ctx.eth_addrs */
-void fastd_peer_eth_addr_cleanup(void) {
-	size_t i, deleted = 0;
-
-	for (i = 0; i < VECTOR_LEN(ctx.eth_addrs); i++) {
-		if (fastd_timed_out(VECTOR_INDEX(ctx.eth_addrs, i).timeout)) {
-			deleted++;
-			pr_debug(
-				"MAC address %E not seen for more than %u seconds, removing",
-				&VECTOR_INDEX(ctx.eth_addrs, i).addr, ETH_ADDR_STALE_TIME / 1000);
-		} else if (deleted) {
-			VECTOR_INDEX(ctx.eth_addrs, i - deleted) = VECTOR_INDEX(ctx.eth_addrs, i);
-		}
-	}
-
-	VECTOR_RESIZE(ctx.eth_addrs, VECTOR_LEN(ctx.eth_addrs) - deleted);
-}
-
 /** Resets all peers */
 void fastd_peer_reset_all(void) {
 	size_t i;
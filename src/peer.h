@@ -14,6 +14,7 @@
 #pragma once
 
 #include "fastd.h"
+#include "worker.h"
 
 
 /** The state of a peer */
@@ -36,6 +37,12 @@ typedef enum fastd_peer_config_state {
 #endif
 } fastd_peer_config_state_t;
 
+/** Changes that have been handed from the data path to the main thread (see fastd_peer_defer()) */
+typedef enum fastd_peer_deferred {
+	PEER_DEFERRED_HANDSHAKE = 1 << 0, /**< A handshake should be scheduled */
+	PEER_DEFERRED_PROTOCOL = 1 << 1,  /**< The protocol needs to update its session state */
+} fastd_peer_deferred_t;
+
 /** A peer's configuration and state */
 struct fastd_peer {
 	/* The following fields are more or less static configuration: */
@@ -43,7 +50,7 @@ struct fastd_peer {
 	uint64_t id; /**< A unique ID assigned to each peer */
 
 	char *name;                      /**< The peer's name */
-	const fastd_peer_group_t *group; /**< The peer group the peer belongs to */
+	fastd_peer_group_t *group;       /**< The peer group the peer belongs to */
 	const char *config_source_dir;   /**< The directory this peer's configuration was loaded from */
 
 	VECTOR(fastd_remote_t) remotes; /**< The vector of the peer's remotes */
@@ -63,6 +70,9 @@ struct fastd_peer {
 	/** The socket used by the peer. This can either be a common bound socket or a
 	    dynamic, unbound socket that is used exclusively by this peer */
 	fastd_socket_t *sock;
+	/** A socket connected to the peer's current address, used instead of the bound socket \e sock
+	    while the peer is established (if enabled, see fastd_socket_connect()) */
+	fastd_socket_t *connected_sock;
 	fastd_peer_address_t local_address; /**< The local address used to communicate with this peer */
 	fastd_peer_address_t address;       /**< The peers current address */
 
@@ -81,6 +91,17 @@ struct fastd_peer {
 							    until this timeout has occured */
 	fastd_timeout_t establish_handshake_timeout; /**< A timeout during which all handshakes for this peer will be
 							ignored after a new connection has been established */
+
+	uint8_t handshake_cookie[HANDSHAKE_COOKIE_BYTES]; /**< A cookie the peer demands in handshakes under load */
+	fastd_peer_address_t handshake_cookie_address;    /**< The address the cookie has been received from */
+	fastd_timeout_t handshake_cookie_timeout;         /**< The time until which the cookie is used */
+
+	/** The nonce of the last handshake sent to the peer; only cookie replies echoing it are accepted */
+	uint8_t handshake_cookie_nonce[HANDSHAKE_COOKIE_NONCE_BYTES];
+	fastd_peer_address_t handshake_cookie_nonce_address; /**< The address the last handshake has been sent to */
+	/** The key cookie replies from the peer are authenticated with */
+	uint32_t handshake_cookie_reply_key[FASTD_HMACSHA256_KEY_WORDS];
+
 	int64_t established;                         /**< The time this peer connection has been established */
 
 	fastd_timeout_t reset_timeout;     /**< The timeout after which the peer is reset */
@@ -88,6 +109,13 @@ struct fastd_peer {
 
 	fastd_stats_t stats; /**< Traffic statistics */
 
+	fastd_peer_eth_addr_t *eth_addrs; /**< The list of MAC addresses learned on this peer */
+
+	uint8_t deferred; /**< The deferred changes that haven't been handled yet (see fastd_peer_deferred_t) */
+#ifdef USE_WORKER_THREADS
+	pthread_mutex_t lock; /**< Serializes the session state updates of threads handling packets in parallel */
+#endif
+
 #ifdef WITH_DYNAMIC_PEERS
 	fastd_timeout_t verify_timeout; /**< Specifies the minimum time after which on-verify may be run again */
 	fastd_timeout_t
@@ -96,13 +124,6 @@ struct fastd_peer {
 };
 
 
-/** An entry for a MAC address seen at another peer */
-struct fastd_peer_eth_addr {
-	fastd_eth_addr_t addr;   /**< The MAC address */
-	fastd_peer_t *peer;      /**< The corresponding peer */
-	fastd_timeout_t timeout; /**< Timeout after which the address entry will be purged */
-};
-
 /** A remote entry */
 struct fastd_remote {
 	char *hostname;               /**< The hostname or NULL */
@@ -134,8 +155,11 @@ bool fastd_peer_claim_address(
 	fastd_peer_t *peer, fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
 	const fastd_peer_address_t *remote_addr, bool force);
 void fastd_peer_reset_socket(fastd_peer_t *peer);
+void fastd_peer_close_connected_socket(fastd_peer_t *peer);
 void fastd_peer_schedule_handshake(fastd_peer_t *peer, int delay);
 fastd_peer_t *fastd_peer_find_by_id(uint64_t id);
+void fastd_peer_defer(fastd_peer_t *peer, fastd_peer_deferred_t deferred);
+void fastd_peer_handle_deferred(fastd_peer_t *peer);
 
 void fastd_peer_set_shell_env(
 	fastd_shell_env_t *env, const fastd_peer_t *peer, const fastd_peer_address_t *local_addr,
@@ -144,11 +168,7 @@ void fastd_peer_exec_shell_command(
 	const fastd_shell_command_t *command, const fastd_peer_t *peer, const fastd_peer_address_t *local_addr,
 	const fastd_peer_address_t *peer_addr, bool sync);
 
-void fastd_peer_eth_addr_add(fastd_peer_t *peer, fastd_eth_addr_t addr);
-bool fastd_peer_find_by_eth_addr(const fastd_eth_addr_t addr, fastd_peer_t **peer);
-
 void fastd_peer_handle_task(fastd_task_t *task);
-void fastd_peer_eth_addr_cleanup(void);
 void fastd_peer_reset_all(void);
 
 
@@ -186,14 +206,14 @@ static inline void fastd_peer_unschedule_handshake(fastd_peer_t *peer) {
 #ifdef WITH_DYNAMIC_PEERS
 /** Call to signal that there is currently an asychronous on-verify command running for the peer */
 static inline void fastd_peer_set_verifying(fastd_peer_t *peer) {
-	peer->verify_timeout = ctx.now + MIN_VERIFY_INTERVAL;
+	peer->verify_timeout = fastd_now() + MIN_VERIFY_INTERVAL;
 
 	fastd_timeout_advance(&peer->reset_timeout, peer->verify_timeout);
 }
 
 /** Marks the peer verification as successful or failed */
 static inline void fastd_peer_set_verified(fastd_peer_t *peer, bool ok) {
-	peer->verify_valid_timeout = ctx.now + (ok ? VERIFY_VALID_TIME : 0);
+	peer->verify_valid_timeout = fastd_now() + (ok ? VERIFY_VALID_TIME : 0);
 
 	fastd_timeout_advance(&peer->reset_timeout, peer->verify_valid_timeout);
 }
@@ -250,14 +270,41 @@ static inline bool fastd_peer_is_established(const fastd_peer_t *peer) {
 	}
 }
 
+/**
+   Locks the session state of a peer against other threads handling packets
+
+   This is a no-op unless the current thread handles packets in parallel to other threads; the main thread
+   doesn't need to lock peers otherwise, as the worker threads are waiting for it then.
+*/
+static inline void fastd_peer_lock(UNUSED fastd_peer_t *peer) {
+#ifdef USE_WORKER_THREADS
+	if (!fastd_worker_is_shared())
+		return;
+
+	if ((errno = pthread_mutex_lock(&peer->lock)) != 0)
+		exit_errno("pthread_mutex_lock");
+#endif
+}
+
+/** Unlocks the session state of a peer after fastd_peer_lock() */
+static inline void fastd_peer_unlock(UNUSED fastd_peer_t *peer) {
+#ifdef USE_WORKER_THREADS
+	if (!fastd_worker_is_shared())
+		return;
+
+	if ((errno = pthread_mutex_unlock(&peer->lock)) != 0)
+		exit_errno("pthread_mutex_unlock");
+#endif
+}
+
 /** Signals that a valid packet was received from the peer */
 static inline void fastd_peer_seen(fastd_peer_t *peer) {
-	peer->reset_timeout = ctx.now + PEER_STALE_TIME;
+	__atomic_store_n(&peer->reset_timeout, fastd_now() + PEER_STALE_TIME, __ATOMIC_RELAXED);
 }
 
 /** Resets the keepalive timeout */
 static inline void fastd_peer_clear_keepalive(fastd_peer_t *peer) {
-	peer->keepalive_timeout = ctx.now + KEEPALIVE_TIMEOUT;
+	__atomic_store_n(&peer->keepalive_timeout, fastd_now() + KEEPALIVE_TIMEOUT, __ATOMIC_RELAXED);
 }
 
 /** Checks if a peer uses dynamic sockets (which means that each connection attempt uses a new socket) */
@@ -281,16 +328,28 @@ static inline bool fastd_eth_addr_is_unicast(fastd_eth_addr_t addr) {
 	return ((addr.data[0] & 1) == 0);
 }
 
+/** Adds to a statistics counter, atomically when worker threads are used */
+static inline void fastd_counter_add(uint64_t *counter, uint64_t value) {
+#ifdef USE_WORKER_THREADS
+	if (conf.worker_threads) {
+		__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+		return;
+	}
+#endif
+
+	*counter += value;
+}
+
 /** Adds statistics for a single packet of a given size */
 static inline void fastd_stats_add(UNUSED fastd_peer_t *peer, UNUSED fastd_stat_type_t stat, UNUSED size_t bytes) {
 #ifdef WITH_STATUS_SOCKET
 	if (!bytes)
 		return;
 
-	ctx.stats.packets[stat]++;
-	ctx.stats.bytes[stat] += bytes;
+	fastd_counter_add(&ctx.stats.packets[stat], 1);
+	fastd_counter_add(&ctx.stats.bytes[stat], bytes);
 
-	peer->stats.packets[stat]++;
-	peer->stats.bytes[stat] += bytes;
+	fastd_counter_add(&peer->stats.packets[stat], 1);
+	fastd_counter_add(&peer->stats.bytes[stat], bytes);
 #endif
 }
@@ -30,6 +30,7 @@ struct fastd_peer_group {
 	fastd_string_stack_t *peer_dirs; /**< List of peer directories which belong to this group */
 
 	int max_connections;           /**< The maximum number of connections to allow in this group; -1 for no limit */
+	size_t n_established;          /**< The number of established peers in this group and its subgroups */
 	fastd_string_stack_t *methods; /**< The list of configured method names */
 
 	fastd_shell_command_t on_up;   /**< The command to execute after the initialization of the tunnel interface */
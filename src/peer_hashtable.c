@@ -8,55 +8,232 @@
    \file
 
    A hashtable allowing fast lookup from an IP address to a peer
+
+   The hashtable uses open addressing with linear probing; the addresses are stored in the slots
+   in a compact form, so a lookup usually only touches a single cache line. The slots are found
+   using SipHash-1-3 with a random key, so remote hosts can't cause collisions deliberately.
+
+   When the hashtable is grown, the entries aren't moved to the new table at once. Instead, a few
+   slots of the previous table are moved with each insertion or removal, and lookups check both
+   tables until all entries have been moved.
+
+   A second index maps the statically configured remote addresses to the peers owning them.
 */
 
 
 #include "peer_hashtable.h"
 
 
-/** Initializes the hashtable */
-static void init_hashtable(void) {
-	fastd_random_bytes(&ctx.peer_addr_ht_seed, sizeof(ctx.peer_addr_ht_seed), false);
-	ctx.peer_addr_ht = fastd_new0_array(ctx.peer_addr_ht_size, __typeof__(*ctx.peer_addr_ht));
+/** The initial number of slots of the hashtable */
+#define HASHTABLE_INITIAL_SIZE 16
+
+/** The number of slots of the previous table moved with each insertion or removal while the hashtable is resized */
+#define HASHTABLE_MOVE_SLOTS 16
+
+/** The address family marking slots of the previous table whose entry has been moved or removed */
+#define FAMILY_MOVED 0xffff
+
+
+/** The compact form of a peer address used as key of the hashtable */
+typedef union peer_hashtable_key {
+	struct {
+		uint16_t family;   /**< The address family (AF_UNSPEC for empty slots) */
+		uint16_t port;     /**< The port in network byte order */
+		uint32_t scope_id; /**< The scope ID of link-local IPv6 addresses (0 for all other addresses) */
+		uint8_t addr[16];  /**< The IPv4 or IPv6 address */
+	};
+	uint64_t words[3]; /**< The key as a sequence of words, used for hashing and comparisons */
+} peer_hashtable_key_t;
+
+/** A slot of the hashtable */
+struct fastd_peer_hashtable_entry {
+	peer_hashtable_key_t key; /**< The address of the peer */
+	fastd_peer_t *peer;       /**< The peer (NULL for empty slots) */
+};
+
+
+/** Returns the key used for a peer address */
+static inline peer_hashtable_key_t address_key(const fastd_peer_address_t *addr) {
+	peer_hashtable_key_t key = {};
+	key.family = addr->sa.sa_family;
+
+	switch (addr->sa.sa_family) {
+	case AF_INET:
+		key.port = addr->in.sin_port;
+		memcpy(key.addr, &addr->in.sin_addr, sizeof(addr->in.sin_addr));
+		break;
+
+	case AF_INET6:
+		key.port = addr->in6.sin6_port;
+		memcpy(key.addr, &addr->in6.sin6_addr, sizeof(addr->in6.sin6_addr));
+		if (IN6_IS_ADDR_LINKLOCAL(&addr->in6.sin6_addr))
+			key.scope_id = addr->in6.sin6_scope_id;
+		break;
+
+	default:
+		exit_bug("peer hashtable: unknown address family");
+	}
+
+	return key;
 }
 
-/** Initializes the hashtable with the default size */
-void fastd_peer_hashtable_init(void) {
-	ctx.peer_addr_ht_size = 8;
-	init_hashtable();
+/** Returns the hash value of a key */
+static inline uint64_t key_hash(const peer_hashtable_key_t *key) {
+	return fastd_siphash13(ctx.peer_addr_ht_key, key->words, array_size(key->words));
 }
 
-/** Frees the resources used by the hashtable */
-void fastd_peer_hashtable_free(void) {
+/** Checks if two keys are equal */
+static inline bool key_equal(const peer_hashtable_key_t *key1, const peer_hashtable_key_t *key2) {
+	return key1->words[0] == key2->words[0] && key1->words[1] == key2->words[1] &&
+	       key1->words[2] == key2->words[2];
+}
+
+
+/** Finds the slot containing a key in a table, returning NULL if it isn't found */
+static fastd_peer_hashtable_entry_t *
+table_find(fastd_peer_hashtable_entry_t *slots, size_t size, const peer_hashtable_key_t *key, uint64_t hash) {
+	size_t mask = size - 1;
 	size_t i;
-	for (i = 0; i < ctx.peer_addr_ht_size; i++)
-		VECTOR_FREE(ctx.peer_addr_ht[i]);
 
-	free(ctx.peer_addr_ht);
+	for (i = hash & mask; slots[i].key.family != AF_UNSPEC; i = (i + 1) & mask) {
+		if (slots[i].peer && key_equal(&slots[i].key, key))
+			return &slots[i];
+	}
+
+	return NULL;
 }
 
-/** Doubles the size of the peer hashtable and rebuild it afterwards */
-static void resize_hashtable(void) {
-	fastd_peer_hashtable_free();
-	ctx.peer_addr_ht_used = 0;
+/**
+   Finds the slot containing a peer with a key in a table, returning NULL if it isn't found
 
-	ctx.peer_addr_ht_size *= 2;
-	pr_debug("resizing peer address hashtable to %u buckets", (unsigned)ctx.peer_addr_ht_size);
+   Unlike table_find(), this skips the entries of other peers with the same address.
+*/
+static fastd_peer_hashtable_entry_t *table_find_peer(
+	fastd_peer_hashtable_entry_t *slots, size_t size, const peer_hashtable_key_t *key, uint64_t hash,
+	const fastd_peer_t *peer) {
+	size_t mask = size - 1;
+	size_t i;
 
-	init_hashtable();
+	for (i = hash & mask; slots[i].key.family != AF_UNSPEC; i = (i + 1) & mask) {
+		if (slots[i].peer == peer && key_equal(&slots[i].key, key))
+			return &slots[i];
+	}
+
+	return NULL;
+}
 
+/** Adds an entry to the first empty slot for its hash value in a table */
+static void table_insert(
+	fastd_peer_hashtable_entry_t *slots, size_t size, const peer_hashtable_key_t *key, uint64_t hash,
+	fastd_peer_t *peer) {
+	size_t mask = size - 1;
 	size_t i;
-	for (i = 0; i < VECTOR_LEN(ctx.peers); i++)
-		fastd_peer_hashtable_insert(VECTOR_INDEX(ctx.peers, i));
+
+	for (i = hash & mask; slots[i].key.family != AF_UNSPEC; i = (i + 1) & mask) {}
+
+	slots[i] = (fastd_peer_hashtable_entry_t){ .key = *key, .peer = peer };
 }
 
-/** Gets the hash bucket used for an address */
-static size_t peer_address_bucket(const fastd_peer_address_t *addr) {
-	uint32_t hash = ctx.peer_addr_ht_seed;
-	fastd_peer_address_hash(&hash, addr);
-	fastd_hash_final(&hash);
+/**
+   Removes the entry in slot \e i of a table
+
+   The following entries of the same probe sequence are moved back, so lookups never need to skip
+   over removed entries.
+*/
+static void table_delete(fastd_peer_hashtable_entry_t *slots, size_t size, size_t i) {
+	size_t mask = size - 1;
+	size_t j = i;
+
+	while (true) {
+		slots[i] = (fastd_peer_hashtable_entry_t){};
 
-	return hash % ctx.peer_addr_ht_size;
+		size_t home;
+		do {
+			j = (j + 1) & mask;
+			if (slots[j].key.family == AF_UNSPEC)
+				return;
+
+			home = key_hash(&slots[j].key) & mask;
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+		slots[i] = slots[j];
+		i = j;
+	}
+}
+
+
+/** Frees the previous table after all its entries have been moved */
+static void free_old_table(void) {
+	free(ctx.peer_addr_ht_old);
+
+	ctx.peer_addr_ht_old = NULL;
+	ctx.peer_addr_ht_old_size = 0;
+	ctx.peer_addr_ht_old_used = 0;
+	ctx.peer_addr_ht_moved = 0;
+}
+
+/** Moves the entries of up to \e n slots of the previous table to the current one */
+static void move_slots(size_t n) {
+	while (ctx.peer_addr_ht_old && n--) {
+		fastd_peer_hashtable_entry_t *entry = &ctx.peer_addr_ht_old[ctx.peer_addr_ht_moved++];
+
+		if (entry->peer) {
+			table_insert(
+				ctx.peer_addr_ht, ctx.peer_addr_ht_size, &entry->key, key_hash(&entry->key),
+				entry->peer);
+			ctx.peer_addr_ht_used++;
+			ctx.peer_addr_ht_old_used--;
+
+			entry->key.family = FAMILY_MOVED;
+			entry->peer = NULL;
+		}
+
+		if (!ctx.peer_addr_ht_old_used || ctx.peer_addr_ht_moved == ctx.peer_addr_ht_old_size)
+			free_old_table();
+	}
+}
+
+/**
+   Doubles the size of the hashtable
+
+   The entries of the current table are moved to the new one incrementally. A resize that is
+   still in progress is finished first.
+*/
+static void grow_hashtable(void) {
+	move_slots(SIZE_MAX);
+
+	ctx.peer_addr_ht_old = ctx.peer_addr_ht;
+	ctx.peer_addr_ht_old_size = ctx.peer_addr_ht_size;
+	ctx.peer_addr_ht_old_used = ctx.peer_addr_ht_used;
+	ctx.peer_addr_ht_moved = 0;
+
+	ctx.peer_addr_ht_size *= 2;
+	ctx.peer_addr_ht = fastd_new0_array(ctx.peer_addr_ht_size, fastd_peer_hashtable_entry_t);
+	ctx.peer_addr_ht_used = 0;
+
+	pr_debug("resizing peer address hashtable to %u slots", (unsigned)ctx.peer_addr_ht_size);
+}
+
+
+/** Initializes the hashtable */
+void fastd_peer_hashtable_init(void) {
+	fastd_random_bytes(ctx.peer_addr_ht_key, sizeof(ctx.peer_addr_ht_key), false);
+
+	ctx.peer_addr_ht_size = HASHTABLE_INITIAL_SIZE;
+	ctx.peer_addr_ht_used = 0;
+	ctx.peer_addr_ht = fastd_new0_array(ctx.peer_addr_ht_size, fastd_peer_hashtable_entry_t);
+
+	fastd_peer_index_init(&ctx.peer_owners);
+}
+
+/** Frees the resources used by the hashtable */
+void fastd_peer_hashtable_free(void) {
+	free_old_table();
+
+	free(ctx.peer_addr_ht);
+	ctx.peer_addr_ht = NULL;
+
+	fastd_peer_index_free(&ctx.peer_owners);
 }
 
 /**
@@ -68,15 +245,15 @@ void fastd_peer_hashtable_insert(fastd_peer_t *peer) {
 	if (!peer->address.sa.sa_family)
 		return;
 
-	ctx.peer_addr_ht_used++;
+	/* Keep the load factor (including the entries that are still to be moved) below 3/4 */
+	if (4 * (ctx.peer_addr_ht_used + ctx.peer_addr_ht_old_used + 1) > 3 * ctx.peer_addr_ht_size)
+		grow_hashtable();
 
-	if (ctx.peer_addr_ht_used > 2 * ctx.peer_addr_ht_size) {
-		resize_hashtable();
-		return;
-	}
+	peer_hashtable_key_t key = address_key(&peer->address);
+	table_insert(ctx.peer_addr_ht, ctx.peer_addr_ht_size, &key, key_hash(&key), peer);
+	ctx.peer_addr_ht_used++;
 
-	size_t b = peer_address_bucket(&peer->address);
-	VECTOR_ADD(ctx.peer_addr_ht[b], peer);
+	move_slots(HASHTABLE_MOVE_SLOTS);
 }
 
 /**
@@ -88,28 +265,86 @@ void fastd_peer_hashtable_remove(fastd_peer_t *peer) {
 	if (!peer->address.sa.sa_family)
 		return;
 
-	size_t b = peer_address_bucket(&peer->address);
+	peer_hashtable_key_t key = address_key(&peer->address);
+	uint64_t hash = key_hash(&key);
 
-	size_t i;
-	for (i = 0; i < VECTOR_LEN(ctx.peer_addr_ht[b]); i++) {
-		if (VECTOR_INDEX(ctx.peer_addr_ht[b], i) == peer) {
-			VECTOR_DELETE(ctx.peer_addr_ht[b], i);
-			break;
+	fastd_peer_hashtable_entry_t *entry =
+		table_find_peer(ctx.peer_addr_ht, ctx.peer_addr_ht_size, &key, hash, peer);
+	if (entry) {
+		table_delete(ctx.peer_addr_ht, ctx.peer_addr_ht_size, entry - ctx.peer_addr_ht);
+		ctx.peer_addr_ht_used--;
+	} else if (ctx.peer_addr_ht_old) {
+		entry = table_find_peer(ctx.peer_addr_ht_old, ctx.peer_addr_ht_old_size, &key, hash, peer);
+		if (entry) {
+			entry->key.family = FAMILY_MOVED;
+			entry->peer = NULL;
+			ctx.peer_addr_ht_old_used--;
 		}
 	}
 
-	ctx.peer_addr_ht_used--;
+	move_slots(HASHTABLE_MOVE_SLOTS);
 }
 
 /** Looks up a peer in the hashtable */
 fastd_peer_t *fastd_peer_hashtable_lookup(const fastd_peer_address_t *addr) {
-	size_t b = peer_address_bucket(addr);
+	peer_hashtable_key_t key = address_key(addr);
+	uint64_t hash = key_hash(&key);
+
+	fastd_peer_hashtable_entry_t *entry = table_find(ctx.peer_addr_ht, ctx.peer_addr_ht_size, &key, hash);
+	if (!entry && ctx.peer_addr_ht_old)
+		entry = table_find(ctx.peer_addr_ht_old, ctx.peer_addr_ht_old_size, &key, hash);
+
+	return entry ? entry->peer : NULL;
+}
+
+
+/** Returns the hash value of an address in the index of statically configured addresses */
+static inline uint64_t owner_hash(const fastd_peer_address_t *addr) {
+	peer_hashtable_key_t key = address_key(addr);
+	return fastd_peer_index_hash(&ctx.peer_owners, key.words, array_size(key.words));
+}
+
+/** Adds the statically configured remote addresses of a peer to the index of owned addresses */
+void fastd_peer_hashtable_add_owner(fastd_peer_t *peer) {
+	if (fastd_peer_is_floating(peer))
+		return;
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(peer->remotes); i++) {
+		const fastd_remote_t *remote = &VECTOR_INDEX(peer->remotes, i);
+
+		if (!remote->hostname)
+			fastd_peer_index_insert(&ctx.peer_owners, owner_hash(&remote->address), peer);
+	}
+}
+
+/** Removes the statically configured remote addresses of a peer from the index of owned addresses */
+void fastd_peer_hashtable_remove_owner(fastd_peer_t *peer) {
+	if (fastd_peer_is_floating(peer))
+		return;
 
 	size_t i;
-	for (i = 0; i < VECTOR_LEN(ctx.peer_addr_ht[b]); i++) {
-		fastd_peer_t *peer = VECTOR_INDEX(ctx.peer_addr_ht[b], i);
+	for (i = 0; i < VECTOR_LEN(peer->remotes); i++) {
+		const fastd_remote_t *remote = &VECTOR_INDEX(peer->remotes, i);
+
+		if (!remote->hostname)
+			fastd_peer_index_remove(&ctx.peer_owners, owner_hash(&remote->address), peer);
+	}
+}
+
+/**
+   Looks up an enabled peer that has statically configured an address
+
+   The peer \e except is ignored. This is the same as checking fastd_peer_owns_address() for all
+   other enabled peers.
+*/
+fastd_peer_t *fastd_peer_hashtable_lookup_owner(const fastd_peer_address_t *addr, const fastd_peer_t *except) {
+	uint64_t hash = owner_hash(addr);
+	size_t pos = 0;
+	fastd_peer_t *peer;
 
-		if (fastd_peer_address_equal(&peer->address, addr))
+	while ((peer = fastd_peer_index_next(&ctx.peer_owners, hash, &pos))) {
+		if (peer != except && fastd_peer_is_enabled(peer) && fastd_peer_owns_address(peer, addr))
 			return peer;
 	}
 
@@ -45,3 +45,7 @@ void fastd_peer_hashtable_free(void);
 void fastd_peer_hashtable_insert(fastd_peer_t *peer);
 void fastd_peer_hashtable_remove(fastd_peer_t *peer);
 fastd_peer_t *fastd_peer_hashtable_lookup(const fastd_peer_address_t *addr);
+
+void fastd_peer_hashtable_add_owner(fastd_peer_t *peer);
+void fastd_peer_hashtable_remove_owner(fastd_peer_t *peer);
+fastd_peer_t *fastd_peer_hashtable_lookup_owner(const fastd_peer_address_t *addr, const fastd_peer_t *except);
@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Indexes allowing to find peers by a hash value of arbitrary keys
+
+   The indexes use open addressing with linear probing. As the hash value of each peer is stored
+   in its slot, the index can be resized and entries can be removed without access to the keys.
+*/
+
+
+#include "peer_index.h"
+#include "fastd.h"
+#include "hash.h"
+
+
+/** The number of slots allocated when the first peer is inserted into an index */
+#define PEER_INDEX_INITIAL_SIZE 16
+
+
+/** Adds an entry to the first empty slot for its hash value */
+static void index_add(fastd_peer_index_entry_t *slots, size_t size, uint64_t hash, fastd_peer_t *peer) {
+	size_t mask = size - 1;
+	size_t i;
+
+	for (i = hash & mask; slots[i].peer; i = (i + 1) & mask) {}
+
+	slots[i] = (fastd_peer_index_entry_t){ .hash = hash, .peer = peer };
+}
+
+/** Resizes the slot array of an index, keeping its entries */
+static void index_resize(fastd_peer_index_t *index, size_t size) {
+	fastd_peer_index_entry_t *slots = fastd_new0_array(size, fastd_peer_index_entry_t);
+
+	size_t i;
+	for (i = 0; i < index->size; i++) {
+		if (index->slots[i].peer)
+			index_add(slots, size, index->slots[i].hash, index->slots[i].peer);
+	}
+
+	free(index->slots);
+	index->slots = slots;
+	index->size = size;
+}
+
+
+/** Initializes an empty index with a random hash key */
+void fastd_peer_index_init(fastd_peer_index_t *index) {
+	*index = (fastd_peer_index_t){};
+	fastd_random_bytes(index->key, sizeof(index->key), false);
+}
+
+/** Frees the slots of an index */
+void fastd_peer_index_free(fastd_peer_index_t *index) {
+	free(index->slots);
+
+	index->slots = NULL;
+	index->size = 0;
+	index->used = 0;
+}
+
+/** Computes the hash value of a key consisting of \e n 64bit words for an index */
+uint64_t fastd_peer_index_hash(const fastd_peer_index_t *index, const uint64_t *data, size_t n) {
+	return fastd_siphash13(index->key, data, n);
+}
+
+/** Inserts a peer with a hash value into an index */
+void fastd_peer_index_insert(fastd_peer_index_t *index, uint64_t hash, fastd_peer_t *peer) {
+	if (4 * (index->used + 1) > 3 * index->size)
+		index_resize(index, index->size ? 2 * index->size : PEER_INDEX_INITIAL_SIZE);
+
+	index_add(index->slots, index->size, hash, peer);
+	index->used++;
+}
+
+/**
+   Removes a peer that has been inserted with a hash value from an index
+
+   The following entries of the same probe sequence are moved back, so lookups never need to skip
+   over removed entries. The slots are freed when the last peer is removed.
+*/
+void fastd_peer_index_remove(fastd_peer_index_t *index, uint64_t hash, const fastd_peer_t *peer) {
+	if (!index->slots)
+		return;
+
+	size_t mask = index->size - 1;
+	size_t i;
+
+	for (i = hash & mask; index->slots[i].hash != hash || index->slots[i].peer != peer; i = (i + 1) & mask) {
+		if (!index->slots[i].peer)
+			return;
+	}
+
+	if (!--index->used) {
+		fastd_peer_index_free(index);
+		return;
+	}
+
+	size_t j = i;
+
+	while (true) {
+		index->slots[i] = (fastd_peer_index_entry_t){};
+
+		size_t home;
+		do {
+			j = (j + 1) & mask;
+			if (!index->slots[j].peer)
+				return;
+
+			home = index->slots[j].hash & mask;
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+		index->slots[i] = index->slots[j];
+		i = j;
+	}
+}
+
+/**
+   Returns the next peer that has been inserted into an index with a hash value
+
+   \e pos must be set to 0 before the first call for a hash value. NULL is returned when there are
+   no more peers with the hash value.
+*/
+fastd_peer_t *fastd_peer_index_next(const fastd_peer_index_t *index, uint64_t hash, size_t *pos) {
+	if (!index->slots)
+		return NULL;
+
+	size_t mask = index->size - 1;
+
+	while (true) {
+		const fastd_peer_index_entry_t *entry = &index->slots[(hash + *pos) & mask];
+		if (!entry->peer)
+			return NULL;
+
+		(*pos)++;
+
+		if (entry->hash == hash)
+			return entry->peer;
+	}
+}
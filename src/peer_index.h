@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Indexes allowing to find peers by a hash value of arbitrary keys
+*/
+
+
+#pragma once
+
+#include "types.h"
+
+
+/** A slot of a peer index */
+typedef struct fastd_peer_index_entry {
+	uint64_t hash;      /**< The hash value the peer has been inserted with */
+	fastd_peer_t *peer; /**< The peer (NULL for empty slots) */
+} fastd_peer_index_entry_t;
+
+/**
+   An index of peers by a hash value
+
+   The index doesn't know about the keys the hash values have been computed from, so multiple peers
+   may be found for a hash value; the callers must check the keys of the peers they get.
+*/
+typedef struct fastd_peer_index {
+	uint64_t key[2];                 /**< The SipHash key used to compute hash values for the index */
+	fastd_peer_index_entry_t *slots; /**< The slots (NULL while the index is empty) */
+	size_t size;                     /**< The number of slots (a power of two) */
+	size_t used;                     /**< The number of used slots */
+} fastd_peer_index_t;
+
+
+void fastd_peer_index_init(fastd_peer_index_t *index);
+void fastd_peer_index_free(fastd_peer_index_t *index);
+
+uint64_t fastd_peer_index_hash(const fastd_peer_index_t *index, const uint64_t *data, size_t n);
+
+void fastd_peer_index_insert(fastd_peer_index_t *index, uint64_t hash, fastd_peer_t *peer);
+void fastd_peer_index_remove(fastd_peer_index_t *index, uint64_t hash, const fastd_peer_t *peer);
+fastd_peer_t *fastd_peer_index_next(const fastd_peer_index_t *index, uint64_t hash, size_t *pos);
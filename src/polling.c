@@ -13,12 +13,18 @@
 
 #include "polling.h"
 #include "async.h"
+#include "offload.h"
 #include "peer.h"
+#include "worker.h"
 
 #include <signal.h>
 
 
-#ifdef USE_EPOLL
+#if defined(USE_IO_URING)
+
+#include <liburing.h>
+
+#elif defined(USE_EPOLL)
 
 #include <sys/epoll.h>
 #include <sys/syscall.h>
@@ -38,7 +44,7 @@ static inline int task_timeout(void) {
 	if (timeout == FASTD_TIMEOUT_INV)
 		return -1;
 
-	int diff_msec = timeout - ctx.now;
+	int diff_msec = timeout - fastd_now();
 	if (diff_msec < 0)
 		return 0;
 	else
@@ -72,7 +78,9 @@ static inline void handle_fd(fastd_poll_fd_t *fd, bool input, bool error) {
 		fastd_socket_t *sock = container_of(fd, fastd_socket_t, fd);
 
 		if (error) {
-			if (sock->peer)
+			if (sock->connected)
+				fastd_peer_close_connected_socket(sock->peer);
+			else if (sock->peer)
 				fastd_peer_reset_socket(sock->peer);
 			else
 				fastd_socket_error(sock);
@@ -81,7 +89,7 @@ static inline void handle_fd(fastd_poll_fd_t *fd, bool input, bool error) {
 		}
 
 		if (input)
-			fastd_receive(sock);
+			fastd_receive(sock, conf.receive_batch);
 
 		break;
 	}
@@ -95,7 +103,453 @@ static inline void handle_fd(fastd_poll_fd_t *fd, bool input, bool error) {
 }
 
 
-#ifdef USE_EPOLL
+/**
+   Returns the number of packets that may be read from a readable file descriptor
+
+   Only the main TUN/TAP interface (and its additional queues) and the sockets bound to the
+   configured addresses are drained. Peer-specific interfaces, dynamic and connected peer sockets
+   may be closed while a packet is handled, so they are still read from once per event.
+*/
+size_t fastd_poll_drain_budget(const fastd_poll_fd_t *fd) {
+	switch (fd->type) {
+	case POLL_TYPE_IFACE:
+		return ctx.iface ? conf.iface_drain_budget : 0;
+
+	case POLL_TYPE_SOCKET:
+		return container_of(fd, const fastd_socket_t, fd)->peer ? 0 : conf.socket_drain_budget;
+
+	default:
+		return 0;
+	}
+}
+
+/** Reads up to \e max packets from a file descriptor, returning the number of packets that have been read */
+static size_t drain_fd(fastd_poll_fd_t *fd, size_t max) {
+	if (fd->type == POLL_TYPE_IFACE)
+		return fastd_iface_handle_queue(ctx.iface, fd->fd, max);
+	else
+		return fastd_receive(container_of(fd, fastd_socket_t, fd), max);
+}
+
+/**
+   Reads from a set of readable file descriptors until each of them is drained or has used up its budget
+
+   The file descriptors are served in round-robin order, reading at most conf.receive_batch packets
+   from each of them per round, so a single busy socket or interface can't starve the others. When
+   the budget of a file descriptor is used up before it has been drained, the remaining packets are
+   left for the next event, giving timers and other file descriptors a chance to run.
+*/
+void fastd_poll_drain(fastd_poll_drain_t *entries, size_t n) {
+	bool pending;
+
+	do {
+		pending = false;
+
+		size_t i;
+		for (i = 0; i < n; i++) {
+			fastd_poll_drain_t *entry = &entries[i];
+			if (!entry->budget)
+				continue;
+
+			size_t quantum = min_size_t(entry->budget, conf.receive_batch);
+			if (drain_fd(entry->fd, quantum) < quantum) {
+				entry->budget = 0;
+				continue;
+			}
+
+			entry->budget -= quantum;
+
+			if (entry->budget) {
+				pending = true;
+			} else {
+#ifdef WITH_STATUS_SOCKET
+				entry->fd->budget_exhausted++;
+#endif
+			}
+		}
+	} while (pending);
+}
+
+
+#if defined(USE_IO_URING)
+
+
+/** The buffer group the receive buffers are provided in */
+#define URING_BUFFER_GROUP 0
+
+/** The space reserved for the source address in front of each received datagram */
+#define URING_RECV_NAME_SIZE 32
+
+/** The mask of the bits of the user data of a request that specify its kind */
+#define URING_OP_MASK 3
+
+
+/** The kinds of requests submitted to io_uring */
+typedef enum uring_op {
+	URING_OP_POLL = 0, /**< A multishot poll on a file descriptor */
+	URING_OP_RECV = 1, /**< A multishot receive on a socket */
+	URING_OP_SEND = 2, /**< A message sent on a socket */
+} uring_op_t;
+
+/** A file descriptor registered with the poll interface */
+typedef struct uring_fd {
+	fastd_poll_fd_t *fd; /**< The registered file descriptor (NULL if there is none) */
+	uint32_t gen;        /**< Distinguishes the requests of different registrations of the same file descriptor */
+	bool armed;          /**< Set if a request has been submitted for the file descriptor */
+} uring_fd_t;
+
+
+/** The io_uring instance */
+static struct io_uring ring;
+
+/** The registered file descriptors, indexed by the file descriptors themselves */
+static VECTOR(uring_fd_t) uring_fds = {};
+
+/** The generation of the next registered file descriptor */
+static uint32_t next_gen = 0;
+
+/** The buffers provided to the kernel for receiving datagrams (NULL until the buffer pool has been initialized) */
+static struct io_uring_buf_ring *recv_ring = NULL;
+
+/** The buffers in recv_ring, indexed by their buffer IDs */
+static fastd_buffer_t *recv_buffers[IO_URING_RECV_BUFFERS];
+
+/** The layout of the received messages */
+static struct msghdr recv_msghdr = {
+	.msg_namelen = URING_RECV_NAME_SIZE,
+	.msg_controllen = FASTD_POLL_RECV_HEADROOM - sizeof(struct io_uring_recvmsg_out) - URING_RECV_NAME_SIZE,
+};
+
+/** The number of messages that have been submitted, but not completed yet */
+static size_t sends_pending = 0;
+
+
+/** Returns the user data of a request for a registered file descriptor */
+static inline uint64_t fd_user_data(int fd, uint32_t gen, uring_op_t op) {
+	return ((uint64_t)gen << 32) | ((uint64_t)fd << 2) | op;
+}
+
+/** Returns a submission queue entry, submitting the queued entries if there are no free ones */
+static struct io_uring_sqe *get_sqe(void) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+	if (sqe)
+		return sqe;
+
+	int ret = io_uring_submit(&ring);
+	if (ret < 0) {
+		errno = -ret;
+		exit_errno("io_uring_submit");
+	}
+
+	sqe = io_uring_get_sqe(&ring);
+	if (!sqe)
+		exit_bug("io_uring_get_sqe");
+
+	return sqe;
+}
+
+/** Determines if datagrams are received on a file descriptor directly, rather than waiting for it to become readable */
+static inline bool use_recv(const fastd_poll_fd_t *fd) {
+	if (fd->type != POLL_TYPE_SOCKET)
+		return false;
+
+	/* Datagrams coalesced by UDP GRO may be much larger than the receive buffers */
+	return !container_of(fd, fastd_socket_t, fd)->udp_gro;
+}
+
+/** Submits the multishot request of a registered file descriptor */
+static void arm_fd(int fd) {
+	uring_fd_t *entry = &VECTOR_INDEX(uring_fds, fd);
+	bool recv = use_recv(entry->fd);
+
+	/* Receives are armed as soon as the receive buffers are available */
+	if (recv && !recv_ring)
+		return;
+
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (recv) {
+		io_uring_prep_recvmsg_multishot(sqe, fd, &recv_msghdr, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUFFER_GROUP;
+	} else {
+		io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+	}
+
+	io_uring_sqe_set_data64(sqe, fd_user_data(fd, entry->gen, recv ? URING_OP_RECV : URING_OP_POLL));
+	entry->armed = true;
+}
+
+/** Allocates a buffer from the buffer pool and provides it to the kernel */
+static void provide_recv_buffer(uint16_t bid) {
+	fastd_buffer_t *buffer =
+		fastd_buffer_alloc(fastd_receive_buffer_size(), conf.decrypt_headroom + FASTD_POLL_RECV_HEADROOM);
+	recv_buffers[bid] = buffer;
+
+	/* The kernel writes the message header, source address and ancillary data in front of the datagram */
+	io_uring_buf_ring_add(
+		recv_ring, (uint8_t *)buffer->data - FASTD_POLL_RECV_HEADROOM, FASTD_POLL_RECV_HEADROOM + buffer->len,
+		bid, io_uring_buf_ring_mask(IO_URING_RECV_BUFFERS), 0);
+	io_uring_buf_ring_advance(recv_ring, 1);
+}
+
+/** Sets up the receive buffers and arms the receives of all registered sockets */
+static void init_recv_buffers(void) {
+	int ret;
+	recv_ring = io_uring_setup_buf_ring(&ring, IO_URING_RECV_BUFFERS, URING_BUFFER_GROUP, 0, &ret);
+	if (!recv_ring) {
+		errno = -ret;
+		exit_errno("io_uring_setup_buf_ring");
+	}
+
+	size_t i;
+	for (i = 0; i < IO_URING_RECV_BUFFERS; i++)
+		provide_recv_buffer(i);
+
+	for (i = 0; i < VECTOR_LEN(uring_fds); i++) {
+		const uring_fd_t *entry = &VECTOR_INDEX(uring_fds, i);
+		if (entry->fd && !entry->armed)
+			arm_fd(i);
+	}
+}
+
+/**
+   Returns the registered file descriptor a completion belongs to
+
+   Returns NULL if the file descriptor has been closed since the request was submitted.
+*/
+static uring_fd_t *get_fd_entry(uint64_t user_data) {
+	size_t fd = (user_data & 0xffffffff) >> 2;
+	uint32_t gen = user_data >> 32;
+
+	if (fd >= VECTOR_LEN(uring_fds))
+		return NULL;
+
+	uring_fd_t *entry = &VECTOR_INDEX(uring_fds, fd);
+	if (!entry->fd || entry->gen != gen)
+		return NULL;
+
+	return entry;
+}
+
+/** Handles a datagram received into one of the provided buffers */
+static void handle_recv_buffer(fastd_poll_fd_t *fd, uint16_t bid, int len) {
+	fastd_buffer_t *buffer = recv_buffers[bid];
+	provide_recv_buffer(bid);
+
+	struct io_uring_recvmsg_out *out =
+		io_uring_recvmsg_validate((uint8_t *)buffer->data - FASTD_POLL_RECV_HEADROOM, len, &recv_msghdr);
+	if (!fd || !out) {
+		fastd_buffer_free(buffer);
+		return;
+	}
+
+	fastd_peer_address_t recvaddr = {};
+	memcpy(&recvaddr, io_uring_recvmsg_name(out), min_size_t(out->namelen, sizeof(recvaddr)));
+
+	struct msghdr message = {
+		.msg_control = (uint8_t *)io_uring_recvmsg_name(out) + recv_msghdr.msg_namelen,
+		.msg_controllen = out->controllen,
+	};
+
+	buffer->len = io_uring_recvmsg_payload_length(out, len, &recv_msghdr);
+
+	fastd_receive_datagram(container_of(fd, fastd_socket_t, fd), &message, &recvaddr, buffer);
+}
+
+/** Handles the completion of a poll or receive request */
+static void handle_fd_cqe(uint64_t user_data, int res, uint32_t flags, bool drop) {
+	uring_fd_t *entry = drop ? NULL : get_fd_entry(user_data);
+	fastd_poll_fd_t *fd = entry ? entry->fd : NULL;
+	int fd_num = fd ? fd->fd : -1;
+
+	if ((user_data & URING_OP_MASK) == URING_OP_RECV) {
+		if (flags & IORING_CQE_F_BUFFER) {
+			if (recv_ring)
+				handle_recv_buffer(fd, flags >> IORING_CQE_BUFFER_SHIFT, res);
+		} else if (fd && res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+			errno = -res;
+			pr_debug_errno("recvmsg");
+			handle_fd(fd, false, true);
+		}
+	} else if (fd) {
+		fastd_poll_drain_t drain = { fd, res >= 0 ? fastd_poll_drain_budget(fd) : 0 };
+
+		if (drain.budget && (res & (POLLIN | POLLERR | POLLHUP | POLLNVAL)) == POLLIN)
+			fastd_poll_drain(&drain, 1);
+		else if (res >= 0)
+			handle_fd(fd, res & POLLIN, res & (POLLERR | POLLHUP | POLLNVAL));
+		else if (res != -ECANCELED)
+			handle_fd(fd, false, true);
+	}
+
+	if (flags & IORING_CQE_F_MORE)
+		return;
+
+	/* The request has terminated; resubmit it if the file descriptor hasn't been closed while it was handled */
+	if (fd_num >= 0 && (entry = get_fd_entry(user_data))) {
+		entry->armed = false;
+		arm_fd(fd_num);
+	}
+}
+
+/**
+   Handles the completions that are currently available
+
+   When \e drop is set, received datagrams are dropped and no events are handled.
+*/
+static void handle_cqes(bool drop) {
+	unsigned n = io_uring_cq_ready(&ring);
+
+	while (n--) {
+		struct io_uring_cqe *cqe;
+		if (io_uring_peek_cqe(&ring, &cqe) < 0)
+			break;
+
+		uint64_t user_data = io_uring_cqe_get_data64(cqe);
+		int res = cqe->res;
+		uint32_t flags = cqe->flags;
+
+		io_uring_cqe_seen(&ring, cqe);
+
+		if ((user_data & URING_OP_MASK) == URING_OP_SEND) {
+			sends_pending--;
+			fastd_send_complete((void *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK), res);
+		} else {
+			handle_fd_cqe(user_data, res, flags, drop);
+		}
+	}
+}
+
+
+void fastd_poll_init(void) {
+	int ret = io_uring_queue_init(IO_URING_ENTRIES, &ring, 0);
+	if (ret < 0) {
+		errno = -ret;
+		exit_errno("io_uring_queue_init");
+	}
+}
+
+void fastd_poll_free(void) {
+	io_uring_queue_exit(&ring);
+	VECTOR_FREE(uring_fds);
+}
+
+void fastd_poll_free_buffers(void) {
+	/* Wait for the messages that are still being sent, as they hold buffers as well */
+	while (sends_pending) {
+		int ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret < 0 && ret != -EINTR) {
+			errno = -ret;
+			exit_errno("io_uring_submit_and_wait");
+		}
+
+		handle_cqes(true);
+	}
+
+	if (!recv_ring)
+		return;
+
+	io_uring_free_buf_ring(&ring, recv_ring, IO_URING_RECV_BUFFERS, URING_BUFFER_GROUP);
+	recv_ring = NULL;
+
+	size_t i;
+	for (i = 0; i < IO_URING_RECV_BUFFERS; i++)
+		fastd_buffer_free(recv_buffers[i]);
+}
+
+
+void fastd_poll_fd_register(fastd_poll_fd_t *fd) {
+	if (fd->fd < 0)
+		exit_bug("fastd_poll_fd_register: invalid FD");
+
+	while (VECTOR_LEN(uring_fds) <= (size_t)fd->fd)
+		VECTOR_ADD(uring_fds, (uring_fd_t){});
+
+	VECTOR_INDEX(uring_fds, fd->fd) = (uring_fd_t){ .fd = fd, .gen = next_gen++ };
+	arm_fd(fd->fd);
+}
+
+bool fastd_poll_fd_close(fastd_poll_fd_t *fd) {
+	if (fd->fd < 0 || (size_t)fd->fd >= VECTOR_LEN(uring_fds))
+		exit_bug("fastd_poll_fd_close: invalid FD");
+
+	uring_fd_t *entry = &VECTOR_INDEX(uring_fds, fd->fd);
+
+	if (entry->armed) {
+		/* Submit all pending requests, so none of them can refer to the FD after it has been closed
+		   and reused */
+		int ret = io_uring_submit(&ring);
+		if (ret < 0) {
+			errno = -ret;
+			exit_errno("io_uring_submit");
+		}
+
+		struct io_uring_sync_cancel_reg reg = {
+			.fd = fd->fd,
+			.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL,
+			.timeout = { .tv_sec = -1, .tv_nsec = -1 },
+		};
+
+		ret = io_uring_register_sync_cancel(&ring, &reg);
+		if (ret < 0 && ret != -ENOENT) {
+			errno = -ret;
+			exit_errno("io_uring_register_sync_cancel");
+		}
+	}
+
+	*entry = (uring_fd_t){};
+
+	return (close(fd->fd) == 0);
+}
+
+void fastd_poll_send(int fd, struct msghdr *msg, void *request) {
+	struct io_uring_sqe *sqe = get_sqe();
+
+	io_uring_prep_sendmsg(sqe, fd, msg, 0);
+	io_uring_sqe_set_data64(sqe, (uintptr_t)request | URING_OP_SEND);
+
+	sends_pending++;
+}
+
+
+/**
+   Submits all queued requests and waits for completions
+
+   The queued messages are sent with the same system call that waits for new events.
+*/
+void fastd_poll_handle(void) {
+	if (!recv_ring)
+		init_recv_buffers();
+
+	int timeout = task_timeout();
+
+	struct __kernel_timespec ts, *tsp = NULL;
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		tsp = &ts;
+	}
+
+	sigset_t set;
+	sigemptyset(&set);
+
+	struct io_uring_cqe *cqe;
+
+	fastd_worker_poll_begin();
+	int ret = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, tsp, &set);
+	fastd_worker_poll_end();
+	if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+		errno = -ret;
+		exit_errno("io_uring_submit_and_wait_timeout");
+	}
+
+	fastd_update_time();
+
+	handle_cqes(false);
+}
+
+#elif defined(USE_EPOLL)
 
 
 #ifndef SYS_epoll_pwait
@@ -146,7 +600,10 @@ void fastd_poll_handle(void) {
 	int timeout = task_timeout();
 
 	struct epoll_event events[16];
+
+	fastd_worker_poll_begin();
 	int ret = epoll_wait_unblocked(ctx.epoll_fd, events, 16, timeout);
+	fastd_worker_poll_end();
 	if (ret < 0 && errno != EINTR)
 		exit_errno("epoll_pwait");
 
@@ -155,20 +612,51 @@ void fastd_poll_handle(void) {
 	if (ret < 0)
 		return;
 
-	size_t i;
-	for (i = 0; i < (size_t)ret; i++)
-		handle_fd(events[i].data.ptr, events[i].events & EPOLLIN, events[i].events & (EPOLLERR | EPOLLHUP));
+	fastd_poll_drain_t drain[16];
+	size_t i, n_drain = 0;
+
+	for (i = 0; i < (size_t)ret; i++) {
+		fastd_poll_fd_t *fd = events[i].data.ptr;
+		size_t budget = fastd_poll_drain_budget(fd);
+
+		if (budget && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) == EPOLLIN)
+			drain[n_drain++] = (fastd_poll_drain_t){ fd, budget };
+		else
+			handle_fd(fd, events[i].events & EPOLLIN, events[i].events & (EPOLLERR | EPOLLHUP));
+	}
+
+	if (!n_drain)
+		return;
+
+	/* The main thread handles the packets of the drained file descriptors in parallel to the worker threads */
+	fastd_worker_data_begin();
+
+	fastd_poll_drain(drain, n_drain);
+
+	fastd_offload_flush();
+	fastd_send_flush();
+
+	fastd_worker_data_end();
 }
 
+void fastd_poll_free_buffers(void) {}
+
 #else
 
+/** The readable file descriptors to drain after poll() has returned */
+static VECTOR(fastd_poll_drain_t) drain = {};
+
+
 void fastd_poll_init(void) {}
 
 void fastd_poll_free(void) {
 	VECTOR_FREE(ctx.fds);
 	VECTOR_FREE(ctx.pollfds);
+	VECTOR_FREE(drain);
 }
 
+void fastd_poll_free_buffers(void) {}
+
 
 void fastd_poll_fd_register(fastd_poll_fd_t *fd) {
 	if (fd->fd < 0)
@@ -282,16 +770,24 @@ void fastd_poll_handle(void) {
 	if (ret <= 0)
 		return;
 
+	VECTOR_RESIZE(drain, 0);
+
 	for (i = 0; i < VECTOR_LEN(ctx.pollfds) && ret > 0; i++) {
 		struct pollfd *pollfd = &VECTOR_INDEX(ctx.pollfds, i);
 
 		if (pollfd->revents)
 			ret--;
 
-		handle_fd(
-			VECTOR_INDEX(ctx.fds, pollfd->fd), pollfd->revents & POLLIN,
-			pollfd->revents & (POLLERR | POLLHUP | POLLNVAL));
+		fastd_poll_fd_t *fd = VECTOR_INDEX(ctx.fds, pollfd->fd);
+		size_t budget = fd ? fastd_poll_drain_budget(fd) : 0;
+
+		if (budget && (pollfd->revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL)) == POLLIN)
+			VECTOR_ADD(drain, ((fastd_poll_drain_t){ fd, budget }));
+		else
+			handle_fd(fd, pollfd->revents & POLLIN, pollfd->revents & (POLLERR | POLLHUP | POLLNVAL));
 	}
+
+	fastd_poll_drain(VECTOR_DATA(drain), VECTOR_LEN(drain));
 }
 
 #endif
@@ -21,8 +21,18 @@
 struct fastd_poll_fd {
 	fastd_poll_type_t type; /**< What the file descriptor is used for */
 	int fd;                 /**< The file descriptor itself */
+
+#ifdef WITH_STATUS_SOCKET
+	uint64_t budget_exhausted; /**< The number of times the drain budget was used up before the FD was drained */
+#endif
 };
 
+/** A readable file descriptor to drain */
+typedef struct fastd_poll_drain {
+	fastd_poll_fd_t *fd; /**< The file descriptor */
+	size_t budget;       /**< The number of packets that may still be read from it */
+} fastd_poll_drain_t;
+
 
 /** Initializes the poll interface */
 void fastd_poll_init(void);
@@ -30,7 +40,7 @@ void fastd_poll_init(void);
 void fastd_poll_free(void);
 
 /** Returns a fastd_poll_fd_t structure */
-#define FASTD_POLL_FD(type, fd) ((fastd_poll_fd_t){ type, fd })
+#define FASTD_POLL_FD(type_, fd_) ((fastd_poll_fd_t){ .type = (type_), .fd = (fd_) })
 
 /** Registers a new file descriptor to poll on */
 void fastd_poll_fd_register(fastd_poll_fd_t *fd);
@@ -39,3 +49,32 @@ bool fastd_poll_fd_close(fastd_poll_fd_t *fd);
 
 /** Waits for the next input event */
 void fastd_poll_handle(void);
+
+/** Returns the number of packets that may be read from a readable FD, or 0 if it is handled by a single read */
+size_t fastd_poll_drain_budget(const fastd_poll_fd_t *fd);
+/** Reads from a set of readable FDs in turn until each of them is drained or has used up its budget */
+void fastd_poll_drain(fastd_poll_drain_t *entries, size_t n);
+
+/** Returns the buffers held by the poll interface to the buffer pool */
+void fastd_poll_free_buffers(void);
+
+
+#ifdef USE_IO_URING
+
+/**
+   The space in front of the data of each io_uring receive buffer
+
+   It holds the io_uring_recvmsg_out header, the source address and the ancillary data of the datagram.
+*/
+#define FASTD_POLL_RECV_HEADROOM 144
+
+struct msghdr;
+
+/**
+   Submits a message to be sent with the next wait for events
+
+   fastd_send_complete() is called with \e request when the message has been sent.
+*/
+void fastd_poll_send(int fd, struct msghdr *msg, void *request);
+
+#endif
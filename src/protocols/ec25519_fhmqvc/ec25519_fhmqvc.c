@@ -26,11 +26,20 @@ static inline bool read_key(uint8_t key[32], const char *hexkey) {
 	return true;
 }
 
-/** Checks if the current session with a peers needs refreshing */
+/**
+   Checks if the current session with a peers needs refreshing
+
+   Worker threads hand the refresh to the main thread.
+*/
 static inline void check_session_refresh(fastd_peer_t *peer) {
 	protocol_session_t *session = &peer->protocol_state->session;
 
 	if (!session->refreshing && session->method->provider->session_want_refresh(session->method_state)) {
+		if (fastd_worker_is_shared()) {
+			fastd_peer_defer(peer, PEER_DEFERRED_PROTOCOL);
+			return;
+		}
+
 		pr_verbose("refreshing session with %P", peer);
 		session->handshakes_cleaned = true;
 		session->refreshing = true;
@@ -60,7 +69,7 @@ static fastd_protocol_config_t *protocol_init(void) {
 
 /** Parses a peer's key */
 static fastd_protocol_key_t *protocol_read_key(const char *key) {
-	fastd_protocol_key_t *ret = fastd_new(fastd_protocol_key_t);
+	fastd_protocol_key_t *ret = fastd_new0(fastd_protocol_key_t);
 
 	if (read_key(ret->key.u8, key)) {
 		if (ecc_25519_load_packed_legacy(&ret->unpacked, &ret->key.int256)) {
@@ -84,11 +93,20 @@ static bool protocol_check_peer(const fastd_peer_t *peer) {
 	return true;
 }
 
-/** Checks if the current session with a peer is valid and resets the connection if not */
+/**
+   Checks if the current session with a peer is valid and resets the connection if not
+
+   Worker threads hand the reset to the main thread.
+*/
 static inline bool check_session(fastd_peer_t *peer) {
 	if (is_session_valid(&peer->protocol_state->session))
 		return true;
 
+	if (fastd_worker_is_shared()) {
+		fastd_peer_defer(peer, PEER_DEFERRED_PROTOCOL);
+		return false;
+	}
+
 	pr_verbose("active session with %P timed out", peer);
 	fastd_peer_reset(peer);
 	return false;
@@ -105,93 +123,215 @@ static inline bool use_old_session(const fastd_protocol_peer_state_t *state) {
 	return true;
 }
 
+/**
+   Encrypts or decrypts a packet
+
+   If crypto threads are configured, the job is queued and handed back to
+   fastd_protocol_ec25519_fhmqvc_crypto_complete() later; otherwise, it is processed immediately.
+*/
+static void run_job(fastd_peer_t *peer, fastd_crypto_job_t *job) {
+	fastd_crypto_queue_t *queue = peer->protocol_state->crypto_queue;
+
+	job->now = fastd_now();
+
+	if (!queue) {
+		fastd_peer_lock(peer);
+		fastd_crypto_job_run(job);
+		fastd_peer_unlock(peer);
+
+		fastd_protocol_ec25519_fhmqvc_crypto_complete(peer, job);
+		return;
+	}
+
+	if (!fastd_crypto_queue_submit(queue, job)) {
+		pr_debug2("crypto queue of %P is full, dropping packet", peer);
+
+		if (job->encrypt)
+			fastd_stats_add(peer, STAT_TX_DROPPED, job->stat_size);
+
+		fastd_buffer_free(job->buffer);
+	}
+}
+
 /** Handles a payload packet received from a peer */
 static void protocol_handle_recv(fastd_peer_t *peer, fastd_buffer_t *buffer) {
-	if (!peer->protocol_state || !check_session(peer))
-		goto fail;
-
-	fastd_buffer_t *recv_buffer = NULL;
-	bool reordered = false;
+	if (!peer->protocol_state || !check_session(peer)) {
+		fastd_buffer_free(buffer);
+		return;
+	}
 
 	fastd_buffer_zero_pad(buffer);
 
-	if (is_session_valid(&peer->protocol_state->old_session))
-		recv_buffer = peer->protocol_state->old_session.method->provider->decrypt(
-			peer->protocol_state->old_session.method_state, buffer, &reordered);
+	const protocol_session_t *old_session = &peer->protocol_state->old_session;
+	const protocol_session_t *session = &peer->protocol_state->session;
 
-	if (!recv_buffer) {
-		recv_buffer = peer->protocol_state->session.method->provider->decrypt(
-			peer->protocol_state->session.method_state, buffer, &reordered);
-		if (!recv_buffer) {
-			pr_debug2("verification failed for packet received from %P", peer);
-			goto fail;
-		}
+	fastd_crypto_job_t job = {
+		.encrypt = false,
+		.sessions = { NULL, session->method_state },
+		.providers = { NULL, session->method->provider },
+		.buffer = buffer,
+	};
 
-		if (peer->protocol_state->old_session.method) {
-			pr_debug("invalidating old session with %P", peer);
-			peer->protocol_state->old_session.method->provider->session_free(
-				peer->protocol_state->old_session.method_state);
-			peer->protocol_state->old_session = (protocol_session_t){};
-		}
+	if (is_session_valid(old_session)) {
+		job.sessions[0] = old_session->method_state;
+		job.providers[0] = old_session->method->provider;
+	}
+
+	run_job(peer, &job);
+}
 
-		if (!peer->protocol_state->session.handshakes_cleaned) {
-			pr_debug("cleaning left handshakes with %P", peer);
-			fastd_peer_unschedule_handshake(peer);
-			peer->protocol_state->session.handshakes_cleaned = true;
+/**
+   Drops the old session and cleans up the remaining handshakes after a packet has been received using the newest
+   session
 
-			if (peer->protocol_state->session.method->provider->session_is_initiator(
-				    peer->protocol_state->session.method_state))
-				fastd_protocol_ec25519_fhmqvc_send_empty(peer, &peer->protocol_state->session);
-		}
+   Worker threads hand this to the main thread.
+*/
+static void confirm_session(fastd_peer_t *peer) {
+	fastd_protocol_peer_state_t *state = peer->protocol_state;
+
+	if (!state->old_session.method && state->session.handshakes_cleaned)
+		return;
+
+	if (fastd_worker_is_shared()) {
+		__atomic_store_n(&state->session.confirmed, true, __ATOMIC_RELAXED);
+		fastd_peer_defer(peer, PEER_DEFERRED_PROTOCOL);
+		return;
+	}
 
+	if (state->old_session.method) {
+		pr_debug("invalidating old session with %P", peer);
+
+		fastd_crypto_queue_settle(state->crypto_queue);
+
+		state->old_session.method->provider->session_free(state->old_session.method_state);
+		state->old_session = (protocol_session_t){};
+	}
+
+	if (!state->session.handshakes_cleaned) {
+		pr_debug("cleaning left handshakes with %P", peer);
+		fastd_peer_unschedule_handshake(peer);
+		state->session.handshakes_cleaned = true;
+
+		if (state->session.method->provider->session_is_initiator(state->session.method_state))
+			fastd_protocol_ec25519_fhmqvc_send_empty(peer, &state->session);
+	}
+}
+
+/** Handles a payload packet after it has been decrypted */
+static void handle_decrypted(fastd_peer_t *peer, fastd_crypto_job_t *job) {
+	if (!job->buffer) {
+		pr_debug2("verification failed for packet received from %P", peer);
+		return;
+	}
+
+	/* The packet was decrypted with the newest session; this is skipped if the sessions have changed since */
+	if (job->session == 1 && !job->detached) {
+		confirm_session(peer);
 		check_session_refresh(peer);
 	}
 
 	fastd_peer_seen(peer);
 
-	if (recv_buffer->len)
-		fastd_handle_receive(peer, recv_buffer, reordered);
+	if (job->buffer->len)
+		fastd_handle_receive(peer, job->buffer, job->reordered);
 	else
-		fastd_buffer_free(recv_buffer);
+		fastd_buffer_free(job->buffer);
+}
 
-	return;
+/** Sends a payload packet to a peer after it has been encrypted */
+static void handle_encrypted(fastd_peer_t *peer, fastd_crypto_job_t *job) {
+	if (!job->buffer) {
+		pr_error("failed to encrypt packet for %P", peer);
+		return;
+	}
+
+	fastd_send(peer->sock, &peer->local_address, &peer->address, peer, job->buffer, job->stat_size);
+	fastd_peer_clear_keepalive(peer);
+}
 
-fail:
-	fastd_buffer_free(buffer);
+/** Handles a packet that has been encrypted or decrypted, in the order the packets of the peer were submitted in */
+void fastd_protocol_ec25519_fhmqvc_crypto_complete(fastd_peer_t *peer, fastd_crypto_job_t *job) {
+	if (job->encrypt)
+		handle_encrypted(peer, job);
+	else
+		handle_decrypted(peer, job);
 }
 
 /** Encrypts and sends a packet to a peer using a specified session */
 static void session_send(fastd_peer_t *peer, fastd_buffer_t *buffer, protocol_session_t *session) {
-	size_t stat_size = buffer->len;
+	fastd_crypto_job_t job = {
+		.encrypt = true,
+		.sessions = { session->method_state },
+		.providers = { session->method->provider },
+		.buffer = buffer,
+		.stat_size = buffer->len,
+	};
 
 	fastd_buffer_zero_pad(buffer);
 
-	fastd_buffer_t *send_buffer = session->method->provider->encrypt(session->method_state, buffer);
-	if (!send_buffer) {
-		fastd_buffer_free(buffer);
-		pr_error("failed to encrypt packet for %P", peer);
-		return;
+	run_job(peer, &job);
+}
+
+/**
+   Selects the session used to send a packet to a peer
+
+   Returns NULL if no packets can be sent to the peer at the moment.
+*/
+static protocol_session_t *send_session(fastd_peer_t *peer) {
+	if (!peer->protocol_state || !fastd_peer_is_established(peer) || !check_session(peer))
+		return NULL;
+
+	check_session_refresh(peer);
+
+	if (use_old_session(peer->protocol_state)) {
+		pr_debug2("sending packet for old session to %P", peer);
+		return &peer->protocol_state->old_session;
 	}
 
-	fastd_send(peer->sock, &peer->local_address, &peer->address, peer, send_buffer, stat_size);
-	fastd_peer_clear_keepalive(peer);
+	return &peer->protocol_state->session;
 }
 
 /** Encrypts and sends a packet to a peer */
 static void protocol_send(fastd_peer_t *peer, fastd_buffer_t *buffer) {
-	if (!peer->protocol_state || !fastd_peer_is_established(peer) || !check_session(peer)) {
+	protocol_session_t *session = send_session(peer);
+	if (!session) {
 		fastd_buffer_free(buffer);
 		return;
 	}
 
-	check_session_refresh(peer);
+	session_send(peer, buffer, session);
+}
 
-	if (use_old_session(peer->protocol_state)) {
-		pr_debug2("sending packet for old session to %P", peer);
-		session_send(peer, buffer, &peer->protocol_state->old_session);
-	} else {
-		session_send(peer, buffer, &peer->protocol_state->session);
+/**
+   Encrypts and sends a packet to a peer without consuming the buffer
+
+   The packet is encrypted directly from the shared buffer. Jobs queued for the crypto threads
+   may outlive the buffer, so a copy is sent when crypto threads are used.
+*/
+static void protocol_send_shared(fastd_peer_t *peer, const fastd_buffer_t *buffer) {
+	protocol_session_t *session = send_session(peer);
+	if (!session)
+		return;
+
+	if (peer->protocol_state->crypto_queue) {
+		session_send(peer, fastd_buffer_dup(buffer, conf.encrypt_headroom), session);
+		return;
 	}
+
+	fastd_peer_lock(peer);
+	fastd_buffer_t *encrypted =
+		fastd_method_encrypt_shared(session->method->provider, session->method_state, buffer);
+	fastd_peer_unlock(peer);
+
+	fastd_crypto_job_t job = {
+		.encrypt = true,
+		.sessions = { session->method_state },
+		.providers = { session->method->provider },
+		.buffer = encrypted,
+		.stat_size = buffer->len,
+	};
+
+	fastd_protocol_ec25519_fhmqvc_crypto_complete(peer, &job);
 }
 
 /** Sends an empty payload packet (i.e. keepalive) to a peer using a specified session */
@@ -199,6 +339,17 @@ void fastd_protocol_ec25519_fhmqvc_send_empty(fastd_peer_t *peer, protocol_sessi
 	session_send(peer, fastd_buffer_alloc(0, alignto(session->method->provider->encrypt_headroom, 8)), session);
 }
 
+/** Handles the session state changes deferred by the worker threads */
+static void protocol_handle_deferred(fastd_peer_t *peer) {
+	if (!peer->protocol_state || !check_session(peer))
+		return;
+
+	if (__atomic_exchange_n(&peer->protocol_state->session.confirmed, false, __ATOMIC_RELAXED))
+		confirm_session(peer);
+
+	check_session_refresh(peer);
+}
+
 /** get_current_method implementation for ec25519-fhmqvc */
 const fastd_method_info_t *protocol_get_current_method(const fastd_peer_t *peer) {
 	if (!peer->protocol_state || !fastd_peer_is_established(peer))
@@ -216,6 +367,7 @@ const fastd_protocol_t fastd_protocol_ec25519_fhmqvc = {
 	.name = "ec25519-fhmqvc",
 
 	.init = protocol_init,
+	.maintenance = fastd_protocol_ec25519_fhmqvc_periodic_maintenance,
 
 	.handshake_init = fastd_protocol_ec25519_fhmqvc_handshake_init,
 	.handshake_handle = fastd_protocol_ec25519_fhmqvc_handshake_handle,
@@ -225,6 +377,8 @@ const fastd_protocol_t fastd_protocol_ec25519_fhmqvc = {
 
 	.handle_recv = protocol_handle_recv,
 	.send = protocol_send,
+	.send_shared = protocol_send_shared,
+	.handle_deferred = protocol_handle_deferred,
 
 	.init_peer_state = fastd_protocol_ec25519_fhmqvc_init_peer_state,
 	.reset_peer_state = fastd_protocol_ec25519_fhmqvc_reset_peer_state,
@@ -13,6 +13,7 @@
 
 #pragma once
 
+#include "../../crypto_pool.h"
 #include "../../fastd.h"
 #include "../../method.h"
 #include "../../peer.h"
@@ -46,10 +47,14 @@ struct fastd_protocol_config {
 	keypair_t key; /**< The own keypair */
 };
 
+/** A precomputed table of multiples of a peer's public key */
+typedef struct key_table key_table_t;
+
 /** A peer's public key */
 struct fastd_protocol_key {
 	aligned_int256_t key;      /**< The peer's public key */
 	ecc_25519_work_t unpacked; /**< The peer's public key (unpacked) */
+	key_table_t *table;        /**< The precomputed table of the key (NULL if none has been built yet) */
 };
 
 
@@ -63,6 +68,7 @@ typedef struct protocol_session {
 	*/
 	bool handshakes_cleaned;
 	bool refreshing; /**< true if a session refresh has been triggered by the local side */
+	bool confirmed;  /**< Set by the worker threads when they have received a packet using the session */
 
 	const fastd_method_info_t *method;          /**< The used crypto method */
 	fastd_method_session_state_t *method_state; /**< The method-specific state */
@@ -73,8 +79,12 @@ struct fastd_protocol_peer_state {
 	protocol_session_t old_session; /**< An old, not yet invalidated session */
 	protocol_session_t session;     /**< The newest session */
 
+	fastd_crypto_queue_t *crypto_queue; /**< The packets being encrypted or decrypted by the crypto threads (if any) */
+
 	uint64_t last_serial; /**< The serial number of the ephemeral keypair used for the last session establishment */
 
+	uint64_t pending_handshake; /**< The token of the handshake job of the peer in progress (0 if there is none) */
+
 	/* handshake cache */
 	uint64_t last_handshake_serial; /**< The serial number of the ephemeral keypair used in the last handshake */
 	aligned_int256_t peer_handshake_key; /**< The peer's ephemeral public key used in the last handshake */
@@ -84,6 +94,7 @@ struct fastd_protocol_peer_state {
 
 
 void fastd_protocol_ec25519_fhmqvc_maintenance(void);
+void fastd_protocol_ec25519_fhmqvc_periodic_maintenance(void);
 void fastd_protocol_ec25519_fhmqvc_init_peer_state(fastd_peer_t *peer);
 void fastd_protocol_ec25519_fhmqvc_reset_peer_state(fastd_peer_t *peer);
 void fastd_protocol_ec25519_fhmqvc_free_peer_state(fastd_peer_t *peer);
@@ -102,6 +113,7 @@ void fastd_protocol_ec25519_fhmqvc_handle_verify_return(
 #endif
 
 void fastd_protocol_ec25519_fhmqvc_send_empty(fastd_peer_t *peer, protocol_session_t *session);
+void fastd_protocol_ec25519_fhmqvc_crypto_complete(fastd_peer_t *peer, fastd_crypto_job_t *job);
 
 fastd_peer_t *fastd_protocol_ec25519_fhmqvc_find_peer(const fastd_protocol_key_t *key);
 
@@ -11,10 +11,14 @@
 */
 
 #include "handshake.h"
+#include "key_table.h"
 #include "../../crypto.h"
 #include "../../handshake.h"
+#include "../../handshake_limit.h"
+#include "../../handshake_pool.h"
 #include "../../hkdf_sha256.h"
 #include "../../peer_group.h"
+#include "../../peer_hashtable.h"
 #include "../../verify.h"
 
 
@@ -57,6 +61,8 @@ static void derive_key(
 
 /** Marks the active session as superseded and moves it to the \e old_session field of the protocol peer state */
 static inline void supersede_session(fastd_peer_t *peer, const fastd_method_info_t *method) {
+	fastd_crypto_queue_settle(peer->protocol_state->crypto_queue);
+
 	if (is_session_valid(&peer->protocol_state->session) && !is_session_valid(&peer->protocol_state->old_session)) {
 		if (peer->protocol_state->old_session.method)
 			peer->protocol_state->old_session.method->provider->session_free(
@@ -101,6 +107,7 @@ static inline bool new_session(
 
 	peer->protocol_state->session.handshakes_cleaned = false;
 	peer->protocol_state->session.refreshing = false;
+	peer->protocol_state->session.confirmed = false;
 	peer->protocol_state->session.method = method;
 	peer->protocol_state->last_serial = serial;
 
@@ -138,7 +145,7 @@ static bool establish(
 		return false;
 	}
 
-	peer->establish_handshake_timeout = ctx.now + MIN_HANDSHAKE_INTERVAL;
+	peer->establish_handshake_timeout = fastd_now() + MIN_HANDSHAKE_INTERVAL;
 
 	pr_verbose("new session with %P established using method `%s'.", peer, method->name);
 
@@ -157,6 +164,14 @@ static inline bool has_field(const fastd_handshake_t *handshake, uint8_t type, s
 }
 
 
+/** Multiplies the peer's public key with a scalar, using the precomputed table of the key if there is one */
+static inline void peer_key_mult(ecc_25519_work_t *out, const fastd_protocol_key_t *peer_key, const ecc_int256_t *n) {
+	if (peer_key->table)
+		fastd_protocol_ec25519_fhmqvc_key_table_mult(out, peer_key->table, n);
+	else
+		ecc_25519_scalarmult_bits(out, n, &peer_key->unpacked, KEY_TABLE_BITS);
+}
+
 /** Derives the shares handshake key for computing the MACs used in the handshake */
 static bool make_shared_handshake_key(
 	bool initiator, const keypair_t *handshake_key, const fastd_protocol_key_t *peer_key,
@@ -200,13 +215,13 @@ static bool make_shared_handshake_key(
 		ecc_25519_gf_mult(&da, &d, &conf.protocol_config->key.secret);
 		ecc_25519_gf_add(&s, &da, &handshake_key->secret);
 
-		ecc_25519_scalarmult_bits(&work, &e, &peer_key->unpacked, 128);
+		peer_key_mult(&work, peer_key, &e);
 	} else {
 		ecc_int256_t eb;
 		ecc_25519_gf_mult(&eb, &e, &conf.protocol_config->key.secret);
 		ecc_25519_gf_add(&s, &eb, &handshake_key->secret);
 
-		ecc_25519_scalarmult_bits(&work, &d, &peer_key->unpacked, 128);
+		peer_key_mult(&work, peer_key, &d);
 	}
 
 	ecc_25519_add(&work, &workXY, &work);
@@ -234,23 +249,21 @@ static bool make_shared_handshake_key(
 	return true;
 }
 
-/** Checks if the currently cached shared handshake key is valid and generates a new one otherwise  */
-static bool update_shared_handshake_key(
+/** Checks if the cached shared handshake key of a peer has been derived from the given handshake keys */
+static bool has_shared_handshake_key(
 	const fastd_peer_t *peer, const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key) {
-	if (peer->protocol_state->last_handshake_serial == handshake_key->serial) {
-		if (secure_memequal(&peer->protocol_state->peer_handshake_key, peer_handshake_key, PUBLICKEYBYTES))
-			return true;
-	}
-
-	if (!make_shared_handshake_key(
-		    false, &handshake_key->key, peer->key, peer_handshake_key, &peer->protocol_state->sigma,
-		    &peer->protocol_state->shared_handshake_key))
-		return false;
+	return peer->protocol_state->last_handshake_serial == handshake_key->serial &&
+	       secure_memequal(&peer->protocol_state->peer_handshake_key, peer_handshake_key, PUBLICKEYBYTES);
+}
 
-	peer->protocol_state->last_handshake_serial = handshake_key->serial;
+/** Stores a shared handshake key in the handshake cache of a peer */
+static void cache_shared_handshake_key(
+	const fastd_peer_t *peer, uint64_t serial, const aligned_int256_t *peer_handshake_key,
+	const aligned_int256_t *sigma, const fastd_sha256_t *shared_handshake_key) {
+	peer->protocol_state->last_handshake_serial = serial;
 	peer->protocol_state->peer_handshake_key = *peer_handshake_key;
-
-	return true;
+	peer->protocol_state->sigma = *sigma;
+	peer->protocol_state->shared_handshake_key = *shared_handshake_key;
 }
 
 /** Resets the handshake cache for a peer */
@@ -262,17 +275,58 @@ static void clear_shared_handshake_key(const fastd_peer_t *peer) {
 	memset(&peer->protocol_state->peer_handshake_key, 0, sizeof(peer->protocol_state->peer_handshake_key));
 }
 
-/** Sends a reply to an initial handshake (type 1) */
-static void respond_handshake(
-	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
-	fastd_peer_t *peer, const aligned_int256_t *peer_handshake_key) {
-	pr_debug("responding handshake with %P[%I]...", peer, remote_addr);
-
+/** Checks if the ephemeral keypair with the given serial number may still be used in handshakes */
+static bool is_handshake_serial_valid(uint64_t serial) {
 	const handshake_key_t *handshake_key = &ctx.protocol_state->handshake_key;
+	const handshake_key_t *prev_handshake_key = &ctx.protocol_state->prev_handshake_key;
 
-	if (!update_shared_handshake_key(peer, handshake_key, peer_handshake_key))
-		return;
+	return (handshake_key->serial == serial && is_handshake_key_valid(handshake_key)) ||
+	       (prev_handshake_key->serial == serial && is_handshake_key_valid(prev_handshake_key));
+}
 
+
+/**
+   The key agreement of a received handshake
+
+   The job contains copies of everything the key agreement depends on, as the handshake keys and
+   the peer may change while it is performed by a handshake thread.
+*/
+typedef struct handshake_job {
+	fastd_handshake_job_t job; /**< The generic part of the job */
+
+	uint64_t peer_id; /**< The ID of the peer the handshake was received from */
+	uint64_t token;   /**< The value of the peer's \e pending_handshake field while the job is in progress */
+	uint8_t type;     /**< The type of the received handshake */
+
+	fastd_socket_t *sock;             /**< The socket the handshake was received on */
+	bool peer_sock;                   /**< Set if the socket belongs to the peer */
+	fastd_peer_address_t local_addr;  /**< The local address the handshake was received on */
+	fastd_peer_address_t remote_addr; /**< The address the handshake was received from */
+
+	const fastd_method_info_t *method;   /**< The method negotiated by a handshake of type 2 or 3 */
+	handshake_key_t handshake_key;       /**< The own ephemeral keypair used in the handshake */
+	fastd_protocol_key_t peer_key;       /**< The peer's public key (holding a reference on its table) */
+	aligned_int256_t peer_handshake_key; /**< The peer's ephemeral public key */
+	bool new_table;                      /**< Set if the table of the peer key has been built by the job */
+
+	bool ok;                             /**< Set if the key agreement was successful */
+	aligned_int256_t sigma;              /**< The value of sigma resulting from the key agreement */
+	fastd_sha256_t shared_handshake_key; /**< The shared handshake key resulting from the key agreement */
+
+	uint8_t mac[HASHBYTES] __attribute__((aligned(8))); /**< The TLV MAC of a handshake of type 2 or 3 */
+	size_t tlv_len;                                     /**< The length of the TLV records */
+	uint32_t tlv_data[];                                /**< The TLV records (with a zeroed MAC) */
+} handshake_job_t;
+
+/** Checks the TLV MAC of a received handshake of type 2 or 3 */
+static inline bool verify_handshake_mac(const handshake_job_t *job) {
+	return fastd_hmacsha256_verify(job->mac, job->shared_handshake_key.w, job->tlv_data, job->tlv_len);
+}
+
+/** Sends a reply to an initial handshake (type 1) using the cached shared handshake key */
+static void send_handshake_response(
+	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key) {
 	fastd_buffer_t *buffer = fastd_handshake_new_reply(
 		2, fastd_peer_get_mtu(peer), NULL, *fastd_peer_group_lookup_peer(peer, methods),
 		4 * RECORD_LEN(PUBLICKEYBYTES) + RECORD_LEN(HASHBYTES));
@@ -293,58 +347,229 @@ static void respond_handshake(
 	fastd_send(sock, local_addr, remote_addr, peer, buffer, 0);
 }
 
-/** Sends a reply to a handshake response (type 2) */
-static void finish_handshake(
-	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
-	fastd_peer_t *peer, const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key,
-	const fastd_handshake_t *handshake) {
-	pr_debug("finishing handshake with %P[%I]...", peer, remote_addr);
+/** Sends a reply to an initial handshake (type 1) after the key agreement has been performed */
+static void complete_respond_handshake(fastd_peer_t *peer, const handshake_job_t *job) {
+	cache_shared_handshake_key(
+		peer, job->handshake_key.serial, &job->peer_handshake_key, &job->sigma, &job->shared_handshake_key);
 
-	const fastd_method_info_t *method = fastd_handshake_get_method_by_name_list(peer, handshake);
-	if (!method) {
-		fastd_handshake_send_error(
-			sock, local_addr, remote_addr, peer, handshake, REPLY_UNACCEPTABLE_VALUE, RECORD_METHOD_LIST);
-		return;
-	}
-
-	aligned_int256_t sigma;
-	fastd_sha256_t shared_handshake_key;
-	if (!make_shared_handshake_key(
-		    true, &handshake_key->key, peer->key, peer_handshake_key, &sigma, &shared_handshake_key))
-		return;
-
-	uint8_t mac[HASHBYTES] __attribute__((aligned(8)));
-	memcpy(mac, handshake->records[RECORD_TLV_MAC].data, HASHBYTES);
-	memset(handshake->records[RECORD_TLV_MAC].data, 0, HASHBYTES);
+	send_handshake_response(
+		job->sock, &job->local_addr, &job->remote_addr, peer, &job->handshake_key, &job->peer_handshake_key);
+}
 
-	bool valid = fastd_hmacsha256_verify(mac, shared_handshake_key.w, handshake->tlv_data, handshake->tlv_len);
+/** Establishes a session after a handshake response (type 2) and sends a reply */
+static void complete_finish_handshake(fastd_peer_t *peer, const handshake_job_t *job) {
+	const handshake_key_t *handshake_key = &job->handshake_key;
 
-	if (!valid) {
-		pr_warn("received invalid protocol handshake response from %P[%I]", peer, remote_addr);
+	if (!verify_handshake_mac(job)) {
+		pr_warn("received invalid protocol handshake response from %P[%I]", peer, &job->remote_addr);
 		return;
 	}
 
 	if (!establish(
-		    peer, method, sock, local_addr, remote_addr, true, &handshake_key->key.public, peer_handshake_key,
-		    &conf.protocol_config->key.public, &peer->key->key, &sigma, shared_handshake_key.w,
-		    handshake_key->serial))
+		    peer, job->method, job->sock, &job->local_addr, &job->remote_addr, true, &handshake_key->key.public,
+		    &job->peer_handshake_key, &conf.protocol_config->key.public, &peer->key->key, &job->sigma,
+		    job->shared_handshake_key.w, handshake_key->serial))
 		return;
 
 	fastd_buffer_t *buffer = fastd_handshake_new_reply(
-		3, fastd_peer_get_mtu(peer), method, NULL, 4 * RECORD_LEN(PUBLICKEYBYTES) + RECORD_LEN(HASHBYTES));
+		3, fastd_peer_get_mtu(peer), job->method, NULL, 4 * RECORD_LEN(PUBLICKEYBYTES) + RECORD_LEN(HASHBYTES));
 
 	fastd_handshake_add(buffer, RECORD_SENDER_KEY, PUBLICKEYBYTES, &conf.protocol_config->key.public);
 	fastd_handshake_add(buffer, RECORD_RECIPIENT_KEY, PUBLICKEYBYTES, &peer->key->key);
 	fastd_handshake_add(buffer, RECORD_SENDER_HANDSHAKE_KEY, PUBLICKEYBYTES, &handshake_key->key.public);
-	fastd_handshake_add(buffer, RECORD_RECIPIENT_HANDSHAKE_KEY, PUBLICKEYBYTES, peer_handshake_key);
+	fastd_handshake_add(buffer, RECORD_RECIPIENT_HANDSHAKE_KEY, PUBLICKEYBYTES, &job->peer_handshake_key);
+	fastd_handshake_add_cookie(buffer, peer, &job->remote_addr, &peer->key->key);
 
 	fastd_sha256_t hmacbuf;
 	uint8_t *tlv_mac = fastd_handshake_add_zero(buffer, RECORD_TLV_MAC, HASHBYTES);
 	fastd_hmacsha256(
-		&hmacbuf, shared_handshake_key.w, fastd_handshake_tlv_data(buffer), fastd_handshake_tlv_len(buffer));
+		&hmacbuf, job->shared_handshake_key.w, fastd_handshake_tlv_data(buffer),
+		fastd_handshake_tlv_len(buffer));
 	memcpy(tlv_mac, hmacbuf.b, HASHBYTES);
 
-	fastd_send(sock, local_addr, remote_addr, peer, buffer, 0);
+	fastd_send(job->sock, &job->local_addr, &job->remote_addr, peer, buffer, 0);
+}
+
+/** Establishes a session after a reply to a handshake response (type 3) */
+static void complete_handle_finish_handshake(fastd_peer_t *peer, const handshake_job_t *job) {
+	if (!verify_handshake_mac(job)) {
+		pr_warn("received invalid protocol handshake finish from %P[%I]", peer, &job->remote_addr);
+		return;
+	}
+
+	establish(
+		peer, job->method, job->sock, &job->local_addr, &job->remote_addr, false, &job->peer_handshake_key,
+		&job->handshake_key.key.public, &peer->key->key, &conf.protocol_config->key.public, &job->sigma,
+		job->shared_handshake_key.w, job->handshake_key.serial);
+
+	clear_shared_handshake_key(peer);
+}
+
+/** Performs the key agreement of a handshake job (in a handshake thread) */
+static void run_handshake_job(fastd_handshake_job_t *job) {
+	handshake_job_t *j = container_of(job, handshake_job_t, job);
+
+	if (!j->peer_key.table && key_table_enabled()) {
+		j->peer_key.table = fastd_protocol_ec25519_fhmqvc_key_table_new(&j->peer_key.unpacked);
+		j->new_table = true;
+	}
+
+	j->ok = make_shared_handshake_key(
+		j->type == 2, &j->handshake_key.key, &j->peer_key, &j->peer_handshake_key, &j->sigma,
+		&j->shared_handshake_key);
+}
+
+/**
+   Continues the handling of a handshake after its key agreement has been performed
+
+   The result is discarded if the peer has been reset or deleted in the meantime, or if the
+   ephemeral keypair used for the handshake has expired.
+*/
+static void complete_handshake_job(fastd_handshake_job_t *job) {
+	const handshake_job_t *j = container_of(job, handshake_job_t, job);
+
+	fastd_peer_t *peer = fastd_peer_find_by_id(j->peer_id);
+	if (!peer || peer->protocol_state->pending_handshake != j->token)
+		return;
+
+	peer->protocol_state->pending_handshake = 0;
+
+	if (j->new_table)
+		fastd_protocol_ec25519_fhmqvc_key_table_store(peer->key, j->peer_key.table);
+
+	if (!j->ok)
+		return;
+
+	if (!is_handshake_serial_valid(j->handshake_key.serial)) {
+		pr_debug("handshake key used in handshake with %P[%I] has expired", peer, &j->remote_addr);
+		return;
+	}
+
+	/* Sockets of peers are closed when the peer is reset, but better be safe than sorry */
+	if (j->peer_sock && j->sock != peer->sock)
+		return;
+
+	switch (j->type) {
+	case 1:
+		complete_respond_handshake(peer, j);
+		break;
+
+	case 2:
+		complete_finish_handshake(peer, j);
+		break;
+
+	case 3:
+		complete_handle_finish_handshake(peer, j);
+		break;
+
+	default:
+		exit_bug("complete_handshake_job: unknown type");
+	}
+}
+
+/** Frees a handshake job */
+static void destroy_handshake_job(fastd_handshake_job_t *job) {
+	handshake_job_t *j = container_of(job, handshake_job_t, job);
+
+	if (j->peer_key.table)
+		fastd_protocol_ec25519_fhmqvc_key_table_put(j->peer_key.table);
+
+	secure_memzero(j, sizeof(*j) + j->tlv_len);
+	free(j);
+}
+
+/**
+   Performs the key agreement of a handshake and continues its handling afterwards
+
+   The key agreement is performed by the handshake threads if they are configured. Only one
+   handshake of each peer is processed at a time; further handshakes are ignored until it is
+   finished. When a matching shared handshake key has been cached by the response to an initial
+   handshake, it is reused and the handling continues immediately.
+*/
+static void process_handshake(
+	uint8_t type, fastd_socket_t *sock, const fastd_peer_address_t *local_addr,
+	const fastd_peer_address_t *remote_addr, fastd_peer_t *peer, const fastd_method_info_t *method,
+	const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key,
+	const fastd_handshake_t *handshake) {
+	if (peer->protocol_state->pending_handshake) {
+		pr_debug("ignoring handshake from %P[%I] while the previous one is being processed", peer, remote_addr);
+		return;
+	}
+
+	size_t tlv_len = handshake ? handshake->tlv_len : 0;
+	handshake_job_t *job = fastd_alloc0(sizeof(handshake_job_t) + tlv_len);
+
+	job->job.run = run_handshake_job;
+	job->job.complete = complete_handshake_job;
+	job->job.destroy = destroy_handshake_job;
+
+	job->peer_id = peer->id;
+	job->token = ++ctx.protocol_state->last_handshake_job;
+	job->type = type;
+
+	job->sock = sock;
+	job->peer_sock = sock->peer;
+	job->local_addr = *local_addr;
+	job->remote_addr = *remote_addr;
+
+	job->method = method;
+	job->handshake_key = *handshake_key;
+	job->peer_key = *peer->key;
+	job->peer_key.table = fastd_protocol_ec25519_fhmqvc_key_table_get(peer->key);
+	job->peer_handshake_key = *peer_handshake_key;
+
+	if (handshake) {
+		memcpy(job->mac, handshake->records[RECORD_TLV_MAC].data, HASHBYTES);
+		memset(handshake->records[RECORD_TLV_MAC].data, 0, HASHBYTES);
+
+		job->tlv_len = tlv_len;
+		memcpy(job->tlv_data, handshake->tlv_data, tlv_len);
+	}
+
+	peer->protocol_state->pending_handshake = job->token;
+
+	if (type != 2 && has_shared_handshake_key(peer, handshake_key, peer_handshake_key)) {
+		job->ok = true;
+		job->sigma = peer->protocol_state->sigma;
+		job->shared_handshake_key = peer->protocol_state->shared_handshake_key;
+
+		complete_handshake_job(&job->job);
+		destroy_handshake_job(&job->job);
+		return;
+	}
+
+	if (!fastd_handshake_pool_submit(&job->job)) {
+		pr_debug("too many handshakes in progress, ignoring handshake from %P[%I]", peer, remote_addr);
+		peer->protocol_state->pending_handshake = 0;
+	}
+}
+
+/** Sends a reply to an initial handshake (type 1) */
+static void respond_handshake(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const aligned_int256_t *peer_handshake_key) {
+	pr_debug("responding handshake with %P[%I]...", peer, remote_addr);
+
+	process_handshake(
+		1, sock, local_addr, remote_addr, peer, NULL, &ctx.protocol_state->handshake_key, peer_handshake_key,
+		NULL);
+}
+
+/** Sends a reply to a handshake response (type 2) */
+static void finish_handshake(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, const handshake_key_t *handshake_key, const aligned_int256_t *peer_handshake_key,
+	const fastd_handshake_t *handshake) {
+	pr_debug("finishing handshake with %P[%I]...", peer, remote_addr);
+
+	const fastd_method_info_t *method = fastd_handshake_get_method_by_name_list(peer, handshake);
+	if (!method) {
+		fastd_handshake_send_error(
+			sock, local_addr, remote_addr, peer, handshake, REPLY_UNACCEPTABLE_VALUE, RECORD_METHOD_LIST);
+		return;
+	}
+
+	process_handshake(2, sock, local_addr, remote_addr, peer, method, handshake_key, peer_handshake_key, handshake);
 }
 
 /** Handles a reply to a handshake response (type 3) */
@@ -361,65 +586,56 @@ static void handle_finish_handshake(
 		return;
 	}
 
-	if (!update_shared_handshake_key(peer, handshake_key, peer_handshake_key))
-		return;
+	process_handshake(3, sock, local_addr, remote_addr, peer, method, handshake_key, peer_handshake_key, handshake);
+}
 
-	uint8_t mac[HASHBYTES];
-	memcpy(mac, handshake->records[RECORD_TLV_MAC].data, HASHBYTES);
-	memset(handshake->records[RECORD_TLV_MAC].data, 0, HASHBYTES);
+/** Looks up the peer a public key belongs to in the index of peer keys (including disabled peers) */
+static fastd_peer_t *lookup_key(const uint8_t key[PUBLICKEYBYTES]) {
+	if (!ctx.protocol_state)
+		return NULL;
 
-	bool valid = fastd_hmacsha256_verify(
-		mac, peer->protocol_state->shared_handshake_key.w, handshake->tlv_data, handshake->tlv_len);
+	uint64_t hash = peer_key_hash(key);
+	size_t pos = 0;
+	fastd_peer_t *peer;
 
-	if (!valid) {
-		pr_warn("received invalid protocol handshake finish from %P[%I]", peer, remote_addr);
-		return;
+	while ((peer = fastd_peer_index_next(&ctx.protocol_state->peer_keys, hash, &pos))) {
+		if (secure_memequal(&peer->key->key, key, PUBLICKEYBYTES))
+			return peer;
 	}
 
-	establish(
-		peer, method, sock, local_addr, remote_addr, false, peer_handshake_key, &handshake_key->key.public,
-		&peer->key->key, &conf.protocol_config->key.public, &peer->protocol_state->sigma,
-		peer->protocol_state->shared_handshake_key.w, handshake_key->serial);
-
-	clear_shared_handshake_key(peer);
+	return NULL;
 }
 
-/** Searches the peer a public key belongs to, optionally restricting matches to a specific sender address */
+/**
+   Searches the peer a public key belongs to, optionally restricting matches to a specific sender address
+
+   When an address is given, disabled peers are ignored, and no peer is returned if the address
+   doesn't match the peer's remotes or is statically configured for another peer.
+*/
 static fastd_peer_t *find_key(const uint8_t key[PUBLICKEYBYTES], const fastd_peer_address_t *address) {
 	errno = 0;
 
-	fastd_peer_t *ret = NULL;
-	size_t i;
-
-	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
-		fastd_peer_t *peer = VECTOR_INDEX(ctx.peers, i);
-
-		if (address && !fastd_peer_is_enabled(peer))
-			continue;
+	fastd_peer_t *peer = lookup_key(key);
 
-		if (secure_memequal(&peer->key->key, key, PUBLICKEYBYTES)) {
-			if (!address)
-				return peer;
+	if (address) {
+		if (peer && !fastd_peer_is_enabled(peer))
+			peer = NULL;
 
-			if (!fastd_peer_matches_address(peer, address)) {
-				errno = EPERM;
-				return NULL;
-			}
-
-			ret = peer;
-			continue;
+		if (peer && !fastd_peer_matches_address(peer, address)) {
+			errno = EPERM;
+			return NULL;
 		}
 
-		if (address && fastd_peer_owns_address(peer, address)) {
+		if (fastd_peer_hashtable_lookup_owner(address, peer)) {
 			errno = EPERM;
 			return NULL;
 		}
 	}
 
-	if (!ret)
+	if (!peer)
 		errno = ENOENT;
 
-	return ret;
+	return peer;
 }
 
 /** Searches the peer a public key belongs to (including disabled peers) */
@@ -470,6 +686,8 @@ void fastd_protocol_ec25519_fhmqvc_handshake_init(
 
 	fastd_handshake_add(
 		buffer, RECORD_SENDER_HANDSHAKE_KEY, PUBLICKEYBYTES, &ctx.protocol_state->handshake_key.key.public);
+	if (peer)
+		fastd_handshake_add_cookie(buffer, peer, remote_addr, &peer->key->key);
 
 	if (!peer || !fastd_peer_is_established(peer)) {
 		const fastd_shell_command_t *on_connect = fastd_peer_group_lookup_peer_shell_command(peer, on_connect);
@@ -519,7 +737,7 @@ add_dynamic(fastd_socket_t *sock, const fastd_peer_address_t *addr, const unsign
 		return NULL;
 	}
 
-	fastd_protocol_key_t peer_key;
+	fastd_protocol_key_t peer_key = {};
 	memcpy(&peer_key.key, key, PUBLICKEYBYTES);
 
 	if (!ecc_25519_load_packed_legacy(&peer_key.unpacked, &peer_key.key.int256) ||
@@ -589,7 +807,7 @@ void fastd_protocol_ec25519_fhmqvc_handle_verify_return(
 
 	const verify_data_t *data = protocol_data;
 
-	peer->last_handshake_response_timeout = ctx.now + MIN_HANDSHAKE_INTERVAL;
+	peer->last_handshake_response_timeout = fastd_now() + MIN_HANDSHAKE_INTERVAL;
 	peer->last_handshake_response_address = *remote_addr;
 	respond_handshake(sock, local_addr, remote_addr, peer, &data->peer_handshake_key);
 }
@@ -686,7 +904,7 @@ void fastd_protocol_ec25519_fhmqvc_handshake_handle(
 			"received handshake from %P[%I]%s%s", peer, remote_addr,
 			handshake->peer_version ? " using fastd " : "", handshake->peer_version ?: "");
 
-		peer->last_handshake_response_timeout = ctx.now + MIN_HANDSHAKE_INTERVAL;
+		peer->last_handshake_response_timeout = fastd_now() + MIN_HANDSHAKE_INTERVAL;
 		peer->last_handshake_response_address = *remote_addr;
 		respond_handshake(sock, local_addr, remote_addr, peer, &peer_handshake_key);
 		return;
@@ -45,9 +45,30 @@ typedef struct handshake_key {
 struct fastd_protocol_state {
 	handshake_key_t prev_handshake_key; /**< The previously generated handshake keypair */
 	handshake_key_t handshake_key;      /**< The newest handshake keypair */
+
+	keypair_t next_handshake_key;    /**< The pre-generated keypair for the next key rotation */
+	bool next_handshake_key_ready;   /**< Set if next_handshake_key contains a pre-generated keypair */
+	bool next_handshake_key_pending; /**< Set while the next keypair is generated by a handshake thread */
+
+	fastd_peer_index_t peer_keys; /**< Index of all peers by their public keys */
+
+	key_table_t *key_table_lru_head; /**< The most recently used precomputed key table */
+	key_table_t *key_table_lru_tail; /**< The least recently used precomputed key table */
+	size_t key_table_memory;         /**< The memory used by all stored key tables */
+
+	uint64_t last_handshake_job; /**< The token of the last handshake job that has been created */
 };
 
 
+/** Returns the hash value of a public key in the index of peer keys */
+static inline uint64_t peer_key_hash(const uint8_t key[PUBLICKEYBYTES]) {
+	uint64_t words[PUBLICKEYBYTES / sizeof(uint64_t)];
+	memcpy(words, key, sizeof(words));
+
+	return fastd_peer_index_hash(&ctx.protocol_state->peer_keys, words, array_size(words));
+}
+
+
 /** Checks if a handshake keypair is currently valid */
 static inline bool is_handshake_key_valid(const handshake_key_t *handshake_key) {
 	return !fastd_timed_out(handshake_key->valid_till);
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   ec25519-fhmqvc protocol: precomputed tables for multiplications with peer keys
+
+   Each handshake multiplies the long-term public key of the peer with a 128 bit scalar. When a
+   memory budget is configured with \e handshake \e key \e budget, a table of multiples of the key
+   is built on the first handshake with a peer, so further multiplications can use the comb method
+   (KEY_TABLE_SPACING doublings and additions) instead of a full double-and-add (KEY_TABLE_BITS
+   doublings and additions).
+
+   The stored tables are kept in a LRU list; when they use more memory than the budget allows, the
+   tables that haven't been used for the longest time are freed.
+*/
+
+
+#include "key_table.h"
+#include "handshake.h"
+
+
+/** Returns the bit of a scalar at the given position */
+static inline size_t scalar_bit(const ecc_int256_t *scalar, size_t bit) {
+	return (scalar->p[bit / 8] >> (bit % 8)) & 1;
+}
+
+
+/** Removes a table from the LRU list */
+static void lru_unlink(key_table_t *table) {
+	if (table->lru_prev)
+		table->lru_prev->lru_next = table->lru_next;
+	else
+		ctx.protocol_state->key_table_lru_head = table->lru_next;
+
+	if (table->lru_next)
+		table->lru_next->lru_prev = table->lru_prev;
+	else
+		ctx.protocol_state->key_table_lru_tail = table->lru_prev;
+
+	table->lru_prev = table->lru_next = NULL;
+}
+
+/** Adds a table at the head of the LRU list */
+static void lru_push(key_table_t *table) {
+	table->lru_prev = NULL;
+	table->lru_next = ctx.protocol_state->key_table_lru_head;
+
+	if (table->lru_next)
+		table->lru_next->lru_prev = table;
+	else
+		ctx.protocol_state->key_table_lru_tail = table;
+
+	ctx.protocol_state->key_table_lru_head = table;
+}
+
+/** Removes a table from its owner and drops the owner's reference */
+static void unstore(key_table_t *table) {
+	lru_unlink(table);
+
+	table->owner->table = NULL;
+	table->owner = NULL;
+
+	ctx.protocol_state->key_table_memory -= sizeof(key_table_t);
+
+	fastd_protocol_ec25519_fhmqvc_key_table_put(table);
+}
+
+
+/**
+   Builds the table for a point
+
+   This may be called in a handshake thread. The returned table has a single reference, which
+   belongs to the caller.
+*/
+key_table_t *fastd_protocol_ec25519_fhmqvc_key_table_new(const ecc_25519_work_t *point) {
+	key_table_t *table = fastd_new0(key_table_t);
+	table->refs = 1;
+
+	ecc_25519_work_t base = *point;
+
+	size_t t, i;
+	for (t = 0; t < KEY_TABLE_TEETH; t++) {
+		if (t) {
+			for (i = 0; i < KEY_TABLE_SPACING; i++)
+				ecc_25519_double(&base, &base);
+		}
+
+		size_t bit = 1 << t;
+		table->points[bit - 1] = base;
+
+		for (i = 1; i < bit; i++)
+			ecc_25519_add(&table->points[bit + i - 1], &table->points[i - 1], &base);
+	}
+
+	return table;
+}
+
+/**
+   Multiplies the point of a table with a scalar of up to KEY_TABLE_BITS bits
+
+   The scalars used in the handshake are derived from public values only, so the multiplication
+   doesn't need to run in constant time.
+*/
+void fastd_protocol_ec25519_fhmqvc_key_table_mult(
+	ecc_25519_work_t *out, const key_table_t *table, const ecc_int256_t *scalar) {
+	*out = ecc_25519_work_identity;
+
+	ssize_t i;
+	for (i = KEY_TABLE_SPACING - 1; i >= 0; i--) {
+		ecc_25519_double(out, out);
+
+		size_t index = 0, t;
+		for (t = 0; t < KEY_TABLE_TEETH; t++)
+			index |= scalar_bit(scalar, i + t * KEY_TABLE_SPACING) << t;
+
+		if (index)
+			ecc_25519_add(out, out, &table->points[index - 1]);
+	}
+}
+
+
+/** Returns a new reference to the table stored in a key (or NULL), marking it as recently used */
+key_table_t *fastd_protocol_ec25519_fhmqvc_key_table_get(fastd_protocol_key_t *key) {
+	key_table_t *table = key->table;
+	if (!table)
+		return NULL;
+
+	lru_unlink(table);
+	lru_push(table);
+
+	table->refs++;
+	return table;
+}
+
+/** Drops a reference to a table, freeing it when it was the last one */
+void fastd_protocol_ec25519_fhmqvc_key_table_put(key_table_t *table) {
+	if (--table->refs)
+		return;
+
+	free(table);
+}
+
+/**
+   Stores a table in a key
+
+   Nothing is done if the key already has a table or the table is stored in a key already. Less
+   recently used tables are freed when the memory budget is exceeded afterwards.
+*/
+void fastd_protocol_ec25519_fhmqvc_key_table_store(fastd_protocol_key_t *key, key_table_t *table) {
+	if (key->table || table->owner || !key_table_enabled())
+		return;
+
+	table->owner = key;
+	table->refs++;
+	key->table = table;
+
+	lru_push(table);
+	ctx.protocol_state->key_table_memory += sizeof(key_table_t);
+
+	while (ctx.protocol_state->key_table_memory > conf.handshake_key_budget)
+		unstore(ctx.protocol_state->key_table_lru_tail);
+}
+
+/** Removes the table from a key when the key isn't used anymore */
+void fastd_protocol_ec25519_fhmqvc_key_table_release(fastd_protocol_key_t *key) {
+	if (key->table)
+		unstore(key->table);
+}
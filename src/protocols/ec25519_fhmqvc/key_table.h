@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   ec25519-fhmqvc protocol: precomputed tables for multiplications with peer keys
+*/
+
+
+#pragma once
+
+#include "ec25519_fhmqvc.h"
+
+
+/** The number of teeth of the comb used for multiplications with peer keys */
+#define KEY_TABLE_TEETH 4
+
+/** The number of scalar bits the table of a peer key is used for */
+#define KEY_TABLE_BITS 128
+
+/** The distance of the scalar bits combined in a single table lookup */
+#define KEY_TABLE_SPACING (KEY_TABLE_BITS / KEY_TABLE_TEETH)
+
+
+/**
+   A precomputed table of multiples of a peer's public key
+
+   Entry \e i - 1 contains the sum of the points 2^(KEY_TABLE_SPACING*t)*P for all bits \e t set in \e i.
+
+   Tables are only modified and freed in the main thread; the handshake threads only read the
+   points of tables they hold a reference on.
+*/
+struct key_table {
+	key_table_t *lru_prev; /**< The previous (more recently used) table in the LRU list */
+	key_table_t *lru_next; /**< The next (less recently used) table in the LRU list */
+
+	fastd_protocol_key_t *owner; /**< The key the table is stored in (NULL if it isn't stored anymore) */
+	size_t refs;                 /**< The number of references (the owner's and those of handshake jobs) */
+
+	ecc_25519_work_t points[(1 << KEY_TABLE_TEETH) - 1]; /**< The precomputed points */
+};
+
+
+/** Checks if precomputed tables are enabled by the configured memory budget */
+static inline bool key_table_enabled(void) {
+	return conf.handshake_key_budget >= sizeof(key_table_t);
+}
+
+
+key_table_t *fastd_protocol_ec25519_fhmqvc_key_table_new(const ecc_25519_work_t *point);
+void fastd_protocol_ec25519_fhmqvc_key_table_mult(
+	ecc_25519_work_t *out, const key_table_t *table, const ecc_int256_t *scalar);
+
+key_table_t *fastd_protocol_ec25519_fhmqvc_key_table_get(fastd_protocol_key_t *key);
+void fastd_protocol_ec25519_fhmqvc_key_table_put(key_table_t *table);
+void fastd_protocol_ec25519_fhmqvc_key_table_store(fastd_protocol_key_t *key, key_table_t *table);
+void fastd_protocol_ec25519_fhmqvc_key_table_release(fastd_protocol_key_t *key);
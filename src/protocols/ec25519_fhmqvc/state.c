@@ -12,7 +12,16 @@
 
 
 #include "../../crypto.h"
+#include "../../handshake_pool.h"
 #include "handshake.h"
+#include "key_table.h"
+
+
+/** A job generating the next ephemeral keypair in a handshake thread */
+typedef struct handshake_key_job {
+	fastd_handshake_job_t job; /**< The generic part of the job */
+	keypair_t key;             /**< The generated keypair */
+} handshake_key_job_t;
 
 
 /** Allocates the protocol-specific state */
@@ -20,8 +29,10 @@ static void init_protocol_state(void) {
 	if (!ctx.protocol_state) {
 		ctx.protocol_state = fastd_new0(fastd_protocol_state_t);
 
-		ctx.protocol_state->prev_handshake_key.preferred_till = ctx.now;
-		ctx.protocol_state->handshake_key.preferred_till = ctx.now;
+		ctx.protocol_state->prev_handshake_key.preferred_till = fastd_now();
+		ctx.protocol_state->handshake_key.preferred_till = fastd_now();
+
+		fastd_peer_index_init(&ctx.protocol_state->peer_keys);
 	}
 }
 
@@ -38,29 +49,96 @@ static void new_handshake_key(keypair_t *key) {
 		exit_bug("generated invalid ephemeral key");
 }
 
+/** Generates the next ephemeral keypair (in a handshake thread) */
+static void run_handshake_key_job(fastd_handshake_job_t *job) {
+	handshake_key_job_t *j = container_of(job, handshake_key_job_t, job);
+	new_handshake_key(&j->key);
+}
+
+/** Stores a pre-generated ephemeral keypair for the next key rotation */
+static void complete_handshake_key_job(fastd_handshake_job_t *job) {
+	handshake_key_job_t *j = container_of(job, handshake_key_job_t, job);
+
+	ctx.protocol_state->next_handshake_key = j->key;
+	ctx.protocol_state->next_handshake_key_ready = true;
+	ctx.protocol_state->next_handshake_key_pending = false;
+}
+
+/** Frees a handshake key job, erasing the generated secret */
+static void destroy_handshake_key_job(fastd_handshake_job_t *job) {
+	handshake_key_job_t *j = container_of(job, handshake_key_job_t, job);
+
+	secure_memzero(j, sizeof(*j));
+	free(j);
+}
+
+/**
+   Starts generating the ephemeral keypair for the next key rotation
+
+   Without handshake threads, the keypair is generated immediately, so this must not be called
+   while a handshake is handled in this case.
+*/
+static void pregenerate_handshake_key(void) {
+	if (ctx.protocol_state->next_handshake_key_ready || ctx.protocol_state->next_handshake_key_pending)
+		return;
+
+	handshake_key_job_t *j = fastd_new0(handshake_key_job_t);
+	j->job.run = run_handshake_key_job;
+	j->job.complete = complete_handshake_key_job;
+	j->job.destroy = destroy_handshake_key_job;
+
+	ctx.protocol_state->next_handshake_key_pending = true;
+
+	/* The job is retried on the next call when there are too many pending jobs */
+	if (!fastd_handshake_pool_submit(&j->job))
+		ctx.protocol_state->next_handshake_key_pending = false;
+}
+
 /**
    Performs maintenance tasks on the protocol state
 
-   If there is currently no preferred ephemeral keypair, a new one
-   will be generated.
+   If there is currently no preferred ephemeral keypair, the pre-generated keypair
+   becomes the new preferred one. A keypair is only generated here if none has been
+   pre-generated yet.
 */
 void fastd_protocol_ec25519_fhmqvc_maintenance(void) {
 	init_protocol_state();
 
 	if (!is_handshake_key_preferred(&ctx.protocol_state->handshake_key)) {
-		pr_debug("generating new handshake key");
-
 		ctx.protocol_state->prev_handshake_key = ctx.protocol_state->handshake_key;
 
 		ctx.protocol_state->handshake_key.serial++;
 
-		new_handshake_key(&ctx.protocol_state->handshake_key.key);
+		if (ctx.protocol_state->next_handshake_key_ready) {
+			pr_debug("using pre-generated handshake key");
+
+			ctx.protocol_state->handshake_key.key = ctx.protocol_state->next_handshake_key;
+
+			secure_memzero(&ctx.protocol_state->next_handshake_key, sizeof(keypair_t));
+			ctx.protocol_state->next_handshake_key_ready = false;
+		} else {
+			pr_debug("generating new handshake key");
+			new_handshake_key(&ctx.protocol_state->handshake_key.key);
+		}
 
-		ctx.protocol_state->handshake_key.preferred_till = ctx.now + 15000;
-		ctx.protocol_state->handshake_key.valid_till = ctx.now + 30000;
+		ctx.protocol_state->handshake_key.preferred_till = fastd_now() + 15000;
+		ctx.protocol_state->handshake_key.valid_till = fastd_now() + 30000;
+
+		if (conf.handshake_threads)
+			pregenerate_handshake_key();
 	}
 }
 
+/**
+   Performs periodic maintenance tasks of the protocol
+
+   Pre-generates the ephemeral keypair for the next key rotation outside of handshake handling.
+*/
+void fastd_protocol_ec25519_fhmqvc_periodic_maintenance(void) {
+	init_protocol_state();
+	pregenerate_handshake_key();
+}
+
 /** Allocated protocol-specific peer state */
 void fastd_protocol_ec25519_fhmqvc_init_peer_state(fastd_peer_t *peer) {
 	init_protocol_state();
@@ -70,6 +148,9 @@ void fastd_protocol_ec25519_fhmqvc_init_peer_state(fastd_peer_t *peer) {
 
 	peer->protocol_state = fastd_new0(fastd_protocol_peer_state_t);
 	peer->protocol_state->last_serial = ctx.protocol_state->handshake_key.serial;
+	peer->protocol_state->crypto_queue = fastd_crypto_queue_new(peer, fastd_protocol_ec25519_fhmqvc_crypto_complete);
+
+	fastd_peer_index_insert(&ctx.protocol_state->peer_keys, peer_key_hash(peer->key->key.u8), peer);
 }
 
 /** Resets a the state of a session, freeing method-specific state */
@@ -84,6 +165,11 @@ void fastd_protocol_ec25519_fhmqvc_reset_peer_state(fastd_peer_t *peer) {
 	if (!peer->protocol_state)
 		return;
 
+	fastd_crypto_queue_discard(peer->protocol_state->crypto_queue);
+
+	/* The result of a handshake job still in progress is ignored */
+	peer->protocol_state->pending_handshake = 0;
+
 	reset_session(&peer->protocol_state->old_session);
 	reset_session(&peer->protocol_state->session);
 }
@@ -91,6 +177,11 @@ void fastd_protocol_ec25519_fhmqvc_reset_peer_state(fastd_peer_t *peer) {
 /** Frees the protocol-specific state */
 void fastd_protocol_ec25519_fhmqvc_free_peer_state(fastd_peer_t *peer) {
 	if (peer->protocol_state) {
+		fastd_peer_index_remove(&ctx.protocol_state->peer_keys, peer_key_hash(peer->key->key.u8), peer);
+		fastd_protocol_ec25519_fhmqvc_key_table_release(peer->key);
+
+		fastd_crypto_queue_free(peer->protocol_state->crypto_queue);
+
 		reset_session(&peer->protocol_state->old_session);
 		reset_session(&peer->protocol_state->session);
 
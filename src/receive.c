@@ -12,18 +12,28 @@
 
 
 #include "fastd.h"
+#include "async.h"
+#include "eth_addr.h"
 #include "handshake.h"
 #include "hash.h"
+#include "offload.h"
 #include "peer.h"
 #include "peer_hashtable.h"
+#include "worker.h"
 
 #include <sys/uio.h>
 
 
-/** Handles the ancillary control messages of received packets */
-static inline void
-handle_socket_control(struct msghdr *message, const fastd_socket_t *sock, fastd_peer_address_t *local_addr) {
+/**
+   Handles the ancillary control messages of received packets
+
+   If the packet consists of multiple datagrams coalesced by UDP GRO, \e segment_size
+   is set to the size of the individual datagrams; otherwise it is set to 0.
+*/
+static inline void handle_socket_control(
+	struct msghdr *message, const fastd_socket_t *sock, fastd_peer_address_t *local_addr, size_t *segment_size) {
 	memset(local_addr, 0, sizeof(fastd_peer_address_t));
+	*segment_size = 0;
 
 	const uint8_t *end = (const uint8_t *)message->msg_control + message->msg_controllen;
 
@@ -45,7 +55,7 @@ handle_socket_control(struct msghdr *message, const fastd_socket_t *sock, fastd_
 			local_addr->in.sin_addr = pktinfo.ipi_addr;
 			local_addr->in.sin_port = fastd_peer_address_get_port(sock->bound_addr);
 
-			return;
+			continue;
 		}
 #endif
 
@@ -64,8 +74,24 @@ handle_socket_control(struct msghdr *message, const fastd_socket_t *sock, fastd_
 			if (IN6_IS_ADDR_LINKLOCAL(&local_addr->in6.sin6_addr))
 				local_addr->in6.sin6_scope_id = pktinfo.ipi6_ifindex;
 
-			return;
+			continue;
 		}
+
+#ifdef USE_UDP_GRO
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+			int gso_size;
+
+			if ((const uint8_t *)CMSG_DATA(cmsg) + sizeof(gso_size) > end)
+				return;
+
+			memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+
+			if (gso_size > 0)
+				*segment_size = gso_size;
+
+			continue;
+		}
+#endif
 	}
 }
 
@@ -76,7 +102,7 @@ void fastd_receive_unknown_init(void) {
 		ctx.unknown_handshakes[i] = fastd_new0_array(UNKNOWN_ENTRIES, fastd_handshake_timeout_t);
 
 		for (j = 0; j < UNKNOWN_ENTRIES; j++)
-			ctx.unknown_handshakes[i][j].timeout = ctx.now;
+			ctx.unknown_handshakes[i][j].timeout = fastd_now();
 	}
 
 	fastd_random_bytes(&ctx.unknown_handshake_seed, sizeof(ctx.unknown_handshake_seed), false);
@@ -109,7 +135,7 @@ fastd_handshake_timeout_t *unknown_hash_entry(int64_t base, size_t i, const fast
 static bool backoff_unknown(const fastd_peer_address_t *addr) {
 	static const size_t table_interval = MIN_HANDSHAKE_INTERVAL / (UNKNOWN_TABLES - 1);
 
-	int64_t base = ctx.now / table_interval;
+	int64_t base = fastd_now() / table_interval;
 	size_t first_empty = UNKNOWN_TABLES, i;
 
 	for (i = 0; i < UNKNOWN_TABLES; i++) {
@@ -136,7 +162,7 @@ static bool backoff_unknown(const fastd_peer_address_t *addr) {
 	fastd_handshake_timeout_t *t = unknown_hash_entry(base, first_empty, addr);
 
 	t->address = *addr;
-	t->timeout = ctx.now + MIN_HANDSHAKE_INTERVAL - first_empty * table_interval;
+	t->timeout = fastd_now() + MIN_HANDSHAKE_INTERVAL - first_empty * table_interval;
 
 	return false;
 }
@@ -208,6 +234,37 @@ static inline void handle_socket_receive_unknown(
 	}
 }
 
+/**
+   Checks if a packet can be handled by a thread handling packets in parallel to other threads
+
+   Only payload packets of established peers are handled on the data path; handshakes and packets from unknown
+   addresses change the state shared by all threads.
+*/
+static inline bool may_handle_shared(
+	const fastd_peer_address_t *local_addr, const fastd_peer_t *peer, const fastd_buffer_t *buffer) {
+	const uint8_t *packet_type = buffer->data;
+
+	return peer && *packet_type == PACKET_DATA && fastd_peer_is_established(peer) &&
+	       fastd_peer_address_equal(&peer->local_address, local_addr);
+}
+
+/** Hands a packet to the main thread */
+static void defer_receive(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_buffer_t *buffer) {
+	fastd_async_packet_t packet = {
+		.sock = sock->parent ?: sock,
+		.local_addr = *local_addr,
+		.remote_addr = *remote_addr,
+		.buffer = buffer,
+	};
+
+	if (!fastd_async_try_enqueue(ASYNC_TYPE_PACKET, &packet, sizeof(packet))) {
+		pr_debug2("unable to hand packet from %I to the main thread, dropping", remote_addr);
+		fastd_buffer_free(buffer);
+	}
+}
+
 /** Handles a packet read from a socket */
 static inline void handle_socket_receive(
 	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
@@ -221,10 +278,19 @@ static inline void handle_socket_receive(
 		}
 
 		peer = sock->peer;
+
+		/* Handshakes must refer to the bound socket the connected socket shares its port with */
+		if (sock->connected)
+			sock = peer->sock;
 	} else {
 		peer = fastd_peer_hashtable_lookup(remote_addr);
 	}
 
+	if (fastd_worker_is_shared() && !may_handle_shared(local_addr, peer, buffer)) {
+		defer_receive(sock, local_addr, remote_addr, buffer);
+		return;
+	}
+
 	if (peer) {
 		handle_socket_receive_known(sock, local_addr, remote_addr, peer, buffer);
 	} else if (allow_unknown_peers()) {
@@ -235,11 +301,249 @@ static inline void handle_socket_receive(
 	}
 }
 
-/** Reads a packet from a socket */
-void fastd_receive(fastd_socket_t *sock) {
-	size_t max_len = max_size_t(fastd_max_payload(ctx.max_mtu) + conf.overhead, MAX_HANDSHAKE_SIZE);
-	fastd_buffer_t *buffer = fastd_buffer_alloc(max_len, conf.decrypt_headroom);
+/** Handles a packet a worker thread has handed to the main thread */
+void fastd_receive_deferred(
+	fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_buffer_t *buffer) {
+	handle_socket_receive(sock, local_addr, remote_addr, buffer);
+}
+
+/**
+   Determines the local and remote addresses of a message that has been read from a socket
+
+   Returns false if the message must be discarded.
+*/
+static bool get_message_addresses(
+	const fastd_socket_t *sock, struct msghdr *message, fastd_peer_address_t *local_addr,
+	fastd_peer_address_t *recvaddr, size_t *segment_size) {
+	handle_socket_control(message, sock, local_addr, segment_size);
+
+#ifdef USE_PKTINFO
+	if (!local_addr->sa.sa_family) {
+		pr_error("received packet without packet info");
+		return false;
+	}
+#endif
+
+	fastd_peer_address_simplify(local_addr);
+	fastd_peer_address_simplify(recvaddr);
+
+	return true;
+}
+
+/** Handles a single datagram that has been read from a socket */
+static void handle_socket_message(
+	fastd_socket_t *sock, struct msghdr *message, fastd_peer_address_t *recvaddr, fastd_buffer_t *buffer) {
+	fastd_peer_address_t local_addr;
+	size_t segment_size;
+
+	if (!get_message_addresses(sock, message, &local_addr, recvaddr, &segment_size)) {
+		fastd_buffer_free(buffer);
+		return;
+	}
+
+	handle_socket_receive(sock, &local_addr, recvaddr, buffer);
+}
+
+/** Returns the buffer size needed to receive any packet */
+size_t fastd_receive_buffer_size(void) {
+	return max_size_t(fastd_max_payload(ctx.max_mtu) + conf.overhead, MAX_HANDSHAKE_SIZE);
+}
+
+/** Updates the receive statistics after a socket has been handled */
+static inline void receive_stats_add(UNUSED size_t datagrams) {
+#ifdef WITH_STATUS_SOCKET
+	fastd_counter_add(&ctx.receive_wakeups, 1);
+	fastd_counter_add(&ctx.receive_datagrams, datagrams);
+#endif
+}
+
+
+#ifdef USE_RECVMMSG
+
+/** The size of the ancillary data buffer of each message of a batched receive */
+#define RECEIVE_CONTROL_SIZE 128
+
+/** The size of the buffers datagrams coalesced by UDP GRO are received into */
+#define UDP_GRO_BUFFER_SIZE 65536
+
+/** The per-message state of a batched receive */
+typedef struct receive_slot {
+	fastd_peer_address_t addr; /**< The source address of the datagram */
+	struct iovec iov;          /**< The I/O vector pointing to the buffer the datagram is received into */
+	fastd_buffer_t *buffer;    /**< The buffer the datagram is received into (NULL when UDP GRO is used) */
+	uint8_t control[RECEIVE_CONTROL_SIZE] __attribute__((aligned(8))); /**< The ancillary data of the datagram */
+} receive_slot_t;
+
+/** The message headers passed to recvmmsg() */
+static THREAD_LOCAL struct mmsghdr *receive_msgs = NULL;
+
+/** The per-message state corresponding to the entries of receive_msgs */
+static THREAD_LOCAL receive_slot_t *receive_slots = NULL;
+
+/** The buffers for messages received on sockets with UDP GRO, one per entry of receive_msgs */
+static THREAD_LOCAL uint8_t (*receive_gro_buffers)[UDP_GRO_BUFFER_SIZE] = NULL;
+
+
+/**
+   Allocates the message vectors used for batched receives
+
+   With worker threads, this must be called by each thread that receives packets.
+*/
+void fastd_receive_init(void) {
+	receive_msgs = fastd_new0_array(conf.receive_batch, struct mmsghdr);
+	receive_slots = fastd_new0_array(conf.receive_batch, receive_slot_t);
+
+	if (conf.udp_receive_offload)
+		receive_gro_buffers = fastd_alloc_array(conf.receive_batch, UDP_GRO_BUFFER_SIZE);
+}
+
+/** Frees the message vectors used for batched receives */
+void fastd_receive_free(void) {
+	free(receive_msgs);
+	free(receive_slots);
+	free(receive_gro_buffers);
+}
+
+/**
+   Splits a message that has been read from a socket with UDP GRO into its datagrams and handles them
+
+   Returns the number of datagrams the message consisted of.
+*/
+static size_t handle_socket_gro_message(
+	fastd_socket_t *sock, struct msghdr *message, fastd_peer_address_t *recvaddr, const uint8_t *data, size_t len) {
 	fastd_peer_address_t local_addr;
+	size_t segment_size;
+
+	if (!len)
+		return 1;
+
+	if (!get_message_addresses(sock, message, &local_addr, recvaddr, &segment_size))
+		return 1;
+
+	if (!segment_size)
+		segment_size = len;
+
+	size_t max_len = fastd_receive_buffer_size();
+	size_t offset, datagrams = 0;
+
+	for (offset = 0; offset < len; offset += segment_size) {
+		/* Like recvmsg(), we truncate oversized datagrams */
+		size_t datagram_len = min_size_t(min_size_t(segment_size, len - offset), max_len);
+
+		fastd_buffer_t *buffer = fastd_buffer_alloc(datagram_len, conf.decrypt_headroom);
+		memcpy(buffer->data, data + offset, datagram_len);
+
+		handle_socket_receive(sock, &local_addr, recvaddr, buffer);
+		datagrams++;
+	}
+
+	return datagrams;
+}
+
+/**
+   Reads up to \e max (but at most conf.receive_batch) messages from a socket with a single recvmmsg() call
+
+   The datagrams are handled in the order they were received in. On sockets with UDP GRO,
+   each message may contain multiple coalesced datagrams. Returns the number of messages that
+   have been read; if it is less than requested, the socket has been drained.
+*/
+size_t fastd_receive(fastd_socket_t *sock, size_t max) {
+	size_t max_len = fastd_receive_buffer_size();
+
+	/*
+	  Handling a datagram can close a dynamic or connected peer socket, so we must not touch
+	  such a socket again after the first datagram. They are only used for a
+	  single peer, so there is little use in batching on them anyway.
+	*/
+	size_t n = sock->peer ? 1 : min_size_t(max, conf.receive_batch);
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		receive_slot_t *slot = &receive_slots[i];
+
+		if (sock->udp_gro) {
+			slot->buffer = NULL;
+			slot->iov.iov_base = receive_gro_buffers[i];
+			slot->iov.iov_len = sizeof(receive_gro_buffers[i]);
+		} else {
+			slot->buffer = fastd_buffer_alloc(max_len, conf.decrypt_headroom);
+			slot->iov.iov_base = slot->buffer->data;
+			slot->iov.iov_len = slot->buffer->len;
+		}
+
+		receive_msgs[i].msg_hdr = (struct msghdr){
+			.msg_name = &slot->addr,
+			.msg_namelen = sizeof(slot->addr),
+			.msg_iov = &slot->iov,
+			.msg_iovlen = 1,
+			.msg_control = slot->control,
+			.msg_controllen = sizeof(slot->control),
+		};
+	}
+
+	int ret = recvmmsg(sock->fd.fd, receive_msgs, n, MSG_DONTWAIT, NULL);
+	if (ret < 0) {
+		/* Connected sockets report ICMP errors of earlier sends as ECONNREFUSED */
+		if (errno == ECONNREFUSED)
+			pr_debug_errno("recvmmsg");
+		else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			pr_warn_errno("recvmmsg");
+
+		ret = 0;
+	}
+
+	/*
+	  Peers and handshakes only ever refer to the sockets of the main thread,
+	  packets sent through them are redirected to the worker's own socket
+	*/
+	if (sock->parent)
+		sock = sock->parent;
+
+	size_t count = ret;
+
+	for (i = count; i < n; i++) {
+		if (receive_slots[i].buffer)
+			fastd_buffer_free(receive_slots[i].buffer);
+	}
+
+	size_t datagrams = 0;
+
+	for (i = 0; i < count; i++) {
+		receive_slot_t *slot = &receive_slots[i];
+		size_t len = receive_msgs[i].msg_len;
+
+		if (!slot->buffer) {
+			datagrams += handle_socket_gro_message(
+				sock, &receive_msgs[i].msg_hdr, &slot->addr, slot->iov.iov_base, len);
+			continue;
+		}
+
+		datagrams++;
+
+		if (!len) {
+			fastd_buffer_free(slot->buffer);
+			continue;
+		}
+
+		slot->buffer->len = len;
+		handle_socket_message(sock, &receive_msgs[i].msg_hdr, &slot->addr, slot->buffer);
+	}
+
+	receive_stats_add(datagrams);
+
+	return count;
+}
+
+#else
+
+void fastd_receive_init(void) {}
+
+void fastd_receive_free(void) {}
+
+/** Reads a packet from a socket, returning false if there was none to read */
+static bool receive_single(fastd_socket_t *sock) {
+	fastd_buffer_t *buffer = fastd_buffer_alloc(fastd_receive_buffer_size(), conf.decrypt_headroom);
 	fastd_peer_address_t recvaddr;
 	struct iovec buffer_vec = { .iov_base = buffer->data, .iov_len = buffer->len };
 	uint8_t cbuf[1024] __attribute__((aligned(8)));
@@ -253,33 +557,68 @@ void fastd_receive(fastd_socket_t *sock) {
 		.msg_controllen = sizeof(cbuf),
 	};
 
-	ssize_t len = recvmsg(sock->fd.fd, &message, 0);
+	ssize_t len = recvmsg(sock->fd.fd, &message, MSG_DONTWAIT);
 	if (len <= 0) {
-		if (len < 0)
+		if (len < 0 && errno == ECONNREFUSED)
+			pr_debug_errno("recvmsg");
+		else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
 			pr_warn_errno("recvmsg");
 
+		receive_stats_add(0);
 		fastd_buffer_free(buffer);
-		return;
+		return (len == 0);
 	}
 
 	buffer->len = len;
 
-	handle_socket_control(&message, sock, &local_addr);
+	receive_stats_add(1);
+	handle_socket_message(sock, &message, &recvaddr, buffer);
+	return true;
+}
 
-#ifdef USE_PKTINFO
-	if (!local_addr.sa.sa_family) {
-		pr_error("received packet without packet info");
-		fastd_buffer_free(buffer);
-		return;
+/**
+   Reads up to \e max packets from a socket
+
+   Returns the number of packets that have been read; if it is less than requested, the socket
+   has been drained.
+*/
+size_t fastd_receive(fastd_socket_t *sock, size_t max) {
+	/* Handling a packet can close a dynamic peer socket, see the recvmmsg() variant */
+	size_t n = sock->peer ? 1 : max;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (!receive_single(sock))
+			break;
 	}
+
+	return i;
+}
+
 #endif
 
-	fastd_peer_address_simplify(&local_addr);
-	fastd_peer_address_simplify(&recvaddr);
+#ifdef USE_IO_URING
 
-	handle_socket_receive(sock, &local_addr, &recvaddr, buffer);
+/**
+   Handles a datagram that has been received by the poll interface
+
+   With io_uring, datagrams are received into buffers provided to the kernel in advance, so
+   fastd_receive() is only used for sockets with UDP GRO.
+*/
+void fastd_receive_datagram(
+	fastd_socket_t *sock, struct msghdr *message, fastd_peer_address_t *recvaddr, fastd_buffer_t *buffer) {
+	receive_stats_add(1);
+
+	if (!buffer->len) {
+		fastd_buffer_free(buffer);
+		return;
+	}
+
+	handle_socket_message(sock, message, recvaddr, buffer);
 }
 
+#endif
+
 /** Handles a received and decrypted payload packet */
 void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reordered) {
 	if (conf.mode == MODE_TAP) {
@@ -300,7 +639,8 @@ void fastd_handle_receive(fastd_peer_t *peer, fastd_buffer_t *buffer, bool reord
 	if (reordered)
 		fastd_stats_add(peer, STAT_RX_REORDERED, buffer->len);
 
-	fastd_iface_write(peer->iface, buffer);
+	if (!fastd_offload_receive(peer->iface, buffer))
+		fastd_iface_write(peer->iface, buffer);
 
 	if (conf.mode == MODE_TAP && conf.forward) {
 		/*
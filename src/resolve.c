@@ -108,7 +108,7 @@ void fastd_resolve_peer(fastd_peer_t *peer, fastd_remote_t *remote) {
 
 	pr_verbose("resolving host `%s' for peer %P...", remote->hostname, peer);
 
-	remote->last_resolve_timeout = ctx.now + MIN_RESOLVE_INTERVAL;
+	remote->last_resolve_timeout = fastd_now() + MIN_RESOLVE_INTERVAL;
 
 	resolv_arg_t *arg = fastd_new(resolv_arg_t);
 
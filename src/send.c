@@ -16,7 +16,9 @@
 
 
 #include "fastd.h"
+#include "eth_addr.h"
 #include "peer.h"
+#include "worker.h"
 
 #include <sys/uio.h>
 
@@ -39,7 +41,7 @@ static inline void add_pktinfo(struct msghdr *msg, const fastd_peer_address_t *l
 		cmsg->cmsg_type = IP_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
 
-		msg->msg_controllen += cmsg->cmsg_len;
+		msg->msg_controllen += CMSG_SPACE(sizeof(struct in_pktinfo));
 
 		struct in_pktinfo pktinfo = {};
 		pktinfo.ipi_spec_dst = local_addr->in.sin_addr;
@@ -53,7 +55,7 @@ static inline void add_pktinfo(struct msghdr *msg, const fastd_peer_address_t *l
 		cmsg->cmsg_type = IPV6_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
 
-		msg->msg_controllen += cmsg->cmsg_len;
+		msg->msg_controllen += CMSG_SPACE(sizeof(struct in6_pktinfo));
 
 		struct in6_pktinfo pktinfo = {};
 		pktinfo.ipi6_addr = local_addr->in6.sin6_addr;
@@ -65,113 +67,750 @@ static inline void add_pktinfo(struct msghdr *msg, const fastd_peer_address_t *l
 	}
 }
 
-/** Sends a packet */
-void fastd_send(
-	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
-	fastd_peer_t *peer, fastd_buffer_t *buffer, size_t stat_size) {
-	if (!sock)
-		exit_bug("send: sock == NULL");
+/** The size of the ancillary data buffer of each outgoing message */
+#define SEND_CONTROL_SIZE 128
+
+/** The maximum number of packets sent with a single UDP segmentation offload send */
+#define UDP_SEGMENT_MAX_SEGMENTS 64
+
+/** The maximum total payload size of a UDP segmentation offload send */
+#define UDP_SEGMENT_MAX_SIZE 65507
+
+
+/** A packet to send */
+typedef struct fastd_send_entry {
+	fastd_peer_address_t remote_addr; /**< The destination address (widened for IPv6 sockets) */
+	fastd_peer_address_t local_addr;  /**< The source address (AF_UNSPEC if none should be set) */
+	fastd_peer_t *peer;               /**< The peer the packet is sent to (or NULL) */
+	fastd_buffer_t *buffer;           /**< The packet data */
+	size_t stat_size;                 /**< The size to add to the statistics */
+} fastd_send_entry_t;
 
-	struct msghdr msg = {};
-	uint8_t cbuf[1024] __attribute__((aligned(8))) = {};
-	fastd_peer_address_t remote_addr6;
+/** The buffers referenced by the header of a single outgoing message */
+typedef struct send_message_buffers {
+	struct iovec iov;                                                /**< The I/O vector of the message */
+	uint8_t control[SEND_CONTROL_SIZE] __attribute__((aligned(8))); /**< The ancillary data of the message */
+} send_message_buffers_t;
+
+
+#ifdef USE_UDP_SEGMENT
+/** Adds a UDP segment size to ancillary control messages */
+static inline void add_segment_size(struct msghdr *msg, uint16_t segment_size) {
+	struct cmsghdr *cmsg = (struct cmsghdr *)((char *)msg->msg_control + msg->msg_controllen);
+
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(segment_size));
+
+	msg->msg_controllen += CMSG_SPACE(sizeof(segment_size));
+
+	memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+}
+#endif
+
+/**
+   Initializes the message header for a packet to send
+
+   The I/O vector must already point to the packet data. Packets sent on connected sockets have
+   no destination address. If \e segment_size is non-zero, the kernel is asked to split the
+   message into UDP datagrams of the given size.
+*/
+static void init_message(
+	struct msghdr *msg, struct iovec *iov, size_t iovlen, uint8_t *control, const fastd_send_entry_t *entry,
+	UNUSED uint16_t segment_size) {
+	*msg = (struct msghdr){};
+
+	switch (entry->remote_addr.sa.sa_family) {
+	case AF_UNSPEC:
+		/* Sent on a connected socket */
+		break;
 
-	switch (remote_addr->sa.sa_family) {
 	case AF_INET:
-		msg.msg_name = (void *)&remote_addr->in;
-		msg.msg_namelen = sizeof(struct sockaddr_in);
+		msg->msg_name = (void *)&entry->remote_addr.in;
+		msg->msg_namelen = sizeof(struct sockaddr_in);
 		break;
 
 	case AF_INET6:
-		msg.msg_name = (void *)&remote_addr->in6;
-		msg.msg_namelen = sizeof(struct sockaddr_in6);
+		msg->msg_name = (void *)&entry->remote_addr.in6;
+		msg->msg_namelen = sizeof(struct sockaddr_in6);
 		break;
 
 	default:
 		exit_bug("unsupported address family");
 	}
 
-	if (sock->bound_addr->sa.sa_family == AF_INET6) {
-		remote_addr6 = *remote_addr;
-		fastd_peer_address_widen(&remote_addr6);
+	msg->msg_iov = iov;
+	msg->msg_iovlen = iovlen;
+	msg->msg_control = control;
+	msg->msg_controllen = 0;
 
-		msg.msg_name = (void *)&remote_addr6.in6;
-		msg.msg_namelen = sizeof(struct sockaddr_in6);
-	}
+	add_pktinfo(msg, &entry->local_addr);
 
-	struct iovec iov = { .iov_base = buffer->data, .iov_len = buffer->len };
-
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	msg.msg_control = cbuf;
-	msg.msg_controllen = 0;
+#ifdef USE_UDP_SEGMENT
+	if (segment_size)
+		add_segment_size(msg, segment_size);
+#endif
 
-	add_pktinfo(&msg, local_addr);
+	if (!msg->msg_controllen)
+		msg->msg_control = NULL;
+}
 
-	if (!msg.msg_controllen)
-		msg.msg_control = NULL;
+/**
+   Finishes sending a packet
 
-	int ret = sendmsg(sock->fd.fd, &msg, 0);
+   If sending has failed with an error that might have been caused by the packet info,
+   the packet is sent again without it. Afterwards, the statistics are updated and the
+   packet's buffer is freed.
+*/
+static void finish_send(const fastd_socket_t *sock, struct msghdr *msg, const fastd_send_entry_t *entry, bool sent) {
+	fastd_peer_t *peer = entry->peer;
 
-	if (ret < 0 && msg.msg_controllen) {
+	if (!sent && msg->msg_controllen) {
 		switch (errno) {
 		case EINVAL:
 		case ENETUNREACH:
 			pr_debug2("sendmsg: %s (trying again without pktinfo)", strerror(errno));
 
-			if (peer && !fastd_peer_handshake_scheduled(peer))
-				fastd_peer_schedule_handshake_default(peer);
+			if (peer && !fastd_peer_handshake_scheduled(peer)) {
+				if (fastd_worker_is_shared())
+					fastd_peer_defer(peer, PEER_DEFERRED_HANDSHAKE);
+				else
+					fastd_peer_schedule_handshake_default(peer);
+			}
 
-			msg.msg_control = NULL;
-			msg.msg_controllen = 0;
+			msg->msg_control = NULL;
+			msg->msg_controllen = 0;
 
-			ret = sendmsg(sock->fd.fd, &msg, 0);
+			sent = (sendmsg(sock->fd.fd, msg, 0) >= 0);
 		}
 	}
 
-	if (ret < 0) {
+	if (!sent) {
 		switch (errno) {
 		case EAGAIN:
 #if EAGAIN != EWOULDBLOCK
 		case EWOULDBLOCK:
 #endif
 			pr_debug2_errno("sendmsg");
-			fastd_stats_add(peer, STAT_TX_DROPPED, stat_size);
+			fastd_stats_add(peer, STAT_TX_DROPPED, entry->stat_size);
 			break;
 
 		case ENETDOWN:
 		case ENETUNREACH:
 		case EHOSTUNREACH:
+		case ECONNREFUSED:
 			pr_debug_errno("sendmsg");
-			fastd_stats_add(peer, STAT_TX_ERROR, stat_size);
+			fastd_stats_add(peer, STAT_TX_ERROR, entry->stat_size);
 			break;
 
 		default:
 			pr_warn_errno("sendmsg");
-			fastd_stats_add(peer, STAT_TX_ERROR, stat_size);
+			fastd_stats_add(peer, STAT_TX_ERROR, entry->stat_size);
 		}
 	} else {
-		fastd_stats_add(peer, STAT_TX, stat_size);
+		fastd_stats_add(peer, STAT_TX, entry->stat_size);
 	}
 
-	fastd_buffer_free(buffer);
+	fastd_buffer_free(entry->buffer);
+}
+
+
+/** Sends a single packet immediately */
+static void send_single(const fastd_socket_t *sock, const fastd_send_entry_t *entry) {
+	struct msghdr msg;
+	send_message_buffers_t bufs;
+
+	bufs.iov = (struct iovec){ .iov_base = entry->buffer->data, .iov_len = entry->buffer->len };
+	init_message(&msg, &bufs.iov, 1, bufs.control, entry, 0);
+
+	finish_send(sock, &msg, entry, sendmsg(sock->fd.fd, &msg, 0) >= 0);
+}
+
+#ifdef USE_SENDMMSG
+
+/** A queue of packets waiting to be sent on a socket */
+struct fastd_send_queue {
+	fastd_socket_t *sock;               /**< The socket the packets are sent on */
+	VECTOR(fastd_send_entry_t) entries; /**< The queued packets */
+};
+
+/** A message passed to sendmmsg(), consisting of one or more consecutive queued packets */
+typedef struct send_message_info {
+	size_t first;    /**< The index of the first packet of the message in the send queue */
+	size_t segments; /**< The number of packets in the message */
+} send_message_info_t;
+
+
+/** A list of send queues */
+typedef VECTOR(fastd_send_queue_t *) send_queue_list_t;
+
+
+/**
+   The send queues of the current thread that currently contain packets
+
+   Each socket is only used by a single thread, so the queues of different threads never overlap.
+*/
+static THREAD_LOCAL send_queue_list_t pending_queues = {};
+
+/** The total number of queued packets of all sockets of the current thread */
+static THREAD_LOCAL size_t queued = 0;
+
+/** The message headers passed to sendmmsg() */
+static THREAD_LOCAL struct mmsghdr *send_msgs = NULL;
+
+/** The packets the entries of send_msgs consist of */
+static THREAD_LOCAL send_message_info_t *send_infos = NULL;
+
+/** The I/O vectors of all queued packets of the socket that is flushed */
+static THREAD_LOCAL struct iovec *send_iovs = NULL;
+
+/** The ancillary data buffers of the entries of send_msgs */
+static THREAD_LOCAL uint8_t (*send_controls)[SEND_CONTROL_SIZE] = NULL;
+
+#ifdef USE_IO_URING
+
+/**
+   A message that has been submitted to io_uring
+
+   Requests are taken from a fixed pool in the order they are submitted. The request at a pool
+   index uses the packet slots (send_request_entries and send_request_iovs) starting at the same
+   index, so each message's packets are stored consecutively.
+*/
+typedef struct send_request {
+	fastd_socket_t *sock; /**< The socket the message is sent on */
+	struct msghdr msg;    /**< The message header */
+	uint8_t control[SEND_CONTROL_SIZE] __attribute__((aligned(8))); /**< The ancillary data of the message */
+
+	size_t segments; /**< The number of packets in the message */
+	size_t slots;    /**< The number of pool slots used (including skipped slots at the end of the pool) */
+	bool done;       /**< Set when the message has been completed, or if the request marks skipped slots */
+} send_request_t;
+
+/** The pool of requests submitted to io_uring (only used by the main thread) */
+static send_request_t send_requests[IO_URING_SEND_PACKETS];
+
+/** The packets of the messages submitted to io_uring */
+static fastd_send_entry_t send_request_entries[IO_URING_SEND_PACKETS];
+
+/** The I/O vectors of the messages submitted to io_uring */
+static struct iovec send_request_iovs[IO_URING_SEND_PACKETS];
+
+/** The pool index of the oldest request that hasn't been released yet */
+static size_t send_requests_first = 0;
+
+/** The number of pool slots used by the requests that haven't been released yet */
+static size_t send_requests_used = 0;
+
+#endif
+
+
+/**
+   Allocates the message vectors used for batched sends
+
+   With worker threads, this must be called by each thread that sends packets.
+*/
+void fastd_send_init(void) {
+	send_msgs = fastd_new0_array(conf.send_batch, struct mmsghdr);
+	send_infos = fastd_new0_array(conf.send_batch, send_message_info_t);
+	send_iovs = fastd_new0_array(conf.send_batch, struct iovec);
+	send_controls = fastd_alloc_aligned(conf.send_batch * SEND_CONTROL_SIZE, 8);
+
+}
+
+/** Frees the message vectors used for batched sends */
+void fastd_send_free(void) {
+	VECTOR_FREE(pending_queues);
+
+	free(send_msgs);
+	free(send_infos);
+	free(send_iovs);
+	free(send_controls);
+}
+
+/** Creates the send queue of a socket */
+fastd_send_queue_t *fastd_send_queue_new(fastd_socket_t *sock) {
+	fastd_send_queue_t *queue = fastd_new0(fastd_send_queue_t);
+	queue->sock = sock;
+	return queue;
+}
+
+/**
+   Returns how many consecutive packets starting at the given index can be sent with a single
+   UDP segmentation offload send
+
+   All packets must have the same destination and source, and the same size, except for the
+   last one, which may be shorter.
+*/
+static size_t count_segments(UNUSED const fastd_send_queue_t *queue, UNUSED size_t first) {
+#ifdef USE_UDP_SEGMENT
+	if (!queue->sock->udp_segment)
+		return 1;
+
+	const fastd_send_entry_t *entry = &VECTOR_INDEX(queue->entries, first);
+	size_t segment_size = entry->buffer->len;
+	size_t total = segment_size;
+	size_t i;
+
+	if (!segment_size)
+		return 1;
+
+	for (i = first + 1; i < VECTOR_LEN(queue->entries) && i - first < UDP_SEGMENT_MAX_SEGMENTS; i++) {
+		const fastd_send_entry_t *next = &VECTOR_INDEX(queue->entries, i);
+		size_t len = next->buffer->len;
+
+		if (!len || len > segment_size || total + len > UDP_SEGMENT_MAX_SIZE)
+			break;
+
+		if (!fastd_peer_address_equal(&next->remote_addr, &entry->remote_addr) ||
+		    !fastd_peer_address_equal(&next->local_addr, &entry->local_addr))
+			break;
+
+		total += len;
+
+		if (len < segment_size) {
+			i++;
+			break;
+		}
+	}
+
+	return i - first;
+#else
+	return 1;
+#endif
+}
+
+/**
+   Finishes sending a message consisting of multiple packets
+
+   If the message could not be sent for a reason other than a full socket buffer, the packets
+   are sent again one by one. UDP segmentation offload is disabled on the socket if the kernel
+   or the network device do not support it.
+*/
+static void finish_segmented_send(fastd_socket_t *sock, const fastd_send_entry_t *entries, size_t segments, bool sent) {
+	size_t i;
+
+	if (!sent) {
+		int err = errno;
+
+		switch (err) {
+		case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+		case EWOULDBLOCK:
+#endif
+			for (i = 0; i < segments; i++) {
+				struct msghdr msg = {};
+
+				errno = err;
+				finish_send(sock, &msg, &entries[i], false);
+			}
+
+			return;
+
+		case EIO:
+		case EOPNOTSUPP:
+		case ENOPROTOOPT:
+			pr_warn("sendmsg: %s (disabling UDP segmentation offload on socket bound to %B)", strerror(err),
+				sock->bound_addr);
+			sock->udp_segment = false;
+			break;
+
+		default:
+			pr_debug2("sendmsg: %s (trying again without UDP segmentation offload)", strerror(err));
+		}
+
+		for (i = 0; i < segments; i++)
+			send_single(sock, &entries[i]);
+
+		return;
+	}
+
+	for (i = 0; i < segments; i++) {
+		struct msghdr msg = {};
+		finish_send(sock, &msg, &entries[i], true);
+	}
+}
+
+/** Finishes sending one of the messages in send_msgs */
+static void finish_message(fastd_send_queue_t *queue, size_t msg, bool sent) {
+	const send_message_info_t *info = &send_infos[msg];
+
+	if (info->segments > 1)
+		finish_segmented_send(queue->sock, &VECTOR_INDEX(queue->entries, info->first), info->segments, sent);
+	else
+		finish_send(queue->sock, &send_msgs[msg].msg_hdr, &VECTOR_INDEX(queue->entries, info->first), sent);
+}
+
+#ifdef USE_IO_URING
+
+/**
+   Takes a request for a message of the given number of packets from the pool
+
+   Returns NULL if the pool doesn't have enough consecutive free slots.
+*/
+static send_request_t *alloc_request(size_t segments) {
+	size_t next = (send_requests_first + send_requests_used) % IO_URING_SEND_PACKETS;
+	size_t skip = (next + segments > IO_URING_SEND_PACKETS) ? IO_URING_SEND_PACKETS - next : 0;
+
+	if (send_requests_used + skip + segments > IO_URING_SEND_PACKETS)
+		return NULL;
+
+	if (skip) {
+		send_requests[next] = (send_request_t){ .slots = skip, .done = true };
+		send_requests_used += skip;
+		next = 0;
+	}
+
+	send_request_t *req = &send_requests[next];
+	req->segments = segments;
+	req->slots = segments;
+	req->done = false;
+
+	send_requests_used += segments;
+
+	return req;
+}
+
+/** Returns the packets of a request */
+static inline fastd_send_entry_t *request_entries(const send_request_t *req) {
+	return &send_request_entries[req - send_requests];
+}
+
+/** Returns the oldest completed requests to the pool */
+static void release_requests(void) {
+	while (send_requests_used) {
+		const send_request_t *req = &send_requests[send_requests_first];
+		if (!req->done)
+			break;
+
+		send_requests_first = (send_requests_first + req->slots) % IO_URING_SEND_PACKETS;
+		send_requests_used -= req->slots;
+	}
+}
+
+/**
+   Submits the messages prepared in send_msgs to io_uring
+
+   The messages are sent together with the next wait for events. Returns false if the queue must be
+   sent with sendmmsg() instead, as its socket may be closed at any time, it belongs to a worker thread
+   or the request pool is exhausted.
+*/
+static bool submit_queue(fastd_send_queue_t *queue, size_t n_msgs) {
+	fastd_socket_t *sock = queue->sock;
+
+	if (!sock->addr || sock->parent)
+		return false;
+
+	/* Submit all messages or none to retain the order of the packets; allocating again yields the same slots */
+	size_t used = send_requests_used;
+	size_t i;
+
+	for (i = 0; i < n_msgs; i++) {
+		if (!alloc_request(send_infos[i].segments)) {
+			send_requests_used = used;
+			return false;
+		}
+	}
+
+	send_requests_used = used;
+
+	for (i = 0; i < n_msgs; i++) {
+		const send_message_info_t *info = &send_infos[i];
+		const struct msghdr *msg = &send_msgs[i].msg_hdr;
+		send_request_t *req = alloc_request(info->segments);
+		fastd_send_entry_t *entries = request_entries(req);
+		struct iovec *iovs = &send_request_iovs[req - send_requests];
+
+		req->sock = sock;
+
+		memcpy(entries, &VECTOR_INDEX(queue->entries, info->first),
+		       info->segments * sizeof(fastd_send_entry_t));
+		memcpy(iovs, msg->msg_iov, info->segments * sizeof(struct iovec));
+
+		req->msg = *msg;
+		req->msg.msg_name = &entries[0].remote_addr;
+		req->msg.msg_iov = iovs;
+
+		if (msg->msg_controllen) {
+			memcpy(req->control, msg->msg_control, msg->msg_controllen);
+			req->msg.msg_control = req->control;
+		}
+
+		fastd_poll_send(sock->fd.fd, &req->msg, req);
+	}
+
+	return true;
+}
+
+/** Finishes sending a message that has been submitted to io_uring */
+void fastd_send_complete(void *request, int res) {
+	send_request_t *req = request;
+	fastd_send_entry_t *entries = request_entries(req);
+
+	if (res < 0)
+		errno = -res;
+
+	if (req->segments > 1)
+		finish_segmented_send(req->sock, entries, req->segments, res >= 0);
+	else
+		finish_send(req->sock, &req->msg, &entries[0], res >= 0);
+
+	req->done = true;
+	release_requests();
+}
+
+#endif
+
+/** Sends all packets queued on a socket with as few sendmmsg() calls as possible */
+static void flush_queue(fastd_send_queue_t *queue) {
+	size_t n = VECTOR_LEN(queue->entries);
+	size_t n_msgs = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		const fastd_buffer_t *buffer = VECTOR_INDEX(queue->entries, i).buffer;
+		send_iovs[i] = (struct iovec){ .iov_base = buffer->data, .iov_len = buffer->len };
+	}
+
+	for (i = 0; i < n; n_msgs++) {
+		size_t segments = count_segments(queue, i);
+		const fastd_send_entry_t *entry = &VECTOR_INDEX(queue->entries, i);
+
+		send_infos[n_msgs] = (send_message_info_t){ .first = i, .segments = segments };
+		init_message(
+			&send_msgs[n_msgs].msg_hdr, &send_iovs[i], segments, send_controls[n_msgs], entry,
+			(segments > 1) ? entry->buffer->len : 0);
+
+		i += segments;
+	}
+
+#ifdef USE_IO_URING
+	if (submit_queue(queue, n_msgs)) {
+		queued -= n;
+		VECTOR_RESIZE(queue->entries, 0);
+		return;
+	}
+#endif
+
+	i = 0;
+	while (i < n_msgs) {
+		int ret = sendmmsg(queue->sock->fd.fd, &send_msgs[i], n_msgs - i, 0);
+
+		if (ret <= 0) {
+			/* sendmmsg() only returns an error when the first message could not be sent */
+			finish_message(queue, i, false);
+			i++;
+			continue;
+		}
+
+		size_t end = i + ret;
+		for (; i < end; i++)
+			finish_message(queue, i, true);
+	}
+
+	queued -= n;
+	VECTOR_RESIZE(queue->entries, 0);
+}
+
+/** Flushes and frees the send queue of a socket */
+void fastd_send_queue_free(fastd_send_queue_t *queue) {
+	if (VECTOR_LEN(queue->entries)) {
+		flush_queue(queue);
+
+		size_t i;
+		for (i = 0; i < VECTOR_LEN(pending_queues); i++) {
+			if (VECTOR_INDEX(pending_queues, i) == queue) {
+				VECTOR_DELETE(pending_queues, i);
+				break;
+			}
+		}
+	}
+
+	VECTOR_FREE(queue->entries);
+	free(queue);
+}
+
+/** Sends all queued packets */
+void fastd_send_flush(void) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(pending_queues); i++)
+		flush_queue(VECTOR_INDEX(pending_queues, i));
+
+	VECTOR_RESIZE(pending_queues, 0);
+}
+
+/** Removes all references to a peer from a list of packets */
+static void forget_peer_entries(fastd_send_entry_t *entries, size_t n, const fastd_peer_t *peer) {
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (entries[i].peer == peer) {
+			entries[i].peer = NULL;
+			entries[i].stat_size = 0;
+		}
+	}
+}
+
+/** Removes all references to a peer from the queues of a list */
+static void forget_peer(const send_queue_list_t *queues, const fastd_peer_t *peer) {
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(*queues); i++) {
+		fastd_send_queue_t *queue = VECTOR_INDEX(*queues, i);
+		forget_peer_entries(VECTOR_DATA(queue->entries), VECTOR_LEN(queue->entries), peer);
+	}
+}
+
+/**
+   Removes all references to a peer that is about to be freed from the queued packets
+
+   Peers are only deleted by the main thread while no worker thread is handling packets, and the
+   workers flush their queues before they stop doing so, so only the queues of the calling thread
+   need to be checked. With io_uring, the messages that are still being sent are checked as well.
+*/
+void fastd_send_forget_peer(const fastd_peer_t *peer) {
+	forget_peer(&pending_queues, peer);
+
+#ifdef USE_IO_URING
+	size_t i;
+	for (i = 0; i < send_requests_used;) {
+		const send_request_t *req = &send_requests[(send_requests_first + i) % IO_URING_SEND_PACKETS];
+		if (!req->done)
+			forget_peer_entries(request_entries(req), req->segments, peer);
+
+		i += req->slots;
+	}
+#endif
 }
 
-/** Encrypts and sends a payload packet to all peers */
+/**
+   Adds a packet to the send queue of a socket
+
+   Worker threads use their own socket with the same bind address instead of the socket of
+   the main thread. Packets they send on dynamic peer sockets are sent immediately.
+*/
+static void send_entry(const fastd_socket_t *sock, const fastd_send_entry_t *entry) {
+	const fastd_socket_t *own_sock = fastd_worker_socket(sock);
+	if (!own_sock) {
+		send_single(sock, entry);
+		return;
+	}
+
+	if (queued >= conf.send_batch)
+		fastd_send_flush();
+
+	fastd_send_queue_t *queue = own_sock->queue;
+
+	if (!VECTOR_LEN(queue->entries))
+		VECTOR_ADD(pending_queues, queue);
+
+	VECTOR_ADD(queue->entries, *entry);
+	queued++;
+}
+
+#else
+
+void fastd_send_init(void) {}
+
+void fastd_send_free(void) {}
+
+fastd_send_queue_t *fastd_send_queue_new(UNUSED fastd_socket_t *sock) {
+	return NULL;
+}
+
+void fastd_send_queue_free(UNUSED fastd_send_queue_t *queue) {}
+
+void fastd_send_flush(void) {}
+
+void fastd_send_forget_peer(UNUSED const fastd_peer_t *peer) {}
+
+/** Sends a packet immediately */
+static void send_entry(const fastd_socket_t *sock, const fastd_send_entry_t *entry) {
+	send_single(sock, entry);
+}
+
+#endif
+
+
+/**
+   Returns the connected socket of a peer if a packet to the given addresses can be sent on it (or NULL)
+
+   Worker threads keep sending on their own sockets, so their packets can still be batched.
+*/
+static inline const fastd_socket_t *connected_socket(
+	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	const fastd_peer_t *peer) {
+	if (!peer || !peer->connected_sock || sock != peer->sock || fastd_worker_socket(sock) != sock)
+		return NULL;
+
+	if (!fastd_peer_address_equal(remote_addr, &peer->address))
+		return NULL;
+
+	if (local_addr && !fastd_peer_address_equal(local_addr, &peer->local_address))
+		return NULL;
+
+	return peer->connected_sock;
+}
+
+/**
+   Sends a packet
+
+   Where supported, the packet is only queued and sent with other packets for the same
+   socket when fastd_send_flush() is called, at the latest before fastd waits for new events.
+*/
+void fastd_send(
+	const fastd_socket_t *sock, const fastd_peer_address_t *local_addr, const fastd_peer_address_t *remote_addr,
+	fastd_peer_t *peer, fastd_buffer_t *buffer, size_t stat_size) {
+	if (!sock)
+		exit_bug("send: sock == NULL");
+
+	fastd_send_entry_t entry = {
+		.peer = peer,
+		.buffer = buffer,
+		.stat_size = stat_size,
+	};
+
+	const fastd_socket_t *connected = connected_socket(sock, local_addr, remote_addr, peer);
+	if (connected) {
+		send_entry(connected, &entry);
+		return;
+	}
+
+	entry.remote_addr = *remote_addr;
+
+	if (local_addr)
+		entry.local_addr = *local_addr;
+
+	if (sock->bound_addr->sa.sa_family == AF_INET6)
+		fastd_peer_address_widen(&entry.remote_addr);
+
+	send_entry(sock, &entry);
+}
+
+/**
+   Encrypts and sends a payload packet to all peers
+
+   All but the last peer share the same plaintext buffer, which is only encrypted into a new
+   buffer for each of them.
+*/
 static inline void send_all(fastd_buffer_t *buffer, fastd_peer_t *source) {
+	bool prepared = false;
+
 	size_t i;
 	for (i = 0; i < VECTOR_LEN(ctx.peers); i++) {
 		fastd_peer_t *dest = VECTOR_INDEX(ctx.peers, i);
 		if (dest == source || !fastd_peer_is_established(dest))
 			continue;
 
-		/* optimization, primarily for TUN mode: don't duplicate the buffer for the last (or only) peer */
+		/* optimization, primarily for TUN mode: hand the buffer itself to the last (or only) peer */
 		if (i == VECTOR_LEN(ctx.peers) - 1) {
 			conf.protocol->send(dest, buffer);
 			return;
 		}
 
-		conf.protocol->send(dest, fastd_buffer_dup(buffer, conf.encrypt_headroom));
+		if (!prepared) {
+			buffer = fastd_buffer_prepare_shared(buffer, conf.encrypt_headroom);
+			prepared = true;
+		}
+
+		conf.protocol->send_shared(dest, buffer);
 	}
 
 	fastd_buffer_free(buffer);
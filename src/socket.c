@@ -11,6 +11,7 @@
 */
 
 #include "fastd.h"
+#include "peer.h"
 #include "polling.h"
 
 #include <net/if.h>
@@ -82,6 +83,16 @@ static int bind_socket(const fastd_bind_address_t *addr) {
 	}
 #endif
 
+#ifdef SO_REUSEPORT
+	/* Allow the worker threads and the connected peer sockets to bind sockets to the same address */
+	if (conf.worker_threads || conf.socket_connect) {
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+			pr_error_errno("setsockopt: unable to set SO_REUSEPORT");
+			goto error;
+		}
+	}
+#endif
+
 #ifdef USE_PMTU
 	int pmtu = IP_PMTUDISC_DONT;
 	if (setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu))) {
@@ -156,6 +167,42 @@ error:
 	return -1;
 }
 
+/** Enables UDP segmentation offload on a socket if it is configured and supported by the kernel */
+static bool init_udp_segment(UNUSED int fd) {
+#ifdef USE_UDP_SEGMENT
+	if (!conf.udp_segmentation)
+		return false;
+
+	int zero = 0;
+	if (setsockopt(fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero))) {
+		pr_warn_errno("setsockopt: unable to enable UDP segmentation offload");
+		return false;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/** Enables UDP GRO on a socket if it is configured and supported by the kernel */
+static bool init_udp_gro(UNUSED int fd) {
+#ifdef USE_UDP_GRO
+	if (!conf.udp_receive_offload)
+		return false;
+
+	int one = 1;
+	if (setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one))) {
+		pr_warn_errno("setsockopt: unable to enable UDP GRO");
+		return false;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
 /** Gets the address a socket is bound to and sets it in the socket structure */
 static void set_bound_address(fastd_socket_t *sock) {
 	fastd_peer_address_t addr = {};
@@ -183,6 +230,14 @@ void fastd_socket_bind_all(void) {
 			exit(1); /* message has already been printed */
 
 		set_bound_address(sock);
+		sock->queue = fastd_send_queue_new(sock);
+		sock->udp_segment = init_udp_segment(sock->fd.fd);
+
+		/*
+		  Dynamic peer sockets can be closed while a received packet is handled,
+		  so UDP GRO is only used on the bound sockets, which stay open.
+		*/
+		sock->udp_gro = init_udp_gro(sock->fd.fd);
 
 		fastd_peer_address_t bound_addr = *sock->bound_addr;
 		if (!sock->addr->addr.sa.sa_family)
@@ -197,6 +252,36 @@ void fastd_socket_bind_all(void) {
 	}
 }
 
+#ifdef USE_WORKER_THREADS
+
+/**
+   Initializes a socket of a worker thread bound to the same address as a socket of the main thread
+
+   The kernel distributes incoming datagrams over all sockets bound to the address by flow.
+   The new socket is not registered with the main thread's poll interface.
+*/
+void fastd_socket_clone(fastd_socket_t *sock, fastd_socket_t *parent) {
+	/* Use the actual port, as the configured one may be random */
+	fastd_bind_address_t addr = *parent->addr;
+	addr.addr.in.sin_port = fastd_peer_address_get_port(parent->bound_addr);
+
+	*sock = (fastd_socket_t){};
+
+	sock->fd = FASTD_POLL_FD(POLL_TYPE_SOCKET, bind_socket(&addr));
+	if (sock->fd.fd < 0)
+		exit(1); /* message has already been printed */
+
+	sock->addr = parent->addr;
+	sock->parent = parent;
+
+	set_bound_address(sock);
+	sock->queue = fastd_send_queue_new(sock);
+	sock->udp_segment = init_udp_segment(sock->fd.fd);
+	sock->udp_gro = init_udp_gro(sock->fd.fd);
+}
+
+#endif
+
 /** Opens a single socket bound to a random port for the given address family */
 fastd_socket_t *fastd_socket_open(fastd_peer_t *peer, int af) {
 	const fastd_bind_address_t any_address = { .addr.sa.sa_family = af };
@@ -227,6 +312,65 @@ fastd_socket_t *fastd_socket_open(fastd_peer_t *peer, int af) {
 	sock->peer = peer;
 
 	set_bound_address(sock);
+	sock->queue = fastd_send_queue_new(sock);
+	sock->udp_segment = init_udp_segment(fd);
+
+	fastd_poll_fd_register(&sock->fd);
+
+	return sock;
+}
+
+/**
+   Opens a socket connected to the current address of an established peer
+
+   The socket is bound to the local address of the peer and the port of its bound socket, which
+   shares the port using SO_REUSEPORT. As the kernel prefers connected sockets when it delivers
+   datagrams, all packets from the peer are received on the new socket, so the peer doesn't need
+   to be looked up by its address. Packets sent on it need neither a destination address nor
+   packet info, and the kernel can cache the route.
+
+   Returns NULL if the socket can't be opened; the peer's bound socket is used in this case.
+*/
+fastd_socket_t *fastd_socket_connect(fastd_peer_t *peer) {
+	const fastd_socket_t *parent = peer->sock;
+
+	fastd_bind_address_t addr = *parent->addr;
+	if (peer->local_address.sa.sa_family != AF_UNSPEC)
+		addr.addr = peer->local_address;
+	else
+		addr.addr.in.sin_port = fastd_peer_address_get_port(parent->bound_addr);
+
+	int fd = bind_socket(&addr);
+	if (fd < 0)
+		return NULL;
+
+	fastd_socket_t *sock = fastd_new0(fastd_socket_t);
+
+	sock->fd = FASTD_POLL_FD(POLL_TYPE_SOCKET, fd);
+	sock->addr = NULL;
+	sock->peer = peer;
+	sock->connected = true;
+
+	set_bound_address(sock);
+
+	fastd_peer_address_t remote_addr = peer->address;
+	if (sock->bound_addr->sa.sa_family == AF_INET6)
+		fastd_peer_address_widen(&remote_addr);
+
+	if (connect(fd, &remote_addr.sa,
+		    remote_addr.sa.sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in))) {
+		pr_warn_errno("connect");
+
+		if (close(fd))
+			pr_error_errno("close");
+
+		free(sock->bound_addr);
+		free(sock);
+		return NULL;
+	}
+
+	sock->queue = fastd_send_queue_new(sock);
+	sock->udp_segment = init_udp_segment(fd);
 
 	fastd_poll_fd_register(&sock->fd);
 
@@ -235,8 +379,15 @@ fastd_socket_t *fastd_socket_open(fastd_peer_t *peer, int af) {
 
 /** Closes a socket */
 void fastd_socket_close(fastd_socket_t *sock) {
+	if (sock->queue) {
+		fastd_send_queue_free(sock->queue);
+		sock->queue = NULL;
+	}
+
 	if (sock->fd.fd >= 0) {
-		if (!fastd_poll_fd_close(&sock->fd))
+		/* Sockets of worker threads are not registered with the main thread's poll interface */
+		bool ok = sock->parent ? (close(sock->fd.fd) == 0) : fastd_poll_fd_close(&sock->fd);
+		if (!ok)
 			pr_error_errno("closing socket: close");
 
 		sock->fd.fd = -1;
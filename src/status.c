@@ -16,6 +16,7 @@
 
 #ifdef WITH_STATUS_SOCKET
 
+#include "eth_addr.h"
 #include "method.h"
 #include "peer.h"
 
@@ -88,6 +89,73 @@ static json_object *dump_stats(const fastd_stats_t *stats) {
 }
 
 
+/** Dumps the socket receive statistics as a JSON object */
+static json_object *dump_receive(void) {
+	struct json_object *ret = json_object_new_object();
+
+	json_object_object_add(ret, "wakeups", json_object_new_int64(ctx.receive_wakeups));
+	json_object_object_add(ret, "datagrams", json_object_new_int64(ctx.receive_datagrams));
+	json_object_object_add(
+		ret, "datagrams_per_wakeup",
+		json_object_new_double(
+			ctx.receive_wakeups ? (double)ctx.receive_datagrams / ctx.receive_wakeups : 0));
+	json_object_object_add(
+		ret, "interface_drain_budget_exhausted",
+		json_object_new_int64(ctx.iface ? ctx.iface->fd.budget_exhausted : 0));
+
+	return ret;
+}
+
+
+/** Dumps the bound sockets and their capabilities as a JSON object */
+static json_object *dump_sockets(void) {
+	struct json_object *ret = json_object_new_object();
+
+	size_t i;
+	for (i = 0; i < ctx.n_socks; i++) {
+		const fastd_socket_t *sock = &ctx.socks[i];
+
+		if (sock->fd.fd < 0)
+			continue;
+
+		/* '[' + IPv6 addresss + '%' + interface + ']:' + port + NUL */
+		char addr_buf[1 + INET6_ADDRSTRLEN + 2 + IFNAMSIZ + 1 + 5 + 1];
+		fastd_snprint_peer_address(addr_buf, sizeof(addr_buf), sock->bound_addr, NULL, true, false);
+
+		struct json_object *socket = json_object_new_object();
+		json_object_object_add(socket, "udp_segmentation", json_object_new_boolean(sock->udp_segment));
+		json_object_object_add(socket, "udp_receive_offload", json_object_new_boolean(sock->udp_gro));
+		json_object_object_add(
+			socket, "drain_budget_exhausted", json_object_new_int64(sock->fd.budget_exhausted));
+
+		json_object_object_add(ret, addr_buf, socket);
+	}
+
+	return ret;
+}
+
+
+/** Dumps the size classes of the buffer pool as a JSON array */
+static json_object *dump_buffers(void) {
+	struct json_object *ret = json_object_new_array();
+
+	fastd_buffer_stats_t stats[BUFFER_CLASSES];
+	size_t i, n = min_size_t(fastd_buffer_get_stats(stats, BUFFER_CLASSES), BUFFER_CLASSES);
+
+	for (i = 0; i < n; i++) {
+		struct json_object *cls = json_object_new_object();
+		json_object_object_add(cls, "size", json_object_new_int64(stats[i].size));
+		json_object_object_add(cls, "total", json_object_new_int64(stats[i].total));
+		json_object_object_add(cls, "high_water", json_object_new_int64(stats[i].high_water));
+		json_object_object_add(cls, "alloc_failures", json_object_new_int64(stats[i].alloc_failures));
+
+		json_object_array_add(ret, cls);
+	}
+
+	return ret;
+}
+
+
 /** Dumps a peer's status as a JSON object */
 static json_object *dump_peer(const fastd_peer_t *peer) {
 	struct json_object *ret = json_object_new_object();
@@ -107,7 +175,8 @@ static json_object *dump_peer(const fastd_peer_t *peer) {
 	if (fastd_peer_is_established(peer)) {
 		connection = json_object_new_object();
 
-		json_object_object_add(connection, "established", json_object_new_int64(ctx.now - peer->established));
+		json_object_object_add(
+			connection, "established", json_object_new_int64(fastd_now() - peer->established));
 
 		struct json_object *method = NULL;
 
@@ -124,13 +193,8 @@ static json_object *dump_peer(const fastd_peer_t *peer) {
 			struct json_object *mac_addresses = json_object_new_array();
 			json_object_object_add(connection, "mac_addresses", mac_addresses);
 
-			size_t i;
-			for (i = 0; i < VECTOR_LEN(ctx.eth_addrs); i++) {
-				fastd_peer_eth_addr_t *addr = &VECTOR_INDEX(ctx.eth_addrs, i);
-
-				if (addr->peer != peer)
-					continue;
-
+			const fastd_peer_eth_addr_t *addr;
+			for (addr = peer->eth_addrs; addr; addr = addr->peer_next) {
 				const uint8_t *d = addr->addr.data;
 
 				char eth_addr_buf[18];
@@ -152,12 +216,15 @@ static json_object *dump_peer(const fastd_peer_t *peer) {
 static void dump_status(int fd) {
 	struct json_object *json = json_object_new_object();
 
-	json_object_object_add(json, "uptime", json_object_new_int64(ctx.now - ctx.started));
+	json_object_object_add(json, "uptime", json_object_new_int64(fastd_now() - ctx.started));
 
 	if (ctx.iface)
 		json_object_object_add(json, "interface", dump_iface(ctx.iface));
 
 	json_object_object_add(json, "statistics", dump_stats(&ctx.stats));
+	json_object_object_add(json, "receive", dump_receive());
+	json_object_object_add(json, "sockets", dump_sockets());
+	json_object_object_add(json, "buffers", dump_buffers());
 
 	struct json_object *peers = json_object_new_object();
 	json_object_object_add(json, "peers", peers);
@@ -8,23 +8,25 @@
    \file
 
    Task queue
+
+   The scheduled tasks are kept in a hierarchical timer wheel, so scheduling and removing tasks
+   takes constant time regardless of the number of peers.
 */
 
 #include "task.h"
+#include "eth_addr.h"
 #include "peer.h"
 
 
 /** Performs periodic maintenance tasks */
 static inline void maintenance(void) {
 	fastd_peer_eth_addr_cleanup();
+	conf.protocol->maintenance();
 	fastd_task_reschedule_relative(&ctx.next_maintenance, MAINTENANCE_INTERVAL);
 }
 
 /** Handles one task */
-static void handle_task(void) {
-	fastd_task_t *task = container_of(ctx.task_queue, fastd_task_t, entry);
-	fastd_pqueue_remove(ctx.task_queue);
-
+static void handle_task(fastd_task_t *task) {
 	switch (task->type) {
 	case TASK_TYPE_MAINTENANCE:
 		maintenance();
@@ -39,22 +41,186 @@ static void handle_task(void) {
 	}
 }
 
+
+/** The bits of a timeout covered by the levels of the task wheel */
+#define TASK_WHEEL_RANGE (((uint64_t)1 << (TASK_WHEEL_BITS * TASK_WHEEL_LEVELS)) - 1)
+
+
+/** Returns the index of the slot of a level of the task wheel a time falls into */
+static inline size_t wheel_index(uint64_t time, size_t level) {
+	return (time >> (TASK_WHEEL_BITS * level)) & (TASK_WHEEL_SLOTS - 1);
+}
+
+/** Unlinks a task from its slot */
+static void wheel_unlink(fastd_task_t *task) {
+	*task->pprev = task->next;
+	if (task->next)
+		task->next->pprev = task->pprev;
+
+	task->next = NULL;
+	task->pprev = NULL;
+}
+
+/** Adds a task to the slot for its timeout, relative to the current time of the wheel */
+static void wheel_add(fastd_task_t *task) {
+	fastd_task_wheel_t *wheel = &ctx.task_wheel;
+	uint64_t time = wheel->time;
+	uint64_t expires = (task->timeout > wheel->time) ? task->timeout : wheel->time;
+
+	fastd_task_t **slot;
+
+	if ((expires ^ time) > TASK_WHEEL_RANGE) {
+		/* Timeouts outside of the range of the wheel are added again when the wheel reaches the next range */
+		slot = &wheel->overflow;
+	} else {
+		size_t level = 0;
+		if (expires != time)
+			level = (63 - __builtin_clzll(expires ^ time)) / TASK_WHEEL_BITS;
+
+		size_t index = wheel_index(expires, level);
+		slot = &wheel->slots[level][index];
+		wheel->occupied[level] |= (uint64_t)1 << index;
+	}
+
+	task->next = *slot;
+	task->pprev = slot;
+	if (task->next)
+		task->next->pprev = &task->next;
+
+	*slot = task;
+}
+
+/**
+   Finds the non-empty slot of the task wheel that starts first
+
+   Returns the start time of the slot, or FASTD_TIMEOUT_INV if the wheel is empty. When slots of
+   different levels start at the same time, the one of the highest level is returned, so its tasks
+   are moved down before any tasks of the lower levels are handled. The overflow list is returned
+   as level TASK_WHEEL_LEVELS, starting with the next range of the wheel.
+*/
+static fastd_timeout_t wheel_next(size_t *level, size_t *index) {
+	fastd_task_wheel_t *wheel = &ctx.task_wheel;
+	fastd_timeout_t ret = FASTD_TIMEOUT_INV;
+
+	if (wheel->overflow) {
+		ret = ((uint64_t)wheel->time | TASK_WHEEL_RANGE) + 1;
+		*level = TASK_WHEEL_LEVELS;
+		*index = 0;
+	}
+
+	size_t l;
+	for (l = TASK_WHEEL_LEVELS; l-- > 0;) {
+		uint64_t bits = wheel->occupied[l] & (~(uint64_t)0 << wheel_index(wheel->time, l));
+
+		while (bits) {
+			size_t i = __builtin_ctzll(bits);
+
+			/* Bits of slots emptied by fastd_task_unschedule() are only cleared here */
+			if (!wheel->slots[l][i]) {
+				wheel->occupied[l] &= ~((uint64_t)1 << i);
+				bits &= ~((uint64_t)1 << i);
+				continue;
+			}
+
+			uint64_t mask = ((uint64_t)1 << (TASK_WHEEL_BITS * (l + 1))) - 1;
+			uint64_t offset = (uint64_t)i << (TASK_WHEEL_BITS * l);
+			fastd_timeout_t start = ((uint64_t)wheel->time & ~mask) | offset;
+
+			if (start < ret) {
+				ret = start;
+				*level = l;
+				*index = i;
+			}
+
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/**
+   Removes and returns a task whose timeout has been reached
+
+   Returns NULL when there are no more such tasks. The tasks of each slot of the lowest level of
+   the task wheel are all due at the same time, so they are returned without looking at the other
+   slots again.
+*/
+fastd_task_t *fastd_task_get_due(void) {
+	fastd_task_wheel_t *wheel = &ctx.task_wheel;
+
+	while (true) {
+		fastd_task_t *task = wheel->slots[0][wheel_index(wheel->time, 0)];
+		if (task) {
+			wheel_unlink(task);
+			return task;
+		}
+
+		size_t level, index;
+		fastd_timeout_t start = wheel_next(&level, &index);
+
+		if (start > fastd_now()) {
+			/* No slot starts before the current time, so the wheel can just be moved forward */
+			if (wheel->time < fastd_now())
+				wheel->time = fastd_now();
+
+			return NULL;
+		}
+
+		wheel->time = start;
+
+		if (!level)
+			continue;
+
+		/* Move the tasks of the slot to the lower levels */
+		if (level == TASK_WHEEL_LEVELS) {
+			task = wheel->overflow;
+			wheel->overflow = NULL;
+		} else {
+			task = wheel->slots[level][index];
+			wheel->slots[level][index] = NULL;
+			wheel->occupied[level] &= ~((uint64_t)1 << index);
+		}
+
+		while (task) {
+			fastd_task_t *next = task->next;
+			wheel_add(task);
+			task = next;
+		}
+	}
+}
+
 /** Handles all tasks whose timeout has been reached */
 void fastd_task_handle(void) {
-	while (ctx.task_queue && fastd_timed_out(ctx.task_queue->value))
-		handle_task();
+	fastd_task_t *task;
+
+	while ((task = fastd_task_get_due()))
+		handle_task(task);
 }
 
 /** Puts a task back into the queue with a new timeout */
 void fastd_task_reschedule(fastd_task_t *task, fastd_timeout_t timeout) {
-	task->entry.value = timeout;
-	fastd_pqueue_insert(&ctx.task_queue, &task->entry);
+	if (fastd_task_scheduled(task))
+		wheel_unlink(task);
+
+	task->timeout = timeout;
+	wheel_add(task);
 }
 
-/** Gets the timeout of the next task in the task queue */
-fastd_timeout_t fastd_task_queue_timeout(void) {
-	if (!ctx.task_queue)
-		return FASTD_TIMEOUT_INV;
+/** Removes a task from the queue */
+void fastd_task_unschedule(fastd_task_t *task) {
+	if (fastd_task_scheduled(task))
+		wheel_unlink(task);
+}
+
+/**
+   Gets the timeout of the next task in the task queue
 
-	return ctx.task_queue->value;
+   For tasks in the higher levels of the task wheel, only the start of their slot is known, so the
+   returned value may lie before the actual timeout. fastd_task_handle() will then only move the
+   tasks to the lower levels.
+*/
+fastd_timeout_t fastd_task_queue_timeout(void) {
+	size_t level, index;
+	return wheel_next(&level, &index);
 }
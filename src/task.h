@@ -12,25 +12,56 @@
 
 #pragma once
 
-#include "pqueue.h"
+#include "types.h"
+
+
+/** The number of bits of a timeout handled by each level of the task wheel */
+#define TASK_WHEEL_BITS 6
+
+/** The number of slots of each level of the task wheel */
+#define TASK_WHEEL_SLOTS (1 << TASK_WHEEL_BITS)
+
+/** The number of levels of the task wheel (covering timeouts up to 2^48 ms in the future) */
+#define TASK_WHEEL_LEVELS 8
 
 
 /** A scheduled task */
 struct fastd_task {
-	fastd_pqueue_t entry;   /**< Task queue entry */
-	fastd_task_type_t type; /**< Type of the task */
+	fastd_task_t *next;      /**< The next task in the same slot of the task wheel */
+	fastd_task_t **pprev;    /**< The pointer to this task in its slot (NULL if the task isn't scheduled) */
+	fastd_timeout_t timeout; /**< The time the task is scheduled for */
+	fastd_task_type_t type;  /**< Type of the task */
+};
+
+/**
+   A hierarchical timer wheel holding the scheduled tasks
+
+   Level \e l of the wheel sorts the tasks by bits (6 * l) to (6 * l + 5) of their timeouts. Each
+   task is put into the lowest level at which its timeout only differs from the current time of the
+   wheel in these bits, or the bits below. When the time of the wheel reaches the start of a slot in
+   a higher level, the tasks in this slot are moved to the lower levels. Tasks whose timeouts differ
+   from the current time in even higher bits are kept in an overflow list until the time of the
+   wheel reaches the next multiple of 2^48 ms.
+*/
+struct fastd_task_wheel {
+	fastd_timeout_t time; /**< The time up to which the slots of the wheel have been handled */
+	uint64_t occupied[TASK_WHEEL_LEVELS]; /**< A bitmap of the non-empty slots of each level */
+	fastd_task_t *slots[TASK_WHEEL_LEVELS][TASK_WHEEL_SLOTS]; /**< The lists of tasks in each slot */
+	fastd_task_t *overflow; /**< The tasks whose timeouts lie beyond the range of the top level */
 };
 
 
 void fastd_task_handle(void);
+fastd_task_t *fastd_task_get_due(void);
 
 void fastd_task_reschedule(fastd_task_t *task, fastd_timeout_t timeout);
+void fastd_task_unschedule(fastd_task_t *task);
 fastd_timeout_t fastd_task_queue_timeout(void);
 
 
 /** Checks if the given task is currently scheduled */
 static inline bool fastd_task_scheduled(fastd_task_t *task) {
-	return fastd_pqueue_linked(&task->entry);
+	return task->pprev;
 }
 
 /** Gets the timeout of a task */
@@ -38,17 +69,12 @@ static inline fastd_timeout_t fastd_task_timeout(fastd_task_t *task) {
 	if (!fastd_task_scheduled(task))
 		return FASTD_TIMEOUT_INV;
 
-	return task->entry.value;
-}
-
-/** Removes a task from the queue */
-static inline void fastd_task_unschedule(fastd_task_t *task) {
-	fastd_pqueue_remove(&task->entry);
+	return task->timeout;
 }
 
 /** Puts a task back into the queue with a new timeout relative to the old one */
 static inline void fastd_task_reschedule_relative(fastd_task_t *task, int64_t delay) {
-	fastd_task_reschedule(task, task->entry.value + delay);
+	fastd_task_reschedule(task, task->timeout + delay);
 }
 
 /** Schedules a task with given type and timeout */
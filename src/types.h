@@ -22,6 +22,14 @@
 /** Annotation for unused function parameters */
 #define UNUSED __attribute__((unused))
 
+#ifdef USE_WORKER_THREADS
+/** Annotation for variables which exist once per thread, as they are used by the main thread and each worker thread */
+#define THREAD_LOCAL __thread
+#else
+/** Annotation for variables which exist once per thread (a no-op without worker thread support) */
+#define THREAD_LOCAL
+#endif
+
 
 /** A tri-state with the values \em true, \em false and \em undefined */
 typedef struct fastd_tristate {
@@ -86,21 +94,26 @@ typedef int64_t fastd_timeout_t;
 typedef struct fastd_buffer fastd_buffer_t;
 typedef struct fastd_buffer_view fastd_buffer_view_t;
 typedef struct fastd_poll_fd fastd_poll_fd_t;
-typedef struct fastd_pqueue fastd_pqueue_t;
 typedef struct fastd_task fastd_task_t;
+typedef struct fastd_task_wheel fastd_task_wheel_t;
 
 typedef union fastd_peer_address fastd_peer_address_t;
 typedef struct fastd_bind_address fastd_bind_address_t;
 typedef struct fastd_iface fastd_iface_t;
 typedef struct fastd_socket fastd_socket_t;
+typedef struct fastd_send_queue fastd_send_queue_t;
+typedef struct fastd_worker fastd_worker_t;
 typedef struct fastd_peer_group fastd_peer_group_t;
 typedef struct fastd_eth_addr fastd_eth_addr_t;
 typedef struct fastd_eth_header fastd_eth_header_t;
 typedef struct fastd_peer fastd_peer_t;
 typedef struct fastd_peer_eth_addr fastd_peer_eth_addr_t;
+typedef struct fastd_eth_addr_slot fastd_eth_addr_slot_t;
+typedef struct fastd_peer_hashtable_entry fastd_peer_hashtable_entry_t;
 typedef struct fastd_remote fastd_remote_t;
 typedef struct fastd_stats fastd_stats_t;
 typedef struct fastd_handshake_timeout fastd_handshake_timeout_t;
+typedef struct fastd_handshake_bucket fastd_handshake_bucket_t;
 
 typedef struct fastd_config fastd_config_t;
 typedef struct fastd_context fastd_context_t;
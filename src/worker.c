@@ -0,0 +1,438 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Worker threads handling packets in parallel to the main thread
+
+   Each worker thread has its own queue of the multi-queue TAP interface and its own socket for
+   each bind address, which are bound with SO_REUSEPORT. The kernel distributes the received
+   packets over the main thread and the workers by flow.
+
+   The threads handling packets share the state of the main thread, but only read it. The main thread
+   holds the lock exclusively while it changes the state (handling handshakes, tasks, configuration
+   reloads, etc.) and releases it while it waits for events and while it handles packets itself; the
+   worker threads hold it in shared mode while they handle packets. The few changes made on the data
+   path are either made atomically (statistics, timeouts, the current time), under the lock of the
+   affected peer (the session state used for encryption and decryption), or handed to the main thread
+   through the async notification socket (handshakes and payload packets of unknown peers, peer resets,
+   session refreshes and newly learned MAC addresses).
+*/
+
+
+#include "worker.h"
+#include "fastd.h"
+#include "offload.h"
+
+#include <sys/epoll.h>
+
+
+#ifdef USE_WORKER_THREADS
+
+
+/** A worker thread */
+struct fastd_worker {
+	pthread_t thread;         /**< The thread handle */
+	int epoll_fd;             /**< The worker's epoll instance */
+	fastd_poll_fd_t iface_fd; /**< The worker's queue of the TAP interface */
+	fastd_socket_t *socks;    /**< The worker's sockets, in the same order as ctx.socks */
+};
+
+
+/** The mutex protecting the state of the lock shared by the threads handling packets */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signalled when the main thread releases the exclusive lock or the last thread releases the shared lock */
+static pthread_cond_t lock_cond = PTHREAD_COND_INITIALIZER;
+
+/** The number of worker threads currently holding the lock in shared mode */
+static size_t shared_holders = 0;
+
+/** Set while the main thread holds the lock exclusively or waits for it */
+static bool exclusive = false;
+
+/** The worker threads */
+static fastd_worker_t *workers = NULL;
+
+/** Set while the worker threads are running */
+static bool running = false;
+
+/** Set when the worker threads should terminate */
+static bool stopping = false;
+
+/** A pipe that is written to to wake up the worker threads when they should terminate */
+static int stop_pipe[2] = { -1, -1 };
+
+/** The worker the current thread is running (NULL for the main thread) */
+static THREAD_LOCAL fastd_worker_t *current_worker = NULL;
+
+/** Set while the current thread handles packets in parallel to other threads */
+static THREAD_LOCAL bool shared = false;
+
+
+/** Locks the mutex protecting the lock state */
+static inline void mutex_acquire(void) {
+	if ((errno = pthread_mutex_lock(&lock)) != 0)
+		exit_errno("pthread_mutex_lock");
+}
+
+/** Unlocks the mutex protecting the lock state */
+static inline void mutex_release(void) {
+	if ((errno = pthread_mutex_unlock(&lock)) != 0)
+		exit_errno("pthread_mutex_unlock");
+}
+
+/** Waits for a change of the lock state */
+static inline void mutex_wait(void) {
+	if ((errno = pthread_cond_wait(&lock_cond, &lock)) != 0)
+		exit_errno("pthread_cond_wait");
+}
+
+/** Wakes up all threads waiting for a change of the lock state */
+static inline void mutex_broadcast(void) {
+	if ((errno = pthread_cond_broadcast(&lock_cond)) != 0)
+		exit_errno("pthread_cond_broadcast");
+}
+
+/**
+   Acquires the lock exclusively in the main thread
+
+   New shared holders are blocked as soon as the main thread starts waiting, so the main thread can't
+   be starved by busy worker threads.
+*/
+static void exclusive_acquire(void) {
+	int err = errno;
+
+	mutex_acquire();
+
+	exclusive = true;
+	while (shared_holders)
+		mutex_wait();
+
+	mutex_release();
+
+	errno = err;
+}
+
+/** Releases the exclusive lock of the main thread */
+static void exclusive_release(void) {
+	mutex_acquire();
+
+	exclusive = false;
+	mutex_broadcast();
+
+	mutex_release();
+}
+
+/** Acquires the lock in shared mode in a worker thread, returning false if the worker should terminate instead */
+static bool shared_acquire(void) {
+	mutex_acquire();
+
+	while (exclusive && !stopping)
+		mutex_wait();
+
+	bool ret = !stopping;
+	if (ret)
+		shared_holders++;
+
+	mutex_release();
+
+	return ret;
+}
+
+/** Releases the shared lock of a worker thread */
+static void shared_release(void) {
+	mutex_acquire();
+
+	if (!--shared_holders && exclusive)
+		mutex_broadcast();
+
+	mutex_release();
+}
+
+
+/** Releases the lock before the main thread waits for events, if worker threads are running */
+void fastd_worker_poll_begin(void) {
+	if (running)
+		exclusive_release();
+}
+
+/** Reacquires the lock after fastd_worker_poll_begin(), preserving errno */
+void fastd_worker_poll_end(void) {
+	if (running)
+		exclusive_acquire();
+}
+
+/**
+   Releases the lock before the main thread handles packets
+
+   Until fastd_worker_data_end() is called, the main thread is subject to the same restrictions as the
+   worker threads (see fastd_worker_is_shared()).
+*/
+void fastd_worker_data_begin(void) {
+	if (!running)
+		return;
+
+	exclusive_release();
+	shared = true;
+}
+
+/** Reacquires the lock after fastd_worker_data_begin() */
+void fastd_worker_data_end(void) {
+	if (!running)
+		return;
+
+	shared = false;
+	exclusive_acquire();
+}
+
+/**
+   Checks if the current thread handles packets in parallel to other threads
+
+   If it does, the state shared by all threads must not be changed except through the facilities intended
+   for this: atomic updates, the lock of a peer (fastd_peer_lock()) and deferring changes to the main
+   thread (fastd_peer_defer() and the async notifications).
+*/
+bool fastd_worker_is_shared(void) {
+	return shared;
+}
+
+
+/**
+   Returns the socket of the current thread with the same bind address as a socket of the main thread
+
+   Returns NULL for dynamic peer sockets when called by a worker thread, as packets can't be queued on
+   sockets owned by another thread.
+*/
+const fastd_socket_t *fastd_worker_socket(const fastd_socket_t *sock) {
+	if (!current_worker || sock->parent)
+		return sock;
+
+	if (!sock->addr)
+		return NULL;
+
+	return &current_worker->socks[sock - ctx.socks];
+}
+
+
+/** Adds a file descriptor to a worker's epoll instance */
+static void worker_poll_add(fastd_worker_t *worker, int fd, fastd_poll_fd_t *data) {
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.ptr = data,
+	};
+
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+		exit_errno("epoll_ctl");
+}
+
+/**
+   Opens the sockets and interface queues of the worker threads
+
+   This must be called after the sockets of the main thread have been bound and the TAP interface
+   has been opened, while fastd still has the capabilities needed to do so.
+*/
+void fastd_workers_init(void) {
+	if (!conf.worker_threads)
+		return;
+
+	if (pipe2(stop_pipe, O_CLOEXEC) < 0)
+		exit_errno("pipe2");
+
+	workers = fastd_new0_array(conf.worker_threads, fastd_worker_t);
+
+	size_t i, j;
+	for (i = 0; i < conf.worker_threads; i++) {
+		fastd_worker_t *worker = &workers[i];
+
+		worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (worker->epoll_fd < 0)
+			exit_errno("epoll_create1");
+
+		worker_poll_add(worker, stop_pipe[0], NULL);
+
+		worker->iface_fd = FASTD_POLL_FD(POLL_TYPE_IFACE, fastd_iface_open_queue(ctx.iface));
+		worker_poll_add(worker, worker->iface_fd.fd, &worker->iface_fd);
+
+		worker->socks = fastd_new0_array(ctx.n_socks, fastd_socket_t);
+
+		for (j = 0; j < ctx.n_socks; j++) {
+			fastd_socket_t *sock = &worker->socks[j];
+
+			fastd_socket_clone(sock, &ctx.socks[j]);
+			worker_poll_add(worker, sock->fd.fd, &sock->fd);
+		}
+	}
+
+	pr_debug("initialized %u worker threads", (unsigned)conf.worker_threads);
+}
+
+/** Handles an event on one of a worker's file descriptors */
+static void worker_handle_fd(fastd_poll_fd_t *fd, bool input, bool error) {
+	switch (fd->type) {
+	case POLL_TYPE_IFACE:
+		if (input)
+			fastd_iface_handle_queue(ctx.iface, fd->fd, 1);
+		break;
+
+	case POLL_TYPE_SOCKET: {
+		fastd_socket_t *sock = container_of(fd, fastd_socket_t, fd);
+
+		if (error) {
+			fastd_socket_error(sock);
+			return;
+		}
+
+		if (input)
+			fastd_receive(sock, conf.receive_batch);
+
+		break;
+	}
+
+	default:
+		exit_bug("unknown FD type");
+	}
+
+	if (error)
+		exit_error("unexpected poll error");
+}
+
+/** Handles the events returned by epoll_wait() in a worker thread */
+static void worker_handle_events(const struct epoll_event *events, size_t n) {
+	fastd_poll_drain_t drain[16];
+	size_t i, n_drain = 0;
+
+	for (i = 0; i < n; i++) {
+		fastd_poll_fd_t *fd = events[i].data.ptr;
+
+		/* The stop pipe */
+		if (!fd)
+			continue;
+
+		size_t budget = fastd_poll_drain_budget(fd);
+
+		if (budget && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) == EPOLLIN)
+			drain[n_drain++] = (fastd_poll_drain_t){ fd, budget };
+		else
+			worker_handle_fd(fd, events[i].events & EPOLLIN, events[i].events & (EPOLLERR | EPOLLHUP));
+	}
+
+	fastd_poll_drain(drain, n_drain);
+
+	fastd_offload_flush();
+	fastd_send_flush();
+}
+
+/** The main loop of a worker thread */
+static void *worker_thread(void *p) {
+	current_worker = p;
+	shared = true;
+
+	fastd_send_init();
+	fastd_receive_init();
+
+	while (true) {
+		struct epoll_event events[16];
+
+		int ret = epoll_wait(current_worker->epoll_fd, events, 16, -1);
+		if (ret < 0) {
+			if (errno != EINTR)
+				exit_errno("epoll_wait");
+
+			continue;
+		}
+
+		if (!shared_acquire())
+			break;
+
+		fastd_update_time();
+		worker_handle_events(events, ret);
+
+		shared_release();
+	}
+
+	fastd_send_free();
+	fastd_receive_free();
+	fastd_buffer_cache_flush();
+
+	return NULL;
+}
+
+/**
+   Starts the worker threads
+
+   From here on, the main thread holds the lock exclusively except while it waits for events or handles
+   packets.
+*/
+void fastd_workers_start(void) {
+	if (!conf.worker_threads)
+		return;
+
+	exclusive_acquire();
+	running = true;
+
+	size_t i;
+	for (i = 0; i < conf.worker_threads; i++) {
+		if ((errno = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i])) != 0)
+			exit_errno("unable to create worker thread");
+	}
+}
+
+/** Stops the worker threads and waits for them to terminate */
+void fastd_workers_stop(void) {
+	if (!running)
+		return;
+
+	mutex_acquire();
+	stopping = true;
+	mutex_broadcast();
+	mutex_release();
+
+	static const uint8_t dummy = 0;
+	if (write(stop_pipe[1], &dummy, 1) < 0)
+		exit_errno("write");
+
+	size_t i;
+	for (i = 0; i < conf.worker_threads; i++) {
+		if ((errno = pthread_join(workers[i].thread, NULL)) != 0)
+			exit_errno("pthread_join");
+	}
+
+	running = false;
+	exclusive_release();
+}
+
+/** Closes the sockets and interface queues of the worker threads */
+void fastd_workers_free(void) {
+	if (!workers)
+		return;
+
+	size_t i, j;
+	for (i = 0; i < conf.worker_threads; i++) {
+		fastd_worker_t *worker = &workers[i];
+
+		for (j = 0; j < ctx.n_socks; j++)
+			fastd_socket_close(&worker->socks[j]);
+
+		free(worker->socks);
+
+		if (close(worker->iface_fd.fd))
+			pr_warn_errno("closing TUN/TAP queue: close");
+
+		if (close(worker->epoll_fd))
+			pr_warn_errno("closing EPOLL: close");
+	}
+
+	free(workers);
+	workers = NULL;
+
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+}
+
+
+#endif
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+/**
+   \file
+
+   Worker threads handling packets in parallel to the main thread
+*/
+
+
+#pragma once
+
+#include "types.h"
+
+
+#ifdef USE_WORKER_THREADS
+
+void fastd_workers_init(void);
+void fastd_workers_start(void);
+void fastd_workers_stop(void);
+void fastd_workers_free(void);
+
+void fastd_worker_poll_begin(void);
+void fastd_worker_poll_end(void);
+void fastd_worker_data_begin(void);
+void fastd_worker_data_end(void);
+bool fastd_worker_is_shared(void);
+
+const fastd_socket_t *fastd_worker_socket(const fastd_socket_t *sock);
+
+void fastd_socket_clone(fastd_socket_t *sock, fastd_socket_t *parent);
+int fastd_iface_open_queue(const fastd_iface_t *iface);
+
+#else /* USE_WORKER_THREADS */
+
+static inline void fastd_workers_init(void) {}
+static inline void fastd_workers_start(void) {}
+static inline void fastd_workers_stop(void) {}
+static inline void fastd_workers_free(void) {}
+
+static inline void fastd_worker_poll_begin(void) {}
+static inline void fastd_worker_poll_end(void) {}
+static inline void fastd_worker_data_begin(void) {}
+static inline void fastd_worker_data_end(void) {}
+
+static inline bool fastd_worker_is_shared(void) {
+	return false;
+}
+
+static inline const fastd_socket_t *fastd_worker_socket(const fastd_socket_t *sock) {
+	return sock;
+}
+
+#endif
@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+
+#include "peer_hashtable.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+
+/* The chained hashtable with Jenkins hashing fastd used before, for comparison */
+
+static uint32_t ref_seed;
+static size_t ref_size;
+static size_t ref_used;
+static VECTOR(fastd_peer_t *) *ref_buckets;
+
+static void ref_insert(fastd_peer_t *peer);
+
+static void ref_init(size_t size) {
+	fastd_random_bytes(&ref_seed, sizeof(ref_seed), false);
+	ref_size = size;
+	ref_buckets = fastd_new0_array(ref_size, __typeof__(*ref_buckets));
+}
+
+static void ref_free(void) {
+	size_t i;
+	for (i = 0; i < ref_size; i++)
+		VECTOR_FREE(ref_buckets[i]);
+
+	free(ref_buckets);
+}
+
+static size_t ref_bucket(const fastd_peer_address_t *addr) {
+	uint32_t hash = ref_seed;
+	fastd_peer_address_hash(&hash, addr);
+	fastd_hash_final(&hash);
+
+	return hash % ref_size;
+}
+
+static void ref_resize(fastd_peer_t *peers, size_t n) {
+	ref_free();
+	ref_init(2 * ref_size);
+	ref_used = 0;
+
+	size_t i;
+	for (i = 0; i < n; i++)
+		ref_insert(&peers[i]);
+}
+
+static fastd_peer_t *ref_peers;
+
+static void ref_insert(fastd_peer_t *peer) {
+	ref_used++;
+
+	if (ref_used > 2 * ref_size) {
+		ref_resize(ref_peers, peer - ref_peers + 1);
+		return;
+	}
+
+	VECTOR_ADD(ref_buckets[ref_bucket(&peer->address)], peer);
+}
+
+static void ref_remove(fastd_peer_t *peer) {
+	size_t b = ref_bucket(&peer->address);
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(ref_buckets[b]); i++) {
+		if (VECTOR_INDEX(ref_buckets[b], i) == peer) {
+			VECTOR_DELETE(ref_buckets[b], i);
+			break;
+		}
+	}
+
+	ref_used--;
+}
+
+static fastd_peer_t *ref_lookup(const fastd_peer_address_t *addr) {
+	size_t b = ref_bucket(addr);
+
+	size_t i;
+	for (i = 0; i < VECTOR_LEN(ref_buckets[b]); i++) {
+		fastd_peer_t *peer = VECTOR_INDEX(ref_buckets[b], i);
+
+		if (fastd_peer_address_equal(&peer->address, addr))
+			return peer;
+	}
+
+	return NULL;
+}
+
+
+typedef struct hashtable_impl {
+	const char *name;
+	void (*init)(void);
+	void (*free)(void);
+	void (*insert)(fastd_peer_t *peer);
+	void (*remove)(fastd_peer_t *peer);
+	fastd_peer_t *(*lookup)(const fastd_peer_address_t *addr);
+} hashtable_impl_t;
+
+static void ref_init_default(void) {
+	ref_used = 0;
+	ref_init(8);
+}
+
+static const hashtable_impl_t impls[] = {
+	{
+		.name = "chained (Jenkins)",
+		.init = ref_init_default,
+		.free = ref_free,
+		.insert = ref_insert,
+		.remove = ref_remove,
+		.lookup = ref_lookup,
+	},
+	{
+		.name = "open addressing (SipHash-1-3)",
+		.init = fastd_peer_hashtable_init,
+		.free = fastd_peer_hashtable_free,
+		.insert = fastd_peer_hashtable_insert,
+		.remove = fastd_peer_hashtable_remove,
+		.lookup = fastd_peer_hashtable_lookup,
+	},
+};
+
+
+static int64_t get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return (1000000000 * (int64_t)ts.tv_sec) + ts.tv_nsec;
+}
+
+static void make_address(fastd_peer_address_t *addr, size_t i) {
+	memset(addr, 0, sizeof(*addr));
+
+	if (i % 2) {
+		addr->in.sin_family = AF_INET;
+		addr->in.sin_addr.s_addr = htonl(0x0a000000 | (uint32_t)i);
+		addr->in.sin_port = htons(10000 + i % 1000);
+	} else {
+		addr->in6.sin6_family = AF_INET6;
+		addr->in6.sin6_addr.s6_addr[0] = 0x20;
+		addr->in6.sin6_addr.s6_addr[1] = 0x01;
+		uint32_t v = htonl(i);
+		memcpy(&addr->in6.sin6_addr.s6_addr[12], &v, sizeof(v));
+		addr->in6.sin6_port = htons(10000 + i % 1000);
+	}
+}
+
+static void run_benchmark(const hashtable_impl_t *impl, size_t n_peers, size_t lookups) {
+	printf("Running %s with %zd peers... ", impl->name, n_peers);
+
+	fastd_peer_t *peers = fastd_new0_array(n_peers, fastd_peer_t);
+	fastd_peer_address_t *addrs = fastd_new_array(n_peers, fastd_peer_address_t);
+	fastd_peer_t **expected = fastd_new_array(n_peers, fastd_peer_t *);
+	fastd_peer_address_t miss;
+
+	size_t i;
+	for (i = 0; i < n_peers; i++) {
+		make_address(&peers[i].address, i);
+
+		/* Look up the addresses in a different order than they were inserted in */
+		make_address(&addrs[i], (i * 7919) % n_peers);
+		expected[i] = &peers[(i * 7919) % n_peers];
+	}
+
+	make_address(&miss, n_peers);
+
+	ref_peers = peers;
+
+	impl->init();
+
+	int64_t start = get_time();
+	for (i = 0; i < n_peers; i++)
+		impl->insert(&peers[i]);
+
+	int64_t inserted = get_time();
+
+	size_t found = 0;
+	for (i = 0; i < lookups; i++) {
+		if (impl->lookup(&addrs[i % n_peers]) == expected[i % n_peers])
+			found++;
+		if (!impl->lookup(&miss))
+			found++;
+	}
+
+	int64_t looked_up = get_time();
+
+	for (i = 0; i < n_peers; i++)
+		impl->remove(&peers[i]);
+
+	int64_t removed = get_time();
+
+	impl->free();
+
+	if (found != 2 * lookups)
+		exit_bug("lookup failed");
+
+	printf("insert %.1f ns, lookup %.1f ns, remove %.1f ns\n", (double)(inserted - start) / n_peers,
+	       (double)(looked_up - inserted) / (2 * lookups), (double)(removed - looked_up) / n_peers);
+
+	free(expected);
+	free(addrs);
+	free(peers);
+}
+
+
+int main(void) {
+	/* Suppress the debug messages of the hashtable */
+	ctx.log_initialized = true;
+
+	size_t i, j;
+	static const size_t sizes[] = { 1000, 10000, 100000 };
+
+	for (i = 0; i < array_size(sizes); i++) {
+		for (j = 0; j < array_size(impls); j++)
+			run_benchmark(&impls[j], sizes[i], 10000000);
+	}
+
+	return 0;
+}
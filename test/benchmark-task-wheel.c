@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+
+#include "fastd.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+
+/* The pairing heap fastd used for its task queue before, for comparison */
+
+typedef struct ref_elem ref_elem_t;
+
+struct ref_elem {
+	ref_elem_t **pprev;
+	ref_elem_t *next;
+	ref_elem_t *children;
+	int64_t value;
+};
+
+static ref_elem_t *ref_queue;
+static ref_elem_t *ref_elems;
+
+static void ref_link(ref_elem_t **pqueue, ref_elem_t *elem) {
+	elem->pprev = pqueue;
+	elem->next = *pqueue;
+	if (elem->next)
+		elem->next->pprev = &elem->next;
+
+	*pqueue = elem;
+}
+
+static void ref_unlink(ref_elem_t *elem) {
+	*elem->pprev = elem->next;
+	if (elem->next)
+		elem->next->pprev = elem->pprev;
+
+	elem->next = NULL;
+}
+
+static ref_elem_t *ref_merge(ref_elem_t *pqueue1, ref_elem_t *pqueue2) {
+	if (!pqueue2)
+		return pqueue1;
+
+	ref_elem_t *lo, *hi;
+
+	if (pqueue1->value < pqueue2->value) {
+		lo = pqueue1;
+		hi = pqueue2;
+	} else {
+		lo = pqueue2;
+		hi = pqueue1;
+	}
+
+	ref_link(&lo->children, hi);
+
+	return lo;
+}
+
+static ref_elem_t *ref_merge_pairs(ref_elem_t *pqueue0) {
+	if (!pqueue0)
+		return NULL;
+
+	ref_elem_t *pqueue1 = pqueue0->next;
+
+	if (!pqueue1)
+		return pqueue0;
+
+	ref_elem_t *pqueue2 = pqueue1->next;
+
+	pqueue0->next = pqueue1->next = NULL;
+
+	return ref_merge(ref_merge(pqueue0, pqueue1), ref_merge_pairs(pqueue2));
+}
+
+static void ref_insert(ref_elem_t *elem) {
+	ref_queue = ref_merge(elem, ref_queue);
+	ref_queue->pprev = &ref_queue;
+}
+
+static void ref_remove(ref_elem_t *elem) {
+	if (!elem->pprev)
+		return;
+
+	ref_elem_t **pprev = elem->pprev;
+
+	ref_unlink(elem);
+
+	ref_elem_t *merged = ref_merge_pairs(elem->children);
+	if (merged)
+		ref_link(pprev, merged);
+
+	elem->pprev = NULL;
+	elem->children = NULL;
+}
+
+static void ref_init(size_t n) {
+	ref_queue = NULL;
+	ref_elems = fastd_new0_array(n, ref_elem_t);
+}
+
+static void ref_free(void) {
+	free(ref_elems);
+}
+
+static void ref_reschedule(size_t i, fastd_timeout_t timeout) {
+	ref_remove(&ref_elems[i]);
+	ref_elems[i].value = timeout;
+	ref_insert(&ref_elems[i]);
+}
+
+static ssize_t ref_get_due(void) {
+	if (!ref_queue || !fastd_timed_out(ref_queue->value))
+		return -1;
+
+	ref_elem_t *elem = ref_queue;
+	ref_remove(elem);
+
+	return elem - ref_elems;
+}
+
+
+static fastd_task_t *wheel_tasks;
+
+static void wheel_init(size_t n) {
+	memset(&ctx.task_wheel, 0, sizeof(ctx.task_wheel));
+	ctx.task_wheel.time = ctx.now;
+
+	wheel_tasks = fastd_new0_array(n, fastd_task_t);
+}
+
+static void wheel_free(void) {
+	free(wheel_tasks);
+}
+
+static void wheel_reschedule(size_t i, fastd_timeout_t timeout) {
+	fastd_task_unschedule(&wheel_tasks[i]);
+	fastd_task_reschedule(&wheel_tasks[i], timeout);
+}
+
+static ssize_t wheel_get_due(void) {
+	fastd_task_t *task = fastd_task_get_due();
+	if (!task)
+		return -1;
+
+	return task - wheel_tasks;
+}
+
+
+typedef struct queue_impl {
+	const char *name;
+	void (*init)(size_t n);
+	void (*free)(void);
+	void (*reschedule)(size_t i, fastd_timeout_t timeout);
+	ssize_t (*get_due)(void);
+} queue_impl_t;
+
+static const queue_impl_t impls[] = {
+	{
+		.name = "pairing heap",
+		.init = ref_init,
+		.free = ref_free,
+		.reschedule = ref_reschedule,
+		.get_due = ref_get_due,
+	},
+	{
+		.name = "timer wheel",
+		.init = wheel_init,
+		.free = wheel_free,
+		.reschedule = wheel_reschedule,
+		.get_due = wheel_get_due,
+	},
+};
+
+
+static int64_t get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return (1000000000 * (int64_t)ts.tv_sec) + ts.tv_nsec;
+}
+
+/* Returns a timeout like the ones of peer tasks: handshakes, keepalives and resets 15 to 90 seconds ahead */
+static fastd_timeout_t peer_timeout(void) {
+	return ctx.now + 15000 + random() % 75000;
+}
+
+/*
+  Simulates the task queue of n_peers established peers for a number of milliseconds
+
+  In each millisecond, packets received from a number of random peers move their timeouts, and
+  all tasks that are due are handled and rescheduled. A tenth of the peers never send packets, so
+  their tasks are due regularly.
+*/
+static void run_benchmark(const queue_impl_t *impl, size_t n_peers, size_t duration, size_t packets) {
+	printf("Running %s with %zd peers... ", impl->name, n_peers);
+
+	const fastd_timeout_t start_time = 1000000;
+	size_t i, j;
+
+	srandom(42);
+	ctx.now = start_time;
+	impl->init(n_peers);
+
+	for (i = 0; i < n_peers; i++)
+		impl->reschedule(i, peer_timeout());
+
+	size_t rescheduled = 0, handled = 0;
+	int64_t start = get_time();
+
+	for (i = 0; i < duration; i++) {
+		ctx.now++;
+
+		for (j = 0; j < packets; j++) {
+			impl->reschedule(random() % (n_peers - n_peers / 10), peer_timeout());
+			rescheduled++;
+		}
+
+		ssize_t due;
+		while ((due = impl->get_due()) >= 0) {
+			impl->reschedule(due, peer_timeout());
+			handled++;
+		}
+	}
+
+	int64_t end = get_time();
+
+	impl->free();
+
+	printf("%zd reschedules, %zd handled tasks, %.1f ns per operation\n", rescheduled, handled,
+	       (double)(end - start) / (rescheduled + handled));
+}
+
+
+int main(void) {
+	size_t i, j;
+	static const size_t sizes[] = { 1000, 10000, 100000 };
+
+	for (i = 0; i < array_size(sizes); i++) {
+		for (j = 0; j < array_size(impls); j++)
+			run_benchmark(&impls[j], sizes[i], 300000, 20);
+	}
+
+	return 0;
+}
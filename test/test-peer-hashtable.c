@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+
+#include "peer_hashtable.h"
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <cmocka.h>
+
+
+/* The number of entries that fit into the initial 16 slots without growing the table */
+#define INITIAL_ENTRIES 12
+
+
+static int setup(UNUSED void **state) {
+	fastd_peer_hashtable_init();
+	return 0;
+}
+
+static int teardown(UNUSED void **state) {
+	fastd_peer_hashtable_free();
+	return 0;
+}
+
+
+static void make_address(fastd_peer_address_t *addr, size_t i) {
+	memset(addr, 0, sizeof(*addr));
+
+	if (i % 2) {
+		addr->in.sin_family = AF_INET;
+		addr->in.sin_addr.s_addr = htonl(0x0a000000 | (uint32_t)i);
+		addr->in.sin_port = htons(10000 + i % 1000);
+	} else {
+		addr->in6.sin6_family = AF_INET6;
+		addr->in6.sin6_addr.s6_addr[0] = 0x20;
+		addr->in6.sin6_addr.s6_addr[1] = 0x01;
+		uint32_t v = htonl(i);
+		memcpy(&addr->in6.sin6_addr.s6_addr[12], &v, sizeof(v));
+		addr->in6.sin6_port = htons(10000 + i % 1000);
+	}
+}
+
+static fastd_peer_t *make_peers(size_t n) {
+	fastd_peer_t *peers = fastd_new0_array(n, fastd_peer_t);
+
+	size_t i;
+	for (i = 0; i < n; i++)
+		make_address(&peers[i].address, i);
+
+	return peers;
+}
+
+/* Checks that the peers in the table are found, and the ones that aren't in it are not */
+static void check_lookups(const fastd_peer_t *peers, const bool *present, size_t n) {
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (present[i])
+			assert_ptr_equal(fastd_peer_hashtable_lookup(&peers[i].address), &peers[i]);
+		else
+			assert_null(fastd_peer_hashtable_lookup(&peers[i].address));
+	}
+}
+
+
+/* Inserts and removes peers while the table is grown, checking all lookups after each step */
+static void test_resize(UNUSED void **state) {
+	const size_t n = 1000;
+	fastd_peer_t *peers = make_peers(n);
+	bool present[n];
+	size_t migrating = 0;
+	size_t i;
+
+	memset(present, 0, sizeof(present));
+
+	for (i = 0; i < n; i++) {
+		fastd_peer_hashtable_insert(&peers[i]);
+		present[i] = true;
+
+		/* Remove every third peer again, which may still be stored in the previous table */
+		if (i % 3 == 1) {
+			fastd_peer_hashtable_remove(&peers[i - 1]);
+			present[i - 1] = false;
+		}
+
+		if (ctx.peer_addr_ht_old)
+			migrating++;
+
+		check_lookups(peers, present, i + 1);
+	}
+
+	/* Some of the steps must have happened while the entries of the previous table were being moved */
+	assert_true(migrating > 0);
+
+	for (i = 0; i < n; i++) {
+		if (!present[i])
+			continue;
+
+		fastd_peer_hashtable_remove(&peers[i]);
+		present[i] = false;
+
+		if (i % 16 == 0)
+			check_lookups(peers, present, n);
+	}
+
+	check_lookups(peers, present, n);
+	assert_int_equal(ctx.peer_addr_ht_used + ctx.peer_addr_ht_old_used, 0);
+
+	free(peers);
+}
+
+/*
+   Removes each peer of a densely populated table in turn
+
+   With 12 entries in 16 slots, most entries are part of a longer probe sequence, so the
+   entries following a removed one must be moved back for the lookups to succeed.
+*/
+static void test_remove_probe_chain(UNUSED void **state) {
+	fastd_peer_t *peers = make_peers(INITIAL_ENTRIES);
+	bool present[INITIAL_ENTRIES];
+	size_t i;
+
+	for (i = 0; i < INITIAL_ENTRIES; i++) {
+		fastd_peer_hashtable_insert(&peers[i]);
+		present[i] = true;
+	}
+
+	assert_int_equal(ctx.peer_addr_ht_size, 16);
+
+	for (i = 0; i < INITIAL_ENTRIES; i++) {
+		fastd_peer_hashtable_remove(&peers[i]);
+		present[i] = false;
+		check_lookups(peers, present, INITIAL_ENTRIES);
+
+		fastd_peer_hashtable_insert(&peers[i]);
+		present[i] = true;
+		check_lookups(peers, present, INITIAL_ENTRIES);
+	}
+
+	for (i = 0; i < INITIAL_ENTRIES; i++)
+		fastd_peer_hashtable_remove(&peers[i]);
+
+	assert_int_equal(ctx.peer_addr_ht_used, 0);
+
+	free(peers);
+}
+
+/* Removing one of two peers with the same address must remove the right entry */
+static void test_remove_same_address(UNUSED void **state) {
+	fastd_peer_t *peers = make_peers(2);
+	peers[1].address = peers[0].address;
+
+	fastd_peer_hashtable_insert(&peers[0]);
+	fastd_peer_hashtable_insert(&peers[1]);
+
+	fastd_peer_hashtable_remove(&peers[1]);
+	assert_ptr_equal(fastd_peer_hashtable_lookup(&peers[0].address), &peers[0]);
+
+	fastd_peer_hashtable_remove(&peers[0]);
+	assert_null(fastd_peer_hashtable_lookup(&peers[0].address));
+
+	assert_int_equal(ctx.peer_addr_ht_used, 0);
+
+	free(peers);
+}
+
+/* The same, while the table is grown and the first peer is most likely still stored in the previous table */
+static void test_remove_same_address_resize(UNUSED void **state) {
+	/* 384 entries fill 512 slots up to the maximum load factor, so the next insertion grows the table */
+	const size_t n = 384;
+	fastd_peer_t *peers = make_peers(n + 1);
+	peers[n].address = peers[0].address;
+	size_t i;
+
+	for (i = 0; i <= n; i++)
+		fastd_peer_hashtable_insert(&peers[i]);
+
+	assert_non_null(ctx.peer_addr_ht_old);
+
+	fastd_peer_hashtable_remove(&peers[0]);
+	assert_ptr_equal(fastd_peer_hashtable_lookup(&peers[0].address), &peers[n]);
+
+	fastd_peer_hashtable_remove(&peers[n]);
+	assert_null(fastd_peer_hashtable_lookup(&peers[0].address));
+
+	for (i = 1; i < n; i++) {
+		assert_ptr_equal(fastd_peer_hashtable_lookup(&peers[i].address), &peers[i]);
+		fastd_peer_hashtable_remove(&peers[i]);
+	}
+
+	assert_int_equal(ctx.peer_addr_ht_used + ctx.peer_addr_ht_old_used, 0);
+
+	free(peers);
+}
+
+
+int main(void) {
+	/* Suppress the debug messages of the hashtable */
+	ctx.log_initialized = true;
+
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_resize, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_remove_probe_chain, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_remove_same_address, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_remove_same_address_resize, setup, teardown),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: BSD-2-Clause
+/*
+  Copyright (c) 2012-2020, Matthias Schiffer <mschiffer@universe-factory.net>
+  All rights reserved.
+*/
+
+
+#include "fastd.h"
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <cmocka.h>
+
+
+/* An arbitrary start time, so the wheel doesn't start at a slot boundary */
+#define START_TIME 1234567
+
+
+static int setup(UNUSED void **state) {
+	ctx.now = START_TIME;
+
+	memset(&ctx.task_wheel, 0, sizeof(ctx.task_wheel));
+	ctx.task_wheel.time = ctx.now;
+
+	return 0;
+}
+
+
+/* Moves the current time forward and returns the next due task */
+static fastd_task_t *get_due_at(fastd_timeout_t now) {
+	ctx.now = now;
+	return fastd_task_get_due();
+}
+
+/* Checks that a task is due exactly at its timeout */
+static void check_due(fastd_task_t *task) {
+	fastd_timeout_t timeout = task->timeout;
+
+	assert_null(get_due_at(timeout - 1));
+	assert_ptr_equal(get_due_at(timeout), task);
+	assert_false(fastd_task_scheduled(task));
+}
+
+
+/* Tasks in the higher levels must be moved down and handled at their exact timeouts */
+static void test_cascade(UNUSED void **state) {
+	static const int64_t delays[] = {
+		1,
+		TASK_WHEEL_SLOTS - 1,
+		TASK_WHEEL_SLOTS,
+		TASK_WHEEL_SLOTS + 1,
+		(1 << (2 * TASK_WHEEL_BITS)) - 1,
+		1 << (2 * TASK_WHEEL_BITS),
+		(1 << (2 * TASK_WHEEL_BITS)) + 1,
+		(1 << (3 * TASK_WHEEL_BITS)) + 17,
+		(1 << (4 * TASK_WHEEL_BITS)) + 4711,
+		((int64_t)1 << (7 * TASK_WHEEL_BITS)) + 12345,
+	};
+	fastd_task_t tasks[array_size(delays)] = {};
+	size_t i;
+
+	for (i = 0; i < array_size(delays); i++)
+		fastd_task_reschedule(&tasks[i], START_TIME + delays[i]);
+
+	for (i = 0; i < array_size(delays); i++) {
+		assert_true(fastd_task_queue_timeout() <= tasks[i].timeout);
+		check_due(&tasks[i]);
+	}
+
+	assert_null(get_due_at(START_TIME + ((int64_t)1 << (8 * TASK_WHEEL_BITS))));
+	assert_int_equal(fastd_task_queue_timeout(), FASTD_TIMEOUT_INV);
+}
+
+/* Timeouts beyond the range of the top level are kept in the wheel until they are reached */
+static void test_beyond_range(UNUSED void **state) {
+	const int64_t range = (int64_t)1 << (TASK_WHEEL_BITS * TASK_WHEEL_LEVELS);
+	fastd_task_t far = {}, farther = {};
+
+	fastd_task_reschedule(&far, START_TIME + range + 1000);
+	fastd_task_reschedule(&farther, START_TIME + 3 * range);
+
+	assert_null(get_due_at(START_TIME + range / 2));
+	check_due(&far);
+
+	assert_null(get_due_at(START_TIME + 2 * range));
+	check_due(&farther);
+}
+
+/* Rescheduling moves a task to the slot of its new timeout */
+static void test_reschedule(UNUSED void **state) {
+	fastd_task_t task = {}, other = {};
+
+	fastd_task_reschedule(&other, START_TIME + 5000);
+
+	fastd_task_reschedule(&task, START_TIME + 100000);
+	fastd_task_reschedule(&task, START_TIME + 100);
+	check_due(&task);
+
+	fastd_task_reschedule(&task, START_TIME + 200);
+	fastd_task_reschedule(&task, START_TIME + 300000);
+	assert_null(get_due_at(START_TIME + 200));
+
+	/* Timeouts that have passed already are due immediately */
+	fastd_task_reschedule(&task, START_TIME + 100);
+	assert_ptr_equal(get_due_at(START_TIME + 200), &task);
+	assert_null(fastd_task_get_due());
+
+	check_due(&other);
+	assert_int_equal(fastd_task_queue_timeout(), FASTD_TIMEOUT_INV);
+}
+
+/* Tasks may be unscheduled while the tasks of their slot are being handled */
+static void test_unschedule_processing(UNUSED void **state) {
+	fastd_task_t tasks[3] = {};
+	size_t i;
+
+	/* The tasks are put into a slot of a higher level, which is moved down first */
+	for (i = 0; i < array_size(tasks); i++)
+		fastd_task_reschedule(&tasks[i], START_TIME + 10000);
+
+	fastd_task_t *first = get_due_at(START_TIME + 10000);
+	assert_non_null(first);
+
+	for (i = 0; i < array_size(tasks); i++) {
+		if (&tasks[i] != first && fastd_task_scheduled(&tasks[i])) {
+			fastd_task_unschedule(&tasks[i]);
+			break;
+		}
+	}
+
+	fastd_task_t *second = fastd_task_get_due();
+	assert_non_null(second);
+	assert_ptr_not_equal(second, first);
+	assert_ptr_not_equal(second, &tasks[i]);
+
+	assert_null(fastd_task_get_due());
+
+	/* A slot of a higher level that has been emptied by unscheduling doesn't yield any tasks */
+	fastd_task_reschedule(&tasks[0], START_TIME + 50000);
+	fastd_task_unschedule(&tasks[0]);
+
+	assert_int_equal(fastd_task_queue_timeout(), FASTD_TIMEOUT_INV);
+	assert_null(get_due_at(START_TIME + 60000));
+}
+
+/* Compares the wheel with the timeouts of randomly rescheduled tasks */
+static void test_random(UNUSED void **state) {
+	const size_t n = 1000;
+	fastd_task_t *tasks = fastd_new0_array(n, fastd_task_t);
+	size_t step, i;
+
+	srandom(42);
+
+	for (step = 0; step < 2000; step++) {
+		for (i = 0; i < 10; i++) {
+			fastd_task_t *task = &tasks[random() % n];
+
+			if (random() % 8)
+				fastd_task_reschedule(task, fastd_now() + random() % (1 << (random() % 30)));
+			else
+				fastd_task_unschedule(task);
+		}
+
+		fastd_timeout_t now = fastd_now() + random() % (1 << (random() % 16));
+
+		fastd_task_t *task;
+		while ((task = get_due_at(now))) {
+			assert_true(task->timeout <= now);
+			assert_false(fastd_task_scheduled(task));
+		}
+
+		fastd_timeout_t next = FASTD_TIMEOUT_INV;
+		for (i = 0; i < n; i++) {
+			if (!fastd_task_scheduled(&tasks[i]))
+				continue;
+
+			assert_true(tasks[i].timeout > now);
+			next = fastd_timeout_min(next, tasks[i].timeout);
+		}
+
+		assert_true(fastd_task_queue_timeout() <= next);
+	}
+
+	free(tasks);
+}
+
+
+int main(void) {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup(test_cascade, setup),
+		cmocka_unit_test_setup(test_beyond_range, setup),
+		cmocka_unit_test_setup(test_reschedule, setup),
+		cmocka_unit_test_setup(test_unschedule_processing, setup),
+		cmocka_unit_test_setup(test_random, setup),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}